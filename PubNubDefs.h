@@ -46,6 +46,22 @@
 #endif
 #endif /* !defined(PubNub_BASE_CLIENT) */
 
+/* Compile-time feature selection. To save flash and (mostly) RAM,
+   define (as a compiler option, or before including this file):
+   - PUBNUB_NO_SUBSCRIBE to leave out subscribe (and its client),
+   - PUBNUB_NO_HISTORY to leave out history (and its client),
+   - PUBNUB_PUBLISH_ONLY for both of the above,
+   - PUBNUB_NO_TO_STR to leave out the `to_str()` string tables.
+   */
+#if defined(PUBNUB_PUBLISH_ONLY)
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+#define PUBNUB_NO_SUBSCRIBE
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+#define PUBNUB_NO_HISTORY
+#endif
+#endif
+
 #ifdef PUBNUB_DEBUG
 #define DBGprint(x...) Serial.print(x)
 #define DBGprintln(x...) Serial.println(x)
@@ -90,73 +106,409 @@ inline int strncasecmp(const char* s1, const char* s2, size_t n)
 }
 #endif
 
-/** This is a very thin Arduino #Client interface wrapper.
-    It's reason d'^etre is the fact that some clients,
-    namely the WiFiClient for ESP32, drops the available()
-    count to 0 on connection close. So, if you don't read
-    the incoming octets fast enough, you won't read them
-    at all (if you observe the result of available()).
+/** Incremental decoder of the HTTP "chunked" transfer encoding.
 
+    It is fed the chunk framing (sizes, extensions, line ends and
+    the trailer) octet by octet, while the chunk data is read by the
+    user directly (into its own buffer, no copies), just reporting
+    how much was read. Thus, it always knows how much data is left
+    in the current chunk and whether the body has ended.
  */
-class PubNonSubClient : public PubNub_BASE_CLIENT {
+class PubNubChunkDecoder {
 public:
-    PubNonSubClient()
-        : PubNub_BASE_CLIENT()
-        , d_avail(0)
+    PubNubChunkDecoder() { start(); }
+
+    /** Start decoding a new body */
+    void start()
     {
+        d_state = chunk_size;
+        d_left  = 0;
     }
 
-    int available()
+    /** Are we in the data of a chunk (that is, the next octet is
+        body data and not framing)? */
+    bool in_data() const { return chunk_data == d_state; }
+
+    /** Has the whole body (including the trailer) been decoded? */
+    bool done() const { return body_done == d_state; }
+
+    /** Was the framing malformed (like a chunk size too big), so
+        the rest of the body can't be decoded? */
+    bool failed() const { return framing_error == d_state; }
+
+    /** Octets of data left in the current chunk */
+    unsigned long data_left() const { return d_left; }
+
+    /** Reports that `len` octets of chunk data were read */
+    void data_read(size_t len)
     {
-        if (0 == d_avail) {
-            d_avail = PubNub_BASE_CLIENT::available();
+        d_left -= len;
+        if (0 == d_left) {
+            d_state = chunk_data_end;
         }
-        return d_avail;
     }
-    int read()
+
+    /** Handles one octet of framing */
+    inline void input(char c);
+
+    /** Reads the framing from the `client`, as far as it has
+        arrived, until the data of a chunk (or the end of the body)
+        is reached. Reads "around" any overrides of the `read()`
+        of the `client`. Returns the number of octets read.
+     */
+    inline int skip_framing(PubNub_BASE_CLIENT& client);
+
+private:
+    enum {
+        /** In the chunk size (hex digits) */
+        chunk_size,
+        /** Rest of the chunk size line (extensions, CR) */
+        chunk_ext,
+        chunk_data,
+        /** Line end after the chunk data */
+        chunk_data_end,
+        /** At the start of a line of the trailer */
+        trailer_line_start,
+        trailer_line,
+        body_done,
+        framing_error
+    } d_state;
+    unsigned long d_left;
+};
+
+
+inline void PubNubChunkDecoder::input(char c)
+{
+    switch (d_state) {
+    case chunk_size:
+        if (isxdigit((unsigned char)c)) {
+            if (d_left > (~0UL >> 4)) {
+                DBGprintln(F("Chunk size too big"));
+                d_state = framing_error;
+                break;
+            }
+            d_left = d_left * 16
+                     + (isdigit((unsigned char)c) ? c - '0'
+                                                  : tolower((unsigned char)c) - 'a' + 10);
+            break;
+        }
+        d_state = chunk_ext;
+        /* FALLTHRU */
+    case chunk_ext:
+        if ('\n' == c) {
+            /* The last chunk has size 0 and is followed by the
+             * trailer */
+            d_state = (d_left > 0) ? chunk_data : trailer_line_start;
+        }
+        break;
+    case chunk_data_end:
+        if ('\n' == c) {
+            d_state = chunk_size;
+            d_left  = 0;
+        }
+        break;
+    case trailer_line_start:
+        if ('\n' == c) {
+            d_state = body_done;
+        }
+        else if (c != '\r') {
+            d_state = trailer_line;
+        }
+        break;
+    case trailer_line:
+        if ('\n' == c) {
+            d_state = trailer_line_start;
+        }
+        break;
+    case chunk_data:
+    case body_done:
+    case framing_error:
+    default:
+        break;
+    }
+}
+
+
+inline int PubNubChunkDecoder::skip_framing(PubNub_BASE_CLIENT& client)
+{
+    int n = 0;
+    while (!in_data() && !done() && !failed()) {
+        uint8_t c;
+        if (client.PubNub_BASE_CLIENT::read(&c, 1) != 1) {
+            break;
+        }
+        input(c);
+        ++n;
+    }
+    return n;
+}
+
+
+/** Whether `PubNub` keeps statistics of its requests: how long
+    each phase of a request takes, failures and octets sent and
+    received (see `PubNubStats`). They take some RAM (about 800
+    octets on 32-bit boards), so they are off unless this is defined
+    to 1. When off, the statistics are all zero, but the code using
+    them still compiles.
+ */
+#if !defined(PUBNUB_STATS)
+#define PUBNUB_STATS 0
+#endif
+
+/** Number of buckets of the duration histograms (at most 12) */
+#if !defined(PUBNUB_STATS_BUCKETS)
+#define PUBNUB_STATS_BUCKETS 10
+#endif
+
+
+/** Histogram of durations. The upper bounds of the buckets grow by
+    powers of 4, from 256 microseconds: 256 us, 1 ms, 4 ms, 16 ms,
+    65 ms, 262 ms, 1 s, 4 s, 17 s, the last bucket having no bound.
+    The counts stop at 65535.
+ */
+class PubNubHistogram {
+public:
+    enum { buckets = PUBNUB_STATS_BUCKETS };
+
+    PubNubHistogram() { clear(); }
+
+    /** Upper bound (exclusive) of bucket `i`, in microseconds, 0
+        for the last bucket, which has none */
+    static unsigned long bound_us(unsigned i)
     {
-        if (d_avail > 0) {
-            --d_avail;
+        return (i + 1 < buckets) ? (256UL << (2 * i)) : 0;
+    }
+
+    /** Number of durations in bucket `i` */
+    unsigned count(unsigned i) const { return d_count[i]; }
+
+    /** Number of durations in all the buckets */
+    unsigned long total() const
+    {
+        unsigned long rslt = 0;
+        for (unsigned i = 0; i < buckets; ++i) {
+            rslt += d_count[i];
         }
-        return PubNub_BASE_CLIENT::read();
+        return rslt;
     }
-    int read(uint8_t* buf, size_t size)
+
+    /** The last and the longest duration, in microseconds */
+    unsigned long last_us() const { return d_last; }
+    unsigned long max_us() const { return d_max; }
+
+    void clear()
     {
-        int len = PubNub_BASE_CLIENT::read(buf, size);
-        if (d_avail > len) {
-            if (len > 0) {
-                d_avail -= len;
-            }
+        memset(d_count, 0, sizeof d_count);
+        d_last = d_max = 0;
+    }
+
+    void add(unsigned long us)
+    {
+        unsigned i = 0;
+        while ((i + 1 < buckets) && (us >= bound_us(i))) {
+            ++i;
         }
-        else {
-            d_avail = 0;
+        if (d_count[i] < 0xFFFF) {
+            ++d_count[i];
+        }
+        d_last = us;
+        if (us > d_max) {
+            d_max = us;
         }
-        return len;
     }
 
 private:
-    int d_avail;
+    uint16_t      d_count[buckets];
+    unsigned long d_last;
+    unsigned long d_max;
 };
 
 
-/* This class is a thin #EthernetClient (in general, any class that
- * implements the Arduino #Client "interface") wrapper whose
- * goal is to automatically acquire time token information when
- * reading subscribe call response.
- *
- * The user application sees only the JSON body, not the timetoken.
- * As soon as the body ends, PubSubclient reads the rest of HTTP reply
- * itself and disconnects. The stored timetoken is used in the next call
- * to the PubNub::subscribe() method.
+/** Statistics of the requests of one kind (publish, subscribe or
+    history): a histogram of the duration of each phase of a
+    request and counters of requests, failures and octets.
  */
-class PubSubClient : public PubNub_BASE_CLIENT {
+class PubNubOpStats {
 public:
-    PubSubClient()
+    /** Phases of a request */
+    enum phase {
+        /** Connecting, which, with the Arduino `Client`, includes
+            the DNS lookup and the TCP (and TLS) handshake. Not
+            recorded when a kept-alive connection is reused. */
+        phase_connect,
+        /** Writing the request */
+        phase_write,
+        /** From the request written to the first octet of the
+            response (time to first byte) */
+        phase_first_byte,
+        /** The rest of the response head */
+        phase_head,
+        /** From the end of the head until the whole body is read,
+            or the client is stopped */
+        phase_body,
+        phases
+    };
+
+    PubNubOpStats() { clear(); }
+
+#if PUBNUB_STATS
+    PubNubHistogram const& histogram(phase p) const { return d_hist[p]; }
+
+    /** Requests started, new connections made (not reused) and
+        failed connection attempts */
+    unsigned long requests() const { return d_requests; }
+    unsigned long connects() const { return d_connects; }
+    unsigned long connect_failures() const { return d_connect_failures; }
+
+    /** Responses that did not arrive in time and connections lost
+        waiting for them */
+    unsigned long timeouts() const { return d_timeouts; }
+    unsigned long resets() const { return d_resets; }
+
+    /** Octets sent and received (head, body and chunk framing) */
+    unsigned long bytes_out() const { return d_bytes_out; }
+    unsigned long bytes_in() const { return d_bytes_in; }
+
+    void clear()
+    {
+        for (int i = 0; i < phases; ++i) {
+            d_hist[i].clear();
+        }
+        d_requests = d_connects = d_connect_failures = 0;
+        d_timeouts = d_resets = 0;
+        d_bytes_out = d_bytes_in = 0;
+        d_phase = phases;
+    }
+#else
+    PubNubHistogram const& histogram(phase) const
+    {
+        static PubNubHistogram const none;
+        return none;
+    }
+    unsigned long requests() const { return 0; }
+    unsigned long connects() const { return 0; }
+    unsigned long connect_failures() const { return 0; }
+    unsigned long timeouts() const { return 0; }
+    unsigned long resets() const { return 0; }
+    unsigned long bytes_out() const { return 0; }
+    unsigned long bytes_in() const { return 0; }
+    void clear() {}
+#endif
+
+    /** Prints the statistics as a JSON object, say, to publish
+        them as telemetry. The histograms are arrays of the bucket
+        counts. */
+    inline void print_json(Print& out) const;
+
+private:
+    friend class PubNub;
+    friend class PubNonSubClient;
+    friend class PubSubClient;
+
+#if PUBNUB_STATS
+    /** A request starts, with connecting */
+    void _start()
+    {
+        ++d_requests;
+        d_phase = phase_connect;
+        d_t_mark = micros();
+    }
+
+    /** Phase `p`, if it's the one in progress, ends now (recorded,
+        unless `record` is false) and the next one starts */
+    void _mark(phase p, bool record = true)
+    {
+        if (d_phase != p) {
+            return;
+        }
+        unsigned long const now = micros();
+        if (record) {
+            d_hist[p].add(now - d_t_mark);
+        }
+        d_t_mark = now;
+        d_phase  = (phase)(p + 1);
+    }
+
+    void _connected() { ++d_connects; }
+    void _connect_failed()
+    {
+        ++d_connect_failures;
+        d_phase = phases;
+    }
+    void _timeout()
+    {
+        ++d_timeouts;
+        d_phase = phases;
+    }
+    void _reset()
+    {
+        ++d_resets;
+        d_phase = phases;
+    }
+    void _wrote(size_t n) { d_bytes_out += n; }
+    void _read(int n)
+    {
+        if (n > 0) {
+            d_bytes_in += n;
+        }
+    }
+
+    PubNubHistogram d_hist[phases];
+    unsigned long   d_requests;
+    unsigned long   d_connects;
+    unsigned long   d_connect_failures;
+    unsigned long   d_timeouts;
+    unsigned long   d_resets;
+    unsigned long   d_bytes_out;
+    unsigned long   d_bytes_in;
+    /** The phase in progress (`phases` if none) and when it began */
+    phase         d_phase;
+    unsigned long d_t_mark;
+#else
+    void _start() {}
+    void _mark(phase, bool = true) {}
+    void _connected() {}
+    void _connect_failed() {}
+    void _timeout() {}
+    void _reset() {}
+    void _wrote(size_t) {}
+    void _read(int) {}
+#endif
+};
+
+
+/** This is a very thin Arduino #Client interface wrapper.
+    It's reason d'^etre is the fact that some clients,
+    namely the WiFiClient for ESP32, drops the available()
+    count to 0 on connection close. So, if you don't read
+    the incoming octets fast enough, you won't read them
+    at all (if you observe the result of available()).
+
+    It also knows where the response body ends, if the response
+    had a `Content-Length` or was "chunked" (in which case it also
+    strips the chunk framing, so the user sees only the body data).
+    That is what makes it possible to keep
+    the connection alive and reuse it for the next request: reading
+    stops at the end of the body, connected() reports `false` from
+    then on (as if the server has closed the connection) and stop()
+    reads away what has arrived of the rest of the body, keeping the
+    connection open. Whatever is still to arrive is read away later,
+    by drain_step() (called from PubNub::poll()), never waiting for
+    it.
+ */
+class PubNonSubClient : public PubNub_BASE_CLIENT {
+public:
+    PubNonSubClient()
         : PubNub_BASE_CLIENT()
         , d_avail(0)
-        , json_enabled(false)
+        , d_body_left(0)
+        , d_length_known(false)
+        , d_chunked(false)
+        , d_keep_alive(false)
+        , d_draining(false)
+        , d_drain_start(0)
+        , d_stats(0)
     {
-        strcpy(timetoken, "0");
     }
 
     int available()
@@ -164,71 +516,98 @@ public:
         if (0 == d_avail) {
             d_avail = PubNub_BASE_CLIENT::available();
         }
+        if (d_chunked) {
+            if (!_chunk_data_ready()) {
+                return 0;
+            }
+            if ((unsigned long)d_avail > d_chunk.data_left()) {
+                return (int)d_chunk.data_left();
+            }
+        }
+        else if (d_length_known && ((unsigned long)d_avail > d_body_left)) {
+            return (int)d_body_left;
+        }
         return d_avail;
     }
-
-    /* Customized functions that make reading stop as soon as we
-     * have hit ',' outside of braces and string, which indicates
-     * end of JSON body. */
     int read()
     {
-        int c = PubNub_BASE_CLIENT::read();
-        if (c != -1) {
-            if (d_avail > 0) {
-                --d_avail;
-            }
+        if (d_chunked ? !_chunk_data_ready()
+                      : (d_length_known && (0 == d_body_left))) {
+            return -1;
+        }
+        if (d_avail > 0) {
+            --d_avail;
         }
-        if (!json_enabled || c == -1) {
+        int c = PubNub_BASE_CLIENT::read();
+        if (c == -1) {
+            /* Whatever we thought, there is nothing to read */
+            d_avail = 0;
             return c;
         }
-
-        this->_state_input(c, 0, 0);
+        if (d_chunked) {
+            d_chunk.data_read(1);
+        }
+        else if (d_length_known) {
+            --d_body_left;
+        }
+        _count_read(1);
         return c;
     }
-
     int read(uint8_t* buf, size_t size)
     {
-        int len = PubNub_BASE_CLIENT::read(buf, size);
-
-        if (d_avail > len) {
-            if (len > 0) {
-                d_avail -= len;
+        if (d_chunked) {
+            if (!_chunk_data_ready()) {
+                return -1;
             }
+            if (size > d_chunk.data_left()) {
+                size = d_chunk.data_left();
+            }
+        }
+        else if (d_length_known && (size > d_body_left)) {
+            if (0 == d_body_left) {
+                return -1;
+            }
+            size = d_body_left;
+        }
+        int len = PubNub_BASE_CLIENT::read(buf, size);
+        if ((d_avail > len) && (len > 0)) {
+            d_avail -= len;
         }
         else {
             d_avail = 0;
         }
-        if (!json_enabled || len <= 0) {
-            return len;
-        }
-        for (int i = 0; i < len; i++) {
-            this->_state_input(buf[i], buf + i + 1, len - i - 1);
+        if (len > 0) {
+            if (d_chunked) {
+                d_chunk.data_read(len);
+            }
+            else if (d_length_known) {
+                d_body_left -= len;
+            }
+            _count_read(len);
         }
         return len;
     }
 
-    void stop()
+    /* Once the body of a kept-alive response is read, we report
+     * being disconnected, so that the user can read the response
+     * "until the server closes the connection", as if keep-alive
+     * was not used. */
+    uint8_t connected()
     {
-        if ((!available() && !connected()) || !json_enabled) {
-            PubNub_BASE_CLIENT::stop();
-            return;
-        }
-        /* We are still connected. Read the rest of the stream so that
-         * we catch the timetoken. */
-        while (wait_for_data(10)) {
-            read();
+        if (_body_done() || (d_chunked && d_chunk.failed())) {
+            return 0;
         }
-        json_enabled = false;
+        return PubNub_BASE_CLIENT::connected();
     }
 
     /* Block until data is available. Returns false in case the
-     * connection goes down or timeout expires. */
+     * body ends, the connection goes down or timeout expires. */
     bool wait_for_data(int timeout = 310)
     {
         unsigned long t_start = millis();
         while ((0 == available()) && connected()) {
             if (millis() - t_start > (unsigned long)timeout * 1000) {
-                DBGprintln("wait_for_data() timeout");
+                DBGprintln(F("wait_for_data() timeout"));
                 return false;
             }
             delay(10);
@@ -236,1242 +615,8040 @@ public:
         return available() > 0;
     }
 
-    /* Enable the JSON state machine. */
-    void start_body()
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size)
     {
-        json_enabled = true;
-        in_string = after_backslash = false;
-        braces_depth                = 0;
+        size_t const n = PubNub_BASE_CLIENT::write(buf, size);
+        if (d_stats) {
+            d_stats->_wrote(n);
+        }
+        return n;
     }
+    using PubNub_BASE_CLIENT::write;
 
-    char const* server_timetoken() const { return timetoken; }
+    /* If the connection is kept alive, read away the rest of the
+     * response body, instead of closing the connection. Only what
+     * has arrived is read, if there is more to come, it is read by
+     * drain_step(). */
+    void stop()
+    {
+        _end_body();
+        d_draining = false;
+        if (d_keep_alive) {
+            if (_drain_available()) {
+                return;
+            }
+            if (PubNub_BASE_CLIENT::connected()
+                && !(d_chunked && d_chunk.failed())) {
+                d_draining    = true;
+                d_drain_start = millis();
+                return;
+            }
+        }
+        _close();
+    }
+
+    /* Reads away what has arrived of the rest of the body of a
+     * stop()-ed response. Closes the connection if the server
+     * closes it, or the rest doesn't arrive in 10 seconds. Never
+     * waits, call it often (PubNub::poll() does). */
+    void drain_step()
+    {
+        if (!d_draining) {
+            return;
+        }
+        if (_drain_available()) {
+            d_draining = false;
+            return;
+        }
+        if (!PubNub_BASE_CLIENT::connected()
+            || (d_chunked && d_chunk.failed())
+            || (millis() - d_drain_start > 10000UL)) {
+            DBGprintln(F("Failed to read the rest of the body"));
+            _close();
+        }
+    }
+
+    /* Called when the response headers have been read. If the
+     * body is `chunked`, it is decoded and the `content_length` is
+     * ignored. Otherwise, if the `content_length` is not known,
+     * pass a negative value and the body will be read until the
+     * server closes the connection. */
+    void start_body(long content_length, bool keep_alive, bool chunked)
+    {
+        d_chunked      = chunked;
+        d_length_known = !chunked && (content_length >= 0);
+        d_body_left    = d_length_known ? content_length : 0;
+        d_keep_alive   = keep_alive && (d_length_known || chunked);
+        d_chunk.start();
+    }
+
+    /* Prepares the client for the next request. Returns whether the
+     * connection of the previous request was kept alive and can be
+     * reused. It is not waited for the rest of the previous body, so
+     * if it hasn't all arrived yet (or the server has closed the
+     * connection in the meantime), the connection is stopped. */
+    bool reuse()
+    {
+        _end_body();
+        bool const reusable = d_keep_alive && _drain_available()
+                              && PubNub_BASE_CLIENT::connected();
+        if (d_keep_alive && !reusable) {
+            DBGprintln(F("Previous response not read, reconnecting"));
+            PubNub_BASE_CLIENT::stop();
+        }
+        d_keep_alive = d_length_known = d_chunked = d_draining = false;
+        d_avail                                                = 0;
+        return reusable;
+    }
 
 private:
-    inline void _state_input(uint8_t ch, uint8_t* nextbuf, size_t nextsize);
-    inline void _grab_timetoken(uint8_t* nextbuf, size_t nextsize);
+    friend class PubNub;
+
+    /* Counts `n` octets read, ending the body phase if the end
+     * of the body is reached */
+    void _count_read(int n)
+    {
+        if (d_stats) {
+            d_stats->_read(n);
+            if (_body_done()) {
+                d_stats->_mark(PubNubOpStats::phase_body);
+            }
+        }
+    }
+
+    /* Ends the body phase, if it's in progress */
+    void _end_body()
+    {
+        if (d_stats) {
+            d_stats->_mark(PubNubOpStats::phase_body);
+        }
+    }
+
+    /* Is the end of the response body known and reached? */
+    bool _body_done() const
+    {
+        return d_chunked ? d_chunk.done()
+                         : (d_length_known && (0 == d_body_left));
+    }
+
+    /* Reads the chunk framing that has arrived. Returns whether
+     * the next octet (to arrive) is chunk data. */
+    bool _chunk_data_ready()
+    {
+        if (!d_chunk.in_data()) {
+            int n = d_chunk.skip_framing(*this);
+            d_avail = (d_avail > n) ? d_avail - n : 0;
+            _count_read(n);
+        }
+        return d_chunk.in_data();
+    }
+
+    /* Reads (and ignores) what has arrived of the rest of the
+     * response body, without waiting for more. Returns whether the
+     * end of the body was reached. */
+    bool _drain_available()
+    {
+        while (!_body_done()) {
+            if (d_chunked && d_chunk.failed()) {
+                return false;
+            }
+            if (available() <= 0) {
+                return _body_done();
+            }
+            uint8_t buf[16];
+            read(buf, sizeof buf);
+        }
+        return true;
+    }
+
+    /* Closes the connection, forgetting the response */
+    void _close()
+    {
+        d_keep_alive = d_length_known = d_chunked = d_draining = false;
+        d_avail                                                = 0;
+        PubNub_BASE_CLIENT::stop();
+    }
 
     int d_avail;
 
-    /* JSON state machine context */
-    bool json_enabled : 1;
-    bool in_string : 1;
-    bool after_backslash : 1;
-    int  braces_depth;
+    /* Response body framing */
+    unsigned long      d_body_left;
+    PubNubChunkDecoder d_chunk;
+    bool               d_length_known : 1;
+    bool               d_chunked : 1;
+    bool               d_keep_alive : 1;
+    /* The rest of a stop()-ed body is still to be read away,
+     * since `d_drain_start` */
+    bool          d_draining : 1;
+    unsigned long d_drain_start;
 
-    /* Time token acquired during the last subscribe request. */
-    char timetoken[22];
+    /* Statistics of the requests made with this client, 0 if none */
+    PubNubOpStats* d_stats;
 };
 
 
-class PubNub {
+/** Size of the buffer in which PubSubClient keeps the list of the
+    channels of the messages of a subscribe response (when
+    subscribed to more than one channel, or to channel groups). Can
+    be set (as a compiler option, or before including this file).
+ */
+#if !defined(PUBNUB_CHANNEL_LIST_SIZE)
+#if defined(__AVR)
+#define PUBNUB_CHANNEL_LIST_SIZE 48
+#else
+#define PUBNUB_CHANNEL_LIST_SIZE 256
+#endif
+#endif
+
+
+/** The timetoken is a 64-bit (unsigned) integer, sent (and shown)
+    as a string of (up to 20) decimal digits. These are the helpers
+    to convert between the two.
+
+    Comparing the integers is much cheaper than comparing the
+    strings, for ordering timetokens or for telling if a message was
+    already seen.
+ */
+class PubNubTimetoken {
 public:
-    /**
-     * Init the Pubnub Client API
-     *
-     * This should be called after Ethernet.begin().
-     * Note that the string parameters are not copied; do not
-     * overwrite or free the memory where you stored the keys!
-     * (If you are passing string literals, don't worry about it.)
-     * Note that you should run only a single publish at once.
-     *
-     * @param string publish_key required key to send messages.
-     * @param string subscribe_key required key to receive messages.
-     * @param string origin optional setting for cloud origin.
-     * @return boolean whether begin() was successful.
-     */
-    bool begin(const char* publish_key,
-               const char* subscribe_key,
-               const char* origin = "pubsub.pubnub.com")
+    /** Size of the buffer for the string of a timetoken, with the
+        terminating NUL */
+    enum { str_size = 21 };
+
+    /** Adds the decimal `digit` to (the end of) `tt`. Returns false,
+        leaving `tt` as it was, if `digit` isn't a digit or `tt` would
+        overflow. */
+    static bool add_digit(uint64_t& tt, char digit)
     {
-        d_publish_key                 = publish_key;
-        d_subscribe_key               = subscribe_key;
-        d_origin                      = origin;
-        d_uuid                        = 0;
-        d_auth                        = 0;
-        d_last_http_status_code_class = http_scc_unknown;
-        set_port(http_port);
+        if ((digit < '0') || (digit > '9')) {
+            return false;
+        }
+        uint8_t const d = digit - '0';
+        if (tt > (~(uint64_t)0 - d) / 10) {
+            return false;
+        }
+        tt = tt * 10 + d;
         return true;
     }
 
-    /**
-     * HTTP status code class. It is defined by the first digit of the
-     * HTTP status code.
-     *
-     * @see RFC 7231 Section 6
-     */
-    enum http_status_code_class {
-        /** This is not defined in the RFC, we use it to indicate
-            "none/unknown" */
-        http_scc_unknown = 0,
-        /** The request was received, continuing process */
-        http_scc_informational = 1,
-        /** The request was successfully received, understood, and
-            accepted */
-        http_scc_success = 2,
-        /** Further action needs to be taken in order to complete the
-            request */
-        http_scc_redirection = 3,
-        /** The request contains bad syntax or cannot be fulfilled */
-        http_scc_client_error = 4,
-        /** The server failed to fulfill an apparently valid
-            request */
-        http_scc_server_error = 5
-    };
+    /** Parses the (whole) string `s` into `tt`. Returns false,
+        leaving `tt` as it was, if it's not a valid timetoken. */
+    static bool parse(char const* s, uint64_t& tt)
+    {
+        uint64_t v = 0;
+        if (!*s) {
+            return false;
+        }
+        for (; *s; ++s) {
+            if (!add_digit(v, *s)) {
+                return false;
+            }
+        }
+        tt = v;
+        return true;
+    }
 
-    /**
-     * Possible TCP/IP ports to use when connecting to Pubnub.
-     */
-    enum port_for_connection {
-        /** Connect via HTTP on its default port */
-        http_port,
-        /** Connect via TLS (formerly known as SSL) on its default port) */
-        tls_port
-    };
+    /** Puts the string of `tt` into `buf`, of `str_size` octets.
+        Returns `buf`. */
+    static char const* to_str(uint64_t tt, char* buf)
+    {
+        char  rev[str_size];
+        char* p = rev;
+        do {
+            *p++ = '0' + (char)(tt % 10);
+            tt /= 10;
+        } while (tt > 0);
+        char* q = buf;
+        while (p > rev) {
+            *q++ = *--p;
+        }
+        *q = '\0';
+        return buf;
+    }
+};
 
-    /**
-     * Set the UUID identification of PubNub client. This is useful
-     * e.g. for presence identification.
-     *
-     * Pass 0 to unset. The string is not copied over (just like
-     * in begin()). See the PubNubSubscriber example for simple code
-     * that generates a random UUID (although not 100% reliable).
-     */
-    void set_uuid(const char* uuid) { d_uuid = uuid; }
 
-    /**
-     * Set the authorization key/token of PubNub client. This is useful
-     * e.g. for access rights validation (PAM).
-     *
-     * Pass 0 to unset. The string is not copied over (just like
-     * in begin()). */
-    void set_auth(const char* auth) { d_auth = auth; }
+/* This class is a thin #EthernetClient (in general, any class that
+ * implements the Arduino #Client "interface") wrapper whose
+ * goal is to automatically acquire time token information when
+ * reading subscribe call response.
+ *
+ * The user application sees only the JSON body, not the timetoken.
+ * The timetoken is filtered out of the data read, as it arrives, so
+ * reading never waits for it. If all that was available was (a part
+ * of) the timetoken, read() returns 0 (or -1 for the single-octet
+ * read()), just as if there was nothing to read. As soon as the body
+ * ends, PubSubclient reads the rest of HTTP reply itself and
+ * disconnects. If it hasn't all arrived when the body is stop()-ed,
+ * the rest is read by drain_step() (called from PubNub::poll()),
+ * never waiting for it. The stored timetoken is used in the next
+ * call to the PubNub::subscribe() method.
+ */
+class PubSubClient : public PubNub_BASE_CLIENT {
+public:
+    PubSubClient()
+        : PubNub_BASE_CLIENT()
+        , d_avail(0)
+        , d_chunked(false)
+        , d_draining(false)
+        , d_drain_start(0)
+        , json_enabled(false)
+        , tt_state(tt_idle)
+        , d_new_tt(0)
+        , d_tt_read(false)
+        , d_malformed(false)
+        , d_tt(0)
+        , d_region(-1)
+        , d_channels_len(0)
+        , d_channels_truncated(false)
+        , d_stats(0)
+    {
+        strcpy(timetoken, "0");
+        d_channels[0] = '\0';
+    }
 
-    /**
-     * Set the TCP/IP port to use when connecting to Pubnub.
-     * Basically, only call this if your client supports SSL/TLS
-     * as you will need to set the `tls_port`.
-     */
-    void set_port(port_for_connection port) {
-        switch (port) {
-        case http_port:
-        default:
-            d_port = 80;
+    int available()
+    {
+        if (0 == d_avail) {
+            d_avail = PubNub_BASE_CLIENT::available();
+        }
+        if (d_chunked) {
+            if (!_chunk_data_ready()) {
+                return 0;
+            }
+            if ((unsigned long)d_avail > d_chunk.data_left()) {
+                return (int)d_chunk.data_left();
+            }
+        }
+        return d_avail;
+    }
+
+    /* Customized functions that make reading stop as soon as we
+     * have hit ',' outside of braces and string, which indicates
+     * end of JSON body. */
+    int read()
+    {
+        for (;;) {
+            if (d_chunked && !_chunk_data_ready()) {
+                return -1;
+            }
+            int c = PubNub_BASE_CLIENT::read();
+            if (c != -1) {
+                if (d_avail > 0) {
+                    --d_avail;
+                }
+                if (d_chunked) {
+                    d_chunk.data_read(1);
+                }
+                _count_read(1);
+            }
+            if (!json_enabled || c == -1) {
+                return c;
+            }
+            if (this->_state_input(c)) {
+                return c;
+            }
+        }
+    }
+
+    int read(uint8_t* buf, size_t size)
+    {
+        if (d_chunked) {
+            if (!_chunk_data_ready()) {
+                return -1;
+            }
+            if (size > d_chunk.data_left()) {
+                size = d_chunk.data_left();
+            }
+        }
+        int len = PubNub_BASE_CLIENT::read(buf, size);
+
+        if (d_avail > len) {
+            if (len > 0) {
+                d_avail -= len;
+            }
+        }
+        else {
+            d_avail = 0;
+        }
+        if (d_chunked && (len > 0)) {
+            d_chunk.data_read(len);
+        }
+        _count_read(len);
+        if (!json_enabled || len <= 0) {
+            return len;
+        }
+        /* Leave only the body in `buf`, filtering out the timetoken */
+        int body_len = 0;
+        for (int i = 0; i < len; i++) {
+            if (this->_state_input(buf[i])) {
+                buf[body_len++] = buf[i];
+            }
+        }
+        return body_len;
+    }
+
+    void stop()
+    {
+        if (d_stats) {
+            d_stats->_mark(PubNubOpStats::phase_body);
+        }
+        d_draining = false;
+        if (json_enabled) {
+            /* Read the rest of the stream, so that we catch the
+             * timetoken. If it hasn't all arrived, leave it to
+             * drain_step(). */
+            _drain_available();
+            if ((tt_state != tt_done) && connected()) {
+                d_draining    = true;
+                d_drain_start = millis();
+                return;
+            }
+        }
+        json_enabled = false;
+        PubNub_BASE_CLIENT::stop();
+    }
+
+    /* Reads what has arrived of the rest of a stop()-ed response,
+     * to catch the timetoken. Disconnects once the server closes
+     * the connection, or the rest doesn't arrive in 10 seconds.
+     * Never waits, call it often (PubNub::poll() does). */
+    void drain_step()
+    {
+        if (!d_draining) {
+            return;
+        }
+        _drain_available();
+        if ((tt_state != tt_done) && connected()
+            && (millis() - d_drain_start <= 10000UL)) {
+            return;
+        }
+        d_draining = json_enabled = false;
+        PubNub_BASE_CLIENT::stop();
+    }
+
+    /* Block until data is available. Returns false in case the
+     * connection goes down or timeout expires. */
+    bool wait_for_data(int timeout = 310)
+    {
+        unsigned long t_start = millis();
+        while ((0 == available()) && connected()) {
+            if (millis() - t_start > (unsigned long)timeout * 1000) {
+                DBGprintln(F("wait_for_data() timeout"));
+                return false;
+            }
+            delay(10);
+        }
+        return available() > 0;
+    }
+
+    /* Disable the JSON state machine, the response (headers) of a
+     * new request will be read. The rest of the previous response
+     * is not waited for, if it hasn't arrived, the connection is
+     * closed and its timetoken is lost (the previous one is kept). */
+    void start_request()
+    {
+        if (d_draining) {
+            _drain_available();
+            if ((tt_state != tt_done) && connected()) {
+                DBGprintln(F("Subscribe response not read, timetoken lost"));
+            }
+            PubNub_BASE_CLIENT::stop();
+        }
+        json_enabled = d_chunked = d_draining = false;
+        d_avail                               = 0;
+    }
+
+    /* Called when the response headers have been read. If the body
+     * is `chunked`, it is decoded, so that only the body data is
+     * read. */
+    void set_chunked(bool chunked)
+    {
+        d_chunked = chunked;
+        d_chunk.start();
+    }
+
+    /* Enable the JSON state machine. */
+    void start_body()
+    {
+        json_enabled = true;
+        in_string = after_backslash = false;
+        braces_depth                = 0;
+        tt_state                    = tt_idle;
+        d_malformed                 = false;
+        d_channels_len              = 0;
+        d_channels[0]               = '\0';
+        d_channels_truncated        = false;
+    }
+
+    char const* server_timetoken() const { return timetoken; }
+
+    /* Was the timetoken of the last response not valid (not a
+     * number, or too big)? Then the previous timetoken is kept,
+     * and subscribed from again. */
+    bool malformed() const { return d_malformed; }
+
+    /* The timetoken, as an integer, 0 until one is received (or
+     * set). */
+    uint64_t server_timetoken_value() const { return d_tt; }
+
+    /* The region of the timetoken, as sent by the v2 subscribe, -1
+     * if not known (v1 subscribe doesn't send it). */
+    int server_region() const { return d_region; }
+
+    /* Sets the timetoken (and its region) to subscribe from. It's
+     * set from the response of each subscribe, so you need this only
+     * to resume from some timetoken you saved. A string that is not
+     * a valid timetoken is ignored. */
+    void set_timetoken(char const* tt, int region = -1)
+    {
+        uint64_t v;
+        if (PubNubTimetoken::parse(tt, v)) {
+            set_timetoken(v, region);
+        }
+    }
+
+    /* Sets the timetoken (and its region) to subscribe from, as an
+     * integer. */
+    void set_timetoken(uint64_t tt, int region = -1)
+    {
+        d_tt     = tt;
+        d_region = region;
+        PubNubTimetoken::to_str(tt, timetoken);
+    }
+
+    /* The (comma separated) list of channels of the messages in the
+     * last response, one for each message, in the same order. It is
+     * sent after the messages and the timetoken, so it's known only
+     * once the whole response has been read. It's empty if it was
+     * not sent, which is the case when subscribing to a single
+     * channel. */
+    char const* channel_list() const { return d_channels; }
+
+    /* Puts the channel of the message at `index` (0 being the first
+     * message of the last response) into `channel`, a buffer of
+     * `cap` octets. Returns false if it isn't known (or doesn't
+     * fit). */
+    inline bool message_channel(size_t index, char* channel, size_t cap) const;
+
+    /* Once the chunked body is read, we report being
+     * disconnected, as that is what happens next anyway. */
+    uint8_t connected()
+    {
+        if (d_chunked && (d_chunk.done() || d_chunk.failed())) {
+            return 0;
+        }
+        return PubNub_BASE_CLIENT::connected();
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size)
+    {
+        size_t const n = PubNub_BASE_CLIENT::write(buf, size);
+        if (d_stats) {
+            d_stats->_wrote(n);
+        }
+        return n;
+    }
+    using PubNub_BASE_CLIENT::write;
+
+private:
+    friend class PubNub;
+
+    /* Counts `n` octets read, ending the body phase if the end
+     * of the (chunked) body is reached */
+    void _count_read(int n)
+    {
+        if (d_stats) {
+            d_stats->_read(n);
+            if (d_chunked && d_chunk.done()) {
+                d_stats->_mark(PubNubOpStats::phase_body);
+            }
+        }
+    }
+
+    inline bool _state_input(uint8_t ch);
+    inline bool _timetoken_input(uint8_t ch);
+
+    /* Reads (filtering) what has arrived, without waiting for more */
+    void _drain_available()
+    {
+        uint8_t buf[16];
+        while ((available() > 0) && (read(buf, sizeof buf) >= 0)) {
+        }
+    }
+
+    /* Reads the chunk framing that has arrived. Returns whether
+     * the next octet (to arrive) is chunk data. */
+    bool _chunk_data_ready()
+    {
+        if (!d_chunk.in_data()) {
+            int n = d_chunk.skip_framing(*this);
+            d_avail = (d_avail > n) ? d_avail - n : 0;
+            _count_read(n);
+        }
+        return d_chunk.in_data();
+    }
+
+    int d_avail;
+
+    /* Response body framing */
+    PubNubChunkDecoder d_chunk;
+    bool               d_chunked : 1;
+    /* The rest of a stop()-ed response is still to be read, since
+     * `d_drain_start` */
+    bool          d_draining : 1;
+    unsigned long d_drain_start;
+
+    /* JSON state machine context */
+    bool json_enabled : 1;
+    bool in_string : 1;
+    bool after_backslash : 1;
+    int  braces_depth;
+
+    /* Timetoken grabbing (state machine) context. Expected input,
+     * after the body, is:
+     * 	,"13511688131075270"]
+     * or, with the channel list (and, for channel groups, the list of
+     * the subscriptions - groups - that matched before it):
+     * 	,"13511688131075270","ch1,ch2"]
+     */
+    enum {
+        tt_idle,
+        tt_await_comma,
+        tt_await_quote,
+        tt_read,
+        /** The rest of an invalid timetoken */
+        tt_skip,
+        tt_after,
+        tt_await_list_quote,
+        tt_read_list,
+        /** The whole response has been read */
+        tt_done
+    } tt_state;
+    uint64_t d_new_tt;
+    /* Some digits of the new timetoken were read */
+    bool d_tt_read : 1;
+    /* The timetoken of the last response was not valid */
+    bool d_malformed : 1;
+
+    /* Time token acquired during the last subscribe request... */
+    uint64_t d_tt;
+    /* ...its string, for printing... */
+    char timetoken[PubNubTimetoken::str_size];
+    /* ...and its region, -1 if not known */
+    int d_region;
+
+    /* Channel list of the last response */
+    char   d_channels[PUBNUB_CHANNEL_LIST_SIZE];
+    size_t d_channels_len;
+    bool   d_channels_truncated;
+
+    /* Statistics of the requests made with this client, 0 if none */
+    PubNubOpStats* d_stats;
+};
+
+
+#if defined(__AVR)
+#include <avr/pgmspace.h>
+/* The constant tables of the library are kept in flash on AVR, where
+   they would otherwise be copied to the (scarce) RAM at startup. */
+#define PUBNUB_PROGMEM PROGMEM
+#define pubnub_read_table(p) pgm_read_byte(p)
+#else
+#define PUBNUB_PROGMEM
+#define pubnub_read_table(p) (*(p))
+#if !defined(strncasecmp_P) || defined(PUBNUB_DEFINE_STRSPN_AND_STRNCASECMP)
+#define strncasecmp_P(a, b, c) strncasecmp(a, b, c)
+#endif
+#endif
+
+
+/** Whether the URL encoder checks (and copies) four octets at a time
+    (SWAR, "SIMD within a register") when they are all letters or
+    digits, which most of the (JSON) messages are. It pays off on
+    32-bit (and bigger) CPUs, so it's off on AVR. Set to 0 to leave
+    it out.
+ */
+#if !defined(PUBNUB_SWAR_ENCODE)
+#if defined(__AVR)
+#define PUBNUB_SWAR_ENCODE 0
+#else
+#define PUBNUB_SWAR_ENCODE 1
+#endif
+#endif
+
+
+/** %-encoder of the strings put in a request URL (RFC 3986). The
+    unreserved characters, plus a few reserved ones that are safe
+    (`,=:;@[]`), are left as they are, all the other octets
+    (including those of UTF-8 sequences) are %-encoded.
+ */
+class PubNubUrlEncoder {
+public:
+    /** Is octet `c` left as it is (not %-encoded)? */
+    static bool unreserved(uint8_t c)
+    {
+        /* Bit `c % 8` of octet `c / 8` is set for the characters
+           that are left as they are. No octet above 0x7F is, so
+           only the lower 128 bits (of the 256) are kept. */
+        static const uint8_t bitmap[16] PUBNUB_PROGMEM = {
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x70, 0xFF, 0x2F,
+            0xFF, 0xFF, 0xFF, 0xAF, 0xFE, 0xFF, 0xFF, 0x47
+        };
+        return (c < 0x80) && (pubnub_read_table(bitmap + c / 8) & (1 << (c % 8)));
+    }
+
+    /** Encodes (up to) `len` octets of `s` into `out` of `size`
+        octets, as many as fit. Returns the number of octets of `s`
+        encoded and sets `written` to the number of octets put in
+        `out`. A %-encoded octet is never split, so this stops
+        short if it doesn't fit (in the last 1 or 2 octets of `out`).
+     */
+    static size_t encode(char const* s, size_t len, char* out, size_t size, size_t& written)
+    {
+        size_t i = 0;
+        size_t o = 0;
+        for (;;) {
+            /* As many octets as fit even if all are %-encoded, so
+               there's no need to check for room for each one */
+            size_t n = (size - o) / 3;
+            if (n > len - i) {
+                n = len - i;
+            }
+            if (0 == n) {
+                break;
+            }
+            size_t const end = i + n;
+            while (i < end) {
+#if PUBNUB_SWAR_ENCODE
+                if (end - i >= 4) {
+                    if (_alnum4(s + i)) {
+                        memcpy(out + o, s + i, 4);
+                        o += 4;
+                    }
+                    else {
+                        /* Not re-checking a word at every octet */
+                        o += _encode(s[i], out + o);
+                        o += _encode(s[i + 1], out + o);
+                        o += _encode(s[i + 2], out + o);
+                        o += _encode(s[i + 3], out + o);
+                    }
+                    i += 4;
+                    continue;
+                }
+#endif
+                o += _encode(s[i++], out + o);
+            }
+        }
+        /* The last one or two octets of room, which a %-encoded
+           octet doesn't fit in */
+        while ((i < len) && (o < size) && unreserved(s[i])) {
+            out[o++] = s[i++];
+        }
+        written = o;
+        return i;
+    }
+
+private:
+    static char _hex(uint8_t d)
+    {
+        static const char digits[16] PUBNUB_PROGMEM = {
+            '0', '1', '2', '3', '4', '5', '6', '7',
+            '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+        };
+        return pubnub_read_table(digits + d);
+    }
+
+    /** Puts octet `c`, %-encoded if need be, at `out`. Returns the
+        number of octets put. */
+    static size_t _encode(uint8_t c, char* out)
+    {
+        if (unreserved(c)) {
+            out[0] = c;
+            return 1;
+        }
+        out[0] = '%';
+        out[1] = _hex(c >> 4);
+        out[2] = _hex(c & 0x0F);
+        return 3;
+    }
+
+#if PUBNUB_SWAR_ENCODE
+    /** Are all four octets at `s` ASCII letters or digits? With
+        the top bits clear, adding `0x80 - lo` to an octet sets its
+        top bit iff it's >= `lo`, and adding `0x7F - hi` iff it's >
+        `hi`, without carrying into the next octet. Letters are
+        checked case-folded (`| 0x20`), which maps no other octet
+        into `a`..`z`.
+     */
+    static bool _alnum4(char const* s)
+    {
+        uint32_t w;
+        memcpy(&w, s, 4);
+        uint32_t const ones = 0x01010101UL;
+        uint32_t const tops = 0x80808080UL;
+        if (w & tops) {
+            return false;
+        }
+        uint32_t const f      = w | 0x20202020UL;
+        uint32_t const digit  = (w + ones * (0x80 - '0')) & ~(w + ones * (0x7F - '9'));
+        uint32_t const letter = (f + ones * (0x80 - 'a')) & ~(f + ones * (0x7F - 'z'));
+        return ((digit | letter) & tops) == tops;
+    }
+#endif
+};
+
+
+/** Size of the buffer in which a request is put together before
+    it's written to the client. Can be set (as a compiler option,
+    or before including this file) to, say, save RAM (stack) on
+    boards that have little of it.
+ */
+#if !defined(PUBNUB_REQUEST_BUFFER_SIZE)
+#if defined(__AVR)
+#define PUBNUB_REQUEST_BUFFER_SIZE 64
+#else
+#define PUBNUB_REQUEST_BUFFER_SIZE 256
+#endif
+#endif
+
+
+/** Collects what is printed to it in a fixed-size buffer and
+    writes it to the client only when the buffer is full, or on
+    flush(). So, a request is sent in a few (mostly, one) writes,
+    instead of one for every little piece of it, as with many
+    clients (WiFi101, ESP...) each write has a big overhead, or even
+    becomes a TCP segment of its own.
+ */
+class PubNubRequestWriter : public Print {
+public:
+    PubNubRequestWriter(PubNub_BASE_CLIENT& client)
+        : d_client(client)
+        , d_len(0)
+    {
+    }
+
+    size_t write(uint8_t c)
+    {
+        if (d_len == sizeof d_buf) {
+            flush();
+        }
+        d_buf[d_len++] = c;
+        return 1;
+    }
+
+    size_t write(const uint8_t* buf, size_t size)
+    {
+        size_t const rslt = size;
+        while (size > 0) {
+            if (d_len == sizeof d_buf) {
+                flush();
+            }
+            size_t n = sizeof d_buf - d_len;
+            if (n > size) {
+                n = size;
+            }
+            memcpy(d_buf + d_len, buf, n);
+            d_len += n;
+            buf += n;
+            size -= n;
+        }
+        return rslt;
+    }
+
+    /** Writes `len` octets read from the stream `in`, reading them
+        straight into the buffer. Returns the number of octets
+        written, which is less than `len` if `in` timed out.
+     */
+    size_t write_from(Stream& in, size_t len)
+    {
+        size_t written = 0;
+        while (written < len) {
+            if (d_len == sizeof d_buf) {
+                flush();
+            }
+            size_t n = sizeof d_buf - d_len;
+            if (n > len - written) {
+                n = len - written;
+            }
+            size_t got = in.readBytes((char*)d_buf + d_len, n);
+            d_len += got;
+            written += got;
+            if (got < n) {
+                break;
+            }
+        }
+        return written;
+    }
+
+    /** Writes the (NUL terminated) `s` %-encoded, encoding it
+        straight into the buffer */
+    void write_encoded(char const* s)
+    {
+        size_t len = strlen(s);
+        while (len > 0) {
+            size_t written;
+            size_t n = PubNubUrlEncoder::encode(
+                s, len, (char*)d_buf + d_len, sizeof d_buf - d_len, written);
+            d_len += written;
+            if (0 == n) {
+                /* The buffer is full, or the next (%-encoded) octet
+                   doesn't fit in what's left of it. Split it, so
+                   that the buffer is always written full. */
+                char enc[3];
+                n = PubNubUrlEncoder::encode(s, 1, enc, sizeof enc, written);
+                write((const uint8_t*)enc, written);
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    /** Writes what is in the buffer to the client */
+    void flush()
+    {
+        if (d_len > 0) {
+            d_client.write(d_buf, d_len);
+            d_len = 0;
+        }
+    }
+
+    using Print::write;
+
+private:
+    PubNub_BASE_CLIENT& d_client;
+    uint8_t             d_buf[PUBNUB_REQUEST_BUFFER_SIZE];
+    size_t              d_len;
+};
+
+
+/** Statistics of the requests of a `PubNub`, of each kind */
+struct PubNubStats {
+    PubNubOpStats publish;
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    PubNubOpStats subscribe;
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+    PubNubOpStats history;
+#endif
+
+    void clear()
+    {
+        publish.clear();
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+        subscribe.clear();
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+        history.clear();
+#endif
+    }
+
+    /** Prints the statistics as a JSON object, with a member for
+        each kind of request, like {"publish":{...},...} */
+    inline void print_json(Print& out) const;
+};
+
+
+inline void PubNubOpStats::print_json(Print& out) const
+{
+    out.print(F("{\"requests\":"));
+    out.print(requests());
+    out.print(F(",\"connects\":"));
+    out.print(connects());
+    out.print(F(",\"connect_failures\":"));
+    out.print(connect_failures());
+    out.print(F(",\"timeouts\":"));
+    out.print(timeouts());
+    out.print(F(",\"resets\":"));
+    out.print(resets());
+    out.print(F(",\"bytes_out\":"));
+    out.print(bytes_out());
+    out.print(F(",\"bytes_in\":"));
+    out.print(bytes_in());
+    for (int p = 0; p < phases; ++p) {
+        switch (p) {
+        case phase_connect:
+            out.print(F(",\"connect\":["));
+            break;
+        case phase_write:
+            out.print(F(",\"write\":["));
+            break;
+        case phase_first_byte:
+            out.print(F(",\"first_byte\":["));
+            break;
+        case phase_head:
+            out.print(F(",\"head\":["));
+            break;
+        default:
+            out.print(F(",\"body\":["));
+            break;
+        }
+        PubNubHistogram const& h = histogram((phase)p);
+        for (unsigned i = 0; i < h.buckets; ++i) {
+            if (i > 0) {
+                out.print(',');
+            }
+            out.print(h.count(i));
+        }
+        out.print(']');
+    }
+    out.print('}');
+}
+
+
+inline void PubNubStats::print_json(Print& out) const
+{
+    out.print(F("{\"publish\":"));
+    publish.print_json(out);
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    out.print(F(",\"subscribe\":"));
+    subscribe.print_json(out);
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+    out.print(F(",\"history\":"));
+    history.print_json(out);
+#endif
+    out.print('}');
+}
+
+
+/** Options of a publish, sent as query parameters. Those left at
+    their default are not sent, so the defaults of your keys apply.
+ */
+struct PubNubPublishOptions {
+    PubNubPublishOptions()
+        : store(-1)
+        , ttl(0)
+        , meta(0)
+        , norep(false)
+    {
+    }
+
+    /** Whether to store the message in history: 1 - yes, 0 - no,
+        -1 - as configured for the keys */
+    int8_t store;
+    /** For how many hours to keep the message in history, 0 for
+        as configured for the keys */
+    unsigned ttl;
+    /** Metadata of the message, a JSON object, which subscribers
+        can filter on (see `PubNub::set_filter_expr()`), or 0 */
+    const char* meta;
+    /** Don't replicate the message to other PubNub regions */
+    bool norep;
+};
+
+
+#if !defined(PUBNUB_NO_HISTORY)
+/** Options of a (v2) history request, see `PubNub::history_v2()` */
+struct PubNubHistoryOptions {
+    PubNubHistoryOptions()
+        : start(0)
+        , end(0)
+        , reverse(false)
+        , include_token(false)
+    {
+    }
+
+    /** Get the messages older than this timetoken (exclusive),
+        or, with `reverse`, newer than it, 0 for no limit */
+    uint64_t start;
+    /** Get the messages not older than this timetoken (inclusive),
+        0 for no limit */
+    uint64_t end;
+    /** Get the oldest messages (in the range) first, instead of the
+        newest ones */
+    bool reverse;
+    /** Send the timetoken of each message, with the message, like
+        {"message":...,"timetoken":15...} */
+    bool include_token;
+};
+#endif /* !defined(PUBNUB_NO_HISTORY) */
+
+
+class PubNubChannel;
+
+
+class PubNub {
+public:
+    PubNub()
+        : d_request_gen(0)
+    {
+        publish_client.d_stats = d_publish_tr.stats = &d_stats.publish;
+#if !defined(PUBNUB_NO_HISTORY)
+        history_client.d_stats = d_history_tr.stats = &d_stats.history;
+#endif
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+        subscribe_client.d_stats = d_subscribe_tr.stats = &d_stats.subscribe;
+#endif
+    }
+
+    /**
+     * Init the Pubnub Client API
+     *
+     * This should be called after Ethernet.begin().
+     * Note that the string parameters are not copied; do not
+     * overwrite or free the memory where you stored the keys!
+     * (If you are passing string literals, don't worry about it.)
+     * Note that you should run only a single publish at once.
+     *
+     * @param string publish_key required key to send messages.
+     * @param string subscribe_key required key to receive messages.
+     * @param string origin optional setting for cloud origin.
+     * @return boolean whether begin() was successful.
+     */
+    bool begin(const char* publish_key,
+               const char* subscribe_key,
+               const char* origin = "pubsub.pubnub.com")
+    {
+        d_publish_key                 = publish_key;
+        d_subscribe_key               = subscribe_key;
+        d_origin                      = origin;
+        d_uuid                        = 0;
+        d_auth                        = 0;
+        d_keep_alive                  = false;
+        d_presence_timeout            = 0;
+        d_heartbeat_at                = millis();
+        d_last_http_status_code_class = http_scc_unknown;
+        ++d_request_gen;
+        d_async_callback              = 0;
+        d_publish_tr.state            = async_idle;
+#if !defined(PUBNUB_NO_HISTORY)
+        d_history_tr.state = async_idle;
+#endif
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+        d_subscribe_tr.state = async_idle;
+        d_subscribe_v2       = false;
+        d_filter_expr        = 0;
+#endif
+        set_port(http_port);
+        return true;
+    }
+
+    /**
+     * HTTP status code class. It is defined by the first digit of the
+     * HTTP status code.
+     *
+     * @see RFC 7231 Section 6
+     */
+    enum http_status_code_class {
+        /** This is not defined in the RFC, we use it to indicate
+            "none/unknown" */
+        http_scc_unknown = 0,
+        /** The request was received, continuing process */
+        http_scc_informational = 1,
+        /** The request was successfully received, understood, and
+            accepted */
+        http_scc_success = 2,
+        /** Further action needs to be taken in order to complete the
+            request */
+        http_scc_redirection = 3,
+        /** The request contains bad syntax or cannot be fulfilled */
+        http_scc_client_error = 4,
+        /** The server failed to fulfill an apparently valid
+            request */
+        http_scc_server_error = 5
+    };
+
+    /**
+     * Possible TCP/IP ports to use when connecting to Pubnub.
+     */
+    enum port_for_connection {
+        /** Connect via HTTP on its default port */
+        http_port,
+        /** Connect via TLS (formerly known as SSL) on its default port) */
+        tls_port
+    };
+
+    /**
+     * Set the UUID identification of PubNub client. This is useful
+     * e.g. for presence identification.
+     *
+     * Pass 0 to unset. The string is not copied over (just like
+     * in begin()). See the PubNubSubscriber example for simple code
+     * that generates a random UUID (although not 100% reliable).
+     */
+    void set_uuid(const char* uuid) { d_uuid = uuid; }
+
+    /**
+     * Set the presence timeout, in seconds: if PubNub doesn't hear
+     * from this client (UUID) for that long, it deems it gone. It is
+     * sent with subscribe and heartbeat requests, each of which
+     * tells PubNub the client is still there.
+     *
+     * Pass 0 (the default) to not send it, so the PubNub default
+     * (300 s) applies. */
+    void set_presence_timeout(unsigned seconds) { d_presence_timeout = seconds; }
+
+    /** The presence timeout (0 if not set, see above) */
+    unsigned presence_timeout() const { return d_presence_timeout; }
+
+    /** The time (`millis()`) when the last heartbeat or subscribe
+        request was sent, or, if none was, `begin()` was called */
+    unsigned long heartbeat_sent_at() const { return d_heartbeat_at; }
+
+    /**
+     * Set the authorization key/token of PubNub client. This is useful
+     * e.g. for access rights validation (PAM).
+     *
+     * Pass 0 to unset. The string is not copied over (just like
+     * in begin()). */
+    void set_auth(const char* auth)
+    {
+        d_auth = auth;
+        ++d_request_gen;
+    }
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    /**
+     * Set the filter expression of subscribe, so that PubNub sends
+     * only the messages whose metadata matches it, like:
+     * "region == 'east' && temp > 30". Stream filtering has to be
+     * enabled for the keys. To filter the messages locally instead,
+     * see `PubNubFilter`.
+     *
+     * Pass 0 to unset. The string is not copied over (just like
+     * in begin()). */
+    void set_filter_expr(const char* filter_expr) { d_filter_expr = filter_expr; }
+#endif
+
+    /**
+     * Set the TCP/IP port to use when connecting to Pubnub.
+     * Basically, only call this if your client supports SSL/TLS
+     * as you will need to set the `tls_port`.
+     */
+    void set_port(port_for_connection port) {
+        switch (port) {
+        case http_port:
+        default:
+            d_port = 80;
+            break;
+        case tls_port:
+            d_port = 443;
+            break;
+        }
+    }
+
+    /**
+     * Set whether to keep the connections used for publish and
+     * history alive (HTTP/1.1 persistent connections) and reuse
+     * them for subsequent requests, instead of connecting (and,
+     * possibly, doing a TLS handshake) for every request. This is
+     * off by default.
+     *
+     * With keep-alive, call `stop()` on the client you got from
+     * `publish()` or `history()` when you're done with the response,
+     * as usual - it will not close the connection, just read away
+     * whatever is left of the response. If the server closes the
+     * connection, we reconnect on the next request.
+     */
+    void set_keep_alive(bool keep_alive)
+    {
+        d_keep_alive = keep_alive;
+        ++d_request_gen;
+    }
+
+    /**
+     * Publish/Send a message (assumed to be well-formed JSON) to a
+     * given channel.
+     *
+     * Note that the reply can be obtained using code like:
+
+         client = PubNub.publish("demo", "\"lala\"");
+         if (!client) {
+             Serial.println("Failed to publish, got no response from PubNub");
+             return;
+         }
+         if (PubNub.get_last_http_status_code_class() !=
+     PubNub::http_scc_success) { Serial.print("Got HTTP status code error from
+     PubNub, class: ");
+             Serial.print((int)PubNub.get_last_http_status_code_class(), DEC);
+         }
+         while (client->connected()) {
+         // More sophisticated code will want to add timeout handling here
+         while (client->connected() && !client->available()) ; // wait
+             char c = client->read();
+             Serial.print(c);
+         }
+         client->stop();
+
+     * You will get content right away, the header has been already
+     * skipped inside the function. If you do not care about
+     * the reply, just call client->stop(); immediately.
+     *
+     * It returns an object that is typically EthernetClient (but it
+     * can be a WiFiClient if you enabled the WiFi shield).
+     *
+     * @param string channel required channel name.
+     * @param string message required message string in JSON format.
+     * @param string timeout optional timeout in seconds.
+     * @return string Stream-ish object with reply message or 0 on error.
+     */
+    inline PubNonSubClient* publish(const char* channel,
+                                    const char* message,
+                                    int         timeout = 30);
+
+    /**
+     * Publish to the `channel` handle, which keeps the (text of the)
+     * request, except the message, so it's not "printed" all over
+     * again on every publish. Otherwise, the same as `publish()`.
+     */
+    inline PubNonSubClient* publish(PubNubChannel& channel,
+                                    const char*    message,
+                                    int            timeout = 30);
+
+    /**
+     * Publish, sending the message in the body of a HTTP POST
+     * request, instead of in the URL. So, it is not %-encoded, which
+     * can make it up to three times shorter, and it's not limited by
+     * the URL length (that proxies allow). Otherwise, the same as
+     * `publish()`.
+     */
+    inline PubNonSubClient* publish_post(const char* channel,
+                                         const char* message,
+                                         int         timeout = 30);
+
+    /**
+     * Publish a message of `length` octets, read from the `message`
+     * stream as it is sent, so it need not be in RAM. It fails if the
+     * stream times out before all of the message is read.
+     */
+    inline PubNonSubClient* publish_post(const char* channel,
+                                         Stream&     message,
+                                         size_t      length,
+                                         int         timeout = 30);
+
+    /**
+     * Publish with the given `options` (storing in history,
+     * replication, metadata...). Otherwise, the same as `publish()`.
+     */
+    inline PubNonSubClient* publish(const char*                 channel,
+                                    const char*                 message,
+                                    PubNubPublishOptions const& options,
+                                    int                         timeout = 30);
+    inline PubNonSubClient* publish_post(const char*                 channel,
+                                         const char*                 message,
+                                         PubNubPublishOptions const& options,
+                                         int timeout = 30);
+
+    /**
+     * Fire a message - publish it, but neither store it in history
+     * nor replicate it to other PubNub regions. Good for frequent
+     * (telemetry) messages which are only of interest "live". The
+     * response is the same as for `publish()`, but you may read it
+     * with the (smaller) `SentCracker`.
+     */
+    inline PubNonSubClient* fire(const char* channel,
+                                 const char* message,
+                                 int         timeout = 30);
+
+    /**
+     * Send a signal - a tiny message (PubNub limits its size to 64
+     * octets), which is cheaper than a publish and is never stored.
+     * Subscribers get it like any other message. The response is
+     * the same as for `publish()` (see `SentCracker`).
+     */
+    inline PubNonSubClient* signal(const char* channel,
+                                   const char* message,
+                                   int         timeout = 30);
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    /**
+     * Subscribe/Listen for a message on a given channel. The function
+     * will block and return when a message arrives. Typically, you
+     * will run this function from loop() function to keep listening
+     * for messages indefinitely.
+     *
+     * As a reply, you will get a JSON array with messages, e.g.:
+     * 	["msg1",{msg2:"x"}]
+     * and so on. Empty reply [] is also normal and your code must be
+     * able to handle that. Note that the reply specifically does not
+     * include the time token present in the raw reply.
+     *
+     * To subscribe to more than one channel, pass a comma separated
+     * list of them, like "door,window". The channel of each message
+     * can then be found with `PubSubClient::message_channel()`.
+     *
+     * @param string channel required channel name.
+     * @param string timeout optional timeout in seconds.
+     * @return string Stream-ish object with reply message or 0 on error.
+     */
+    inline PubSubClient* subscribe(const char* channel, int timeout = 310)
+    {
+        return subscribe(channel, 0, timeout);
+    }
+
+    /**
+     * Subscribe to (comma separated lists of) channels and channel
+     * groups, with a single request (and connection). Either one
+     * can be null (or empty), but not both.
+     *
+     * @param string channels channel name(s).
+     * @param string channel_groups channel group name(s).
+     * @param string timeout optional timeout in seconds.
+     * @return string Stream-ish object with reply message or 0 on error.
+     */
+    inline PubSubClient* subscribe(const char* channels,
+                                   const char* channel_groups,
+                                   int         timeout = 310);
+
+    /**
+     * Subscribe, using the v2 protocol, to (comma separated lists
+     * of) channels and channel groups, either of which can be 0.
+     *
+     * The reply is the whole v2 envelope:
+     * 	{"t":{"t":"15...","r":12},"m":[{"c":"ch","d":{msg},...},...]}
+     * which is to be read with a `SubscribeV2Cracker`. Besides the
+     * message itself, it gives its channel, publisher and timetoken.
+     * The region of the timetoken is kept with it, so the next
+     * subscribe continues right where this one left off, even if
+     * PubNub has switched to another region in the meantime.
+     *
+     * @return Stream-ish object with the reply or 0 on error.
+     */
+    inline PubSubClient* subscribe_v2(const char* channels,
+                                      const char* channel_groups = 0,
+                                      int         timeout        = 310);
+#endif /* !defined(PUBNUB_NO_SUBSCRIBE) */
+
+#if !defined(PUBNUB_NO_HISTORY)
+    /**
+     * History
+     *
+     * Receive list of the last N messages on the given channel.
+     *
+     * @param string channel required channel name.
+     * @param int limit optional number of messages to retrieve.
+     * @param string timeout optional timeout in seconds.
+     * @return string Stream-ish object with reply message or 0 on error. */
+    inline PubNonSubClient* history(const char* channel,
+                                    int         limit   = 10,
+                                    int         timeout = 310);
+
+    /**
+     * History, using the v2 API, which can get (at most `count`)
+     * messages in a time range, oldest or newest first, with their
+     * timetokens (see `PubNubHistoryOptions`). The response, like
+     * [[msg1,msg2,...],start,end], is to be read with a
+     * `HistoryV2Cracker`. To page through more messages than
+     * PubNub gives in one response (100), use a `PubNubHistoryPager`.
+     */
+    inline PubNonSubClient* history_v2(const char*                 channel,
+                                       int                         count,
+                                       PubNubHistoryOptions const& options,
+                                       int timeout = 310);
+
+    /**
+     * Fetch the messages of (a comma separated list of) `channels`,
+     * at most `count` of each (PubNub gives at most 25 of each for
+     * more than one channel), in a single request, using the v3
+     * history API. Only the `start` and `end` of the `options`
+     * apply. The response is to be read with a `FetchMessagesCracker`,
+     * which tells the channel of each message.
+     */
+    inline PubNonSubClient* fetch_messages(const char*                 channels,
+                                           int                         count,
+                                           PubNubHistoryOptions const& options,
+                                           int timeout = 310);
+
+    /**
+     * Get the number of messages published to each of (a comma
+     * separated list of) `channels` since the `timetoken`, say, to
+     * skip getting the history of the channels with no new ones.
+     * The response is to be read with a `MessageCountsCracker`.
+     */
+    inline PubNonSubClient* message_counts(const char* channels,
+                                           uint64_t    timetoken,
+                                           int         timeout = 310);
+#endif /* !defined(PUBNUB_NO_HISTORY) */
+
+    /**
+     * Presence
+     *
+     * These requests are sent over the publish client (and its
+     * connection, if kept alive), so there is no need for another
+     * connection, but there can be no publish in progress. The client
+     * (UUID) is the one set with `set_uuid()`. The comma separated
+     * lists of `channels` and `channel_groups` can be 0 (or empty),
+     * but not both.
+     *
+     * Send a heartbeat, telling PubNub that the client is (still)
+     * present on the channels (and groups), with its `state` (a JSON
+     * object), if not 0. A subscribe request does the same, but, as
+     * it is not sent while waiting for messages, a heartbeat is
+     * needed if the presence timeout is shorter than that (see
+     * `PubNubHeartbeat`).
+     *
+     * @return the client to read the response from, 0 on error.
+     */
+    inline PubNonSubClient* heartbeat(const char* channels,
+                                      const char* channel_groups = 0,
+                                      const char* state          = 0,
+                                      int         timeout        = 30);
+
+    /**
+     * Leave the channels (and groups), telling PubNub right away
+     * that the client is gone, instead of it finding out when the
+     * presence timeout expires.
+     */
+    inline PubNonSubClient* leave(const char* channels,
+                                  const char* channel_groups = 0,
+                                  int         timeout        = 30);
+
+    /**
+     * Get the (UUIDs of the) clients present on the `channel`, to be
+     * read with a `HereNowCracker`.
+     */
+    inline PubNonSubClient* here_now(const char* channel, int timeout = 30);
+
+    /**
+     * Set the `state` (a JSON object) of the client on the
+     * `channel`. A UUID has to be set.
+     */
+    inline PubNonSubClient* set_state(const char* channel,
+                                      const char* state,
+                                      int         timeout = 30);
+
+    /**
+     * Get the state of the client on the `channel`, in the
+     * "payload" of the response, like:
+     * {"status":200,"message":"OK","payload":{...},...}.
+     * A UUID has to be set.
+     */
+    inline PubNonSubClient* get_state(const char* channel, int timeout = 30);
+
+    /**
+     * Get the PubNub time, as a timetoken (in the response, like
+     * [15541724007473323], to be read with a `TimeCracker`). Sent
+     * over the publish client, like presence requests. To know the
+     * time without asking PubNub each time, see `PubNubClock`.
+     *
+     * @return the client to read the response from, 0 on error.
+     */
+    inline PubNonSubClient* time(int timeout = 30);
+
+    /**
+     * The state of an asynchronous (non-blocking) transaction.
+     */
+    enum async_state {
+        /** Not started */
+        async_idle,
+        /** Started, waiting for (the rest of) the response head */
+        async_in_progress,
+        /** Response head received, the body can be read from the
+            client (see `publish_response()` and friends) */
+        async_done,
+        /** Failed - connection lost or unexpected response */
+        async_error,
+        /** Failed - the response did not arrive in time */
+        async_timeout
+    };
+
+    /**
+     * Kinds of asynchronous transactions. There can be one of
+     * each kind in progress at the same time.
+     */
+    enum async_operation { async_publish, async_subscribe, async_history };
+
+    /**
+     * A function called when a transaction finishes, either
+     * successfully (`async_done`) or not.
+     */
+    typedef void (*async_callback)(async_operation op, async_state state);
+
+    /**
+     * Start a publish, but don't wait for the response. Call `poll()`
+     * to advance the transaction and `publish_state()` to see when it
+     * is done, or use a callback (`set_async_callback()`). Once it is
+     * done, read the response from `publish_response()`, just like
+     * you would from the client returned from `publish()`.
+     *
+     * Keep in mind that establishing the TCP/IP connection still
+     * blocks, as the Arduino `Client` has no other way to connect.
+     * With keep-alive, that happens just for the first publish.
+     *
+     * @return whether the request was sent.
+     */
+    inline bool start_publish(const char* channel,
+                              const char* message,
+                              int         timeout = 30);
+    inline bool start_publish(PubNubChannel& channel,
+                              const char*    message,
+                              int            timeout = 30);
+
+    /**
+     * Start a POST publish (see `publish_post()`), but don't wait for
+     * the response, like `start_publish()`.
+     */
+    inline bool start_publish_post(const char* channel,
+                                   const char* message,
+                                   int         timeout = 30);
+    inline bool start_publish_post(const char* channel,
+                                   Stream&     message,
+                                   size_t      length,
+                                   int         timeout = 30);
+
+    /**
+     * Start a publish with `options`, a fire or a signal, but don't
+     * wait for the response, like `start_publish()`.
+     */
+    inline bool start_publish(const char*                 channel,
+                              const char*                 message,
+                              PubNubPublishOptions const& options,
+                              int                         timeout = 30);
+    inline bool start_publish_post(const char*                 channel,
+                                   const char*                 message,
+                                   PubNubPublishOptions const& options,
+                                   int                         timeout = 30);
+    inline bool start_fire(const char* channel,
+                           const char* message,
+                           int         timeout = 30);
+    inline bool start_signal(const char* channel,
+                             const char* message,
+                             int         timeout = 30);
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    /**
+     * Start a subscribe, but don't wait for the response. The same
+     * as `start_publish()`, but the response (the message array)
+     * is read from `subscribe_response()`.
+     */
+    inline bool start_subscribe(const char* channel, int timeout = 310)
+    {
+        return start_subscribe(channel, 0, timeout);
+    }
+
+    /**
+     * Start a subscribe to channels and channel groups, but don't
+     * wait for the response.
+     */
+    inline bool start_subscribe(const char* channels,
+                                const char* channel_groups,
+                                int         timeout = 310);
+
+    /**
+     * Start a v2 subscribe, but don't wait for the response. Read it
+     * from `subscribe_response()`, with a `SubscribeV2Cracker`.
+     */
+    inline bool start_subscribe_v2(const char* channels,
+                                   const char* channel_groups = 0,
+                                   int         timeout        = 310);
+#endif /* !defined(PUBNUB_NO_SUBSCRIBE) */
+
+#if !defined(PUBNUB_NO_HISTORY)
+    /**
+     * Start a history request, but don't wait for the response.
+     * The same as `start_publish()`, but the response is read from
+     * `history_response()`.
+     */
+    inline bool start_history(const char* channel,
+                              int         limit   = 10,
+                              int         timeout = 310);
+    inline bool start_history_v2(const char*                 channel,
+                                 int                         count,
+                                 PubNubHistoryOptions const& options,
+                                 int                         timeout = 310);
+    inline bool start_fetch_messages(const char*                 channels,
+                                     int                         count,
+                                     PubNubHistoryOptions const& options,
+                                     int timeout = 310);
+    inline bool start_message_counts(const char* channels,
+                                     uint64_t    timetoken,
+                                     int         timeout = 310);
+#endif /* !defined(PUBNUB_NO_HISTORY) */
+
+    /**
+     * Start a heartbeat or a leave, but don't wait for the response.
+     * The same as `start_publish()` (the response is read from
+     * `publish_response()`), but it fails (returns false) while a
+     * publish is in progress, instead of taking over its client.
+     */
+    inline bool start_heartbeat(const char* channels,
+                                const char* channel_groups = 0,
+                                const char* state          = 0,
+                                int         timeout        = 30);
+    inline bool start_leave(const char* channels,
+                            const char* channel_groups = 0,
+                            int         timeout        = 30);
+
+    /** Start a time request, like `start_heartbeat()` (so, not while
+        a publish is in progress) */
+    inline bool start_time(int timeout = 30);
+
+    /**
+     * Advance all the transactions in progress, processing whatever
+     * has arrived so far. It never waits, so call it often, typically
+     * on every `loop()`. It also reads away (what has arrived of) the
+     * rest of the responses that were stopped before being read.
+     */
+    inline void poll();
+
+    /** States of the asynchronous transactions */
+    async_state publish_state() const { return d_publish_tr.state; }
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    async_state subscribe_state() const { return d_subscribe_tr.state; }
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+    async_state history_state() const { return d_history_tr.state; }
+#endif
+
+    /** Clients to read the responses of asynchronous transactions
+        from. Return 0 if the transaction is not `async_done`. */
+    PubNonSubClient* publish_response()
+    {
+        return (async_done == d_publish_tr.state) ? &publish_client : 0;
+    }
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    PubSubClient* subscribe_response()
+    {
+        return (async_done == d_subscribe_tr.state) ? &subscribe_client : 0;
+    }
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+    PubNonSubClient* history_response()
+    {
+        return (async_done == d_history_tr.state) ? &history_client : 0;
+    }
+#endif
+
+    /**
+     * Set the function to call when a transaction finishes. This
+     * includes the transactions of the blocking interface (`publish()`
+     * and friends). Pass 0 to unset.
+     */
+    void set_async_callback(async_callback cb) { d_async_callback = cb; }
+
+    /**
+     * Statistics of the requests: the duration of each of their
+     * phases (connect, write, time to first byte, head and body),
+     * failures and octets sent and received, for each kind of
+     * request. All zero if `PUBNUB_STATS` is 0.
+     */
+    PubNubStats const& stats() const { return d_stats; }
+
+    /** Zeroes the statistics */
+    void clear_stats() { d_stats.clear(); }
+
+    /** Returns the HTTP status code class of the last PubNub
+        transaction. If the transaction failed without getting a
+        (HTTP) response, it will be "unknown".
+    */
+    inline http_status_code_class get_last_http_status_code_class() const
+    {
+        return d_last_http_status_code_class;
+    }
+
+    /** The HTTP status code class of the last publish (or presence
+        request), which other transactions don't change. "unknown"
+        until its response head is read. */
+    http_status_code_class publish_status_class() const
+    {
+        return d_publish_tr.head.status_class();
+    }
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    /** The HTTP status code class of the last subscribe, which,
+        unlike the above, other (asynchronous) transactions don't
+        change. "unknown" until its response head is read. */
+    http_status_code_class subscribe_status_class() const
+    {
+        return d_subscribe_tr.head.status_class();
+    }
+
+    /** Sets the timetoken (and its region) to subscribe from on the
+        next subscribe, to resume from one you saved. */
+    void set_subscribe_timetoken(uint64_t tt, int region = -1)
+    {
+        subscribe_client.set_timetoken(tt, region);
+    }
+#endif
+
+#if defined(PUBNUB_UNIT_TEST)
+    inline PubNonSubClient& publishClient() { return publish_client; }
+#if !defined(PUBNUB_NO_HISTORY)
+    inline PubNonSubClient& historyClient() { return history_client; };
+#endif
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    inline PubSubClient& subscribeClient() { return subscribe_client; }
+#endif
+#endif /* PUBNUB_UNIT_TEST */    
+
+private:
+    /** What the response headers have told us about the body */
+    struct http_body_info {
+        /** Length of the body, negative if not known */
+        long content_length;
+        /** Is the body in the "chunked" transfer encoding */
+        bool chunked;
+        /** Will the server close the connection after the body */
+        bool close;
+    };
+
+    /** Incremental parser of the HTTP response status line and
+        headers. It is fed characters as they arrive, so it never
+        waits for anything.
+    */
+    class http_head_parser {
+    public:
+        inline void start();
+
+        /** Handles one character, returns whether the head is
+            done, that is, the body begins with the next one. */
+        inline bool handle(char c);
+
+        http_status_code_class status_class() const { return d_status; }
+        http_body_info const&  body_info() const { return d_body_info; }
+
+    private:
+        inline void _start_line();
+        inline void _match(uint8_t bit, char const* str, size_t len, char c);
+
+        enum {
+            version,
+            status,
+            skip_line,
+            header,
+            done
+        } d_state;
+        /** Headers (and the empty line) that the current line may
+            still turn out to be - bitmask */
+        uint8_t d_match;
+        /** Position in the current header line */
+        uint8_t                d_pos;
+        http_status_code_class d_status;
+        http_body_info         d_body_info;
+    };
+
+    /** Context of a (possibly asynchronous) transaction */
+    struct transaction {
+        async_state      state;
+        /** Head done, subscribe waits for the body to begin */
+        bool             await_body;
+        bool             keep_alive;
+        int              timeout;
+        unsigned long    t_start;
+        http_head_parser head;
+        PubNubOpStats*   stats;
+    };
+
+    /** Finishes the request line, writes the headers and sends
+        the whole request. If `content_length` is not negative, the
+        request has a (JSON) body of that length, which the caller
+        writes (and flushes) after this.
+     */
+    inline void _send_request_tail(PubNubRequestWriter& out,
+                                   char                 qparsep,
+                                   bool                 keep_alive,
+                                   long                 content_length = -1);
+
+    /** Writes the request tail (see `_send_request_tail()`), without
+        sending it */
+    inline void _print_request_tail(Print& out,
+                                    char   qparsep,
+                                    bool   keep_alive,
+                                    long   content_length);
+
+    /** (Re)connects the publish client, if need be */
+    inline bool _connect_publish();
+
+    /** Writes the request line of a publish (or a signal, as given
+        by the `endpoint`, like " /publish/"), up to the message */
+    inline void _print_publish_path(Print&                     out,
+                                    __FlashStringHelper const* method,
+                                    __FlashStringHelper const* endpoint,
+                                    char const*                channel);
+
+    /** Writes the query parameters of the publish `options`, the
+        first one starting with `qparsep`. Returns the separator
+        for the next parameter. */
+    inline static char _print_publish_options(PubNubRequestWriter&        out,
+                                              PubNubPublishOptions const& options,
+                                              char qparsep);
+
+    /** Writes the string `s`, URI-escaping it */
+    inline static void _print_encoded(PubNubRequestWriter& out, char const* s);
+
+    /** Sends a GET publish (or signal) request, with the `options`,
+        if not 0 */
+    inline bool _start_publish_get(__FlashStringHelper const*  endpoint,
+                                   const char*                 channel,
+                                   const char*                 message,
+                                   PubNubPublishOptions const* options,
+                                   int                         timeout);
+
+    /** Sends a POST publish request, with the body being either the
+        `length` octets at `message` or, if not 0, read from the
+        `stream` */
+    inline bool _start_publish_post(const char*                 channel,
+                                    const char*                 message,
+                                    Stream*                     stream,
+                                    size_t                      length,
+                                    PubNubPublishOptions const* options,
+                                    int                         timeout);
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    /** Sends a (v1 or `v2`) subscribe request */
+    inline bool _start_subscribe(const char* channels,
+                                 const char* channel_groups,
+                                 int         timeout,
+                                 bool        v2);
+#endif
+
+#if !defined(PUBNUB_NO_HISTORY)
+    /** (Re)connects the history client, if need be */
+    inline bool _connect_history();
+#endif
+
+    /** Kinds of presence requests */
+    enum presence_request {
+        presence_heartbeat,
+        presence_leave,
+        presence_here_now,
+        presence_set_state,
+        presence_get_state
+    };
+
+    /** Sends a presence request, over the publish client */
+    inline bool _start_presence(presence_request req,
+                                const char*      channels,
+                                const char*      channel_groups,
+                                const char*      state,
+                                int              timeout);
+
+    /** Sends a presence request and waits for the response */
+    inline PubNonSubClient* _presence(presence_request req,
+                                      const char*      channels,
+                                      const char*      channel_groups,
+                                      const char*      state,
+                                      int              timeout);
+
+    /** Starts waiting for the response to a sent request */
+    inline void _start_transaction(transaction&  tr,
+                                   unsigned long t_start,
+                                   int           timeout,
+                                   bool          keep_alive);
+
+    /** Processes whatever has arrived for the transaction `tr` of
+        the operation `op`, reading from the `client` */
+    inline void _poll(transaction&        tr,
+                      PubNub_BASE_CLIENT& client,
+                      async_operation     op);
+
+    /** Finishes the transaction `tr` of operation `op` with the
+        given state */
+    inline void _finish(transaction& tr, async_operation op, async_state state);
+
+    /** Polls the transaction until it finishes, for the blocking
+        interface. Returns whether it was successful. */
+    inline bool _await(transaction&        tr,
+                       PubNub_BASE_CLIENT& client,
+                       async_operation     op);
+
+    /** Starts the body of a response on `client` that was requested
+        with `keep_alive`, as described by `body_info` */
+    inline void _start_body(PubNonSubClient&      client,
+                            bool                  keep_alive,
+                            http_body_info const& body_info);
+
+    const char* d_publish_key;
+    const char* d_subscribe_key;
+    const char* d_origin;
+    const char* d_uuid;
+    const char* d_auth;
+
+    /// Presence timeout (seconds) to send, 0 for none
+    unsigned d_presence_timeout;
+
+    /// When the last heartbeat (or subscribe) request was sent
+    unsigned long d_heartbeat_at;
+
+    /// TCP/IP port to use.
+    unsigned d_port;
+
+    /// Keep the publish and history connections alive
+    bool d_keep_alive;
+
+    /// Changes whenever something that goes into a (publish) request
+    /// does, so that `PubNubChannel`s know to render theirs again
+    unsigned d_request_gen;
+
+    friend class PubNubChannel;
+
+    /// The HTTP status code class of the last PubNub transaction
+    http_status_code_class d_last_http_status_code_class;
+
+    /// Called when a transaction finishes
+    async_callback d_async_callback;
+
+    /// Statistics of the requests
+    PubNubStats d_stats;
+
+    PubNonSubClient publish_client;
+    transaction     d_publish_tr;
+
+#if !defined(PUBNUB_NO_HISTORY)
+    PubNonSubClient history_client;
+    transaction     d_history_tr;
+#endif
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    PubSubClient subscribe_client;
+    transaction  d_subscribe_tr;
+
+    /// Is the subscribe transaction (in progress) a v2 one
+    bool d_subscribe_v2;
+
+    /// Filter expression of subscribe, 0 if none
+    const char* d_filter_expr;
+#endif
+};
+
+
+/** Size of the buffer in which a `PubNubChannel` keeps the text of
+    its publish request. If it doesn't fit, publishing to the channel
+    works as usual, just without the benefit. Can be set (as a
+    compiler option, or before including this file) as needed.
+ */
+#if !defined(PUBNUB_CHANNEL_REQUEST_SIZE)
+#if defined(__AVR)
+#define PUBNUB_CHANNEL_REQUEST_SIZE 256
+#else
+#define PUBNUB_CHANNEL_REQUEST_SIZE 384
+#endif
+#endif
+
+
+/** A handle of a channel to publish to (often), which keeps the text
+    of the (GET) publish request, as it is the same every time, but
+    for the message. So, instead of printing the keys, the channel,
+    the auth key and the headers on every publish, it is printed once
+    (on the first publish) and then just written out, along with the
+    (URI-escaped) message:
+
+        PubNubChannel sensors("sensors");
+        ...
+        PubNub.publish(sensors, msg);
+
+    It is printed again if anything in it changes (`begin()`,
+    `set_auth()`, `set_keep_alive()`), but not if you change the
+    contents of the strings you gave to those, in which case call
+    `invalidate()`.
+ */
+class PubNubChannel {
+public:
+    /** The `name` is not copied, it has to outlive the handle */
+    explicit PubNubChannel(const char* name)
+        : d_name(name)
+        , d_pn(0)
+        , d_fits(false)
+    {
+    }
+
+    const char* name() const { return d_name; }
+
+    /** Drops the text of the request, it will be printed again on
+        the next publish */
+    void invalidate() { d_pn = 0; }
+
+private:
+    friend class PubNub;
+
+    /** Writes (prints) into a buffer */
+    class buffer_writer : public Print {
+    public:
+        buffer_writer(char* buf, size_t cap)
+            : d_buf(buf)
+            , d_cap(cap)
+            , d_len(0)
+            , d_overflow(false)
+        {
+        }
+
+        size_t write(uint8_t c)
+        {
+            if (d_len < d_cap) {
+                d_buf[d_len++] = c;
+                return 1;
+            }
+            d_overflow = true;
+            return 0;
+        }
+
+        using Print::write;
+
+        size_t length() const { return d_len; }
+        bool   overflow() const { return d_overflow; }
+
+    private:
+        char*  d_buf;
+        size_t d_cap;
+        size_t d_len;
+        bool   d_overflow;
+    };
+
+    /** Prints the text of the request (of `pn`), if it's not already
+        there. Returns whether it fits. */
+    inline bool _render(PubNub& pn);
+
+    char const* _prefix() const { return d_buf; }
+    char const* _suffix() const { return d_buf + d_prefix_len; }
+
+    const char*   d_name;
+    PubNub const* d_pn;
+    unsigned      d_gen;
+    bool          d_fits;
+    /** The request up to the message (the prefix), followed by the
+        rest of it (the suffix), which are not NUL terminated */
+    char     d_buf[PUBNUB_CHANNEL_REQUEST_SIZE];
+    uint16_t d_prefix_len;
+    uint16_t d_suffix_len;
+};
+
+
+inline bool PubNubChannel::_render(PubNub& pn)
+{
+    if ((&pn == d_pn) && (pn.d_request_gen == d_gen)) {
+        return d_fits;
+    }
+    buffer_writer out(d_buf, sizeof d_buf);
+    pn._print_publish_path(out, F("GET"), F(" /publish/"), d_name);
+    out.print(F("/"));
+    d_prefix_len = out.length();
+    if (pn.d_auth) {
+        out.print(F("?auth="));
+        out.print(pn.d_auth);
+    }
+    pn._print_request_tail(out, pn.d_auth ? '&' : '?', pn.d_keep_alive, -1);
+    d_suffix_len = out.length() - d_prefix_len;
+    d_fits       = !out.overflow();
+    d_pn         = &pn;
+    d_gen        = pn.d_request_gen;
+    return d_fits;
+}
+
+
+/* There are some special considerations when using the WiFi libary,
+ * compared to the Ethernet library:
+ *
+ * (i) The client object may return stale data from previous connection,
+ * so we should call .flush() after initiating a connection.
+ *
+ * (ii) It appears .stop() does not block on really terminating
+ * the connection, do that manually.
+ *
+ * (iii) Data may still be available while connected() returns false
+ * already; use available() test on a lot of places where we used
+ * connected() before.
+ */
+
+inline bool PubSubClient::_state_input(uint8_t ch)
+{
+    /* Process a single character on input, updating the JSON
+     * state machine. If we reached the last character of input
+     * (just before expected ","), we will start grabbing the
+     * timetoken. Returns whether the character is a part of the
+     * body (and not of the timetoken). */
+    if (tt_state != tt_idle) {
+        return this->_timetoken_input(ch);
+    }
+    if (in_string) {
+        if (after_backslash) {
+            /* Whatever this is... */
+            after_backslash = false;
+            return true;
+        }
+        switch (ch) {
+        case '"':
+            in_string = false;
+            if (braces_depth == 0)
+                tt_state = tt_await_comma;
+            return true;
+        case '\\':
+            after_backslash = true;
+            return true;
+        default:
+            return true;
+        }
+    }
+    else {
+        switch (ch) {
+        case '"':
+            in_string = true;
+            return true;
+        case '{':
+        case '[':
+            braces_depth++;
+            return true;
+        case '}':
+        case ']':
+            braces_depth--;
+            if (braces_depth == 0)
+                tt_state = tt_await_comma;
+            return true;
+        default:
+            return true;
+        }
+    }
+}
+
+
+inline bool PubSubClient::_timetoken_input(uint8_t ch)
+{
+    /* Returns whether the character is a part of the body, which
+     * is true only for the closing ']' of the whole response. */
+    switch (tt_state) {
+    case tt_await_comma:
+        if (',' == ch) {
+            tt_state = tt_await_quote;
+        }
+        break;
+    case tt_await_quote:
+        if ('"' == ch) {
+            tt_state  = tt_read;
+            d_new_tt  = 0;
+            d_tt_read = false;
+        }
+        break;
+    case tt_read:
+        if (ch == '"') {
+            if (d_tt_read) {
+                set_timetoken(d_new_tt);
+            }
+            else {
+                DBGprintln(F("Empty timetoken, keeping the previous one"));
+                d_malformed = true;
+            }
+            tt_state = tt_after;
+            break;
+        }
+        if (PubNubTimetoken::add_digit(d_new_tt, ch)) {
+            d_tt_read = true;
+        }
+        else {
+            DBGprintln(F("Invalid timetoken, keeping the previous one"));
+            d_malformed = true;
+            tt_state    = tt_skip;
+        }
+        break;
+    case tt_skip:
+        if ('"' == ch) {
+            tt_state = tt_after;
+        }
+        break;
+    case tt_after:
+        if (',' == ch) {
+            tt_state = tt_await_list_quote;
+        }
+        else if (']' == ch) {
+            tt_state = tt_done;
+            return true;
+        }
+        break;
+    case tt_await_list_quote:
+        if ('"' == ch) {
+            /* Only the last list (that of channels) is kept */
+            tt_state             = tt_read_list;
+            d_channels_len       = 0;
+            d_channels[0]        = '\0';
+            d_channels_truncated = false;
+        }
+        break;
+    case tt_read_list:
+        if ('"' == ch) {
+            tt_state = tt_after;
+        }
+        else if (d_channels_len < sizeof d_channels - 1) {
+            d_channels[d_channels_len++] = ch;
+            d_channels[d_channels_len]   = '\0';
+        }
+        else {
+            d_channels_truncated = true;
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+
+inline bool PubSubClient::message_channel(size_t index, char* channel, size_t cap) const
+{
+    char const* start = d_channels;
+    for (; index > 0; --index) {
+        start = strchr(start, ',');
+        if (0 == start) {
+            return false;
+        }
+        ++start;
+    }
+    char const* end = strchr(start, ',');
+    if (0 == end) {
+        if (d_channels_truncated) {
+            return false;
+        }
+        end = start + strlen(start);
+    }
+    size_t len = end - start;
+    if ((0 == len) || (len >= cap)) {
+        return false;
+    }
+    memcpy(channel, start, len);
+    channel[len] = '\0';
+    return true;
+}
+
+
+inline bool await_disconnect(PubNub_BASE_CLIENT& client, unsigned long timeout) {
+    unsigned long    t_start = millis();
+    while (client.connected()) {
+        if (millis() - t_start > timeout * 1000UL) {
+            return false;
+        }
+        delay(10);
+    }
+    return true;
+}
+
+
+inline bool PubNub::start_publish(const char* channel,
+                                  const char* message,
+                                  int         timeout)
+{
+    return _start_publish_get(F(" /publish/"), channel, message, 0, timeout);
+}
+
+
+inline bool PubNub::_start_publish_get(__FlashStringHelper const*  endpoint,
+                                       const char*                 channel,
+                                       const char*                 message,
+                                       PubNubPublishOptions const* options,
+                                       int                         timeout)
+{
+    char          qparsep = '?';
+    unsigned long t_start = millis();
+
+    if (!_connect_publish()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(publish_client);
+    _print_publish_path(out, F("GET"), endpoint, channel);
+    out.print(F("/"));
+
+    _print_encoded(out, message);
+
+    if (options) {
+        qparsep = _print_publish_options(out, *options, qparsep);
+    }
+    if (d_auth) {
+        out.print(qparsep);
+        out.print(F("auth="));
+        out.print(d_auth);
+        qparsep = '&';
+    }
+
+    _send_request_tail(out, qparsep, d_keep_alive);
+    _start_transaction(d_publish_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::publish(const char* channel,
+                                        const char* message,
+                                        int         timeout)
+{
+    if (!start_publish(channel, message, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline bool PubNub::start_publish(PubNubChannel& channel,
+                                  const char*    message,
+                                  int            timeout)
+{
+    if (!channel._render(*this)) {
+        /* Print it as usual, then */
+        return start_publish(channel.name(), message, timeout);
+    }
+
+    unsigned long t_start = millis();
+
+    if (!_connect_publish()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(publish_client);
+    out.write((const uint8_t*)channel._prefix(), channel.d_prefix_len);
+    _print_encoded(out, message);
+    out.write((const uint8_t*)channel._suffix(), channel.d_suffix_len);
+    out.flush();
+    _start_transaction(d_publish_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::publish(PubNubChannel& channel,
+                                        const char*    message,
+                                        int            timeout)
+{
+    if (!start_publish(channel, message, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline bool PubNub::start_publish_post(const char* channel,
+                                       const char* message,
+                                       int         timeout)
+{
+    return _start_publish_post(
+        channel, message, 0, strlen(message), 0, timeout);
+}
+
+
+inline bool PubNub::start_publish_post(const char* channel,
+                                       Stream&     message,
+                                       size_t      length,
+                                       int         timeout)
+{
+    return _start_publish_post(channel, 0, &message, length, 0, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::publish_post(const char* channel,
+                                             const char* message,
+                                             int         timeout)
+{
+    if (!start_publish_post(channel, message, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish_post() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline PubNonSubClient* PubNub::publish_post(const char* channel,
+                                             Stream&     message,
+                                             size_t      length,
+                                             int         timeout)
+{
+    if (!start_publish_post(channel, message, length, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish_post() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline bool PubNub::start_publish(const char*                 channel,
+                                  const char*                 message,
+                                  PubNubPublishOptions const& options,
+                                  int                         timeout)
+{
+    return _start_publish_get(
+        F(" /publish/"), channel, message, &options, timeout);
+}
+
+
+inline bool PubNub::start_publish_post(const char*                 channel,
+                                       const char*                 message,
+                                       PubNubPublishOptions const& options,
+                                       int                         timeout)
+{
+    return _start_publish_post(
+        channel, message, 0, strlen(message), &options, timeout);
+}
+
+
+inline bool PubNub::start_fire(const char* channel,
+                               const char* message,
+                               int         timeout)
+{
+    PubNubPublishOptions options;
+    options.store = 0;
+    options.norep = true;
+    return _start_publish_get(
+        F(" /publish/"), channel, message, &options, timeout);
+}
+
+
+inline bool PubNub::start_signal(const char* channel,
+                                 const char* message,
+                                 int         timeout)
+{
+    return _start_publish_get(F(" /signal/"), channel, message, 0, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::publish(const char*                 channel,
+                                        const char*                 message,
+                                        PubNubPublishOptions const& options,
+                                        int                         timeout)
+{
+    if (!start_publish(channel, message, options, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline PubNonSubClient* PubNub::publish_post(const char*                 channel,
+                                             const char*                 message,
+                                             PubNubPublishOptions const& options,
+                                             int timeout)
+{
+    if (!start_publish_post(channel, message, options, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("publish_post() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline PubNonSubClient* PubNub::fire(const char* channel,
+                                     const char* message,
+                                     int         timeout)
+{
+    if (!start_fire(channel, message, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("fire() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline PubNonSubClient* PubNub::signal(const char* channel,
+                                       const char* message,
+                                       int         timeout)
+{
+    if (!start_signal(channel, message, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("signal() failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline bool PubNub::_connect_publish()
+{
+    PubNonSubClient& client = publish_client;
+    bool const       reused = client.reuse();
+
+    d_stats.publish._start();
+    /* connect() timeout is about 30s, much lower than our usual
+     * timeout is. */
+    if (!reused) {
+        int rslt = client.connect(d_origin, d_port);
+        if (rslt != 1) {
+            DBGprint(F("Connection error "));
+            DBGprintln(rslt);
+            client.stop();
+            d_stats.publish._connect_failed();
+            d_publish_tr.state = async_error;
+            return false;
+        }
+        d_stats.publish._connected();
+    }
+    d_stats.publish._mark(PubNubOpStats::phase_connect, !reused);
+
+    d_last_http_status_code_class = http_scc_unknown;
+    client.flush();
+    return true;
+}
+
+
+inline void PubNub::_print_encoded(PubNubRequestWriter& out, char const* s)
+{
+    out.write_encoded(s);
+}
+
+
+inline void PubNub::_print_publish_path(Print&                     out,
+                                        __FlashStringHelper const* method,
+                                        __FlashStringHelper const* endpoint,
+                                        char const*                channel)
+{
+    out.print(method);
+    out.print(endpoint);
+    out.print(d_publish_key);
+    out.print(F("/"));
+    out.print(d_subscribe_key);
+    out.print(F("/0/"));
+    out.print(channel);
+    out.print(F("/0"));
+}
+
+
+inline char PubNub::_print_publish_options(PubNubRequestWriter&        out,
+                                           PubNubPublishOptions const& options,
+                                           char                        qparsep)
+{
+    if (options.store >= 0) {
+        out.print(qparsep);
+        out.print(options.store ? F("store=1") : F("store=0"));
+        qparsep = '&';
+    }
+    if (options.ttl > 0) {
+        out.print(qparsep);
+        out.print(F("ttl="));
+        out.print(options.ttl);
+        qparsep = '&';
+    }
+    if (options.norep) {
+        out.print(qparsep);
+        out.print(F("norep=true"));
+        qparsep = '&';
+    }
+    if (options.meta) {
+        out.print(qparsep);
+        out.print(F("meta="));
+        _print_encoded(out, options.meta);
+        qparsep = '&';
+    }
+    return qparsep;
+}
+
+
+inline bool PubNub::_start_publish_post(const char*                 channel,
+                                        const char*                 message,
+                                        Stream*                     stream,
+                                        size_t                      length,
+                                        PubNubPublishOptions const* options,
+                                        int                         timeout)
+{
+    char          qparsep = '?';
+    unsigned long t_start = millis();
+
+    if (!_connect_publish()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(publish_client);
+    _print_publish_path(out, F("POST"), F(" /publish/"), channel);
+    if (options) {
+        qparsep = _print_publish_options(out, *options, qparsep);
+    }
+    if (d_auth) {
+        out.print(qparsep);
+        out.print(F("auth="));
+        out.print(d_auth);
+        qparsep = '&';
+    }
+    _send_request_tail(out, qparsep, d_keep_alive, (long)length);
+
+    /* The head and (the start of) the body go out together */
+    if (!stream) {
+        out.write((const uint8_t*)message, length);
+    }
+    else if (out.write_from(*stream, length) != length) {
+        /* We promised `length` octets, so there's no way to
+         * finish this request. */
+        DBGprintln(F("Timeout reading the message to publish"));
+        publish_client.stop();
+        d_publish_tr.state = async_error;
+        return false;
+    }
+    out.flush();
+
+    _start_transaction(d_publish_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+inline bool PubNub::start_subscribe(const char* channels,
+                                    const char* channel_groups,
+                                    int         timeout)
+{
+    return _start_subscribe(channels, channel_groups, timeout, false);
+}
+
+
+inline bool PubNub::start_subscribe_v2(const char* channels,
+                                       const char* channel_groups,
+                                       int         timeout)
+{
+    return _start_subscribe(channels, channel_groups, timeout, true);
+}
+
+
+inline bool PubNub::_start_subscribe(const char* channels,
+                                     const char* channel_groups,
+                                     int         timeout,
+                                     bool        v2)
+{
+    PubSubClient& client = subscribe_client;
+    int           have_param = 0;
+    unsigned long t_start = millis();
+
+    client.start_request();
+
+    d_stats.subscribe._start();
+    /* connect() timeout is about 30s, much lower than our usual
+     * timeout is. */
+    if (!client.connect(d_origin, d_port)) {
+        DBGprintln(F("Connection error"));
+        client.stop();
+        d_stats.subscribe._connect_failed();
+        d_subscribe_tr.state = async_error;
+        return false;
+    }
+    d_stats.subscribe._connected();
+    d_stats.subscribe._mark(PubNubOpStats::phase_connect);
+
+    d_last_http_status_code_class = http_scc_unknown;
+    client.flush();
+    PubNubRequestWriter out(client);
+    if (v2) {
+        out.print(F("GET /v2/subscribe/"));
+    }
+    else {
+        out.print(F("GET /subscribe/"));
+    }
+    out.print(d_subscribe_key);
+    out.print(F("/"));
+    /* With only channel groups, the channel is just a "," */
+    out.print((channels && *channels) ? channels : ",");
+    if (v2) {
+        /* The timetoken is a query parameter, with its region */
+        out.print(F("/0?tt="));
+        out.print(client.server_timetoken());
+        if (client.server_region() >= 0) {
+            out.print(F("&tr="));
+            out.print(client.server_region(), DEC);
+        }
+        have_param = 1;
+    }
+    else {
+        out.print(F("/0/"));
+        out.print(client.server_timetoken());
+    }
+    if (channel_groups && *channel_groups) {
+        out.print(have_param ? '&' : '?');
+        out.print(F("channel-group="));
+        out.print(channel_groups);
+        have_param = 1;
+    }
+    if (d_filter_expr && *d_filter_expr) {
+        out.print(have_param ? '&' : '?');
+        out.print(F("filter-expr="));
+        _print_encoded(out, d_filter_expr);
+        have_param = 1;
+    }
+    if (d_uuid) {
+        out.print(have_param ? '&' : '?');
+        out.print(F("uuid="));
+        out.print(d_uuid);
+        have_param = 1;
+    }
+    if (d_presence_timeout) {
+        out.print(have_param ? '&' : '?');
+        out.print(F("heartbeat="));
+        out.print(d_presence_timeout);
+        have_param = 1;
+    }
+    if (d_auth) {
+        out.print(have_param ? '&' : '?');
+        out.print(F("auth="));
+        out.print(d_auth);
+        have_param = 1;
+    }
+
+    _send_request_tail(out, have_param ? '&' : '?', false);
+    _start_transaction(d_subscribe_tr, t_start, timeout, false);
+    d_subscribe_v2 = v2;
+    d_heartbeat_at = millis();
+    return true;
+}
+
+
+inline PubSubClient* PubNub::subscribe(const char* channels,
+                                       const char* channel_groups,
+                                       int         timeout)
+{
+    if (!start_subscribe(channels, channel_groups, timeout)) {
+        return 0;
+    }
+    if (!_await(d_subscribe_tr, subscribe_client, async_subscribe)) {
+        DBGprintln(F("subscribe() failed"));
+        return 0;
+    }
+    /* Now return handle to the client for further perusal.
+     * PubSubClient class will make sure that the client does
+     * not see the time token but we stop right after the
+     * message body. */
+    return &subscribe_client;
+}
+
+
+inline PubSubClient* PubNub::subscribe_v2(const char* channels,
+                                          const char* channel_groups,
+                                          int         timeout)
+{
+    if (!start_subscribe_v2(channels, channel_groups, timeout)) {
+        return 0;
+    }
+    if (!_await(d_subscribe_tr, subscribe_client, async_subscribe)) {
+        DBGprintln(F("subscribe_v2() failed"));
+        return 0;
+    }
+    return &subscribe_client;
+}
+#endif /* !defined(PUBNUB_NO_SUBSCRIBE) */
+
+
+#if !defined(PUBNUB_NO_HISTORY)
+inline bool PubNub::_connect_history()
+{
+    PubNonSubClient& client = history_client;
+    bool const       reused = client.reuse();
+
+    d_stats.history._start();
+    if (!reused) {
+        if (!client.connect(d_origin, d_port)) {
+            DBGprintln(F("Connection error"));
+            client.stop();
+            d_stats.history._connect_failed();
+            d_history_tr.state = async_error;
+            return false;
+        }
+        d_stats.history._connected();
+    }
+    d_stats.history._mark(PubNubOpStats::phase_connect, !reused);
+
+    d_last_http_status_code_class = http_scc_unknown;
+    client.flush();
+    return true;
+}
+
+
+inline bool PubNub::start_history(const char* channel, int limit, int timeout)
+{
+    unsigned long t_start = millis();
+
+    if (!_connect_history()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(history_client);
+    out.print(F("GET /history/"));
+    out.print(d_subscribe_key);
+    out.print(F("/"));
+    out.print(channel);
+    out.print(F("/0/"));
+    out.print(limit, DEC);
+
+    _send_request_tail(out, '?', d_keep_alive);
+    _start_transaction(d_history_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline bool PubNub::start_history_v2(const char*                 channel,
+                                     int                         count,
+                                     PubNubHistoryOptions const& options,
+                                     int                         timeout)
+{
+    char          tt[PubNubTimetoken::str_size];
+    unsigned long t_start = millis();
+
+    if (!_connect_history()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(history_client);
+    out.print(F("GET /v2/history/sub-key/"));
+    out.print(d_subscribe_key);
+    out.print(F("/channel/"));
+    out.print(channel);
+    out.print(F("?count="));
+    out.print(count, DEC);
+    if (options.start) {
+        out.print(F("&start="));
+        out.print(PubNubTimetoken::to_str(options.start, tt));
+    }
+    if (options.end) {
+        out.print(F("&end="));
+        out.print(PubNubTimetoken::to_str(options.end, tt));
+    }
+    if (options.reverse) {
+        out.print(F("&reverse=true"));
+    }
+    if (options.include_token) {
+        out.print(F("&include_token=true"));
+    }
+    if (d_auth) {
+        out.print(F("&auth="));
+        out.print(d_auth);
+    }
+
+    _send_request_tail(out, '&', d_keep_alive);
+    _start_transaction(d_history_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::history(const char* channel, int limit, int timeout)
+{
+    if (!start_history(channel, limit, timeout)) {
+        return 0;
+    }
+    if (!_await(d_history_tr, history_client, async_history)) {
+        DBGprintln(F("history() failed"));
+        return 0;
+    }
+    return &history_client;
+}
+
+
+inline PubNonSubClient* PubNub::history_v2(const char*                 channel,
+                                           int                         count,
+                                           PubNubHistoryOptions const& options,
+                                           int                         timeout)
+{
+    if (!start_history_v2(channel, count, options, timeout)) {
+        return 0;
+    }
+    if (!_await(d_history_tr, history_client, async_history)) {
+        DBGprintln(F("history_v2() failed"));
+        return 0;
+    }
+    return &history_client;
+}
+
+
+inline bool PubNub::start_fetch_messages(const char*                 channels,
+                                         int                         count,
+                                         PubNubHistoryOptions const& options,
+                                         int                         timeout)
+{
+    char          tt[PubNubTimetoken::str_size];
+    unsigned long t_start = millis();
+
+    if (!_connect_history()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(history_client);
+    out.print(F("GET /v3/history/sub-key/"));
+    out.print(d_subscribe_key);
+    out.print(F("/channel/"));
+    out.print(channels);
+    out.print(F("?max="));
+    out.print(count, DEC);
+    if (options.start) {
+        out.print(F("&start="));
+        out.print(PubNubTimetoken::to_str(options.start, tt));
+    }
+    if (options.end) {
+        out.print(F("&end="));
+        out.print(PubNubTimetoken::to_str(options.end, tt));
+    }
+    if (d_auth) {
+        out.print(F("&auth="));
+        out.print(d_auth);
+    }
+
+    _send_request_tail(out, '&', d_keep_alive);
+    _start_transaction(d_history_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::fetch_messages(const char*                 channels,
+                                               int                         count,
+                                               PubNubHistoryOptions const& options,
+                                               int timeout)
+{
+    if (!start_fetch_messages(channels, count, options, timeout)) {
+        return 0;
+    }
+    if (!_await(d_history_tr, history_client, async_history)) {
+        DBGprintln(F("fetch_messages() failed"));
+        return 0;
+    }
+    return &history_client;
+}
+
+
+inline bool PubNub::start_message_counts(const char* channels,
+                                         uint64_t    timetoken,
+                                         int         timeout)
+{
+    char          tt[PubNubTimetoken::str_size];
+    unsigned long t_start = millis();
+
+    if (!_connect_history()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(history_client);
+    out.print(F("GET /v3/history/sub-key/"));
+    out.print(d_subscribe_key);
+    out.print(F("/message-counts/"));
+    out.print(channels);
+    out.print(F("?timetoken="));
+    out.print(PubNubTimetoken::to_str(timetoken, tt));
+    if (d_auth) {
+        out.print(F("&auth="));
+        out.print(d_auth);
+    }
+
+    _send_request_tail(out, '&', d_keep_alive);
+    _start_transaction(d_history_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::message_counts(const char* channels,
+                                               uint64_t    timetoken,
+                                               int         timeout)
+{
+    if (!start_message_counts(channels, timetoken, timeout)) {
+        return 0;
+    }
+    if (!_await(d_history_tr, history_client, async_history)) {
+        DBGprintln(F("message_counts() failed"));
+        return 0;
+    }
+    return &history_client;
+}
+#endif /* !defined(PUBNUB_NO_HISTORY) */
+
+
+inline bool PubNub::_start_presence(presence_request req,
+                                    const char*      channels,
+                                    const char*      channel_groups,
+                                    const char*      state,
+                                    int              timeout)
+{
+    char          qparsep = '?';
+    unsigned long t_start = millis();
+
+    if (async_in_progress == d_publish_tr.state) {
+        DBGprintln(F("Publish in progress, can't send a presence request"));
+        return false;
+    }
+    if (((presence_set_state == req) || (presence_get_state == req)) && !d_uuid) {
+        DBGprintln(F("No UUID to get or set the state of"));
+        d_publish_tr.state = async_error;
+        return false;
+    }
+    if (!_connect_publish()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(publish_client);
+    out.print(F("GET /v2/presence/sub-key/"));
+    out.print(d_subscribe_key);
+    out.print(F("/channel/"));
+    /* With only channel groups, the channel is just a "," */
+    out.print((channels && *channels) ? channels : ",");
+    switch (req) {
+    case presence_heartbeat:
+        out.print(F("/heartbeat"));
+        if (d_presence_timeout) {
+            out.print(F("?heartbeat="));
+            out.print(d_presence_timeout);
+            qparsep = '&';
+        }
+        break;
+    case presence_leave:
+        out.print(F("/leave"));
+        break;
+    case presence_set_state:
+        out.print(F("/uuid/"));
+        out.print(d_uuid);
+        out.print(F("/data"));
+        break;
+    case presence_get_state:
+        out.print(F("/uuid/"));
+        out.print(d_uuid);
+        break;
+    default:
+        break;
+    }
+    if (channel_groups && *channel_groups) {
+        out.print(qparsep);
+        out.print(F("channel-group="));
+        out.print(channel_groups);
+        qparsep = '&';
+    }
+    if (state) {
+        out.print(qparsep);
+        out.print(F("state="));
+        _print_encoded(out, state);
+        qparsep = '&';
+    }
+    if (d_uuid) {
+        out.print(qparsep);
+        out.print(F("uuid="));
+        out.print(d_uuid);
+        qparsep = '&';
+    }
+    if (d_auth) {
+        out.print(qparsep);
+        out.print(F("auth="));
+        out.print(d_auth);
+        qparsep = '&';
+    }
+
+    _send_request_tail(out, qparsep, d_keep_alive);
+    _start_transaction(d_publish_tr, t_start, timeout, d_keep_alive);
+    if (presence_heartbeat == req) {
+        d_heartbeat_at = millis();
+    }
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::_presence(presence_request req,
+                                          const char*      channels,
+                                          const char*      channel_groups,
+                                          const char*      state,
+                                          int              timeout)
+{
+    if (!_start_presence(req, channels, channel_groups, state, timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("Presence request failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline bool PubNub::start_heartbeat(const char* channels,
+                                    const char* channel_groups,
+                                    const char* state,
+                                    int         timeout)
+{
+    return _start_presence(
+        presence_heartbeat, channels, channel_groups, state, timeout);
+}
+
+
+inline bool PubNub::start_leave(const char* channels,
+                                const char* channel_groups,
+                                int         timeout)
+{
+    return _start_presence(presence_leave, channels, channel_groups, 0, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::heartbeat(const char* channels,
+                                          const char* channel_groups,
+                                          const char* state,
+                                          int         timeout)
+{
+    return _presence(presence_heartbeat, channels, channel_groups, state, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::leave(const char* channels,
+                                      const char* channel_groups,
+                                      int         timeout)
+{
+    return _presence(presence_leave, channels, channel_groups, 0, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::here_now(const char* channel, int timeout)
+{
+    return _presence(presence_here_now, channel, 0, 0, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::set_state(const char* channel,
+                                          const char* state,
+                                          int         timeout)
+{
+    return _presence(presence_set_state, channel, 0, state, timeout);
+}
+
+
+inline PubNonSubClient* PubNub::get_state(const char* channel, int timeout)
+{
+    return _presence(presence_get_state, channel, 0, 0, timeout);
+}
+
+
+inline bool PubNub::start_time(int timeout)
+{
+    unsigned long t_start = millis();
+    if (async_in_progress == d_publish_tr.state) {
+        DBGprintln(F("Publish in progress, can't send a time request"));
+        return false;
+    }
+    if (!_connect_publish()) {
+        return false;
+    }
+
+    PubNubRequestWriter out(publish_client);
+    out.print(F("GET /time/0"));
+    _send_request_tail(out, '?', d_keep_alive);
+    _start_transaction(d_publish_tr, t_start, timeout, d_keep_alive);
+    return true;
+}
+
+
+inline PubNonSubClient* PubNub::time(int timeout)
+{
+    if (!start_time(timeout)) {
+        return 0;
+    }
+    if (!_await(d_publish_tr, publish_client, async_publish)) {
+        DBGprintln(F("Time request failed"));
+        return 0;
+    }
+    return &publish_client;
+}
+
+
+inline void PubNub::poll()
+{
+    _poll(d_publish_tr, publish_client, async_publish);
+    publish_client.drain_step();
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    _poll(d_subscribe_tr, subscribe_client, async_subscribe);
+    subscribe_client.drain_step();
+#endif
+#if !defined(PUBNUB_NO_HISTORY)
+    _poll(d_history_tr, history_client, async_history);
+    history_client.drain_step();
+#endif
+}
+
+
+inline void PubNub::_send_request_tail(PubNubRequestWriter& out,
+                                       char                 qparsep,
+                                       bool                 keep_alive,
+                                       long                 content_length)
+{
+    _print_request_tail(out, qparsep, keep_alive, content_length);
+    if (content_length < 0) {
+        out.flush();
+    }
+}
+
+
+inline void PubNub::_print_request_tail(Print& out,
+                                        char   qparsep,
+                                        bool   keep_alive,
+                                        long   content_length)
+{
+    /* Finish the first line of the request. */
+    out.print(qparsep);
+    out.print(F("pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"));
+    /* Finish HTTP request. */
+    out.print(F("Host: "));
+    out.print(d_origin);
+    out.print(F("\r\nUser-Agent: PubNub-Arduino/1.0\r\n"));
+    if (content_length >= 0) {
+        out.print(F("Content-Type: application/json\r\nContent-Length: "));
+        out.print(content_length, DEC);
+        out.print(F("\r\n"));
+    }
+    out.print(F("Connection: "));
+    if (keep_alive) {
+        out.print(F("keep-alive\r\n\r\n"));
+    }
+    else {
+        out.print(F("close\r\n\r\n"));
+    }
+}
+
+
+inline void PubNub::_start_transaction(transaction&  tr,
+                                       unsigned long t_start,
+                                       int           timeout,
+                                       bool          keep_alive)
+{
+    tr.state      = async_in_progress;
+    tr.await_body = false;
+    tr.keep_alive = keep_alive;
+    tr.timeout    = timeout;
+    tr.t_start    = t_start;
+    tr.head.start();
+    tr.stats->_mark(PubNubOpStats::phase_write);
+}
+
+
+inline void PubNub::_poll(transaction&        tr,
+                          PubNub_BASE_CLIENT& client,
+                          async_operation     op)
+{
+    if (tr.state != async_in_progress) {
+        return;
+    }
+    while (client.available() > 0) {
+        int c = client.read();
+        if (c == -1) {
+            break;
+        }
+        tr.stats->_mark(PubNubOpStats::phase_first_byte);
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+        if (tr.await_body) {
+            /* We need to eat '[' first, as our API contract is to
+             * return only the "message body" part of reply from
+             * subscribe. */
+            if (c != '[') {
+                DBGprintln(F("Unexpected body in subscribe response"));
+                client.stop();
+                _finish(tr, op, async_error);
+                return;
+            }
+            subscribe_client.start_body();
+            _finish(tr, op, async_done);
+            return;
+        }
+#endif
+        if (tr.head.handle(c)) {
+            tr.stats->_mark(PubNubOpStats::phase_head);
+            d_last_http_status_code_class = tr.head.status_class();
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+            if (async_subscribe == op) {
+                subscribe_client.set_chunked(tr.head.body_info().chunked);
+                if (d_subscribe_v2) {
+                    /* The whole v2 envelope is left to the
+                     * SubscribeV2Cracker */
+                    _finish(tr, op, async_done);
+                    return;
+                }
+                tr.await_body = true;
+                continue;
+            }
+#endif
+            /* Publish or history */
+            _start_body(static_cast<PubNonSubClient&>(client),
+                        tr.keep_alive,
+                        tr.head.body_info());
+            _finish(tr, op, async_done);
+            return;
+        }
+    }
+
+    if (millis() - tr.t_start > (unsigned long)tr.timeout * 1000) {
+        DBGprintln(F("Timeout waiting for response"));
+        tr.stats->_timeout();
+        client.stop();
+        _finish(tr, op, async_timeout);
+    }
+    else if (!client.connected()) {
+        /* Oops, connection interrupted. */
+        DBGprintln(F("Connection reset waiting for response"));
+        tr.stats->_reset();
+        client.stop();
+        _finish(tr, op, async_error);
+    }
+}
+
+
+inline void PubNub::_finish(transaction& tr, async_operation op, async_state state)
+{
+    if (tr.head.status_class() != http_scc_unknown) {
+        d_last_http_status_code_class = tr.head.status_class();
+    }
+    tr.state = state;
+    if (d_async_callback) {
+        d_async_callback(op, state);
+    }
+}
+
+
+inline bool PubNub::_await(transaction&        tr,
+                           PubNub_BASE_CLIENT& client,
+                           async_operation     op)
+{
+    for (;;) {
+        _poll(tr, client, op);
+        if (tr.state != async_in_progress) {
+            break;
+        }
+        delay(1);
+    }
+    if (async_done == tr.state) {
+        return true;
+    }
+    if (!await_disconnect(client, 10)) {
+        DBGprintln(F("Disconnect timeout"));
+    }
+    return false;
+}
+
+
+inline void PubNub::http_head_parser::start()
+{
+    d_state                  = version;
+    d_status                 = http_scc_unknown;
+    d_body_info.content_length = -1;
+    d_body_info.chunked        = false;
+    d_body_info.close          = false;
+}
+
+
+/* Bits of `http_head_parser::d_match` */
+#define PUBNUB_HEAD_EMPTY_LINE 0x01
+#define PUBNUB_HEAD_CHUNKED 0x02
+#define PUBNUB_HEAD_CLOSE 0x04
+#define PUBNUB_HEAD_CONTENT_LENGTH 0x08
+
+
+inline void PubNub::http_head_parser::_start_line()
+{
+    d_state = header;
+    d_pos   = 0;
+    d_match = PUBNUB_HEAD_EMPTY_LINE | PUBNUB_HEAD_CHUNKED | PUBNUB_HEAD_CLOSE
+              | PUBNUB_HEAD_CONTENT_LENGTH;
+}
+
+
+inline void PubNub::http_head_parser::_match(uint8_t     bit,
+                                             char const* str,
+                                             size_t      len,
+                                             char        c)
+{
+    if ((d_match & bit)
+        && ((d_pos >= len) || (tolower(c) != tolower(str[d_pos])))) {
+        d_match &= ~bit;
+    }
+}
+
+
+inline bool PubNub::http_head_parser::handle(char c)
+{
+    /* The headers we care about, up to the CR at the end of line */
+    const static char empty_str[]          = "\r";
+    const static char chunked_str[]        = "Transfer-Encoding: chunked\r";
+    const static char close_str[]          = "Connection: close\r";
+    const static char content_length_str[] = "Content-Length: ";
+
+    switch (d_state) {
+    case version:
+        /* "HTTP/1.x " */
+        if (' ' == c) {
+            d_state = status;
+        }
+        break;
+    case status:
+        /* First digit of HTTP code */
+        d_status = static_cast<http_status_code_class>(c - '0');
+        /* Skip the rest of status line */
+        d_state = skip_line;
+        break;
+    case skip_line:
+        /* Let's hope there is no stray LF without CR. */
+        if ('\n' == c) {
+            _start_line();
+        }
+        break;
+    case header:
+        if ('\n' == c) {
+            if ((d_match & PUBNUB_HEAD_EMPTY_LINE)
+                && (d_pos == sizeof empty_str - 1)) {
+                /* Empty line. This means headers end. */
+                d_state = done;
+                break;
+            }
+            if ((d_match & PUBNUB_HEAD_CHUNKED)
+                && (d_pos == sizeof chunked_str - 1)) {
+                d_body_info.chunked = true;
+            }
+            if ((d_match & PUBNUB_HEAD_CLOSE) && (d_pos == sizeof close_str - 1)) {
+                d_body_info.close = true;
+            }
+            _start_line();
+            break;
+        }
+        _match(PUBNUB_HEAD_EMPTY_LINE, empty_str, sizeof empty_str - 1, c);
+        _match(PUBNUB_HEAD_CHUNKED, chunked_str, sizeof chunked_str - 1, c);
+        _match(PUBNUB_HEAD_CLOSE, close_str, sizeof close_str - 1, c);
+        if (d_match & PUBNUB_HEAD_CONTENT_LENGTH) {
+            if (d_pos < sizeof content_length_str - 1) {
+                _match(PUBNUB_HEAD_CONTENT_LENGTH,
+                       content_length_str,
+                       sizeof content_length_str - 1,
+                       c);
+            }
+            else if (isdigit(c)) {
+                if (d_pos == sizeof content_length_str - 1) {
+                    d_body_info.content_length = 0;
+                }
+                d_body_info.content_length =
+                    d_body_info.content_length * 10 + (c - '0');
+            }
+            else {
+                d_match &= ~PUBNUB_HEAD_CONTENT_LENGTH;
+            }
+        }
+        if (d_pos < 255) {
+            ++d_pos;
+        }
+        break;
+    case done:
+    default:
+        break;
+    }
+    return done == d_state;
+}
+
+
+/** Size of the buffer in which the message crackers (SubscribeCracker,
+    HistoryCracker) stage the data read from the client. They read
+    it in blocks of this size, instead of one character at a time.
+    Can be set (as a compiler option, or before including this file)
+    to, say, save RAM on boards that have little of it.
+ */
+#if !defined(PUBNUB_CRACKER_BUFFER_SIZE)
+#if defined(__AVR)
+#define PUBNUB_CRACKER_BUFFER_SIZE 64
+#else
+#define PUBNUB_CRACKER_BUFFER_SIZE 256
+#endif
+#endif
+
+
+/** Staging buffer for reading response data in blocks. It keeps
+    the data that was read, but not yet handled, between calls
+    of the cracker `get()`.
+ */
+class PubNubReadBuffer {
+public:
+    PubNubReadBuffer()
+        : d_pos(0)
+        , d_len(0)
+    {
+    }
+
+    /** Is there no data left in the buffer? */
+    bool empty() const { return d_pos >= d_len; }
+
+    /** The next character from the buffer, which must not be empty */
+    char next() { return d_buf[d_pos++]; }
+
+    /** The data left in the buffer */
+    char const* data() const { return (char const*)d_buf + d_pos; }
+    size_t      size() const { return d_len - d_pos; }
+
+    /** Drops the first `len` octets of the data left */
+    void consume(size_t len) { d_pos += len; }
+
+    /** Reads a block from the `client` into the (empty) buffer.
+        Returns whether anything was read.
+     */
+    bool fill(PubNub_BASE_CLIENT& client)
+    {
+        int len = client.read(d_buf, sizeof d_buf);
+        d_pos   = 0;
+        d_len   = (len > 0) ? len : 0;
+        return d_len > 0;
+    }
+
+private:
+    uint8_t d_buf[PUBNUB_CRACKER_BUFFER_SIZE];
+    size_t  d_pos;
+    size_t  d_len;
+};
+
+
+/** Receives the messages cracked by the `visit()` of a message
+    cracker, directly from the buffer the response was read into,
+    without copying them. A message may be handed out in more than
+    one part, as it may not have been read all at once.
+ */
+class MessageVisitor {
+public:
+    /** Receives a part of a message, `len` octets at `data`, which
+        are valid only during the call */
+    virtual void message_data(char const* data, size_t len) = 0;
+
+    /** The message is complete, the next data is of a new one */
+    virtual void message_end() = 0;
+};
+
+
+/** Decides which messages a cracker's `get()` hands out, like
+    `PubNubFilter` does, or you can implement it yourself.
+ */
+class MessageFilter {
+public:
+    /** Is the message, the (NUL terminated) JSON text `msg`, to be
+        handed out? */
+    virtual bool matches(char const* msg) const = 0;
+};
+
+
+/** A helper that "cracks" the messages from an array of them.
+    It is, essentially, a simple, non-validating parser of
+    a JSON array, yielding individual elements of said array.
+*/
+class MessageCracker {
+public:
+    enum State {
+        bracket_open,
+        ground_zero,
+        in_message,
+        in_quotes,
+        malformed,
+        done
+    };
+
+    /** What to do with the character just cracked */
+    enum Output {
+        /** Ignore it, it's not a part of a message */
+        output_none,
+        /** Start a new message (clear it) and ignore the character */
+        output_start,
+        /** Append it to the message */
+        output_append
+    };
+
+    MessageCracker()
+        : d_state(bracket_open)
+        , d_in_msg(false)
+    {
+    }
+
+    /** Low-level interface, cracks one character, updating the
+        state and returning what to do with the character.
+    */
+    Output crack(char c)
+    {
+        switch (d_state) {
+        case bracket_open:
+            if ('[' == c) {
+                d_state = ground_zero;
+                return output_start;
+            }
+            break;
+        case ground_zero:
+            switch (c) {
+            case '{':
+            case '[':
+                d_bracket_level = 1;
+                d_state         = in_message;
+                return output_append;
+            case '"':
+                d_bracket_level = 0;
+                d_state         = in_quotes;
+                d_backslash     = false;
+                return output_append;
+            case ',':
+                d_bracket_level = 0;
+                d_state         = in_message;
+                break;
+            case ']':
+                d_state = done;
+                break;
+            default:
+                d_bracket_level = 0;
+                d_state         = in_message;
+                return output_append;
+            }
+            break;
+        case in_quotes:
+            if (d_backslash) {
+                /* Whatever is escaped is a part of the string */
+                d_backslash = false;
+                return output_append;
+            }
+            switch (c) {
+            case '"':
+                d_state = (0 == d_bracket_level) ? ground_zero : in_message;
+                return output_append;
+            case '\\':
+                d_backslash = true;
+                return output_append;
+            default:
+                return output_append;
+            }
+        case in_message:
+            switch (c) {
+            case '{':
+            case '[':
+                ++d_bracket_level;
+                return output_append;
+            case '"':
+                d_state     = in_quotes;
+                d_backslash = false;
+                return output_append;
+            case '}':
+            case ']':
+                if (0 == d_bracket_level) {
+                    d_state = done;
+                    break;
+                }
+                if (--d_bracket_level == 0) {
+                    d_state = ground_zero;
+                }
+                return output_append;
+            case ',':
+                if (0 == d_bracket_level) {
+                    /* End of a message that is not an object,
+                     * array or string (like a number) */
+                    d_state = ground_zero;
+                    break;
+                }
+                return output_append;
+            default:
+                return output_append;
+            }
+        case malformed:
+        case done:
+        default:
+            break;
+        }
+        return output_none;
+    }
+
+    void handle(char c, String& msg) { apply(crack(c), c, msg); }
+
+    /** Same as the above, but puts the message in a buffer `msg`
+        of `cap` octets, keeping it NUL terminated. The length of the
+        message is kept in `len`. If the message doesn't fit, the
+        rest of it is dropped (but still counted in `len`) and
+        `truncated` is set.
+    */
+    void handle(char c, char* msg, size_t cap, size_t& len, bool& truncated)
+    {
+        apply(crack(c), c, msg, cap, len, truncated);
+    }
+
+    /** Does to the message `msg` what `out` (cracked from `c`) says.
+        Used by the `handle()` of all the message crackers. */
+    static void apply(Output out, char c, String& msg)
+    {
+        switch (out) {
+        case output_start:
+            msg.remove(0);
+            break;
+        case output_append:
+            msg.concat(c);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /** Same as the above, for a message in a buffer, as in the
+        `handle()` above */
+    static void apply(Output out, char c, char* msg, size_t cap, size_t& len, bool& truncated)
+    {
+        switch (out) {
+        case output_start:
+            len = 0;
+            if (cap > 0) {
+                msg[0] = '\0';
+            }
+            break;
+        case output_append:
+            if (len + 1 < cap) {
+                msg[len]     = c;
+                msg[len + 1] = '\0';
+            }
+            else {
+                truncated = true;
+            }
+            ++len;
+            break;
+        default:
+            break;
+        }
+    }
+
+    /** Cracks (up to) `len` characters at `data`, handing out the
+        messages to the `visitor`. Stops when the message array ends.
+        Returns the number of characters handled.
+    */
+    size_t visit(char const* data, size_t len, MessageVisitor& visitor)
+    {
+        size_t start = 0;
+        size_t i;
+        for (i = 0; (i < len) && (d_state != done); ++i) {
+            Output out = crack(data[i]);
+            if ((output_append == out) && !d_in_msg) {
+                d_in_msg = true;
+                start    = i;
+            }
+            if (d_in_msg && ((ground_zero == d_state) || (done == d_state))) {
+                size_t end = (output_append == out) ? i + 1 : i;
+                if (end > start) {
+                    visitor.message_data(data + start, end - start);
+                }
+                visitor.message_end();
+                d_in_msg = false;
+            }
+        }
+        if (d_in_msg && (i > start)) {
+            visitor.message_data(data + start, i - start);
+        }
+        return i;
+    }
+
+    State state() const { return d_state; }
+
+    bool msg_complete(String& msg) const
+    {
+        return msg_complete(msg.length());
+    }
+
+    /** Is the message of the length `len` complete? */
+    bool msg_complete(size_t len) const
+    {
+        return (len > 0) && (ground_zero == state());
+    }
+
+private:
+    /** Parser/cracker state */
+    State d_state;
+    /** Current bracket level - starts at 0 */
+    size_t d_bracket_level;
+    /** Was the last character a backslash? Valid only inside quotes */
+    bool d_backslash;
+    /** Is a message being visited (handed out by `visit()`)? */
+    bool d_in_msg;
+};
+
+/** Evaluates a subscribe filter expression (in the language of
+    PubNub's stream filtering) on a message, for filtering messages
+    locally, when PubNub doesn't (say, stream filtering is not enabled
+    for the keys). Give it to `SubscribeCracker::set_filter()` and
+    `get()` skips the messages that don't match.
+
+    The fields of the expression are looked up in the message (a JSON
+    object), with '.' separating the keys of nested objects. So, with
+    "region == 'east' && temp > 30", the message {"region":"east",
+    "temp":31} matches. PubNub (`set_filter_expr()`) looks them up in
+    the metadata of the message, so this works the same only if the
+    publisher puts them in the message, too.
+
+    Supported are: `==`, `!=`, `<`, `>`, `<=`, `>=`, `LIKE` (with `*`
+    as the wildcard, ignoring case), `CONTAINS` (substring), `&&`,
+    `||`, `!` and parentheses. Strings are in single or double quotes
+    and are compared as they are in the message (escaped). A
+    comparison with a field that's not in the message is false. A
+    field on its own is true if it is in the message.
+
+    The expression is kept by the pointer and parsed on every
+    evaluation, so no memory is needed for it. An invalid expression
+    matches nothing.
+ */
+class PubNubFilter : public MessageFilter {
+public:
+    PubNubFilter(char const* expr)
+        : d_expr(expr)
+    {
+        cursor c = { expr, "{}", false };
+        _parse(c);
+        d_valid = !c.error;
+    }
+
+    /** Is the expression valid? */
+    bool valid() const { return d_valid; }
+
+    /** Does the message (NUL terminated JSON text) match? */
+    virtual bool matches(char const* json) const
+    {
+        if (!d_valid) {
+            return false;
+        }
+        cursor c = { d_expr, json, false };
+        return _parse(c) && !c.error;
+    }
+
+private:
+    /** Evaluation context: where in the expression we are */
+    struct cursor {
+        char const* e;
+        char const* json;
+        bool        error;
+    };
+
+    /** An operand of a comparison: a field or a literal */
+    struct operand {
+        char const* s;
+        size_t      len;
+        bool        found;
+        bool        is_string;
+    };
+
+    enum Op { op_none, op_eq, op_ne, op_lt, op_gt, op_le, op_ge, op_like, op_contains };
+
+    static char const* _skip_ws(char const* p)
+    {
+        while ((' ' == *p) || ('\t' == *p) || ('\r' == *p) || ('\n' == *p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    static bool _is_word(char c)
+    {
+        return isalnum((unsigned char)c) || ('_' == c) || ('.' == c);
+    }
+
+    /** Finds the closing `quote` of the string at `p` (after the
+        opening quote). Returns 0 if it is not terminated. */
+    static char const* _string_end(char const* p, char quote)
+    {
+        while (*p && (*p != quote)) {
+            if (('\\' == *p) && p[1]) {
+                ++p;
+            }
+            ++p;
+        }
+        return *p ? p : 0;
+    }
+
+    /** Skips the string at `p` (after the opening `quote`) */
+    static char const* _skip_string(char const* p, char quote)
+    {
+        char const* end = _string_end(p, quote);
+        return end ? end + 1 : p + strlen(p);
+    }
+
+    /** Skips the JSON value at `p` */
+    static char const* _skip_value(char const* p)
+    {
+        if ('"' == *p) {
+            return _skip_string(p + 1, '"');
+        }
+        if (('{' == *p) || ('[' == *p)) {
+            int depth = 0;
+            while (*p) {
+                switch (*p) {
+                case '"':
+                    p = _skip_string(p + 1, '"');
+                    continue;
+                case '{':
+                case '[':
+                    ++depth;
+                    break;
+                case '}':
+                case ']':
+                    if (--depth == 0) {
+                        return p + 1;
+                    }
+                    break;
+                default:
+                    break;
+                }
+                ++p;
+            }
+            return p;
+        }
+        while (*p && !strchr(",}] \t\r\n", *p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    /** Looks up the field `path` (of `path_len` octets) in `json` */
+    static operand _find(char const* json, char const* path, size_t path_len)
+    {
+        operand     v = { 0, 0, false, false };
+        char const* p = _skip_ws(json);
+        for (;;) {
+            size_t comp_len = 0;
+            while ((comp_len < path_len) && (path[comp_len] != '.')) {
+                ++comp_len;
+            }
+            if (*p != '{') {
+                return v;
+            }
+            p = _skip_ws(p + 1);
+            for (;;) {
+                if (*p != '"') {
+                    return v;
+                }
+                char const* key = p + 1;
+                char const* end = _string_end(key, '"');
+                if (!end) {
+                    return v;
+                }
+                size_t const len = end - key;
+                p                = _skip_ws(end + 1);
+                if (*p != ':') {
+                    return v;
+                }
+                p = _skip_ws(p + 1);
+                if ((len == comp_len) && (0 == strncmp(key, path, len))) {
+                    break;
+                }
+                p = _skip_ws(_skip_value(p));
+                if (',' == *p) {
+                    p = _skip_ws(p + 1);
+                }
+            }
+            if (comp_len == path_len) {
+                break;
+            }
+            path += comp_len + 1;
+            path_len -= comp_len + 1;
+        }
+        v.is_string = ('"' == *p);
+        if (v.is_string) {
+            char const* end = _string_end(p + 1, '"');
+            if (!end) {
+                return v;
+            }
+            v.s   = p + 1;
+            v.len = end - v.s;
+        }
+        else {
+            v.s   = p;
+            v.len = _skip_value(p) - p;
+        }
+        v.found = (v.len > 0) || v.is_string;
+        return v;
+    }
+
+    static bool _is_number(operand const& v)
+    {
+        return !v.is_string && (v.len > 0)
+               && (isdigit((unsigned char)v.s[0]) || ('-' == v.s[0]));
+    }
+
+    /** Compares the texts of `a` and `b`, as strcmp() does */
+    static int _compare_text(operand const& a, operand const& b)
+    {
+        size_t const n = (a.len < b.len) ? a.len : b.len;
+        int const    r = strncmp(a.s, b.s, n);
+        if (r != 0) {
+            return r;
+        }
+        return (a.len < b.len) ? -1 : (a.len > b.len);
+    }
+
+    /** Matches the `s`tring with the `pat`tern, where `*` matches any
+        number of characters, ignoring case. On a mismatch after a
+        `*`, it's retried with the `*` matching one character more,
+        so it takes (at most) O(length of s * length of pat). */
+    static bool _like(char const* s, size_t s_len, char const* pat, size_t pat_len)
+    {
+        size_t i = 0;
+        size_t j = 0;
+        /* Just past the last `*` and where, in `s`, it's matched up to */
+        size_t star_j = 0;
+        size_t star_i = 0;
+        bool   star   = false;
+        while (i < s_len) {
+            if ((j < pat_len) && ('*' == pat[j])) {
+                star   = true;
+                star_j = ++j;
+                star_i = i;
+            }
+            else if ((j < pat_len)
+                     && (tolower((unsigned char)s[i]) == tolower((unsigned char)pat[j]))) {
+                ++i, ++j;
+            }
+            else if (star) {
+                i = ++star_i;
+                j = star_j;
+            }
+            else {
+                return false;
+            }
+        }
+        while ((j < pat_len) && ('*' == pat[j])) {
+            ++j;
+        }
+        return j == pat_len;
+    }
+
+    static bool _contains(operand const& a, operand const& b)
+    {
+        for (size_t i = 0; i + b.len <= a.len; ++i) {
+            if (0 == strncmp(a.s + i, b.s, b.len)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool _compare(Op op, operand const& a, operand const& b)
+    {
+        if (!a.found || !b.found) {
+            return false;
+        }
+        switch (op) {
+        case op_like:
+            return _like(a.s, a.len, b.s, b.len);
+        case op_contains:
+            return _contains(a, b);
+        default:
+            break;
+        }
+        int cmp;
+        if (_is_number(a) && _is_number(b)) {
+            double const x = strtod(a.s, 0);
+            double const y = strtod(b.s, 0);
+            cmp            = (x < y) ? -1 : (x > y);
+        }
+        else {
+            cmp = _compare_text(a, b);
+        }
+        switch (op) {
+        case op_eq:
+            return 0 == cmp;
+        case op_ne:
+            return 0 != cmp;
+        case op_lt:
+            return cmp < 0;
+        case op_gt:
+            return cmp > 0;
+        case op_le:
+            return cmp <= 0;
+        case op_ge:
+            return cmp >= 0;
+        default:
+            return false;
+        }
+    }
+
+    /** Is the `word` (of `len` octets, in upper case) next in the
+        expression? */
+    static bool _keyword(cursor& c, char const* word, size_t len)
+    {
+        if ((0 == strncasecmp(c.e, word, len)) && !_is_word(c.e[len])) {
+            c.e += len;
+            return true;
+        }
+        return false;
+    }
+
+    static Op _op(cursor& c)
+    {
+        c.e = _skip_ws(c.e);
+        if (('=' == c.e[0]) && ('=' == c.e[1])) {
+            c.e += 2;
+            return op_eq;
+        }
+        if (('!' == c.e[0]) && ('=' == c.e[1])) {
+            c.e += 2;
+            return op_ne;
+        }
+        if (('<' == c.e[0]) || ('>' == c.e[0])) {
+            bool const less = ('<' == c.e[0]);
+            if ('=' == c.e[1]) {
+                c.e += 2;
+                return less ? op_le : op_ge;
+            }
+            c.e += 1;
+            return less ? op_lt : op_gt;
+        }
+        if (_keyword(c, "LIKE", 4)) {
+            return op_like;
+        }
+        if (_keyword(c, "CONTAINS", 8)) {
+            return op_contains;
+        }
+        return op_none;
+    }
+
+    static operand _operand(cursor& c)
+    {
+        operand v = { 0, 0, true, false };
+        c.e       = _skip_ws(c.e);
+        char const ch = *c.e;
+        if (('\'' == ch) || ('"' == ch)) {
+            char const* end = _string_end(c.e + 1, ch);
+            if (!end) {
+                c.error = true;
+                return v;
+            }
+            v.s         = c.e + 1;
+            v.len       = end - v.s;
+            v.is_string = true;
+            c.e         = end + 1;
+        }
+        else if (isdigit((unsigned char)ch) || ('-' == ch)) {
+            v.s = c.e;
+            while (*c.e && (isdigit((unsigned char)*c.e) || strchr("-+.eE", *c.e))) {
+                ++c.e;
+            }
+            v.len = c.e - v.s;
+        }
+        else if (isalpha((unsigned char)ch) || ('_' == ch)) {
+            char const* word = c.e;
+            while (_is_word(*c.e)) {
+                ++c.e;
+            }
+            size_t const len = c.e - word;
+            if (((4 == len) && (0 == strncmp(word, "true", 4)))
+                || ((5 == len) && (0 == strncmp(word, "false", 5)))
+                || ((4 == len) && (0 == strncmp(word, "null", 4)))) {
+                v.s   = word;
+                v.len = len;
+            }
+            else {
+                v = _find(c.json, word, len);
+            }
+        }
+        else {
+            c.error = true;
+        }
+        return v;
+    }
+
+    static bool _comparison(cursor& c)
+    {
+        operand const a  = _operand(c);
+        Op const      op = _op(c);
+        if (op_none == op) {
+            return a.found;
+        }
+        operand const b = _operand(c);
+        return _compare(op, a, b);
+    }
+
+    static bool _unary(cursor& c)
+    {
+        c.e = _skip_ws(c.e);
+        if (('!' == c.e[0]) && ('=' != c.e[1])) {
+            ++c.e;
+            return !_unary(c);
+        }
+        if ('(' == c.e[0]) {
+            ++c.e;
+            bool const v = _or(c);
+            c.e          = _skip_ws(c.e);
+            if (')' == *c.e) {
+                ++c.e;
+            }
+            else {
+                c.error = true;
+            }
+            return v;
+        }
+        return _comparison(c);
+    }
+
+    static bool _and(cursor& c)
+    {
+        bool v = _unary(c);
+        while (!c.error) {
+            c.e = _skip_ws(c.e);
+            if (('&' != c.e[0]) || ('&' != c.e[1])) {
+                break;
+            }
+            c.e += 2;
+            bool const w = _unary(c);
+            v            = v && w;
+        }
+        return v;
+    }
+
+    static bool _or(cursor& c)
+    {
+        bool v = _and(c);
+        while (!c.error) {
+            c.e = _skip_ws(c.e);
+            if (('|' != c.e[0]) || ('|' != c.e[1])) {
+                break;
+            }
+            c.e += 2;
+            bool const w = _and(c);
+            v            = v || w;
+        }
+        return v;
+    }
+
+    /** Evaluates the whole expression */
+    static bool _parse(cursor& c)
+    {
+        bool const v = _or(c);
+        if (*_skip_ws(c.e) != '\0') {
+            c.error = true;
+        }
+        return v;
+    }
+
+    char const* d_expr;
+    bool        d_valid;
+};
+
+
+/** This assumes that the received message is valid JSON.  If it is
+    not, nothing will crash or burn, but, it might parse in an
+    unexpected way.
+ */
+class SubscribeCracker {
+public:
+    enum State { cracking, bracket_close, malformed, done };
+
+    SubscribeCracker(PubSubClient* psc)
+        : d_psc(psc)
+        , d_state(cracking)
+        , d_filter(0)
+        , d_filtered(0)
+    {
+    }
+
+    /** Sets the `filter` (like a `PubNubFilter`), so that `get()`
+        skips the messages which don't match it (`visit()` doesn't
+        filter). Pass 0 to unset. The filter is not copied. */
+    void set_filter(MessageFilter const* filter) { d_filter = filter; }
+
+    /** The number of messages skipped, as they didn't match the
+        filter */
+    unsigned filtered() const { return d_filtered; }
+
+    /** Low-level interface, handles one incoming/response character
+        at a time. To see if a message has been "cracked out" of the
+        response, use `message_complete()`.
+    */
+    void handle(char c, String& msg)
+    {
+        if (cracking == d_state) {
+            d_crack.handle(c, msg);
+            _check_crack_done();
+        }
+        else {
+            _handle_close(c);
+        }
+    }
+
+    /** Same as the above, but for a message in a buffer, as in
+        `MessageCracker::handle()`
+    */
+    void handle(char c, char* msg, size_t cap, size_t& len, bool& truncated)
+    {
+        if (cracking == d_state) {
+            d_crack.handle(c, msg, cap, len, truncated);
+            _check_crack_done();
+        }
+        else {
+            _handle_close(c);
+        }
+    }
+
+    /** Returns whether the parsing of the whole response is
+     * complete/finished */
+    bool finished() const
+    {
+        switch (d_state) {
+        case malformed:
+        case done:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /** Returns whether the `msg` has been "cracked out" of the
+        response (you can use it, it is complete).
+    */
+    bool message_complete(String& msg) const
+    {
+        return d_crack.msg_complete(msg);
+    }
+
+    /** Get's the next message, reading from the client interface.
+     */
+    int get(String& msg)
+    {
+        for (;;) {
+            msg.remove(0);
+            char c;
+            while (!finished() && !message_complete(msg) && _next(c)) {
+                handle(c, msg);
+            }
+            if (!_filter_out(msg.length(), msg.c_str())) {
+                return _result();
+            }
+        }
+    }
+
+    /** Get's the next message into the `msg` buffer of `cap` octets,
+        without allocating any memory. The message is NUL terminated.
+        If it doesn't fit, it is truncated and, if `truncated` is not
+        null, `*truncated` is set to `true`.
+     */
+    int get(char* msg, size_t cap, bool* truncated = 0)
+    {
+        size_t len;
+        bool   trunc;
+        do {
+            len   = 0;
+            trunc = false;
+            if (cap > 0) {
+                msg[0] = '\0';
+            }
+            char c;
+            while (!finished() && !d_crack.msg_complete(len) && _next(c)) {
+                handle(c, msg, cap, len, trunc);
+            }
+        } while ((cap > 0) && _filter_out(len, msg));
+        if (truncated) {
+            *truncated = trunc;
+        }
+        return _result();
+    }
+
+    /** Reads the whole response, handing out the messages to the
+        `visitor` directly from the buffer it was read into, without
+        copying them anywhere.
+     */
+    int visit(MessageVisitor& visitor)
+    {
+        while (!finished()) {
+            if (d_buf.empty() && !_fill()) {
+                break;
+            }
+            if (cracking == d_state) {
+                d_buf.consume(d_crack.visit(d_buf.data(), d_buf.size(), visitor));
+                _check_crack_done();
+            }
+            else {
+                _handle_close(d_buf.next());
+            }
+        }
+        return _result();
+    }
+
+    /** Current parsing state. In general, you don't need it, but, it
+        could be useful for debugging. */
+    State state() const { return d_state; }
+
+private:
+    void _check_crack_done()
+    {
+        if (d_crack.state() == d_crack.done) {
+            d_state = bracket_close;
+        }
+    }
+
+    /** Is the (complete) message, of `len` octets at `msg`, to be
+        skipped, as it doesn't match the filter? */
+    bool _filter_out(size_t len, char const* msg)
+    {
+        bool const complete = (d_crack.ground_zero == d_crack.state())
+                              || (d_crack.done == d_crack.state());
+        if (!d_filter || (0 == len) || !complete || d_filter->matches(msg)) {
+            return false;
+        }
+        ++d_filtered;
+        return true;
+    }
+
+    void _handle_close(char c)
+    {
+        switch (d_state) {
+        case bracket_close:
+            d_state = (']' == c) ? done : malformed;
+            break;
+        case cracking:
+        case malformed:
+        case done:
+        default:
+            break;
+        }
+    }
+
+    /** Reads more data into the (empty) buffer, waiting for it */
+    bool _fill()
+    {
+        while (d_psc->wait_for_data()) {
+            /* PubSubClient filters the timetoken out of what
+             * is read, whether it's an array read or not */
+            if (d_buf.fill(*d_psc)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Gets the next character of the response */
+    bool _next(char& c)
+    {
+        if (d_buf.empty() && !_fill()) {
+            return false;
+        }
+        c = d_buf.next();
+        return true;
+    }
+
+    int _result() const
+    {
+        if ((done == state()) || (d_crack.state() == d_crack.ground_zero)) {
+            return 0;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    /** Client to read incoming response from */
+    PubSubClient* d_psc;
+    /** Current cracker/parser state */
+    State d_state;
+    /** The message array cracker */
+    MessageCracker d_crack;
+    /** Data read from the client, but not yet handled */
+    PubNubReadBuffer d_buf;
+    /** Filter of the messages, 0 if none */
+    MessageFilter const* d_filter;
+    /** Number of messages skipped by the filter */
+    unsigned d_filtered;
+};
+
+
+/** Size of the buffers in which `SubscribeV2Cracker` keeps the
+    channel, subscription and publisher of the message it cracked
+    (and `FetchMessagesCracker` and `MessageCountsCracker` keep the
+    channel, `HereNowCracker` the UUID). Longer ones are truncated.
+    Can be set (as a compiler option, or before including this file)
+    to, say, save RAM on boards that have little of it.
+ */
+#if !defined(PUBNUB_V2_FIELD_SIZE)
+#if defined(__AVR)
+#define PUBNUB_V2_FIELD_SIZE 32
+#else
+#define PUBNUB_V2_FIELD_SIZE 96
+#endif
+#endif
+
+
+/** The base of the crackers of the JSON responses whose fields are
+    told apart by their keys, like the envelope of the v2 subscribe.
+    It reads the response (through a staging buffer) and tokenizes it
+    as it arrives, keeping only the key (or, in an array, the index)
+    of the current value at each of the first `key_depth` levels. The
+    derived cracker is told of the keys and values by the hooks and
+    it picks the fields it needs by those keys and levels.
+
+    Keys are matched by their full name (as it is in the response,
+    escaped) to the table of keys of the derived cracker. A value
+    can be marked as the message, the characters of which `crack()`
+    then says to append to it, like `MessageCracker::crack()` does.
+ */
+class PubNubJsonCracker {
+public:
+    /** Returns whether the whole response has been cracked */
+    bool finished() const { return d_finished; }
+
+    /** Timeout of waiting for (more of) the response, in seconds
+        (310 by default) */
+    void set_timeout(int timeout) { d_timeout = timeout; }
+
+protected:
+    enum {
+        /** The ID of a key which is not in the table */
+        key_other = 0,
+        /** The number of (outermost) levels whose keys are kept */
+        key_depth = 4
+    };
+
+    /** Cracks the response read from the `pnsc`. The `keys` are
+        NUL separated, ending with an empty one (say, "t\0r\0"), the
+        first having the ID 1. It is in flash on AVR. */
+    PubNubJsonCracker(PubNonSubClient* pnsc, char const* keys)
+        : d_keys(keys)
+        , d_timeout(310)
+    {
+        _reset(pnsc);
+    }
+
+    /** Same as the above, for the subscribe client */
+    PubNubJsonCracker(PubSubClient* psc, char const* keys)
+        : d_keys(keys)
+        , d_timeout(310)
+    {
+        _reset(psc);
+    }
+
+    /** Starts cracking a new response, from the `pnsc` */
+    void _reset(PubNonSubClient* pnsc)
+    {
+        d_pnsc = pnsc;
+        d_psc  = 0;
+        _clear();
+    }
+
+    /** Starts cracking a new response, from the `psc` */
+    void _reset(PubSubClient* psc)
+    {
+        d_pnsc = 0;
+        d_psc  = psc;
+        _clear();
+    }
+
+    /** Clears the state of cracking (but not the client) */
+    void _clear()
+    {
+        d_buf           = PubNubReadBuffer();
+        d_depth         = 0;
+        d_objects       = 0;
+        d_key_entry     = d_key_id = d_key_len = 0;
+        d_payload_depth = 0;
+        d_in_string = d_backslash = d_in_scalar = d_is_key = false;
+        d_expect_key = d_payload = d_msg_start = false;
+        d_msg_complete = d_finished = false;
+        memset(d_key, key_other, sizeof d_key);
+    }
+
+    /** Low-level interface, cracks one character of the response,
+        returning what to do with it, like `MessageCracker::crack()`.
+     */
+    inline MessageCracker::Output crack(char c);
+
+    /** Handles one character of the response, putting the message
+        in `msg`. To see if the message is complete, use
+        `message_complete()`.
+     */
+    void handle(char c, String& msg)
+    {
+        MessageCracker::apply(crack(c), c, msg);
+    }
+
+    /** Same as the above, but for a message in a buffer, as in
+        `MessageCracker::handle()`
+    */
+    void handle(char c, char* msg, size_t cap, size_t& len, bool& truncated)
+    {
+        MessageCracker::apply(crack(c), c, msg, cap, len, truncated);
+    }
+
+    /** Returns whether the message that was being cracked (since
+        the last `get()`) is complete */
+    bool message_complete() const { return d_msg_complete; }
+
+    /** Gets the next message, reading from the client. When there
+        are no more messages, `msg` is empty and `finished()` is
+        true. Returns -1 if the response ended before the message.
+     */
+    int get(String& msg)
+    {
+        msg.remove(0);
+        d_msg_complete = false;
+        char c;
+        while (!d_finished && !d_msg_complete && _next(c)) {
+            handle(c, msg);
+        }
+        return _result();
+    }
+
+    /** Gets the next message into the `msg` buffer of `cap` octets,
+        without allocating any memory, as `SubscribeCracker::get()`
+        does.
+     */
+    int get(char* msg, size_t cap, bool* truncated = 0)
+    {
+        size_t len   = 0;
+        bool   trunc = false;
+        if (cap > 0) {
+            msg[0] = '\0';
+        }
+        d_msg_complete = false;
+        char c;
+        while (!d_finished && !d_msg_complete && _next(c)) {
+            handle(c, msg, cap, len, trunc);
+        }
+        if (truncated) {
+            *truncated = trunc;
+        }
+        return _result();
+    }
+
+    /** A key of an object at `_depth()` starts, and goes on with `c`.
+        The keys inside of the message are not reported. */
+    virtual void _key_start() {}
+    virtual void _key_char(char /* c */) {}
+
+    /** A value at `_depth()` starts with `c` (which is '{', '[', '"'
+        or the first character of a number or literal). Its key is
+        `_key(_depth())`. */
+    virtual void _value_start(char /* c */) {}
+
+    /** A character of a string (without the quotes, escaped) or of a
+        number or literal at `_depth()` */
+    virtual void _value_char(char /* c */) {}
+
+    /** The value at `_depth()` is complete. For an object or array,
+        that is after its end, so its key is still known. */
+    virtual void _value_end() {}
+
+    /** Nesting depth, 0 outside of any object or array */
+    uint8_t _depth() const { return d_depth; }
+
+    /** The ID of the key of the current value of the object at
+        `depth` (1 being the outermost), or the index of the current
+        element of the array at `depth`. It is `key_other` if not
+        known. */
+    uint8_t _key(uint8_t depth) const
+    {
+        return ((depth > 0) && (depth <= key_depth)) ? d_key[depth - 1] : (uint8_t)key_other;
+    }
+
+    /** The value starting (to be called from `_value_start()`) is the
+        message, which is appended to by `crack()`. The hooks are not
+        called for what is inside of it. */
+    void _payload_start()
+    {
+        d_payload       = true;
+        d_payload_depth = d_depth;
+    }
+
+    /** A new message starts with the value starting (to be called
+        from `_value_start()`), `crack()` says to start it (and not to
+        append the character starting the value) */
+    void _message_start() { d_msg_start = true; }
+
+    /** The message is complete, `get()` returns it */
+    void _message_done() { d_msg_complete = true; }
+
+    /** Gets the next character of the response */
+    bool _next(char& c)
+    {
+        if (d_buf.empty() && !_fill()) {
+            return false;
+        }
+        c = d_buf.next();
+        return true;
+    }
+
+private:
+    bool _in_object() const
+    {
+        return (d_depth > 0) && (d_depth <= 16)
+               && (d_objects & (1U << (d_depth - 1)));
+    }
+
+    /** Are we inside of (and not at) the message value? */
+    bool _inside_payload() const
+    {
+        return d_payload && (d_depth > d_payload_depth);
+    }
+
+    MessageCracker::Output _payload_output() const
+    {
+        return d_payload ? MessageCracker::output_append
+                         : MessageCracker::output_none;
+    }
+
+    char _table(uint8_t i) const { return (char)pubnub_read_table(d_keys + i); }
+
+    inline void _begin_key();
+    inline void _add_key_char(char c);
+    inline void _end_key();
+    inline MessageCracker::Output _begin_value(char c);
+    inline void _end_value();
+    inline void _push(char c);
+    inline void _pop();
+    inline void _next_child();
+
+    /** Reads more data into the (empty) buffer, waiting for it while
+        the response is not over */
+    bool _fill()
+    {
+        if (d_psc) {
+            /* PubSubClient filters the timetoken out of what
+             * is read, whether it's an array read or not */
+            while (d_psc->wait_for_data(d_timeout)) {
+                if (d_buf.fill(*d_psc)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        while (d_pnsc->wait_for_data(d_timeout)) {
+            if (d_buf.fill(*d_pnsc)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int _result() const { return (d_finished || d_msg_complete) ? 0 : -1; }
+
+    /** Client to read incoming response from, one or the other */
+    PubNonSubClient* d_pnsc;
+    PubSubClient*    d_psc;
+    /** Data read from the client, but not yet handled */
+    PubNubReadBuffer d_buf;
+    /** The table of the keys told apart */
+    char const* d_keys;
+    int         d_timeout;
+
+    /** Nesting depth and which of the (first 16) levels are objects
+        (the others being arrays) */
+    uint8_t  d_depth;
+    uint16_t d_objects;
+    /** Key IDs (or array indices) of the first levels */
+    uint8_t d_key[key_depth];
+    /** The key being read: the offset (in the table) and the ID of
+        the first key it is the beginning of (0 if none) and how much
+        of it was read */
+    uint8_t d_key_entry;
+    uint8_t d_key_id;
+    uint8_t d_key_len;
+    /** Depth of the message value */
+    uint8_t d_payload_depth;
+    bool    d_in_string : 1;
+    bool    d_backslash : 1;
+    bool    d_in_scalar : 1;
+    bool    d_is_key : 1;
+    bool    d_expect_key : 1;
+    /** Inside of the message value */
+    bool d_payload : 1;
+    bool d_msg_start : 1;
+    bool d_msg_complete : 1;
+    bool d_finished : 1;
+};
+
+
+inline MessageCracker::Output PubNubJsonCracker::crack(char c)
+{
+    MessageCracker::Output out = _payload_output();
+    if (d_in_string) {
+        if (d_backslash) {
+            d_backslash = false;
+        }
+        else if ('\\' == c) {
+            d_backslash = true;
+        }
+        else if ('"' == c) {
+            d_in_string = false;
+            if (d_is_key) {
+                d_is_key = false;
+                _end_key();
+            }
+            else {
+                _end_value();
+            }
+            return out;
+        }
+        if (d_is_key) {
+            _add_key_char(c);
+        }
+        else if (!_inside_payload()) {
+            _value_char(c);
+        }
+        return out;
+    }
+    if (d_in_scalar) {
+        if (isalnum(c) || ('.' == c) || ('-' == c) || ('+' == c)) {
+            if (!_inside_payload()) {
+                _value_char(c);
+            }
+            return out;
+        }
+        d_in_scalar = false;
+        _end_value();
+        out = _payload_output();
+    }
+
+    switch (c) {
+    case '{':
+    case '[':
+        out = _begin_value(c);
+        _push(c);
+        return out;
+    case '}':
+    case ']':
+        _pop();
+        return out;
+    case '"':
+        d_in_string = true;
+        d_backslash = false;
+        if (d_expect_key) {
+            d_is_key = true;
+            _begin_key();
+            return out;
+        }
+        return _begin_value(c);
+    case ':':
+        d_expect_key = false;
+        break;
+    case ',':
+        _next_child();
+        break;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        break;
+    default:
+        _begin_value(c);
+        d_in_scalar = true;
+        if (!_inside_payload()) {
+            _value_char(c);
+        }
+        break;
+    }
+    return _payload_output();
+}
+
+
+inline void PubNubJsonCracker::_begin_key()
+{
+    if (_inside_payload()) {
+        return;
+    }
+    if ((d_depth > 0) && (d_depth <= key_depth)) {
+        d_key[d_depth - 1] = key_other;
+    }
+    d_key_entry = d_key_len = 0;
+    d_key_id                = ('\0' == _table(0)) ? 0 : 1;
+    _key_start();
+}
+
+
+inline void PubNubJsonCracker::_add_key_char(char c)
+{
+    if (_inside_payload()) {
+        return;
+    }
+    _key_char(c);
+    if ((0 == d_key_id) || ('\0' == c)) {
+        d_key_id = 0;
+        return;
+    }
+    /* Find the first key of the table, from the one matched so far,
+       which begins with what was read (so, with the beginning of the
+       one matched so far) followed by `c` */
+    uint8_t e  = d_key_entry;
+    uint8_t id = d_key_id;
+    for (;;) {
+        uint8_t i = 0;
+        while ((i < d_key_len) && (_table(e + i) == _table(d_key_entry + i))) {
+            ++i;
+        }
+        if ((i == d_key_len) && (_table(e + i) == c)) {
+            d_key_entry = e;
+            d_key_id    = id;
+            ++d_key_len;
+            return;
+        }
+        while (_table(e) != '\0') {
+            ++e;
+        }
+        ++e;
+        ++id;
+        if ('\0' == _table(e)) {
+            d_key_id = 0;
+            return;
+        }
+    }
+}
+
+
+inline void PubNubJsonCracker::_end_key()
+{
+    if (_inside_payload() || (0 == d_depth) || (d_depth > key_depth)) {
+        return;
+    }
+    if ((d_key_id != 0) && ('\0' == _table(d_key_entry + d_key_len))) {
+        d_key[d_depth - 1] = d_key_id;
+    }
+}
+
+
+/* Returns what to do with `c`, which starts the value */
+inline MessageCracker::Output PubNubJsonCracker::_begin_value(char c)
+{
+    if (!_inside_payload()) {
+        _value_start(c);
+    }
+    if (d_msg_start) {
+        d_msg_start = false;
+        return MessageCracker::output_start;
+    }
+    return _payload_output();
+}
+
+
+inline void PubNubJsonCracker::_end_value()
+{
+    if (d_payload) {
+        if (d_depth > d_payload_depth) {
+            /* A value inside of the message */
+            return;
+        }
+        d_payload = false;
+    }
+    _value_end();
+}
+
+
+inline void PubNubJsonCracker::_push(char c)
+{
+    if (d_depth < 16) {
+        if ('{' == c) {
+            d_objects |= 1U << d_depth;
+        }
+        else {
+            d_objects &= ~(1U << d_depth);
+        }
+    }
+    if (d_depth < 255) {
+        ++d_depth;
+    }
+    if (d_depth <= key_depth) {
+        d_key[d_depth - 1] = key_other;
+    }
+    d_expect_key = ('{' == c);
+}
+
+
+inline void PubNubJsonCracker::_pop()
+{
+    if (d_depth > 0) {
+        --d_depth;
+    }
+    d_expect_key = false;
+    _end_value();
+    if (0 == d_depth) {
+        d_finished = true;
+    }
+}
+
+
+inline void PubNubJsonCracker::_next_child()
+{
+    d_expect_key = _in_object();
+    if (!d_expect_key && (d_depth > 0) && (d_depth <= key_depth)
+        && (d_key[d_depth - 1] < 255) && !_inside_payload()) {
+        /* The index of the next element of the array */
+        ++d_key[d_depth - 1];
+    }
+}
+
+
+/** Cracks the messages from the envelope of the v2 subscribe
+    response:
+
+        {"t":{"t":"15...","r":12},"m":[{"c":"ch","d":{...},"i":"pub",
+        "p":{"t":"15...","r":12},...},...]}
+
+    as it arrives, keeping only the fields of the current message.
+    The message itself (the "d" field) is put in the user's `String`
+    (or buffer), just like `SubscribeCracker` does, and the rest of
+    the message fields can be read from the getters once `get()`
+    returns it. The timetoken of the response (with its region) is
+    set in the `PubSubClient` as soon as it's cracked, for the next
+    subscribe.
+
+    Like the other crackers, it does not validate the JSON. The order
+    of the fields does not matter and unknown ones are skipped.
+ */
+class SubscribeV2Cracker : public PubNubJsonCracker {
+public:
+    SubscribeV2Cracker(PubSubClient* psc)
+        : PubNubJsonCracker(psc, _keys())
+        , d_psc(psc)
+        , d_field(f_none)
+        , d_field_len(0)
+        , d_region(-1)
+    {
+        d_tt[0] = '\0';
+        _clear_message();
+    }
+
+    using PubNubJsonCracker::crack;
+    using PubNubJsonCracker::handle;
+    using PubNubJsonCracker::message_complete;
+    using PubNubJsonCracker::get;
+
+    /** The channel of the message (last) cracked */
+    char const* channel() const { return d_channel; }
+
+    /** The subscription (channel group or wildcard) that matched the
+        message, empty if it was a plain channel subscription */
+    char const* subscription() const { return d_subscription; }
+
+    /** The UUID of the publisher of the message, empty if unknown */
+    char const* publisher() const { return d_publisher; }
+
+    /** The timetoken of the publish of the message and its region */
+    char const* timetoken() const { return d_msg_tt; }
+    int         region() const { return d_msg_region; }
+
+    /** The timetoken of the publish of the message, as an integer
+        (say, to tell if it was already seen), 0 if unknown */
+    uint64_t timetoken_value() const
+    {
+        uint64_t tt = 0;
+        PubNubTimetoken::parse(d_msg_tt, tt);
+        return tt;
+    }
+
+private:
+    /** The keys of the envelope, in the order of `_keys()` */
+    enum Key { k_t = 1, k_r, k_m, k_c, k_b, k_i, k_d, k_p };
+
+    static char const* _keys()
+    {
+        static const char keys[] PUBNUB_PROGMEM = "t\0r\0m\0c\0b\0i\0d\0p\0";
+        return keys;
+    }
+
+    /** The fields of the envelope that we keep */
+    enum Field {
+        f_none,
+        f_tt,
+        f_region,
+        f_channel,
+        f_subscription,
+        f_publisher,
+        f_msg_tt,
+        f_msg_region
+    };
+
+    void _clear_message()
+    {
+        d_channel[0] = d_subscription[0] = d_publisher[0] = '\0';
+        d_msg_tt[0]                                        = '\0';
+        d_msg_region                                       = -1;
+    }
+
+    inline void  _value_start(char c);
+    inline void  _value_char(char c);
+    inline void  _value_end();
+    inline char* _field_buf(size_t& cap);
+
+    /** Client to read incoming response from */
+    PubSubClient* d_psc;
+
+    /** The field whose value is being cracked */
+    Field  d_field;
+    size_t d_field_len;
+
+    /** The timetoken of the response */
+    char d_tt[PubNubTimetoken::str_size];
+    int  d_region;
+
+    /** Fields of the current message */
+    char d_channel[PUBNUB_V2_FIELD_SIZE];
+    char d_subscription[PUBNUB_V2_FIELD_SIZE];
+    char d_publisher[PUBNUB_V2_FIELD_SIZE];
+    char d_msg_tt[PubNubTimetoken::str_size];
+    int  d_msg_region;
+};
+
+
+inline void SubscribeV2Cracker::_value_start(char c)
+{
+    switch (_depth()) {
+    case 2:
+        if (k_t == _key(1)) {
+            if (k_t == _key(2)) {
+                d_field = f_tt;
+            }
+            else if (k_r == _key(2)) {
+                d_field  = f_region;
+                d_region = 0;
+            }
+        }
+        else if ((k_m == _key(1)) && ('{' == c)) {
+            /* A message (object) in the message array */
+            _clear_message();
+            _message_start();
+        }
+        break;
+    case 3:
+        if (k_m == _key(1)) {
+            switch (_key(3)) {
+            case k_c:
+                d_field = f_channel;
+                break;
+            case k_b:
+                d_field = f_subscription;
+                break;
+            case k_i:
+                d_field = f_publisher;
+                break;
+            case k_d:
+                _payload_start();
+                break;
+            default:
+                break;
+            }
+        }
+        break;
+    case 4:
+        if ((k_m == _key(1)) && (k_p == _key(3))) {
+            if (k_t == _key(4)) {
+                d_field = f_msg_tt;
+            }
+            else if (k_r == _key(4)) {
+                d_field      = f_msg_region;
+                d_msg_region = 0;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    d_field_len = 0;
+    size_t cap;
+    char*  buf = _field_buf(cap);
+    if (buf) {
+        buf[0] = '\0';
+    }
+}
+
+
+inline void SubscribeV2Cracker::_value_char(char c)
+{
+    switch (d_field) {
+    case f_region:
+        if (isdigit(c)) {
+            d_region = d_region * 10 + (c - '0');
+        }
+        break;
+    case f_msg_region:
+        if (isdigit(c)) {
+            d_msg_region = d_msg_region * 10 + (c - '0');
+        }
+        break;
+    default: {
+        size_t cap;
+        char*  buf = _field_buf(cap);
+        if (buf && (d_field_len + 1 < cap)) {
+            buf[d_field_len++] = c;
+            buf[d_field_len]   = '\0';
+        }
+        break;
+    }
+    }
+}
+
+
+inline void SubscribeV2Cracker::_value_end()
+{
+    d_field = f_none;
+    if ((1 == _depth()) && (k_t == _key(1)) && (d_tt[0] != '\0')) {
+        /* The timetoken object is complete */
+        d_psc->set_timetoken(d_tt, d_region);
+    }
+    else if ((2 == _depth()) && (k_m == _key(1))) {
+        _message_done();
+    }
+}
+
+
+inline char* SubscribeV2Cracker::_field_buf(size_t& cap)
+{
+    switch (d_field) {
+    case f_tt:
+        cap = sizeof d_tt;
+        return d_tt;
+    case f_channel:
+        cap = sizeof d_channel;
+        return d_channel;
+    case f_subscription:
+        cap = sizeof d_subscription;
+        return d_subscription;
+    case f_publisher:
+        cap = sizeof d_publisher;
+        return d_publisher;
+    case f_msg_tt:
+        cap = sizeof d_msg_tt;
+        return d_msg_tt;
+    default:
+        cap = 0;
+        return 0;
+    }
+}
+
+
+/** This is _very_ similar to SubcribeCracker and has the same
+    user-interface.
+*/
+class HistoryCracker {
+public:
+    HistoryCracker(PubNonSubClient* pnsc)
+        : d_pnsc(pnsc)
+    {
+    }
+
+    bool finished() const { return d_crack.state() == d_crack.done; }
+
+    int get(String& msg)
+    {
+        msg.remove(0);
+        char c;
+        while (!finished() && !d_crack.msg_complete(msg) && _next(c)) {
+            d_crack.handle(c, msg);
+        }
+        return _result();
+    }
+
+    int get(char* msg, size_t cap, bool* truncated = 0)
+    {
+        size_t len   = 0;
+        bool   trunc = false;
+        if (cap > 0) {
+            msg[0] = '\0';
+        }
+        char c;
+        while (!finished() && !d_crack.msg_complete(len) && _next(c)) {
+            d_crack.handle(c, msg, cap, len, trunc);
+        }
+        if (truncated) {
+            *truncated = trunc;
+        }
+        return _result();
+    }
+
+    int visit(MessageVisitor& visitor)
+    {
+        while (!finished()) {
+            if (d_buf.empty() && !_fill()) {
+                break;
+            }
+            d_buf.consume(d_crack.visit(d_buf.data(), d_buf.size(), visitor));
+        }
+        return _result();
+    }
+
+
+private:
+    /** Reads more data into the (empty) buffer, waiting for it
+        while the response body is not over */
+    bool _fill()
+    {
+        while (d_pnsc->wait_for_data()) {
+            if (d_buf.fill(*d_pnsc)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool _next(char& c)
+    {
+        if (d_buf.empty() && !_fill()) {
+            return false;
+        }
+        c = d_buf.next();
+        return true;
+    }
+
+    int _result() const
+    {
+        if ((d_crack.done == d_crack.state())
+            || (d_crack.state() == d_crack.ground_zero)) {
+            return 0;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    /** Client to read incoming response from */
+    PubNonSubClient* d_pnsc;
+    /** The message array cracker */
+    MessageCracker d_crack;
+    /** Data read from the client, but not yet handled */
+    PubNubReadBuffer d_buf;
+};
+
+/** Cracks the messages from the response of the v2 history
+    (`PubNub::history_v2()`):
+
+        [[msg1,msg2,...],15...,15...]
+
+    or, if the timetokens were included (`include_token`):
+
+        [[{"message":msg1,"timetoken":15...},...],15...,15...]
+
+    as it arrives, with the same user interface as `HistoryCracker`.
+    The timetoken of the message just cracked is kept (as an integer)
+    and so are the timetokens of the page (of the oldest and the
+    newest message in it), which follow the messages.
+
+    Like the other crackers, it does not validate the JSON. With the
+    timetokens included, the order of the fields of the message does
+    not matter and unknown ones are skipped.
+ */
+class HistoryV2Cracker : public PubNubJsonCracker {
+public:
+    HistoryV2Cracker(PubNonSubClient* pnsc, bool include_token = false)
+        : PubNubJsonCracker(pnsc, _keys())
+    {
+        reset(pnsc, include_token);
+    }
+
+    /** Starts cracking a new response, from the `pnsc` client, keeping
+        the staging buffer. */
+    void reset(PubNonSubClient* pnsc, bool include_token)
+    {
+        _reset(pnsc);
+        d_include_token = include_token;
+        d_field         = f_none;
+        d_count         = 0;
+        d_tt = d_start = d_end = 0;
+    }
+
+    using PubNubJsonCracker::crack;
+    using PubNubJsonCracker::handle;
+    using PubNubJsonCracker::message_complete;
+    using PubNubJsonCracker::get;
+
+    /** The timetoken of the message (last) cracked, 0 if the
+        timetokens were not included */
+    uint64_t timetoken() const { return d_tt; }
+
+    /** The timetokens of the oldest and the newest message of the
+        response, known once it is `finished()`, 0 if there were no
+        messages */
+    uint64_t start() const { return d_start; }
+    uint64_t end() const { return d_end; }
+
+    /** The number of messages cracked so far */
+    unsigned count() const { return d_count; }
+
+private:
+    /** The keys of a message with its timetoken */
+    enum Key { k_message = 1, k_timetoken };
+
+    static char const* _keys()
+    {
+        static const char keys[] PUBNUB_PROGMEM = "message\0timetoken\0";
+        return keys;
+    }
+
+    /** The fields of the response that we keep */
+    enum Field { f_none, f_tt, f_start, f_end };
+
+    /** The elements of the response array */
+    enum { i_messages, i_start, i_end };
+
+    inline void _value_start(char c);
+    inline void _value_char(char c);
+    inline void _value_end();
+
+    bool d_include_token;
+
+    /** The field whose value is being cracked */
+    Field d_field;
+
+    unsigned d_count;
+    uint64_t d_tt;
+    uint64_t d_start;
+    uint64_t d_end;
+};
+
+
+inline void HistoryV2Cracker::_value_start(char c)
+{
+    switch (_depth()) {
+    case 1:
+        switch (_key(1)) {
+        case i_messages:
+            /* Clear the message before the first one */
+            _message_start();
+            break;
+        case i_start:
+            d_field = f_start;
+            break;
+        case i_end:
+            d_field = f_end;
+            break;
+        default:
+            break;
+        }
+        break;
+    case 2:
+        if (i_messages == _key(1)) {
+            if (!d_include_token) {
+                _payload_start();
+            }
+            else if ('{' == c) {
+                /* A message with its timetoken */
+                d_tt = 0;
+                _message_start();
+            }
+        }
+        break;
+    case 3:
+        if (d_include_token && (i_messages == _key(1))) {
+            if (k_message == _key(3)) {
+                _payload_start();
+            }
+            else if (k_timetoken == _key(3)) {
+                d_field = f_tt;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+inline void HistoryV2Cracker::_value_char(char c)
+{
+    switch (d_field) {
+    case f_tt:
+        PubNubTimetoken::add_digit(d_tt, c);
+        break;
+    case f_start:
+        PubNubTimetoken::add_digit(d_start, c);
+        break;
+    case f_end:
+        PubNubTimetoken::add_digit(d_end, c);
+        break;
+    default:
+        break;
+    }
+}
+
+
+inline void HistoryV2Cracker::_value_end()
+{
+    d_field = f_none;
+    if ((2 == _depth()) && (i_messages == _key(1))) {
+        /* The message, or the object with it and its timetoken */
+        _message_done();
+        ++d_count;
+    }
+}
+
+
+/** Cracks the messages from the response of the v3 history
+    (`PubNub::fetch_messages()`), which has the messages of each
+    channel:
+
+        {"status":200,"error":false,"error_message":"","channels":
+        {"ch1":[{"message":msg1,"timetoken":"15..."},...],"ch2":[...]}}
+
+    as it arrives, with the same user interface as `HistoryCracker`.
+    The channel of the message just cracked (truncated to
+    `PUBNUB_V2_FIELD_SIZE` octets) and its timetoken (as an integer)
+    are kept.
+
+    Like the other crackers, it does not validate the JSON. The order
+    of the fields does not matter and unknown ones are skipped.
+ */
+class FetchMessagesCracker : public PubNubJsonCracker {
+public:
+    FetchMessagesCracker(PubNonSubClient* pnsc)
+        : PubNubJsonCracker(pnsc, _keys())
+        , d_field(f_none)
+        , d_channel_len(0)
+        , d_count(0)
+        , d_tt(0)
+    {
+        d_channel[0] = '\0';
+    }
+
+    using PubNubJsonCracker::crack;
+    using PubNubJsonCracker::handle;
+    using PubNubJsonCracker::message_complete;
+    using PubNubJsonCracker::get;
+
+    /** The channel of the message (last) cracked */
+    char const* channel() const { return d_channel; }
+
+    /** The timetoken of the message (last) cracked */
+    uint64_t timetoken() const { return d_tt; }
+
+    /** The number of messages cracked so far */
+    unsigned count() const { return d_count; }
+
+private:
+    /** The keys of the response, in the order of `_keys()` */
+    enum Key { k_channels = 1, k_message, k_timetoken };
+
+    static char const* _keys()
+    {
+        static const char keys[] PUBNUB_PROGMEM = "channels\0message\0timetoken\0";
+        return keys;
+    }
+
+    /** The fields of the response that we keep */
+    enum Field { f_none, f_tt };
+
+    /** Is the key (or value) at `depth` in the "channels" object? */
+    bool _in_channels(uint8_t depth) const
+    {
+        return (_depth() == depth) && (k_channels == _key(1));
+    }
+
+    inline void _key_start();
+    inline void _key_char(char c);
+    inline void _value_start(char c);
+    inline void _value_char(char c);
+    inline void _value_end();
+
+    /** The field whose value is being cracked */
+    Field d_field;
+
+    char     d_channel[PUBNUB_V2_FIELD_SIZE];
+    size_t   d_channel_len;
+    unsigned d_count;
+    uint64_t d_tt;
+};
+
+
+inline void FetchMessagesCracker::_key_start()
+{
+    if (_in_channels(2)) {
+        d_channel_len = 0;
+        d_channel[0]  = '\0';
+    }
+}
+
+
+inline void FetchMessagesCracker::_key_char(char c)
+{
+    if (_in_channels(2) && (d_channel_len + 1 < sizeof d_channel)) {
+        d_channel[d_channel_len++] = c;
+        d_channel[d_channel_len]   = '\0';
+    }
+}
+
+
+inline void FetchMessagesCracker::_value_start(char c)
+{
+    if (_in_channels(3) && ('{' == c)) {
+        /* A message, with its fields */
+        d_tt = 0;
+        _message_start();
+    }
+    else if (_in_channels(4)) {
+        if (k_message == _key(4)) {
+            _payload_start();
+        }
+        else if (k_timetoken == _key(4)) {
+            d_field = f_tt;
+        }
+    }
+}
+
+
+inline void FetchMessagesCracker::_value_char(char c)
+{
+    if (f_tt == d_field) {
+        PubNubTimetoken::add_digit(d_tt, c);
+    }
+}
+
+
+inline void FetchMessagesCracker::_value_end()
+{
+    d_field = f_none;
+    if (_in_channels(3)) {
+        /* The message object is complete */
+        _message_done();
+        ++d_count;
+    }
+}
+
+
+/** Cracks the response of `PubNub::message_counts()`:
+
+        {"status":200,"error":false,"error_message":"","channels":
+        {"ch1":2,"ch2":0}}
+
+    a channel at a time, as it arrives. It keeps just the (current)
+    channel (truncated to `PUBNUB_V2_FIELD_SIZE` octets) and its
+    count.
+ */
+class MessageCountsCracker : public PubNubJsonCracker {
+public:
+    MessageCountsCracker(PubNonSubClient* pnsc)
+        : PubNubJsonCracker(pnsc, _keys())
+        , d_in_count(false)
+        , d_got(false)
+        , d_channel_len(0)
+        , d_count(0)
+    {
+        d_channel[0] = '\0';
+    }
+
+    /** Low level interface - handles one character at a time. Check
+        `channel_complete()` to know when a channel (and its count)
+        is cracked.
+     */
+    void handle(char c) { crack(c); }
+
+    /** Returns whether the channel that was being cracked (since
+        the last `get()`) is complete */
+    bool channel_complete() const { return d_got; }
+
+    /** Gets the next channel and its count, reading from the client.
+        When there are no more channels, `channel()` is empty and
+        `finished()` is true. Returns -1 if the response ended before
+        the channel.
+     */
+    int get()
+    {
+        d_got = false;
+        char c;
+        while (!finished() && !d_got) {
+            if (!_next(c)) {
+                return -1;
+            }
+            handle(c);
+        }
+        if (!d_got) {
+            d_channel[0] = '\0';
+            d_count      = 0;
+        }
+        return 0;
+    }
+
+    /** The channel (last) cracked */
+    char const* channel() const { return d_channel; }
+
+    /** The number of messages of the channel (last) cracked */
+    unsigned long count() const { return d_count; }
+
+private:
+    enum Key { k_channels = 1 };
+
+    static char const* _keys()
+    {
+        static const char keys[] PUBNUB_PROGMEM = "channels\0";
+        return keys;
+    }
+
+    /** Is the key (or value) that of a channel? */
+    bool _in_channels() const
+    {
+        return (2 == _depth()) && (k_channels == _key(1));
+    }
+
+    inline void _key_start();
+    inline void _key_char(char c);
+    inline void _value_start(char c);
+    inline void _value_char(char c);
+    inline void _value_end();
+
+    /** Cracking the count of a channel */
+    bool d_in_count;
+    bool d_got;
+
+    char          d_channel[PUBNUB_V2_FIELD_SIZE];
+    size_t        d_channel_len;
+    unsigned long d_count;
+};
+
+
+inline void MessageCountsCracker::_key_start()
+{
+    if (_in_channels()) {
+        d_channel_len = 0;
+        d_channel[0]  = '\0';
+    }
+}
+
+
+inline void MessageCountsCracker::_key_char(char c)
+{
+    if (_in_channels() && (d_channel_len + 1 < sizeof d_channel)) {
+        d_channel[d_channel_len++] = c;
+        d_channel[d_channel_len]   = '\0';
+    }
+}
+
+
+inline void MessageCountsCracker::_value_start(char c)
+{
+    if (_in_channels() && isdigit(c)) {
+        d_count    = 0;
+        d_in_count = true;
+    }
+}
+
+
+inline void MessageCountsCracker::_value_char(char c)
+{
+    if (d_in_count && isdigit(c)) {
+        d_count = d_count * 10 + (c - '0');
+    }
+}
+
+
+inline void MessageCountsCracker::_value_end()
+{
+    if (d_in_count) {
+        d_in_count = false;
+        d_got      = true;
+    }
+}
+
+
+/** Cracks the response of `PubNub::here_now()`:
+
+        {"status":200,"message":"OK","occupancy":2,"uuids":["a","b"],
+        "service":"Presence"}
+
+    a UUID at a time, as it arrives. It keeps just the (current) UUID
+    (truncated to `PUBNUB_V2_FIELD_SIZE` octets) and the occupancy.
+ */
+class HereNowCracker : public PubNubJsonCracker {
+public:
+    HereNowCracker(PubNonSubClient* pnsc)
+        : PubNubJsonCracker(pnsc, _keys())
+        , d_in_uuid(false)
+        , d_in_occupancy(false)
+        , d_got(false)
+        , d_uuid_len(0)
+        , d_occupancy(0)
+    {
+        d_uuid[0] = '\0';
+    }
+
+    /** Low level interface - handles one character at a time. Check
+        `uuid_complete()` to know when a UUID is cracked.
+     */
+    void handle(char c) { crack(c); }
+
+    /** Returns whether the UUID that was being cracked (since the
+        last `get()`) is complete */
+    bool uuid_complete() const { return d_got; }
+
+    /** Gets the next UUID, reading from the client. When there are
+        no more UUIDs, `uuid()` is empty and `finished()` is true.
+        Returns -1 if the response ended before the UUID.
+     */
+    int get()
+    {
+        d_got = false;
+        char c;
+        while (!finished() && !d_got) {
+            if (!_next(c)) {
+                return -1;
+            }
+            handle(c);
+        }
+        if (!d_got) {
+            d_uuid[0] = '\0';
+        }
+        return 0;
+    }
+
+    /** The UUID (last) cracked */
+    char const* uuid() const { return d_uuid; }
+
+    /** The occupancy of the channel. Valid once it is cracked, which
+        is sure only when `finished()`.
+     */
+    unsigned long occupancy() const { return d_occupancy; }
+
+private:
+    enum Key { k_uuids = 1, k_occupancy };
+
+    static char const* _keys()
+    {
+        static const char keys[] PUBNUB_PROGMEM = "uuids\0occupancy\0";
+        return keys;
+    }
+
+    inline void _value_start(char c);
+    inline void _value_char(char c);
+    inline void _value_end();
+
+    /** Cracking a UUID (string) in the "uuids" array */
+    bool d_in_uuid;
+    /** Cracking the "occupancy" */
+    bool d_in_occupancy;
+    bool d_got;
+
+    char          d_uuid[PUBNUB_V2_FIELD_SIZE];
+    size_t        d_uuid_len;
+    unsigned long d_occupancy;
+};
+
+
+inline void HereNowCracker::_value_start(char c)
+{
+    if ((1 == _depth()) && (k_occupancy == _key(1)) && isdigit(c)) {
+        d_occupancy    = 0;
+        d_in_occupancy = true;
+    }
+    else if ((2 == _depth()) && (k_uuids == _key(1)) && ('"' == c)) {
+        d_in_uuid  = true;
+        d_uuid_len = 0;
+        d_uuid[0]  = '\0';
+    }
+}
+
+
+inline void HereNowCracker::_value_char(char c)
+{
+    if (d_in_occupancy && isdigit(c)) {
+        d_occupancy = d_occupancy * 10 + (c - '0');
+    }
+    else if (d_in_uuid && (d_uuid_len + 1 < sizeof d_uuid)) {
+        d_uuid[d_uuid_len++] = c;
+        d_uuid[d_uuid_len]   = '\0';
+    }
+}
+
+
+inline void HereNowCracker::_value_end()
+{
+    if (d_in_uuid) {
+        d_in_uuid = false;
+        d_got     = true;
+    }
+    d_in_occupancy = false;
+}
+
+
+/** Size of the buffer in which `PubNubJsonExtractor` collects the
+    value of a field (a string, number or literal). A longer string is
+    truncated. Can be set (as a compiler option, or before including
+    this file) as needed.
+ */
+#if !defined(PUBNUB_JSON_VALUE_SIZE)
+#if defined(__AVR)
+#define PUBNUB_JSON_VALUE_SIZE 32
+#else
+#define PUBNUB_JSON_VALUE_SIZE 128
+#endif
+#endif
+
+/** The most paths a `PubNubJsonExtractor` can extract */
+#if !defined(PUBNUB_JSON_MAX_PATHS)
+#if defined(__AVR)
+#define PUBNUB_JSON_MAX_PATHS 4
+#else
+#define PUBNUB_JSON_MAX_PATHS 8
+#endif
+#endif
+
+/** The most components (keys and indices) a path can have, 32 at
+    most */
+#if !defined(PUBNUB_JSON_PATH_DEPTH)
+#define PUBNUB_JSON_PATH_DEPTH 8
+#endif
+
+
+/** Receives the values of the fields extracted by a
+    `PubNubJsonExtractor`, each with the index of its path (in the
+    order they were added). The values are valid only during the
+    call. Override only those you need.
+ */
+class JsonFieldVisitor {
+public:
+    /** A string, unescaped (except for `\uXXXX`, which is kept
+        as is), NUL terminated. If it didn't fit, it was truncated
+        and `truncated` is set. */
+    virtual void field_string(int /* path */,
+                              char const* /* s */,
+                              size_t /* len */,
+                              bool /* truncated */)
+    {
+    }
+
+    /** A number, with its text (as it was in the message) */
+    virtual void field_number(int /* path */, double /* value */, char const* /* text */)
+    {
+    }
+
+    virtual void field_bool(int /* path */, bool /* value */) {}
+
+    virtual void field_null(int /* path */) {}
+
+    /** The message is done, the next field is of a new one */
+    virtual void fields_done() {}
+};
+
+
+/** Extracts the values of some fields of JSON messages, as they
+    stream in, without building a document (DOM), or even the whole
+    message string. It's a `MessageVisitor`, so use it with the
+    `visit()` of a cracker:
+
+        PubNubJsonExtractor jx(my_visitor);
+        jx.add_path("sensor.temp");
+        jx.add_path("cmd[0]");
+        SubscribeCracker ritz(subclient);
+        ritz.visit(jx);
+
+    A path is a list of object keys, separated by '.', and array
+    indices, in brackets. Only the paths to strings, numbers, `true`,
+    `false` and `null` are reported, paths to objects and arrays are
+    not. Keys with '.' or '[' can't be addressed, and keys are compared
+    as they are in the message (escaped).
+
+    The memory used doesn't depend on the size of the message, parts
+    of it which can't match any path are just skipped over. It
+    assumes valid JSON, but it doesn't crash on invalid one.
+ */
+class PubNubJsonExtractor : public MessageVisitor {
+public:
+    PubNubJsonExtractor(JsonFieldVisitor& visitor)
+        : d_visitor(visitor)
+        , d_npaths(0)
+    {
+        _reset();
+    }
+
+    /** Adds a path to extract, which is kept by the pointer, so it
+        has to outlive the extractor. Returns the index of the path,
+        or -1 if it's not valid or there are too many of them. */
+    int add_path(char const* spec)
+    {
+        int const n = _count_components(spec);
+        if ((n <= 0) || (n > PUBNUB_JSON_PATH_DEPTH) || (strlen(spec) > 127)
+            || (d_npaths >= PUBNUB_JSON_MAX_PATHS)) {
+            return -1;
+        }
+        d_path[d_npaths].path    = spec;
+        d_path[d_npaths].ncomp   = n;
+        d_path[d_npaths].matched = 0;
+        return d_npaths++;
+    }
+
+    /** Handles one character of a message */
+    void handle(char c)
+    {
+        switch (d_state) {
+        case st_value:
+            _value_start(c);
+            break;
+        case st_key_or_end:
+            if ('"' == c) {
+                _key_start();
+            }
+            else if ('}' == c) {
+                _close();
+            }
+            break;
+        case st_key:
+            if (d_backslash) {
+                d_backslash = false;
+            }
+            else if ('\\' == c) {
+                d_backslash = true;
+            }
+            else if ('"' == c) {
+                _key_end();
+                d_state = st_colon;
+                return;
+            }
+            _key_char(c);
+            break;
+        case st_colon:
+            if (':' == c) {
+                d_state = st_value;
+            }
+            break;
+        case st_string:
+            _string_char(c);
+            break;
+        case st_literal:
+            if ((',' == c) || ('}' == c) || (']' == c) || _is_space(c)) {
+                _literal_end();
+                d_state = st_after;
+                _after(c);
+            }
+            else {
+                _append(c);
+            }
+            break;
+        case st_after:
+            _after(c);
+            break;
+        case st_skip:
+            _skip(c);
+            break;
+        case st_done:
+        default:
+            break;
+        }
+    }
+
+    /** The message is complete */
+    void end()
+    {
+        if (st_literal == d_state) {
+            _literal_end();
+        }
+        d_visitor.fields_done();
+        _reset();
+    }
+
+    void message_data(char const* data, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i) {
+            handle(data[i]);
+        }
+    }
+
+    void message_end() { end(); }
+
+private:
+    enum State {
+        /** Expecting a value */
+        st_value,
+        /** In an object, expecting a key or its end */
+        st_key_or_end,
+        st_key,
+        st_colon,
+        /** In a string value */
+        st_string,
+        /** In a number or a literal */
+        st_literal,
+        /** After a value, expecting a ',' or the end of the container */
+        st_after,
+        /** Skipping a container no path goes into */
+        st_skip,
+        st_done
+    };
+
+    /** A path and how much of it matches the current position */
+    struct path {
+        char const* path;
+        uint8_t     ncomp;
+        /** Number of (leading) components that match */
+        uint8_t matched;
+        /** Where the key being read is compared, in the path, -1 if it
+            doesn't match */
+        int8_t cmp;
+    };
+
+    static bool _is_space(char c)
+    {
+        return (' ' == c) || ('\t' == c) || ('\r' == c) || ('\n' == c);
+    }
+
+    /** Does a key component end at `c`? */
+    static bool _key_ends(char c) { return ('\0' == c) || ('.' == c) || ('[' == c); }
+
+    static int _count_components(char const* path)
+    {
+        int n = 0;
+        for (int i = 0; path[i];) {
+            if ('[' == path[i]) {
+                if ((path[i + 1] < '0') || (path[i + 1] > '9')) {
+                    return -1;
+                }
+                for (++i; (path[i] >= '0') && (path[i] <= '9'); ++i) {
+                    continue;
+                }
+                if (path[i++] != ']') {
+                    return -1;
+                }
+            }
+            else {
+                int const start = i;
+                while (!_key_ends(path[i])) {
+                    ++i;
+                }
+                if (i == start) {
+                    return -1;
+                }
+            }
+            ++n;
+            if ('.' == path[i]) {
+                ++i;
+                if ('\0' == path[i]) {
+                    return -1;
+                }
+            }
+        }
+        return n;
+    }
+
+    /** The offset of the component `n` of the `path` */
+    static int _component(char const* path, int n)
+    {
+        int i = 0;
+        while (n-- > 0) {
+            if ('[' == path[i]) {
+                while (path[i++] != ']') {
+                    continue;
+                }
+            }
+            else {
+                while (!_key_ends(path[i])) {
+                    ++i;
+                }
+            }
+            if ('.' == path[i]) {
+                ++i;
+            }
+        }
+        return i;
+    }
+
+    void _reset()
+    {
+        d_state     = st_value;
+        d_depth     = 0;
+        d_objects   = 0;
+        d_backslash = false;
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            d_path[p].matched = 0;
+        }
+    }
+
+    bool _in_object() const
+    {
+        return (d_depth > 0) && (d_objects & ((uint32_t)1 << (d_depth - 1)));
+    }
+
+    /** A child (of the container at `d_depth`) begins, so the paths
+        which matched the previous child don't anymore */
+    void _child_start()
+    {
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            if (d_path[p].matched >= d_depth) {
+                d_path[p].matched = d_depth - 1;
+            }
+        }
+    }
+
+    void _key_start()
+    {
+        d_state     = st_key;
+        d_backslash = false;
+        _child_start();
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            path& pa = d_path[p];
+            pa.cmp   = -1;
+            if (pa.matched == d_depth - 1) {
+                int const i = _component(pa.path, d_depth - 1);
+                if (pa.path[i] != '[') {
+                    pa.cmp = i;
+                }
+            }
+        }
+    }
+
+    void _key_char(char c)
+    {
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            path& pa = d_path[p];
+            if (pa.cmp >= 0) {
+                char const k = pa.path[pa.cmp];
+                pa.cmp       = (!_key_ends(k) && (k == c)) ? pa.cmp + 1 : -1;
+            }
+        }
+    }
+
+    void _key_end()
+    {
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            path& pa = d_path[p];
+            if ((pa.cmp >= 0) && _key_ends(pa.path[pa.cmp])) {
+                pa.matched = d_depth;
+            }
+        }
+    }
+
+    /** The next element of the array at `d_depth` begins */
+    void _element_start()
+    {
+        uint16_t const index = d_index[d_depth - 1];
+        _child_start();
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            path& pa = d_path[p];
+            if (pa.matched == d_depth - 1) {
+                int i = _component(pa.path, d_depth - 1);
+                if (pa.path[i] == '[') {
+                    unsigned long n = 0;
+                    while (pa.path[++i] != ']') {
+                        n = n * 10 + (pa.path[i] - '0');
+                    }
+                    if (n == index) {
+                        pa.matched = d_depth;
+                    }
+                }
+            }
+        }
+    }
+
+    /** Is the value (beginning) at `d_depth` selected by some path,
+        either as a whole (`whole`), or by some path into it */
+    bool _selected(bool whole) const
+    {
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            path const& pa = d_path[p];
+            if ((pa.matched == d_depth)
+                && (whole ? (pa.ncomp == d_depth) : (pa.ncomp > d_depth))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _value_start(char c)
+    {
+        switch (c) {
+        case '{':
+        case '[':
+            if (!_selected(false) || (d_depth >= PUBNUB_JSON_PATH_DEPTH)) {
+                d_state      = st_skip;
+                d_skip_depth = 1;
+                d_in_quotes  = false;
+                break;
+            }
+            ++d_depth;
+            if ('{' == c) {
+                d_objects |= (uint32_t)1 << (d_depth - 1);
+                d_state = st_key_or_end;
+            }
+            else {
+                d_objects &= ~((uint32_t)1 << (d_depth - 1));
+                d_index[d_depth - 1] = 0;
+                d_state              = st_value;
+                _element_start();
+            }
+            break;
+        case ']':
+            /* An empty array */
+            if (!_in_object()) {
+                _close();
+            }
+            break;
+        case '"':
+            d_state     = st_string;
+            d_backslash = false;
+            d_len       = 0;
+            d_truncated = false;
+            break;
+        default:
+            if (!_is_space(c) && (c != ',') && (c != '}')) {
+                d_state     = st_literal;
+                d_len       = 0;
+                d_truncated = false;
+                _append(c);
+            }
+            break;
+        }
+    }
+
+    void _append(char c)
+    {
+        if (d_len + 1 < sizeof d_value) {
+            d_value[d_len++] = c;
+        }
+        else {
+            d_truncated = true;
+        }
+    }
+
+    void _string_char(char c)
+    {
+        if (d_backslash) {
+            d_backslash = false;
+            switch (c) {
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+                _append('\\');
+                break;
+            default:
+                break;
+            }
+            _append(c);
+        }
+        else if ('\\' == c) {
+            d_backslash = true;
+        }
+        else if ('"' == c) {
+            d_value[d_len] = '\0';
+            for (uint8_t p = 0; p < d_npaths; ++p) {
+                if ((d_path[p].matched == d_depth) && (d_path[p].ncomp == d_depth)) {
+                    d_visitor.field_string(p, d_value, d_len, d_truncated);
+                }
+            }
+            d_state = st_after;
+        }
+        else {
+            _append(c);
+        }
+    }
+
+    void _literal_end()
+    {
+        d_value[d_len] = '\0';
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            if ((d_path[p].matched != d_depth) || (d_path[p].ncomp != d_depth)) {
+                continue;
+            }
+            if (0 == strcmp(d_value, "true")) {
+                d_visitor.field_bool(p, true);
+            }
+            else if (0 == strcmp(d_value, "false")) {
+                d_visitor.field_bool(p, false);
+            }
+            else if (0 == strcmp(d_value, "null")) {
+                d_visitor.field_null(p);
+            }
+            else {
+                d_visitor.field_number(p, strtod(d_value, 0), d_value);
+            }
+        }
+    }
+
+    /** After a value, in the container at `d_depth` */
+    void _after(char c)
+    {
+        switch (c) {
+        case ',':
+            if (_in_object()) {
+                d_state = st_key_or_end;
+            }
+            else if (d_depth > 0) {
+                ++d_index[d_depth - 1];
+                d_state = st_value;
+                _element_start();
+            }
+            break;
+        case '}':
+        case ']':
+            _close();
+            break;
+        default:
+            break;
+        }
+    }
+
+    /** The container at `d_depth` ends */
+    void _close()
+    {
+        if (0 == d_depth) {
+            d_state = st_done;
+            return;
+        }
+        for (uint8_t p = 0; p < d_npaths; ++p) {
+            if (d_path[p].matched >= d_depth) {
+                d_path[p].matched = d_depth - 1;
+            }
+        }
+        --d_depth;
+        d_state = (0 == d_depth) ? st_done : st_after;
+    }
+
+    void _skip(char c)
+    {
+        if (d_in_quotes) {
+            if (d_backslash) {
+                d_backslash = false;
+            }
+            else if ('\\' == c) {
+                d_backslash = true;
+            }
+            else if ('"' == c) {
+                d_in_quotes = false;
+            }
+            return;
+        }
+        switch (c) {
+        case '"':
+            d_in_quotes = true;
+            d_backslash = false;
+            break;
+        case '{':
+        case '[':
+            ++d_skip_depth;
+            break;
+        case '}':
+        case ']':
+            if (--d_skip_depth == 0) {
+                d_state = (0 == d_depth) ? st_done : st_after;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    JsonFieldVisitor& d_visitor;
+
+    path    d_path[PUBNUB_JSON_MAX_PATHS];
+    uint8_t d_npaths;
+
+    State d_state;
+    /** Depth of the containers we're in (that some path goes into) */
+    uint8_t d_depth;
+    /** Bit N is set if the container at depth N+1 is an object */
+    uint32_t d_objects;
+    /** Index of the current element of the arrays we're in */
+    uint16_t d_index[PUBNUB_JSON_PATH_DEPTH];
+    /** Depth of the container being skipped */
+    unsigned d_skip_depth;
+    bool     d_in_quotes : 1;
+    bool     d_backslash : 1;
+    bool     d_truncated : 1;
+
+    /** The value being collected */
+    char   d_value[PUBNUB_JSON_VALUE_SIZE];
+    size_t d_len;
+};
+
+
+/** Used for (minimal) parsing of the response to publish.
+    It assumes a valid response.
+ */
+class PublishCracker {
+public:
+    /** State of the parser. In general, user is concerned
+        whether its `done` or not.
+    */
+    enum State {
+        bracket_open,
+        result,
+        comma_description,
+        quote_description,
+        description_chars,
+        comma_timestamp,
+        quote_timestamp,
+        timestamp_chars,
+        bracket_close,
+        done
+    };
+    /** The outcome of the publish - success, fail
+        or "unknown" (IOW: did not finish parsing)
+    */
+    enum Outcome { sent, failed, unknown };
+
+    /** You _don't_ provide the client here, the interface doesn't
+        require it, so it would just take up space in our object.
+    */
+    PublishCracker()
+        : d_state(bracket_open)
+        , d_outcome(unknown)
+        , d_tt(0)
+    {
+        d_description[0] = '\0';
+        d_timestamp[0]   = '\0';
+    }
+
+    /** Low level interface - handles one character at a time.  Check
+        `state() == done` to know when parsing is complete.
+     */
+    void handle(char c)
+    {
+        switch (d_state) {
+        case bracket_open:
+            if ('[' == c) {
+                d_state = result;
+            }
+            break;
+        case result:
+            if ('1' == c) {
+                d_outcome = sent;
+                d_state   = comma_description;
+            }
+            else if ('0' == c) {
+                d_outcome = failed;
+                d_state   = comma_description;
+            }
+            else if (isdigit(c)) {
+                DBGprint(F("Unexpected publish result: "));
+                DBGprintln(c);
+                d_outcome = failed;
+                d_state   = comma_description;
+            }
+            break;
+        case comma_description:
+            if (',' == c) {
+                d_state = quote_description;
+            }
+            break;
+        case quote_description:
+            if ('"' == c) {
+                d_state  = description_chars;
+                d_desc_i = 0;
+            }
+            break;
+        case description_chars:
+            /* Currently, no description uses backslash */
+            if ('"' == c) {
+                d_state                 = comma_timestamp;
+                d_description[d_desc_i] = '\0';
+            }
+            else {
+                if (d_desc_i < MAX_DESCRIPTION) {
+                    d_description[d_desc_i++] = c;
+                    d_description[d_desc_i]   = '\0';
+                }
+            }
+            break;
+        case comma_timestamp:
+            if (',' == c) {
+                d_state = quote_timestamp;
+            }
+            break;
+        case quote_timestamp:
+            if ('"' == c) {
+                d_state = timestamp_chars;
+                d_ts_i  = 0;
+                d_tt    = 0;
+            }
+            break;
+        case timestamp_chars:
+            if ('"' == c) {
+                d_state             = bracket_close;
+                d_timestamp[d_ts_i] = '\0';
+            }
+            else {
+                if (d_ts_i < MAX_TIMESTAMP) {
+                    d_timestamp[d_ts_i++] = c;
+                    d_timestamp[d_ts_i]   = '\0';
+                    PubNubTimetoken::add_digit(d_tt, c);
+                }
+            }
             break;
-        case tls_port:
-            d_port = 443;
+        case bracket_close:
+            if (']' == c) {
+                d_state = done;
+            }
+            break;
+        case done:
+        default:
             break;
         }
     }
 
-    /**
-     * Publish/Send a message (assumed to be well-formed JSON) to a
-     * given channel.
-     *
-     * Note that the reply can be obtained using code like:
-
-         client = PubNub.publish("demo", "\"lala\"");
-         if (!client) {
-             Serial.println("Failed to publish, got no response from PubNub");
-             return;
-         }
-         if (PubNub.get_last_http_status_code_class() !=
-     PubNub::http_scc_success) { Serial.print("Got HTTP status code error from
-     PubNub, class: ");
-             Serial.print((int)PubNub.get_last_http_status_code_class(), DEC);
-         }
-         while (client->connected()) {
-         // More sophisticated code will want to add timeout handling here
-         while (client->connected() && !client->available()) ; // wait
-             char c = client->read();
-             Serial.print(c);
-         }
-         client->stop();
-
-     * You will get content right away, the header has been already
-     * skipped inside the function. If you do not care about
-     * the reply, just call client->stop(); immediately.
-     *
-     * It returns an object that is typically EthernetClient (but it
-     * can be a WiFiClient if you enabled the WiFi shield).
-     *
-     * @param string channel required channel name.
-     * @param string message required message string in JSON format.
-     * @param string timeout optional timeout in seconds.
-     * @return string Stream-ish object with reply message or 0 on error.
-     */
-    inline PubNonSubClient* publish(const char* channel,
-                                    const char* message,
-                                    int         timeout = 30);
-
-    /**
-     * Subscribe/Listen for a message on a given channel. The function
-     * will block and return when a message arrives. Typically, you
-     * will run this function from loop() function to keep listening
-     * for messages indefinitely.
-     *
-     * As a reply, you will get a JSON array with messages, e.g.:
-     * 	["msg1",{msg2:"x"}]
-     * and so on. Empty reply [] is also normal and your code must be
-     * able to handle that. Note that the reply specifically does not
-     * include the time token present in the raw reply.
-     *
-     * @param string channel required channel name.
-     * @param string timeout optional timeout in seconds.
-     * @return string Stream-ish object with reply message or 0 on error.
-     */
-    inline PubSubClient* subscribe(const char* channel, int timeout = 310);
-
-    /**
-     * History
-     *
-     * Receive list of the last N messages on the given channel.
-     *
-     * @param string channel required channel name.
-     * @param int limit optional number of messages to retrieve.
-     * @param string timeout optional timeout in seconds.
-     * @return string Stream-ish object with reply message or 0 on error. */
-    inline PubNonSubClient* history(const char* channel,
-                                    int         limit   = 10,
-                                    int         timeout = 310);
-
-    /** Returns the HTTP status code class of the last PubNub
-        transaction. If the transaction failed without getting a
-        (HTTP) response, it will be "unknown".
+    /** Simple wrapper for `handle(c)` if you read
+        an array of characters.
     */
-    inline http_status_code_class get_last_http_status_code_class() const
+    void handle(uint8_t const* s, size_t n)
     {
-        return d_last_http_status_code_class;
+        for (size_t i = 0; i < n; ++i) {
+            handle(s[i]);
+        }
     }
 
-#if defined(PUBNUB_UNIT_TEST)
-    inline PubNonSubClient& publishClient() { return publish_client; }
-    inline PubNonSubClient& historyClient() { return history_client; };
-    inline PubSubClient& subscribeClient() { return subscribe_client; }
-#endif /* PUBNUB_UNIT_TEST */    
-
-private:
-    enum PubNub_BH {
-        PubNub_BH_OK,
-        PubNub_BH_ERROR,
-        PubNub_BH_TIMEOUT,
-    };
-
-    inline enum PubNub_BH _request_bh(PubNub_BASE_CLIENT& client,
-                                      unsigned long       t_start,
-                                      int                 timeout,
-                                      char                qparsep);
-
-    const char* d_publish_key;
-    const char* d_subscribe_key;
-    const char* d_origin;
-    const char* d_uuid;
-    const char* d_auth;
-
-    /// TCP/IP port to use.
-    unsigned d_port;
-
-    /// The HTTP status code class of the last PubNub transaction
-    http_status_code_class d_last_http_status_code_class;
-
-    PubNonSubClient publish_client, history_client;
-    PubSubClient    subscribe_client;
-};
-
+    /** The "high level" interface, just call this and it will
+        read and parse the response.
+    */
+    Outcome read_and_parse(PubNonSubClient* pnsc)
+    {
+        uint8_t minibuf[MAX_DESCRIPTION];
+        int     retry = 5;
+        while (state() != done) {
+            int len = pnsc->read(minibuf, MAX_DESCRIPTION);
+            if (len > 0) {
+                handle(minibuf, len);
+            }
+            else {
+                if (--retry <= 0) {
+                    break;
+                }
+                delay(10);
+            }
+        }
+        return outcome();
+    }
 
-#if defined(__AVR)
-#include <avr/pgmspace.h>
-#elif !defined(strncasecmp_P) || defined(PUBNUB_DEFINE_STRSPN_AND_STRNCASECMP)
-#define strncasecmp_P(a, b, c) strncasecmp(a, b, c)
-#endif
+    State   state() const { return d_state; }
+    Outcome outcome() const { return d_outcome; }
 
+    char const* description() const { return d_description; }
 
-/* There are some special considerations when using the WiFi libary,
- * compared to the Ethernet library:
- *
- * (i) The client object may return stale data from previous connection,
- * so we should call .flush() after initiating a connection.
- *
- * (ii) It appears .stop() does not block on really terminating
- * the connection, do that manually.
- *
- * (iii) Data may still be available while connected() returns false
- * already; use available() test on a lot of places where we used
- * connected() before.
- */
+    char const* timestamp() const { return d_timestamp; }
 
-inline void PubSubClient::_state_input(uint8_t ch, uint8_t* nextbuf, size_t nextsize)
-{
-    /* Process a single character on input, updating the JSON
-     * state machine. If we reached the last character of input
-     * (just before expected ","), we will eat the rest of the body,
-     * update timetoken and close the connection. */
-    if (in_string) {
-        if (after_backslash) {
-            /* Whatever this is... */
-            after_backslash = false;
-            return;
-        }
-        switch (ch) {
-        case '"':
-            in_string = false;
-            if (braces_depth == 0)
-                this->_grab_timetoken(nextbuf, nextsize);
-            return;
-        case '\\':
-            after_backslash = true;
-            return;
+    /** The timestamp/token, as an integer, 0 if not (yet) known */
+    uint64_t timetoken() const { return d_tt; }
+#if !defined(PUBNUB_NO_TO_STR)
+    __FlashStringHelper const* to_str(Outcome e)
+    {
+        switch (e) {
+        case sent:
+            return F("Sent");
+        case failed:
+            return F("Failed");
+        case unknown:
+            return F("Unknown");
         default:
-            return;
+            return F("!?!");
         }
     }
-    else {
-        switch (ch) {
-        case '"':
-            in_string = true;
-            return;
-        case '{':
-        case '[':
-            braces_depth++;
-            return;
-        case '}':
-        case ']':
-            braces_depth--;
-            if (braces_depth == 0)
-                this->_grab_timetoken(nextbuf, nextsize);
-            return;
-        default:
-            return;
+    __FlashStringHelper const* to_str(State e)
+    {
+        switch (e) {
+        case bracket_open:
+            return F("Bracket open");
+        case result:
+            return F("Result");
+        case comma_description:
+            return F("Comma before description");
+        case quote_description:
+            return F("Quote before description");
+        case description_chars:
+            return F("Characters of description");
+        case comma_timestamp:
+            return F("Comma before timestamp");
+        case quote_timestamp:
+            return F("Quote before timestamp");
+        case timestamp_chars:
+            return F("Characters/digits of timestamp");
+        case bracket_close:
+            return F("Bracket close");
+        case done:
+            return F("Done.");
         }
+        return F("!?!");
     }
+#endif /* !defined(PUBNUB_NO_TO_STR) */
+    enum { MAX_DESCRIPTION = 50, MAX_TIMESTAMP = 20 };
 
-    return;
-}
-
+private:
+    /** Current parser/cracker state */
+    State d_state;
+    /** Outcome of the publish as reported by PubNub */
+    Outcome d_outcome;
+    /** Statically allocated string of the description of
+        the publish outcome as reported by PubNub */
+    char d_description[MAX_DESCRIPTION + 1];
+    /** Current position inside `d_description`, will
+        write next char there */
+    size_t d_desc_i;
+    /** Statically allocated string of the timestamp/token of
+        the publish  as reported by PubNub */
+    char d_timestamp[MAX_TIMESTAMP + 1];
+    /** Current position inside `d_timestamp`, will
+        write next char there */
+    size_t d_ts_i;
+    /** The timestamp/token, as an integer */
+    uint64_t d_tt;
+};
 
-inline void PubSubClient::_grab_timetoken(uint8_t* nextbuf, size_t nextsize)
-{
-    char                new_timetoken[22] = { '\0' };
-    size_t              new_timetoken_len = 0;
-    unsigned long       t_start           = millis();
-    const unsigned long timeout           = /*3*/ 10000UL;
 
-    enum NTTState {
-        await_comma,
-        await_quote,
-        read_timetoken,
+/** A lean parser of the response to publish, fire or signal (like
+    `[1,"Sent","15541191365593405"]`). Unlike `PublishCracker`, it
+    doesn't keep the description or the timetoken string, just the
+    outcome and the timetoken (as an integer), so it is much smaller.
+    The description is skipped, with any escapes in it.
+ */
+class SentCracker {
+public:
+    /** State of the parser, the element of the response array
+        being parsed */
+    enum State {
+        bracket_open,
+        result,
+        description_chars,
+        timestamp_chars,
+        rest,
         done
-    } state = await_comma;
+    };
 
-    /* Expected followup now is:
-     * 	,"13511688131075270"]
-     */
-    while (state != done) {
-        uint8_t ch;
+    SentCracker()
+        : d_state(bracket_open)
+        , d_outcome(PublishCracker::unknown)
+        , d_in_string(false)
+        , d_backslash(false)
+        , d_tt(0)
+    {
+    }
 
-        if (millis() - t_start > timeout) {
-            DBGprintln("Timeout while reading timetoken");
-            return;
-        }
-        if (nextsize > 0) {
-            ch = *nextbuf++;
-            --nextsize;
-        }
-        else {
-            if (0 == available()) {
-                if (!connected()) {
-                    DBGprintln("Lost connection while reading timetoken");
-                    return;
-                }
-                delay(10);
+    /** Low level interface - handles one character at a time.  Check
+        `state() == done` to know when parsing is complete.
+     */
+    void handle(char c)
+    {
+        if (d_in_string) {
+            if (d_backslash) {
+                d_backslash = false;
             }
-            // Some clients (actually, quite a few) implement
-            // character read via array read, like:
-            //
-            //     int read() { uint8_t c; read(&c, 1); return c;}
-            ///
-            // and have both reads virtual. So, if we call such a
-            // `read()`, it will call the virtual "array read", which
-            // is actually _our_ array read, which will then call
-            // _state_input(), in a sort of unwanted recursion.
-            //
-            // @todo: Of course, this does _not_ solve such problems
-            // in general, as some other client might do the opposite,
-            // implement array read via character read! Thus, this
-            // whole idea of inheriting Client classes is wrong (as
-            // inheritance often is) and needs to be refactored.
-            int len = PubNub_BASE_CLIENT::read(&ch, 1);
-            if (len != 1) {
-                continue;
+            else if ('\\' == c) {
+                d_backslash = true;
             }
-            if (d_avail > 0) {
-                --d_avail;
+            else if ('"' == c) {
+                d_in_string = false;
             }
+            else if (timestamp_chars == d_state) {
+                PubNubTimetoken::add_digit(d_tt, c);
+            }
+            return;
         }
-
-        switch (state) {
-        case await_comma:
-            if (',' == ch) {
-                state = await_quote;
+        switch (c) {
+        case '[':
+            if (bracket_open == d_state) {
+                d_state = result;
             }
             break;
-        case await_quote:
-            if ('"' == ch) {
-                state = read_timetoken;
-            }
+        case '"':
+            d_in_string = (d_state != bracket_open) && (d_state != done);
             break;
-        case read_timetoken:
-            if (ch == '"') {
-                state = done;
-                break;
+        case ',':
+            if ((d_state != bracket_open) && (d_state < rest)) {
+                d_state = (State)(d_state + 1);
             }
-            new_timetoken[new_timetoken_len++] = ch;
-            if (new_timetoken_len >= sizeof(new_timetoken) - 1) {
-                /* TODO: handle this as a kind of error */
-                state = done;
-                break;
+            break;
+        case ']':
+            if (d_state != bracket_open) {
+                d_state = done;
             }
             break;
         default:
+            if ((result == d_state) && (PublishCracker::unknown == d_outcome)
+                && isdigit(c)) {
+                d_outcome = ('1' == c) ? PublishCracker::sent
+                                       : PublishCracker::failed;
+            }
             break;
         }
     }
 
-    if (new_timetoken_len > 0) {
-        memcpy(timetoken, new_timetoken, new_timetoken_len);
+    /** Simple wrapper for `handle(c)` if you read
+        an array of characters.
+    */
+    void handle(uint8_t const* s, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            handle(s[i]);
+        }
     }
-    timetoken[new_timetoken_len] = 0;
-}
 
-inline bool await_disconnect(PubNub_BASE_CLIENT& client, unsigned long timeout) {
-    unsigned long    t_start = millis();
-    while (client.connected()) {
-        if (millis() - t_start > timeout * 1000UL) {
-            return false;
+    /** The "high level" interface, just call this and it will
+        read and parse the response.
+    */
+    PublishCracker::Outcome read_and_parse(PubNonSubClient* pnsc)
+    {
+        uint8_t minibuf[16];
+        int     retry = 5;
+        while (state() != done) {
+            int len = pnsc->read(minibuf, sizeof minibuf);
+            if (len > 0) {
+                handle(minibuf, len);
+            }
+            else {
+                if (--retry <= 0) {
+                    break;
+                }
+                delay(10);
+            }
         }
-        delay(10);
+        return outcome();
     }
-    return true;
-}
 
+    State                   state() const { return d_state; }
+    PublishCracker::Outcome outcome() const { return d_outcome; }
 
-inline PubNonSubClient* PubNub::publish(const char* channel,
-                                        const char* message,
-                                        int         timeout)
-{
-    PubNonSubClient& client = publish_client;
-    int              have_param = 0;
-    unsigned long    t_start = millis();
+    /** The timestamp/token, as an integer, 0 if not (yet) known */
+    uint64_t timetoken() const { return d_tt; }
 
-    /* connect() timeout is about 30s, much lower than our usual
-     * timeout is. */
-    int rslt = client.connect(d_origin, d_port);
-    if (rslt != 1) {
-        DBGprint("Connection error ");
-        DBGprintln(rslt);
-        client.stop();
-        return 0;
-    }
+private:
+    State                   d_state : 4;
+    PublishCracker::Outcome d_outcome : 3;
+    bool                    d_in_string : 1;
+    bool                    d_backslash : 1;
+    uint64_t                d_tt;
+};
 
-    d_last_http_status_code_class = http_scc_unknown;
-    client.flush();
-    client.print("GET /publish/");
-    client.print(d_publish_key);
-    client.print("/");
-    client.print(d_subscribe_key);
-    client.print("/0/");
-    client.print(channel);
-    client.print("/0/");
-
-    /* Inject message, URI-escaping it in the process.
-     * We are careful to save RAM by not using any copies
-     * of the string or explicit buffers. */
-    const char* pmessage = message;
-    while (pmessage[0]) {
-        /* RFC 3986 Unreserved characters plus few
-         * safe reserved ones. */
-        size_t okspan = strspn(
-            pmessage,
-            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.~"
-            ",=:;@[]");
-        if (okspan > 0) {
-            client.write((const uint8_t*)pmessage, okspan);
-            pmessage += okspan;
-        }
-        if (pmessage[0]) {
-            /* %-encode a non-ok character. */
-            char enc[3] = { '%' };
-            enc[1]      = "0123456789ABCDEF"[pmessage[0] / 16];
-            enc[2]      = "0123456789ABCDEF"[pmessage[0] % 16];
-            client.write((const uint8_t*)enc, 3);
-            pmessage++;
-        }
-    }
 
-    if (d_auth) {
-        client.print(have_param ? '&' : '?');
-        client.print("auth=");
-        client.print(d_auth);
-        have_param = 1;
+/** Parses the response to a time request (like `[15541724007473323]`)
+    into the timetoken.
+ */
+class TimeCracker {
+public:
+    TimeCracker()
+        : d_state(bracket_open)
+        , d_tt(0)
+    {
     }
 
-    enum PubNub::PubNub_BH ret =
-        this->_request_bh(client, t_start, timeout, have_param ? '&' : '?');
-    switch (ret) {
-    case PubNub_BH_OK:
-        return &client;
-    case PubNub_BH_ERROR:
-        DBGprintln("publish() BH_ERROR");
-        client.stop();
-        if (!await_disconnect(client, 10)) {
-            DBGprintln("publish() BH_ERROR: disconnect timeout");
-        }
-        return 0;
-    case PubNub_BH_TIMEOUT:
-        DBGprintln("publish() BH_TIMEOUT");
-        client.stop();
-        if (!await_disconnect(client, 10)) {
-            DBGprintln("publish() BH_TIMEOUT: disconnect timeout");
+    /** Low level interface - handles one character at a time. Check
+        `finished()` to know when parsing is complete.
+     */
+    void handle(char c)
+    {
+        switch (d_state) {
+        case bracket_open:
+            if ('[' == c) {
+                d_state = digits;
+            }
+            break;
+        case digits:
+            if (!PubNubTimetoken::add_digit(d_tt, c)) {
+                d_state = (']' == c) ? done : error;
+            }
+            break;
+        default:
+            break;
         }
-        return 0;
     }
-    return 0;
-}
-
-
-inline PubSubClient* PubNub::subscribe(const char* channel, int timeout)
-{
-    PubSubClient& client = subscribe_client;
-    int           have_param = 0;
-    unsigned long t_start = millis();
 
-    /* connect() timeout is about 30s, much lower than our usual
-     * timeout is. */
-    if (!client.connect(d_origin, d_port)) {
-        DBGprintln("Connection error");
-        client.stop();
-        return 0;
+    /** The "high level" interface, reads and parses the response.
+        Returns the timetoken, 0 if it couldn't be parsed.
+     */
+    uint64_t read_and_parse(PubNonSubClient* pnsc)
+    {
+        uint8_t minibuf[24];
+        while (!finished() && pnsc->wait_for_data()) {
+            int len = pnsc->read(minibuf, sizeof minibuf);
+            for (int i = 0; i < len; ++i) {
+                handle(minibuf[i]);
+            }
+        }
+        return timetoken();
     }
 
-    d_last_http_status_code_class = http_scc_unknown;
-    client.flush();
-    client.print("GET /subscribe/");
-    client.print(d_subscribe_key);
-    client.print("/");
-    client.print(channel);
-    client.print("/0/");
-    client.print(client.server_timetoken());
-    if (d_uuid) {
-        client.print("?uuid=");
-        client.print(d_uuid);
-        have_param = 1;
-    }
-    if (d_auth) {
-        client.print(have_param ? '&' : '?');
-        client.print("auth=");
-        client.print(d_auth);
-        have_param = 1;
-    }
+    /** Returns whether the whole response has been parsed */
+    bool finished() const { return d_state >= done; }
 
-    enum PubNub::PubNub_BH ret =
-        this->_request_bh(client, t_start, timeout, have_param ? '&' : '?');
-    switch (ret) {
-    case PubNub_BH_OK:
-        /* Success and reached body. We need to eat '[' first,
-         * as our API contract is to return only the "message body"
-         * part of reply from subscribe. */
-        if (!client.wait_for_data()) {
-            DBGprintln("No data received!");
-            client.stop();
-            if (!await_disconnect(client, 10)) {
-                DBGprintln("subscribe() no data received: disconnect timeout");
-            }
-            return 0;
-        }
-        if (client.read() != '[') {
-            DBGprintln("Unexpected body in subscribe response");
-            client.stop();
-            if (!await_disconnect(client, 10)) {
-                DBGprintln("subscribe() unexpected body: disconnect timeout");
-            }
-            return 0;
-        }
-        /* Now return handle to the client for further perusal.
-         * PubSubClient class will make sure that the client does
-         * not see the time token but we stop right after the
-         * message body. */
-        client.start_body();
-        return &client;
+    /** The timetoken, 0 if not (yet, or at all) known */
+    uint64_t timetoken() const { return (done == d_state) ? d_tt : 0; }
 
-    case PubNub_BH_ERROR:
-        DBGprintln("subscribe() BH_ERROR");
-        client.stop();
-        if (!await_disconnect(client, 10)) {
-            DBGprintln("subscribe() BH_ERROR: disconnect timeout");
-        }
-        return 0;
+private:
+    enum { bracket_open, digits, done, error } d_state;
+    uint64_t d_tt;
+};
 
-    case PubNub_BH_TIMEOUT:
-        DBGprintln("subscribe() BH_TIMEOUT");
-        client.stop();
-        DBGprintln("subscribe() BH_TIMEOUT stopped");
-        if (await_disconnect(client, 10)) {
-            DBGprintln("subscribe() BH_TIMEOUT: disconnected");
-        }
-        else {
-            DBGprintln("subscribe() BH_TIMEOUT: disconnect timeout");
-        }
-        return 0;
-    }
-    return 0;
-}
 
+/** Size of the buffer in which `PublishBatcher` collects the
+    messages to publish together. The (JSON array of) messages
+    published at once can't be bigger than this. Can be set (as a
+    compiler option, or before including this file) as needed.
+ */
+#if !defined(PUBNUB_BATCH_BUFFER_SIZE)
+#if defined(__AVR)
+#define PUBNUB_BATCH_BUFFER_SIZE 128
+#else
+#define PUBNUB_BATCH_BUFFER_SIZE 1024
+#endif
+#endif
 
-inline PubNonSubClient* PubNub::history(const char* channel, int limit, int timeout)
-{
-    PubNonSubClient& client = history_client;
-    unsigned long    t_start = millis();
 
-    if (!client.connect(d_origin, d_port)) {
-        DBGprintln("Connection error");
-        client.stop();
-        return 0;
-    }
+/** Collects (small) messages to publish on a channel and publishes
+    them together, as a JSON array, in a single request, instead of
+    one request for each. The messages are published (flushed) when
+    the configured size (in octets), count or age (of the oldest
+    message) is reached, or on an explicit `flush()`. For the age to
+    be checked, call `poll()` often (typically, in `loop()`).
 
-    d_last_http_status_code_class = http_scc_unknown;
-    client.flush();
-    client.print("GET /history/");
-    client.print(d_subscribe_key);
-    client.print("/");
-    client.print(channel);
-    client.print("/0/");
-    client.print(limit, DEC);
-
-    enum PubNub::PubNub_BH ret = this->_request_bh(client, t_start, timeout, '?');
-    switch (ret) {
-    case PubNub_BH_OK:
-        return &client;
-    case PubNub_BH_ERROR:
-        DBGprintln("history() BH_ERROR");
-        client.stop();
-        if (!await_disconnect(client, 10)) {
-            DBGprintln("history() BH_ERROR: disconnect timeout");
-        }
-        return 0;
-    case PubNub_BH_TIMEOUT:
-        DBGprintln("history() BH_TIMEOUT");
-        client.stop();
-        if (!await_disconnect(client, 10)) {
-            DBGprintln("history() BH_TIMEOUT: disconnect timeout");
-        }
-        return 0;
-    }
-    return 0;
-}
+    The messages are kept in a fixed-size buffer, so memory use is
+    bounded (see `PUBNUB_BATCH_BUFFER_SIZE`). Publishing is done with
+    a (blocking) `PubNub::publish_post()`. If it fails, the messages
+    are kept, for the next flush. A message that doesn't fit even
+    after a flush is dropped (and counted).
 
-/** A helper that "cracks" the messages from an array of them.
-    It is, essentially, a simple, non-validating parser of
-    a JSON array, yielding individual elements of said array.
-*/
-class MessageCracker {
+    Keep in mind that the subscribers get the JSON array of messages,
+    as a single message, even if there was just one message in the
+    batch.
+ */
+class PublishBatcher {
 public:
-    enum State {
-        bracket_open,
-        ground_zero,
-        in_message,
-        in_quotes,
-        malformed,
-        done
-    };
-
-    MessageCracker()
-        : d_state(bracket_open)
+    PublishBatcher(PubNub& pubnub, const char* channel)
+        : d_pubnub(pubnub)
+        , d_channel(channel)
+        , d_len(1)
+        , d_count(0)
+        , d_flush_size(sizeof d_buf)
+        , d_flush_count(0)
+        , d_flush_age(0)
+        , d_failed(false)
+        , d_t_failed(0)
+        , d_requests(0)
+        , d_messages(0)
+        , d_failures(0)
+        , d_dropped(0)
+        , d_last_batch(0)
+        , d_max_batch(0)
     {
+        d_buf[0] = '[';
     }
 
-    void handle(char c, String& msg)
+    /** Flush when the size of the array of messages reaches this
+        many octets. By default, that's when the buffer is full
+        (the next message doesn't fit). */
+    void set_flush_size(size_t octets) { d_flush_size = octets; }
+
+    /** Flush when this many messages are collected, 0 for no limit,
+        which is the default */
+    void set_flush_count(unsigned count) { d_flush_count = count; }
+
+    /** Flush when the oldest message is older than this many
+        milliseconds (checked in `poll()`), 0 for no limit, which is
+        the default */
+    void set_flush_age(unsigned long ms) { d_flush_age = ms; }
+
+    /** Adds a message (in JSON format) to the batch, flushing if a
+        threshold is reached. Returns false if the message was
+        dropped, as it didn't fit.
+     */
+    inline bool add(const char* message);
+
+    /** Publishes the collected messages, if any. Returns false if
+        the publish failed, in which case the messages are kept. */
+    inline bool flush();
+
+    /** Flushes, if the oldest message is too old. After a failed
+        flush, it is not retried for the flush age (but at least a
+        second), so that an outage doesn't block every call. */
+    void poll()
     {
-        switch (d_state) {
-        case bracket_open:
-            if ('[' == c) {
-                d_state = ground_zero;
-                msg.remove(0);
-            }
-            break;
-        case ground_zero:
-            switch (c) {
-            case '{':
-            case '[':
-                d_bracket_level = 1;
-                d_state         = in_message;
-                msg.concat(c);
-                break;
-            case '"':
-                d_bracket_level = 0;
-                d_state         = in_quotes;
-                d_backslash     = false;
-                msg.concat(c);
-                break;
-            case ',':
-                d_bracket_level = 0;
-                d_state         = in_message;
-                break;
-            case ']':
-                d_state = done;
-                break;
-            default:
-                d_bracket_level = 0;
-                d_state         = in_message;
-                msg.concat(c);
-                break;
-            }
-            break;
-        case in_quotes:
-            switch (c) {
-            case '"':
-                if (!d_backslash) {
-                    d_state = (0 == d_bracket_level) ? ground_zero : in_message;
-                }
-                else {
-                    d_backslash = false;
-                }
-                msg.concat(c);
-                break;
-            case '\\':
-                d_backslash = true;
-                msg.concat(c);
-                break;
-            default:
-                msg.concat(c);
-                break;
-            }
-            break;
-        case in_message:
-            switch (c) {
-            case '{':
-            case '[':
-                ++d_bracket_level;
-                msg.concat(c);
-                break;
-            case '"':
-                d_state     = in_quotes;
-                d_backslash = false;
-                msg.concat(c);
-                break;
-            case '}':
-            case ']':
-                if (0 == d_bracket_level) {
-                    d_state = done;
-                }
-                else {
-                    if (--d_bracket_level == 0) {
-                        d_state = ground_zero;
-                    }
-                    msg.concat(c);
-                }
-                break;
-            default:
-                msg.concat(c);
-                break;
-            }
-            break;
-        case malformed:
-        case done:
-        default:
-            break;
+        if ((d_count > 0) && (d_flush_age > 0)
+            && (millis() - d_t_oldest >= d_flush_age) && _may_flush()) {
+            flush();
         }
     }
 
-    State state() const { return d_state; }
+    /** Number of messages collected, but not yet published */
+    unsigned count() const { return d_count; }
 
-    bool msg_complete(String& msg) const
+    /** Size of the collected messages (the JSON array), in octets */
+    size_t size() const { return d_len + 1; }
+
+    /** Counters: successful publish requests, messages published by
+        them, failed publish requests and dropped messages */
+    unsigned long requests() const { return d_requests; }
+    unsigned long messages() const { return d_messages; }
+    unsigned long failures() const { return d_failures; }
+    unsigned long dropped() const { return d_dropped; }
+
+    /** Messages in the last request and the most messages in
+        any request */
+    unsigned last_batch() const { return d_last_batch; }
+    unsigned max_batch() const { return d_max_batch; }
+
+private:
+    /** Is there room for a message of `len` octets (and the comma
+        before it, as well as the closing bracket and NUL)? */
+    bool _fits(size_t len) const
     {
-        return (msg.length() > 0) && (ground_zero == state());
+        return d_len + ((d_count > 0) ? 1 : 0) + len + 2 <= sizeof d_buf;
     }
 
-private:
-    /** Parser/cracker state */
-    State d_state;
-    /** Current bracket level - starts at 0 */
-    size_t d_bracket_level;
-    /** Are we inside quotes (string) */
-    bool d_in_quotes;
-    /** Was the last character a backslash? Valid only inside quotes */
-    bool d_backslash;
+    /** May a threshold flush now, or did one fail too recently? */
+    bool _may_flush() const
+    {
+        if (!d_failed) {
+            return true;
+        }
+        unsigned long const wait = (d_flush_age > 1000) ? d_flush_age : 1000;
+        return millis() - d_t_failed >= wait;
+    }
+
+    PubNub&     d_pubnub;
+    const char* d_channel;
+
+    /** The messages, as a JSON array without the closing bracket,
+        for which (and the NUL) there is always room */
+    char          d_buf[PUBNUB_BATCH_BUFFER_SIZE];
+    size_t        d_len;
+    unsigned      d_count;
+    unsigned long d_t_oldest;
+
+    /** Flush thresholds */
+    size_t        d_flush_size;
+    unsigned      d_flush_count;
+    unsigned long d_flush_age;
+
+    /** The last flush failed, at that time */
+    bool          d_failed;
+    unsigned long d_t_failed;
+
+    /** Counters */
+    unsigned long d_requests;
+    unsigned long d_messages;
+    unsigned long d_failures;
+    unsigned long d_dropped;
+    unsigned      d_last_batch;
+    unsigned      d_max_batch;
 };
 
-/** This assumes that the received message is valid JSON.  If it is
-    not, nothing will crash or burn, but, it might parse in an
-    unexpected way.
+
+inline bool PublishBatcher::add(const char* message)
+{
+    size_t const len = strlen(message);
+
+    if (!_fits(len) && (d_count > 0)) {
+        flush();
+    }
+    if (!_fits(len)) {
+        DBGprintln(F("Message doesn't fit in the batch, dropped"));
+        ++d_dropped;
+        return false;
+    }
+    if (d_count > 0) {
+        d_buf[d_len++] = ',';
+    }
+    else {
+        d_t_oldest = millis();
+    }
+    memcpy(d_buf + d_len, message, len);
+    d_len += len;
+    ++d_count;
+
+    if (((size() >= d_flush_size)
+         || ((d_flush_count > 0) && (d_count >= d_flush_count)))
+        && _may_flush()) {
+        flush();
+    }
+    return true;
+}
+
+
+inline bool PublishBatcher::flush()
+{
+    if (0 == d_count) {
+        return true;
+    }
+    d_buf[d_len]     = ']';
+    d_buf[d_len + 1] = '\0';
+
+    bool             sent   = false;
+    PubNonSubClient* client = d_pubnub.publish_post(d_channel, d_buf);
+    if (client) {
+        PublishCracker cheez;
+        sent = (PublishCracker::sent == cheez.read_and_parse(client));
+        client->stop();
+    }
+    if (!sent) {
+        DBGprintln(F("Publishing the batch failed"));
+        ++d_failures;
+        d_failed   = true;
+        d_t_failed = millis();
+        return false;
+    }
+    d_failed = false;
+
+    ++d_requests;
+    d_messages += d_count;
+    d_last_batch = d_count;
+    if (d_count > d_max_batch) {
+        d_max_batch = d_count;
+    }
+    d_len   = 1;
+    d_count = 0;
+    return true;
+}
+
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+/** Keeps a subscribe going, for ever, resubscribing as soon as a
+    response is read and, when a subscribe fails, backing off before
+    trying again, so that a device (or a fleet of them) doesn't hammer
+    the network, and drain its battery, during an outage.
+
+    The wait after a failure doubles with each consecutive failure,
+    from the minimum up to the maximum (cap) backoff. When PubNub
+    refuses the request (HTTP 4xx, like 403 for a missing permission)
+    retrying soon won't help, so the wait is the cap right away. Only
+    half of each wait is fixed, the other half is random ("jitter"),
+    so devices that lost the connection at the same time don't all
+    come back at the same time.
+
+    The timetoken of the last response read is kept, so that a
+    resubscribe, even after a long outage, continues where the last
+    one left off. It's non-blocking (except for connecting, see
+    `PubNub::start_subscribe()`): call `poll()` often, typically in
+    `loop()`.
  */
-class SubscribeCracker {
+class SubscribeSupervisor {
 public:
-    enum State { cracking, bracket_close, malformed, done };
+    /** Kinds of subscribe failures */
+    enum failure {
+        /** None (yet) */
+        failure_none,
+        /** Could not connect */
+        failure_connect,
+        /** Connection lost, or an unexpected response */
+        failure_network,
+        /** The response did not arrive in time */
+        failure_timeout,
+        /** PubNub failed (HTTP 5xx, or some other unexpected status) */
+        failure_server,
+        /** PubNub refused the request (HTTP 4xx) */
+        failure_client
+    };
 
-    SubscribeCracker(PubSubClient* psc)
-        : d_psc(psc)
-        , d_state(cracking)
+    /** Supervises the subscribe of `pubnub` to (comma separated
+        lists of) channels and channel groups, either of which can
+        be 0, using the v1 or (if `v2`) the v2 protocol. The strings
+        are not copied. */
+    SubscribeSupervisor(PubNub&     pubnub,
+                        const char* channels,
+                        const char* channel_groups = 0,
+                        bool        v2             = false)
+        : d_pubnub(pubnub)
+        , d_channels(channels)
+        , d_channel_groups(channel_groups)
+        , d_v2(v2)
+        , d_timeout(310)
+        , d_min_backoff(1000)
+        , d_max_backoff(60000)
+        , d_rand(0)
+        , d_state(start)
+        , d_tt(0)
+        , d_region(-1)
+        , d_last_failure(failure_none)
+        , d_consecutive(0)
+        , d_backoff(0)
+        , d_failures(0)
+        , d_reconnects(0)
+        , d_recoveries(0)
+        , d_last_recovery(0)
+        , d_max_recovery(0)
     {
     }
 
-    /** Low-level interface, handles one incoming/response character
-        at a time. To see if a message has been "cracked out" of the
-        response, use `message_complete()`.
-    */
-    void handle(char c, String& msg)
+    /** The wait after the first failure and the most to wait, in
+        milliseconds. By default, 1 s and 60 s. */
+    void set_backoff(unsigned long min_ms, unsigned long max_ms)
     {
-        switch (d_state) {
-        case cracking:
-            d_crack.handle(c, msg);
-            if (d_crack.state() == d_crack.done) {
-                d_state = bracket_close;
-            }
-            break;
-        case bracket_close:
-            switch (c) {
-            case ']':
-                d_state = done;
-                break;
-            default:
-                d_state = malformed;
-                break;
-            }
-            break;
-        case malformed:
-        case done:
-        default:
-            break;
-        }
+        d_min_backoff = min_ms;
+        d_max_backoff = (max_ms > min_ms) ? max_ms : min_ms;
     }
 
-    /** Returns whether the parsing of the whole response is
-     * complete/finished */
-    bool finished() const
+    /** Timeout of each subscribe, in seconds (310 by default) */
+    void set_timeout(int timeout) { d_timeout = timeout; }
+
+    /** Seeds the jitter. By default, it's seeded from `micros()` at
+        the first failure, which may well be the same on all devices,
+        so, for a fleet, use something unique to the device, like
+        (a part of) its MAC address. */
+    void set_seed(uint32_t seed) { d_rand = seed ? seed : 1; }
+
+    /** Advances the subscribe. Returns the client to read the
+        response from, once it has arrived, otherwise 0. Read the
+        response (with a `SubscribeCracker` or `SubscribeV2Cracker`)
+        and `stop()` it before calling this again, as the next call
+        resubscribes.
+     */
+    inline PubSubClient* poll();
+
+    /** The timetoken (and its region) of the last response read */
+    uint64_t timetoken() const { return d_tt; }
+    int      region() const { return d_region; }
+
+    /** Sets the timetoken (and its region) to subscribe from on
+        the next subscribe, to resume from one you saved */
+    void set_timetoken(uint64_t tt, int region = -1)
     {
-        switch (d_state) {
-        case malformed:
-        case done:
-            return true;
-        default:
-            return false;
-        }
+        d_tt     = tt;
+        d_region = region;
     }
 
-    /** Returns whether the `msg` has been "cracked out" of the
-        response (you can use it, it is complete).
-    */
-    bool message_complete(String& msg) const
+    /** The last failure and the number of failures since the last
+        successful subscribe */
+    failure  last_failure() const { return d_last_failure; }
+    unsigned consecutive_failures() const { return d_consecutive; }
+
+    /** The wait before the next subscribe, in milliseconds, 0 if
+        not backing off */
+    unsigned long backoff_ms() const { return d_backoff; }
+
+    /** Counters: failed subscribes, subscribes started after a
+        failure and recoveries (successful subscribes after a
+        failure) */
+    unsigned long failures() const { return d_failures; }
+    unsigned long reconnects() const { return d_reconnects; }
+    unsigned long recoveries() const { return d_recoveries; }
+
+    /** Time to recover, from the first failure to the next
+        successful subscribe, in milliseconds: the last one and
+        the longest one */
+    unsigned long last_recovery_ms() const { return d_last_recovery; }
+    unsigned long max_recovery_ms() const { return d_max_recovery; }
+
+private:
+    /** Starts a subscribe, from the kept timetoken */
+    inline void _start();
+
+    /** Handles a failure of the kind `f`, starting the backoff */
+    inline void _failed(failure f);
+
+    /** The kind of failure a response of the `status` class is,
+        `otherwise` if it's not an HTTP error */
+    inline static failure _classify(PubNub::http_status_code_class status,
+                                    failure                        otherwise);
+
+    /** Pseudo-random numbers (xorshift32), for the jitter */
+    uint32_t _random()
     {
-        return d_crack.msg_complete(msg);
+        if (0 == d_rand) {
+            set_seed(micros());
+        }
+        d_rand ^= d_rand << 13;
+        d_rand ^= d_rand >> 17;
+        d_rand ^= d_rand << 5;
+        return d_rand;
     }
 
-    /** Get's the next message, reading from the client interface.
-     */
-    int get(String& msg)
-    {
-        msg.remove(0);
-        while (!finished() && !message_complete(msg)) {
-            if (!d_psc->wait_for_data()) {
-                break;
+    PubNub&     d_pubnub;
+    const char* d_channels;
+    const char* d_channel_groups;
+    bool        d_v2;
+    int         d_timeout;
+
+    unsigned long d_min_backoff;
+    unsigned long d_max_backoff;
+    uint32_t      d_rand;
+
+    enum {
+        /** Not started yet */
+        start,
+        /** Subscribe in progress */
+        subscribing,
+        /** The response was given to the user */
+        response,
+        /** Waiting before resubscribing */
+        backoff
+    } d_state;
+
+    /** The timetoken (and region) to subscribe from */
+    uint64_t d_tt;
+    int      d_region;
+
+    failure       d_last_failure;
+    unsigned      d_consecutive;
+    unsigned long d_backoff;
+    /** When the last failure was, and the first one since the
+        last successful subscribe */
+    unsigned long d_t_failed;
+    unsigned long d_t_down;
+
+    /** Counters */
+    unsigned long d_failures;
+    unsigned long d_reconnects;
+    unsigned long d_recoveries;
+    unsigned long d_last_recovery;
+    unsigned long d_max_recovery;
+};
+
+
+inline PubSubClient* SubscribeSupervisor::poll()
+{
+    switch (d_state) {
+    case start:
+        _start();
+        break;
+    case response:
+        if (PubSubClient* client = d_pubnub.subscribe_response()) {
+            if (client->server_timetoken_value() != 0) {
+                d_tt     = client->server_timetoken_value();
+                d_region = client->server_region();
             }
-            // @todo For yet unexplained reasons, things stop working if we
-            // (for performance reasons) try an "array read" here . We get a
-            // "connection lost while getting timetoken". Should
-            // investigate.
-            handle(d_psc->read(), msg);
         }
-        if ((done == state()) || (d_crack.state() == d_crack.ground_zero)) {
+        _start();
+        break;
+    case backoff:
+        if (millis() - d_t_failed < d_backoff) {
             return 0;
         }
-        else {
-            return -1;
+        ++d_reconnects;
+        _start();
+        break;
+    case subscribing:
+        break;
+    }
+    if (d_state != subscribing) {
+        return 0;
+    }
+
+    d_pubnub.poll();
+    switch (d_pubnub.subscribe_state()) {
+    case PubNub::async_in_progress:
+        return 0;
+    case PubNub::async_done:
+        break;
+    case PubNub::async_timeout:
+        _failed(failure_timeout);
+        return 0;
+    default:
+        _failed(_classify(d_pubnub.subscribe_status_class(), failure_network));
+        return 0;
+    }
+
+    PubNub::http_status_code_class status = d_pubnub.subscribe_status_class();
+    if (status != PubNub::http_scc_success) {
+        DBGprint(F("Subscribe failed, HTTP status code class: "));
+        DBGprintln((int)status, DEC);
+        d_pubnub.subscribe_response()->stop();
+        _failed(_classify(status, failure_server));
+        return 0;
+    }
+
+    if (d_consecutive > 0) {
+        d_last_recovery = millis() - d_t_down;
+        if (d_last_recovery > d_max_recovery) {
+            d_max_recovery = d_last_recovery;
         }
+        ++d_recoveries;
     }
+    d_consecutive = 0;
+    d_backoff     = 0;
+    d_state       = response;
+    return d_pubnub.subscribe_response();
+}
 
-    /** Current parsing state. In general, you don't need it, but, it
-        could be useful for debugging. */
-    State state() const { return d_state; }
 
-private:
-    /** Client to read incoming response from */
-    PubSubClient* d_psc;
-    /** Current cracker/parser state */
-    State d_state;
-    /** The message array cracker */
-    MessageCracker d_crack;
-};
+inline void SubscribeSupervisor::_start()
+{
+    if (d_tt != 0) {
+        d_pubnub.set_subscribe_timetoken(d_tt, d_region);
+    }
+    bool started = d_v2 ? d_pubnub.start_subscribe_v2(d_channels, d_channel_groups, d_timeout)
+                        : d_pubnub.start_subscribe(d_channels, d_channel_groups, d_timeout);
+    if (started) {
+        d_state = subscribing;
+    }
+    else {
+        _failed(failure_connect);
+    }
+}
 
 
-/** This is _very_ similar to SubcribeCracker and has the same
-    user-interface.
-*/
-class HistoryCracker {
+inline void SubscribeSupervisor::_failed(failure f)
+{
+    d_t_failed     = millis();
+    d_last_failure = f;
+    ++d_failures;
+    if (0 == d_consecutive++) {
+        d_t_down = d_t_failed;
+    }
+
+    unsigned long wait = d_min_backoff;
+    if (failure_client == f) {
+        wait = d_max_backoff;
+    }
+    for (unsigned i = 1; (i < d_consecutive) && (wait < d_max_backoff); ++i) {
+        wait = (wait > d_max_backoff / 2) ? d_max_backoff : wait * 2;
+    }
+    if (wait > d_max_backoff) {
+        wait = d_max_backoff;
+    }
+    /* "Equal" jitter: the first half of the wait is fixed, the
+       second half random */
+    d_backoff = wait / 2 + _random() % (wait - wait / 2 + 1);
+    d_state   = backoff;
+
+    DBGprint(F("Subscribe failure "));
+    DBGprint((int)f, DEC);
+    DBGprint(F(", retrying in (ms): "));
+    DBGprintln(d_backoff, DEC);
+}
+
+
+inline SubscribeSupervisor::failure SubscribeSupervisor::_classify(
+    PubNub::http_status_code_class status,
+    failure                        otherwise)
+{
+    switch (status) {
+    case PubNub::http_scc_client_error:
+        return failure_client;
+    case PubNub::http_scc_server_error:
+    case PubNub::http_scc_informational:
+    case PubNub::http_scc_redirection:
+        return failure_server;
+    default:
+        return otherwise;
+    }
+}
+#endif /* !defined(PUBNUB_NO_SUBSCRIBE) */
+
+
+#if !defined(PUBNUB_NO_HISTORY)
+/** Iterates over the messages of a channel in a time range, page
+    (v2 history response) after page, so there can be more of them
+    than PubNub gives in one response. Each message is cracked, as
+    it arrives, into your buffer, so neither the page nor even the
+    whole response is ever held in RAM.
+
+    By default, it goes from the newest page back (the messages of
+    each page being oldest first). With `set_reverse(true)`, it goes
+    from the oldest message forward,
+    which is the way to catch up with the messages since the last one
+    you've seen (say, after an outage), by setting `start` to its
+    timetoken:
+
+        PubNubHistoryPager pager(PubNub, "commands");
+        pager.set_range(last_seen_tt, 0);
+        pager.set_reverse(true);
+        char msg[64];
+        while (pager.next(msg, sizeof msg) > 0) {
+            execute(msg);
+            last_seen_tt = pager.timetoken();
+        }
+
+    Each page is requested when the previous one is read, with a
+    (blocking) `PubNub::history_v2()`, so it uses the history client
+    (and its keep-alive connection, if enabled).
+ */
+class PubNubHistoryPager {
 public:
-    HistoryCracker(PubNonSubClient* pnsc)
-        : d_pnsc(pnsc)
+    /** Pages through the messages of `channel`, (at most) `count` of
+        them per page, 100 being the most PubNub gives (a larger one
+        is taken as 100, as a short page is the last). The string is
+        not copied. */
+    PubNubHistoryPager(PubNub& pubnub, const char* channel, int count = 100)
+        : d_pubnub(pubnub)
+        , d_channel(channel)
+        , d_count((count < 1) ? 1 : (count > 100) ? 100 : count)
+        , d_timeout(310)
+        , d_start(0)
+        , d_end(0)
+        , d_reverse(false)
+        , d_cursor(0)
+        , d_client(0)
+        , d_crack(0, true)
+        , d_done(false)
+        , d_page_count(0)
+        , d_tt(0)
+        , d_pages(0)
+        , d_messages(0)
     {
     }
 
-    bool finished() const { return d_crack.state() == d_crack.done; }
+    /** The time range: get the messages newer than `start` and not
+        newer than `end`, 0 being no limit, whichever way it goes. */
+    void set_range(uint64_t start, uint64_t end)
+    {
+        d_start = start;
+        d_end   = end;
+    }
 
-    int get(String& msg)
+    /** Go from the oldest message forward */
+    void set_reverse(bool reverse) { d_reverse = reverse; }
+
+    /** Timeout of each page request, in seconds (310 by default) */
+    void set_timeout(int timeout) { d_timeout = timeout; }
+
+    /** Gets the next message into the `msg` buffer of `cap` octets,
+        requesting the next page if need be. Returns 1 if it got one,
+        0 if there are no more messages and -1 on failure, after which
+        the next call requests the page again (if going forward, from
+        the last message got).
+     */
+    inline int next(char* msg, size_t cap, bool* truncated = 0);
+
+    /** The timetoken of the message last got */
+    uint64_t timetoken() const { return d_tt; }
+
+    /** The number of pages requested and messages got so far */
+    unsigned pages() const { return d_pages; }
+    unsigned long messages() const { return d_messages; }
+
+private:
+    /** Requests the next page */
+    inline bool _request();
+
+    /** Is the message (with timetoken `tt`) past the end of the
+        range? PubNub doesn't take both the start and the end going
+        forward, so the end is checked here. */
+    bool _past_end(uint64_t tt) const
     {
-        msg.remove(0);
-        int retry = 5;
-        while (!finished() && !d_crack.msg_complete(msg)) {
-            // Could try array read here, but, it's tricky, would
-            // need to keep the state of "read but unhandled characters".
-            if (d_pnsc->available()) {
-                d_crack.handle(d_pnsc->read(), msg);
-            }
-            else {
-                if (--retry <= 0) {
-                    break;
-                }
-                delay(10);
-            }
+        return d_reverse && (d_end != 0) && (tt > d_end);
+    }
+
+    void _stop()
+    {
+        if (d_client) {
+            d_client->stop();
+            d_client = 0;
         }
-        if ((d_crack.done == d_crack.state())
-            || (d_crack.state() == d_crack.ground_zero)) {
-            return 0;
+    }
+
+    PubNub&     d_pubnub;
+    const char* d_channel;
+    int         d_count;
+    int         d_timeout;
+
+    /** The range, see `set_range()` */
+    uint64_t d_start;
+    uint64_t d_end;
+    bool     d_reverse;
+    /** Where the next page starts (exclusive), 0 for the first one:
+        the newest message got (forward) or the oldest message of the
+        last page (back) */
+    uint64_t d_cursor;
+
+    /** The client of the page being read, 0 if none */
+    PubNonSubClient* d_client;
+    HistoryV2Cracker d_crack;
+    bool             d_done;
+    unsigned         d_page_count;
+
+    uint64_t      d_tt;
+    unsigned      d_pages;
+    unsigned long d_messages;
+};
+
+
+inline bool PubNubHistoryPager::_request()
+{
+    /* PubNub's start is exclusive and its end inclusive, whichever
+       way it goes, and going back, the start is the newer one */
+    PubNubHistoryOptions options;
+    options.include_token = true;
+    options.reverse       = d_reverse;
+    if (d_reverse) {
+        options.start = d_cursor ? d_cursor : d_start;
+    }
+    else {
+        options.start = d_cursor ? d_cursor : (d_end ? d_end + 1 : 0);
+        options.end   = d_start ? d_start + 1 : 0;
+    }
+    d_client = d_pubnub.history_v2(d_channel, d_count, options, d_timeout);
+    if (!d_client) {
+        return false;
+    }
+    if (d_pubnub.get_last_http_status_code_class() != PubNub::http_scc_success) {
+        DBGprintln(F("History page request failed"));
+        _stop();
+        return false;
+    }
+    d_crack.reset(d_client, true);
+    d_crack.set_timeout(d_timeout);
+    d_page_count = 0;
+    ++d_pages;
+    return true;
+}
+
+
+inline int PubNubHistoryPager::next(char* msg, size_t cap, bool* truncated)
+{
+    while (!d_done) {
+        if (!d_client && !_request()) {
+            return -1;
         }
-        else {
+        if (d_crack.get(msg, cap, truncated) != 0) {
+            DBGprintln(F("History page ended early"));
+            _stop();
             return -1;
         }
+        if (!d_crack.finished()) {
+            if (_past_end(d_crack.timetoken())) {
+                break;
+            }
+            d_tt = d_crack.timetoken();
+            if (d_reverse) {
+                /* A page requested again starts after it */
+                d_cursor = d_tt;
+            }
+            ++d_page_count;
+            ++d_messages;
+            return 1;
+        }
+        _stop();
+        if ((d_page_count < (unsigned)d_count) || (0 == d_crack.start())) {
+            /* No more messages in the range */
+            break;
+        }
+        d_cursor = d_reverse ? d_crack.end() : d_crack.start();
     }
+    _stop();
+    d_done = true;
+    if (cap > 0) {
+        msg[0] = '\0';
+    }
+    return 0;
+}
+#endif /* !defined(PUBNUB_NO_HISTORY) */
+
+
+/** Keeps a client "present" on channels (and channel groups) by
+    sending heartbeats, so that PubNub doesn't (after the presence
+    timeout) consider it gone.
+
+    A subscribe request is a heartbeat, too (it carries the presence
+    timeout, if set), but it may well wait for messages for longer
+    than the presence timeout. So, while subscribed (with
+    `start_subscribe()`), call `poll()` in your loop and it sends a
+    heartbeat (over the publish client, never opening another
+    connection) when one is due, that is, when neither a subscribe
+    nor a heartbeat was sent for an interval. Heartbeats are not
+    sent while a publish is in progress, so read the responses of
+    your publishes before calling `poll()`.
+
+        PubNubHeartbeat presence(PubNub, "lights");
+        PubNub.set_presence_timeout(120);
+        ...
+        presence.poll();
+ */
+class PubNubHeartbeat {
+public:
+    /** Keeps present on the (comma separated lists of) channels
+        and channel groups, either of which can be 0. The strings
+        are not copied. */
+    PubNubHeartbeat(PubNub&     pubnub,
+                    const char* channels,
+                    const char* channel_groups = 0)
+        : d_pubnub(pubnub)
+        , d_channels(channels)
+        , d_channel_groups(channel_groups)
+        , d_state(0)
+        , d_interval(0)
+        , d_timeout(30)
+        , d_sending(false)
+        , d_retry(false)
+        , d_t_failed(0)
+        , d_sent(0)
+        , d_failures(0)
+    {
+    }
+
+    /** The interval between heartbeats, in seconds. By default (0),
+        a bit less than half of the presence timeout, or, if that is
+        not set, of the 300 seconds PubNub defaults to. */
+    void set_interval(unsigned seconds) { d_interval = seconds; }
+    inline unsigned interval() const;
+
+    /** The state (JSON object) to set with each heartbeat, 0 for
+        none. The string is not copied. */
+    void set_state(const char* state) { d_state = state; }
+
+    /** Timeout of each heartbeat, in seconds (30 by default) */
+    void set_timeout(int timeout) { d_timeout = timeout; }
+
+    /** Sends a heartbeat if one is due and advances the one being
+        sent. A failed heartbeat is retried after a quarter of the
+        interval. Returns whether a heartbeat is in progress. */
+    inline bool poll();
+
+    /** Tells PubNub the client is leaving the channels (and channel
+        groups), waiting for the response. Returns whether PubNub
+        accepted it. */
+    inline bool leave();
 
+    /** Counters: heartbeats sent and failed */
+    unsigned long sent() const { return d_sent; }
+    unsigned long failures() const { return d_failures; }
 
 private:
-    /** Client to read incoming response from */
-    PubNonSubClient* d_pnsc;
-    /** The message array cracker */
-    MessageCracker d_crack;
+    /** Handles a failed heartbeat, to retry it */
+    void _failed()
+    {
+        ++d_failures;
+        d_retry    = true;
+        d_t_failed = millis();
+    }
+
+    PubNub&     d_pubnub;
+    const char* d_channels;
+    const char* d_channel_groups;
+    const char* d_state;
+    unsigned    d_interval;
+    int         d_timeout;
+
+    /** A heartbeat is in progress */
+    bool d_sending;
+    /** The last heartbeat failed, retry it */
+    bool          d_retry;
+    unsigned long d_t_failed;
+
+    unsigned long d_sent;
+    unsigned long d_failures;
 };
 
-/** Used for (minimal) parsing of the response to publish.
-    It assumes a valid response.
- */
-class PublishCracker {
-public:
-    /** State of the parser. In general, user is concerned
-        whether its `done` or not.
-    */
-    enum State {
-        bracket_open,
-        result,
-        comma_description,
-        quote_description,
-        description_chars,
-        comma_timestamp,
-        quote_timestamp,
-        timestamp_chars,
-        bracket_close,
-        done
-    };
-    /** The outcome of the publish - success, fail
-        or "unknown" (IOW: did not finish parsing)
-    */
-    enum Outcome { sent, failed, unknown };
 
-    /** You _don't_ provide the client here, the interface doesn't
-        require it, so it would just take up space in our object.
-    */
-    PublishCracker()
-        : d_state(bracket_open)
-        , d_outcome(unknown)
-    {
-        d_description[0] = '\0';
-        d_timestamp[0]   = '\0';
+inline unsigned PubNubHeartbeat::interval() const
+{
+    if (d_interval != 0) {
+        return d_interval;
+    }
+    unsigned const presence_timeout = d_pubnub.presence_timeout();
+    if (0 == presence_timeout) {
+        return 149;
     }
+    return (presence_timeout > 3) ? presence_timeout / 2 - 1 : 1;
+}
 
-    /** Low level interface - handles one character at a time.  Check
-        `state() == done` to know when parsing is complete.
-     */
-    void handle(char c)
-    {
-        switch (d_state) {
-        case bracket_open:
-            if ('[' == c) {
-                d_state = result;
-            }
-            break;
-        case result:
-            if ('1' == c) {
-                d_outcome = sent;
-                d_state   = comma_description;
-            }
-            else if ('0' == c) {
-                d_outcome = failed;
-                d_state   = comma_description;
-            }
-            else if (isdigit(c)) {
-                DBGprint("Unexpected publish result: ");
-                DBGprintln(c);
-                d_outcome = failed;
-                d_state   = comma_description;
-            }
-            break;
-        case comma_description:
-            if (',' == c) {
-                d_state = quote_description;
-            }
-            break;
-        case quote_description:
-            if ('"' == c) {
-                d_state  = description_chars;
-                d_desc_i = 0;
-            }
-            break;
-        case description_chars:
-            /* Currently, no description uses backslash */
-            if ('"' == c) {
-                d_state                 = comma_timestamp;
-                d_description[d_desc_i] = '\0';
-            }
-            else {
-                if (d_desc_i < MAX_DESCRIPTION) {
-                    d_description[d_desc_i++] = c;
-                    d_description[d_desc_i]   = '\0';
-                }
-            }
-            break;
-        case comma_timestamp:
-            if (',' == c) {
-                d_state = quote_timestamp;
-            }
-            break;
-        case quote_timestamp:
-            if ('"' == c) {
-                d_state = timestamp_chars;
-                d_ts_i  = 0;
-            }
-            break;
-        case timestamp_chars:
-            if ('"' == c) {
-                d_state             = bracket_close;
-                d_timestamp[d_ts_i] = '\0';
-            }
-            else {
-                if (d_ts_i < MAX_DESCRIPTION) {
-                    d_timestamp[d_ts_i++] = c;
-                    d_timestamp[d_ts_i]   = '\0';
-                }
-            }
-            break;
-        case bracket_close:
-            if (']' == c) {
-                d_state = done;
-            }
+
+inline bool PubNubHeartbeat::poll()
+{
+    if (d_sending) {
+        d_pubnub.poll();
+        bool success = false;
+        switch (d_pubnub.publish_state()) {
+        case PubNub::async_in_progress:
+            return true;
+        case PubNub::async_done:
+            success = (d_pubnub.publish_status_class() == PubNub::http_scc_success);
+            d_pubnub.publish_response()->stop();
             break;
-        case done:
         default:
             break;
         }
+        d_sending = false;
+        if (success) {
+            d_retry = false;
+        }
+        else {
+            DBGprintln(F("Heartbeat failed"));
+            _failed();
+        }
+        return false;
     }
 
-    /** Simple wrapper for `handle(c)` if you read
-        an array of characters.
-    */
-    void handle(uint8_t const* s, size_t n)
-    {
-        for (size_t i = 0; i < n; ++i) {
-            handle(s[i]);
+    unsigned long const now = millis();
+    if (d_retry && ((long)(d_pubnub.heartbeat_sent_at() - d_t_failed) > 0)) {
+        /* A subscribe was sent since */
+        d_retry = false;
+    }
+    if (d_retry) {
+        unsigned long wait = (unsigned long)interval() * 250;
+        if (wait < 1000) {
+            wait = 1000;
         }
+        if (now - d_t_failed < wait) {
+            return false;
+        }
+    }
+    else if (now - d_pubnub.heartbeat_sent_at() < (unsigned long)interval() * 1000) {
+        return false;
+    }
+    if (PubNub::async_in_progress == d_pubnub.publish_state()) {
+        return false;
     }
+    ++d_sent;
+    if (!d_pubnub.start_heartbeat(d_channels, d_channel_groups, d_state, d_timeout)) {
+        _failed();
+        return false;
+    }
+    d_sending = true;
+    return true;
+}
 
-    /** The "high level" interface, just call this and it will
-        read and parse the response.
-    */
-    Outcome read_and_parse(PubNonSubClient* pnsc)
-    {
-        uint8_t minibuf[MAX_DESCRIPTION];
-        int     retry = 5;
-        while (state() != done) {
-            int len = pnsc->read(minibuf, MAX_DESCRIPTION);
-            if (len > 0) {
-                handle(minibuf, len);
-            }
-            else {
-                if (--retry <= 0) {
-                    break;
-                }
-                delay(10);
-            }
+
+inline bool PubNubHeartbeat::leave()
+{
+    if (d_sending || (PubNub::async_in_progress == d_pubnub.publish_state())) {
+        return false;
+    }
+    PubNonSubClient* client = d_pubnub.leave(d_channels, d_channel_groups, d_timeout);
+    if (!client) {
+        return false;
+    }
+    bool const success = (d_pubnub.get_last_http_status_code_class()
+                          == PubNub::http_scc_success);
+    client->stop();
+    return success;
+}
+
+
+/** The number of (latest) samples of the PubNub time that
+    `PubNubClock` keeps. Can be set (as a compiler option, or before
+    including this file) as needed.
+ */
+#if !defined(PUBNUB_CLOCK_SAMPLES)
+#if defined(__AVR)
+#define PUBNUB_CLOCK_SAMPLES 4
+#else
+#define PUBNUB_CLOCK_SAMPLES 8
+#endif
+#endif
+
+
+/** Estimates the PubNub time from the local clock (`millis()`), so
+    that timetokens can be made (and compared with the ones of
+    messages) without asking PubNub each time.
+
+    Each `sync()` asks PubNub the time and makes a sample of it, like
+    NTP does: PubNub took the time somewhere between the request was
+    sent and the response arrived, so, most likely, in the middle,
+    give or take half of the round trip time. Of the samples kept,
+    the one with the shortest round trip is the most precise, so the
+    time is estimated from it. Sync a few times at start and then
+    every now and then (the local clock drifts):
+
+        PubNubClock clock(PubNub);
+        for (int i = 0; i < 4; ++i) {
+            clock.sync();
         }
-        return outcome();
+        ...
+        uint64_t const an_hour_ago = clock.now() - 3600000ULL * PubNubClock::tt_per_ms;
+ */
+class PubNubClock {
+public:
+    /** Timetokens are in tenths of microseconds */
+    enum { tt_per_ms = 10000 };
+
+    PubNubClock(PubNub& pubnub)
+        : d_pubnub(pubnub)
+        , d_count(0)
+        , d_next(0)
+        , d_best(0)
+    {
     }
 
-    State   state() const { return d_state; }
-    Outcome outcome() const { return d_outcome; }
+    /** Asks PubNub the time, waiting for the response, and adds the
+        sample. Returns whether it did. Doesn't ask while a publish
+        is in progress. */
+    inline bool sync(int timeout = 30);
 
-    char const* description() const { return d_description; }
+    /** Adds a sample: the request was sent at `sent_ms` and the
+        response (with the PubNub time `tt`) arrived at `received_ms`,
+        both by `millis()`. Use it if you got the time yourself. */
+    inline void add_sample(unsigned long sent_ms, unsigned long received_ms, uint64_t tt);
 
-    char const* timestamp() const { return d_timestamp; }
-    char const* to_str(Outcome e)
+    /** Forgets the samples */
+    void clear() { d_count = d_next = d_best = 0; }
+
+    /** Returns whether there is a sample to estimate from */
+    bool synced() const { return d_count > 0; }
+
+    /** The number of samples kept */
+    unsigned samples() const { return d_count; }
+
+    /** The (estimated) PubNub time now, 0 if not synced */
+    uint64_t now() const { return at(millis()); }
+
+    /** The (estimated) PubNub time at `ms` (by `millis()`), which can
+        be in the past, 0 if not synced */
+    uint64_t at(unsigned long ms) const
     {
-        switch (e) {
-        case sent:
-            return "Sent";
-        case failed:
-            return "Failed";
-        case unknown:
-            return "Unknown";
-        default:
-            return "!?!";
+        if (!synced()) {
+            return 0;
         }
+        sample const& s = d_samples[d_best];
+        long const    d = (long)(ms - s.ms);
+        return s.tt + (int64_t)d * tt_per_ms;
     }
-    char const* to_str(State e)
+
+    /** The round trip time of the sample the time is estimated from,
+        in milliseconds. The estimate is off by (at most) half of it,
+        plus the drift of the local clock since. */
+    unsigned long rtt_ms() const { return synced() ? d_samples[d_best].rtt : 0; }
+
+    /** The (estimated) local time (by `millis()`) when PubNub time
+        was `tt`, like the time a message was published. */
+    unsigned long to_millis(uint64_t tt) const
     {
-        switch (e) {
-        case bracket_open:
-            return "Bracket open";
-        case result:
-            return "Result";
-        case comma_description:
-            return "Comma before description";
-        case quote_description:
-            return "Quote before description";
-        case description_chars:
-            return "Characters of description";
-        case comma_timestamp:
-            return "Comma before timestamp";
-        case quote_timestamp:
-            return "Quote before timestamp";
-        case timestamp_chars:
-            return "Characters/digits of timestamp";
-        case bracket_close:
-            return "Bracket close";
-        case done:
-            return "Done.";
+        if (!synced()) {
+            return 0;
         }
-        return "!?!";
+        sample const& s = d_samples[d_best];
+        int64_t const d = (int64_t)(tt - s.tt) / tt_per_ms;
+        return s.ms + (unsigned long)(long)d;
     }
-    enum { MAX_DESCRIPTION = 50, MAX_TIMESTAMP = 20 };
 
 private:
-    /** Current parser/cracker state */
-    State d_state;
-    /** Outcome of the publish as reported by PubNub */
-    Outcome d_outcome;
-    /** Statically allocated string of the description of
-        the publish outcome as reported by PubNub */
-    char d_description[MAX_DESCRIPTION + 1];
-    /** Current position inside `d_description`, will
-        write next char there */
-    size_t d_desc_i;
-    /** Statically allocated string of the timestamp/token of
-        the publish  as reported by PubNub */
-    char d_timestamp[MAX_TIMESTAMP + 1];
-    /** Current position inside `d_timestamp`, will
-        write next char there */
-    size_t d_ts_i;
+    struct sample {
+        /** PubNub time */
+        uint64_t tt;
+        /** Local time (at the middle of the round trip) */
+        unsigned long ms;
+        /** Round trip time, in milliseconds */
+        unsigned long rtt;
+    };
+
+    PubNub& d_pubnub;
+    sample  d_samples[PUBNUB_CLOCK_SAMPLES];
+    /** The number of samples kept, where the next one goes and the
+        one with the shortest round trip */
+    uint8_t d_count;
+    uint8_t d_next;
+    uint8_t d_best;
 };
 
 
-inline enum PubNub::PubNub_BH PubNub::_request_bh(PubNub_BASE_CLIENT& client,
-                                                  unsigned long       t_start,
-                                                  int                 timeout,
-                                                  char                qparsep)
+inline void PubNubClock::add_sample(unsigned long sent_ms,
+                                    unsigned long received_ms,
+                                    uint64_t      tt)
 {
-    /* Finish the first line of the request. */
-    client.print(qparsep);
-    client.print("pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n");
-    /* Finish HTTP request. */
-    client.print("Host: ");
-    client.print(d_origin);
-    client.print(
-        "\r\nUser-Agent: PubNub-Arduino/1.0\r\nConnection: close\r\n\r\n");
-
-#define WAIT()                                                                 \
-    do {                                                                       \
-        while (0 == client.available()) {                                      \
-            /* wait, just check for timeout */                                 \
-            if (millis() - t_start > (unsigned long)timeout * 1000) {          \
-                DBGprintln("Timeout in bottom half");                          \
-                return PubNub_BH_TIMEOUT;                                      \
-            }                                                                  \
-            if (!client.connected()) {                                         \
-                /* Oops, connection interrupted. */                            \
-                DBGprintln("Connection reset in bottom half");                 \
-                return PubNub_BH_ERROR;                                        \
-            }                                                                  \
-            delay(10);                                                         \
-        }                                                                      \
-    } while (0)
-
-    /* Read first line with HTTP code. */
-    /* "HTTP/1.x " */
-    do {
-        WAIT();
-    } while (client.read() != ' ');
-
-    /* Now, first digit of HTTP code. */
-    WAIT();
-
-    char c                        = client.read();
-    d_last_http_status_code_class = static_cast<http_status_code_class>(c - '0');
-
-    /* Now, we enter in a state machine that shall guide us through
-     * the remaining headers to the beginning of the body. */
-    enum {
-        RS_SKIPLINE,               /* Skip the rest of this line. */
-        RS_LOADLINE,               /* Try loading the line in a buffer. */
-    } request_state = RS_SKIPLINE; /* Skip the rest of status line first. */
-    bool chunked    = false;
-
-    while (client.available()) {
-        /* Let's hope there is no stray LF without CR. */
-        if (request_state == RS_SKIPLINE) {
-            do {
-                WAIT();
-            } while (client.read() != '\n');
-            request_state = RS_LOADLINE;
-        }
-        else { /* request_state == RS_LOADLINE */
-            /* line[] must be enough to hold
-             * Transfer-Encoding: chunked (or \r\n) */
-            const static char chunked_str[] = "Transfer-Encoding: chunked\r\n";
-
-            char     line[sizeof(chunked_str)]; /* Not NUL-terminated! */
-            unsigned linelen = 0;
-            char     ch      = 0;
-            do {
-                WAIT();
-                ch              = client.read();
-                line[linelen++] = ch;
-                if (linelen == (sizeof chunked_str - 1)
-                    && !strncasecmp_P(line, chunked_str, linelen)) {
-                    /* Chunked encoding header. */
-                    chunked = true;
-                    break;
-                }
-            } while (ch != '\n' && linelen < sizeof(line));
-            if (ch != '\n') {
-                /* We are not at the end of the line yet.
-                 * Skip the rest of the line. */
-                request_state = RS_SKIPLINE;
-            }
-            else {
+    unsigned long const rtt = received_ms - sent_ms;
+    sample&             s   = d_samples[d_next];
+    s.tt                    = tt;
+    s.ms                    = sent_ms + rtt / 2;
+    s.rtt                   = rtt;
+    d_next = (d_next + 1) % PUBNUB_CLOCK_SAMPLES;
+    if (d_count < PUBNUB_CLOCK_SAMPLES) {
+        ++d_count;
+    }
 
-                if (linelen == 2 && line[0] == '\r') {
-                    /* Empty line. This means headers end. */
-                    break;
-                }
-            }
+    /* Only the kept samples count, the one replaced may have been
+       the best */
+    d_best = 0;
+    for (uint8_t i = 1; i < d_count; ++i) {
+        if (d_samples[i].rtt < d_samples[d_best].rtt) {
+            d_best = i;
         }
     }
+}
 
-    if (chunked) {
-        /* There is one extra line due to Transfer-encoding: chunked.
-         * Our minimalistic support means that we hope for just
-         * a single chunk, just skip the first line after header. */
-        do {
-            WAIT();
-        } while (client.read() != '\n');
+
+inline bool PubNubClock::sync(int timeout)
+{
+    if (PubNub::async_in_progress == d_pubnub.publish_state()) {
+        return false;
+    }
+    if (!d_pubnub.start_time(timeout)) {
+        return false;
+    }
+    /* Connecting doesn't count, the round trip starts once the
+       request is sent */
+    unsigned long const sent = millis();
+    for (;;) {
+        d_pubnub.poll();
+        if (d_pubnub.publish_state() != PubNub::async_in_progress) {
+            break;
+        }
+        delay(1);
+    }
+    unsigned long const received = millis();
+    if (d_pubnub.publish_state() != PubNub::async_done) {
+        DBGprintln(F("Time request failed"));
+        return false;
     }
 
-    /* Body begins now. */
-    return PubNub_BH_OK;
+    uint64_t tt = 0;
+    PubNonSubClient* client = d_pubnub.publish_response();
+    if (d_pubnub.publish_status_class() == PubNub::http_scc_success) {
+        TimeCracker cracker;
+        tt = cracker.read_and_parse(client);
+    }
+    client->stop();
+    if (0 == tt) {
+        DBGprintln(F("Bad time response"));
+        return false;
+    }
+    add_sample(sent, received, tt);
+    return true;
 }
 
+inline void PubNub::_start_body(PubNonSubClient&      client,
+                                bool                  keep_alive,
+                                http_body_info const& body_info)
+{
+    client.start_body(body_info.content_length,
+                      keep_alive && !body_info.close,
+                      body_info.chunked);
+}
 
 #endif
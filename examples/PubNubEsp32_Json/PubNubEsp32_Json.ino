@@ -270,6 +270,10 @@ void loop()
             ArduinoJson, where the capacity could be precisely
             `json_elem_size` (assuming you do get the message you are
             expecting).
+
+            Or, if you need only a few fields of the messages, use
+            `PubNubJsonExtractor` to get them as the response
+            streams in, without any document or message buffer.
         */
 //
         Serial.print("timetoken=");
@@ -2,7 +2,9 @@
   PubNub sample subscribe client
 
   This sample client will subscribe to and handle raw PubNub messages
-  It does so with a randomly generated UUID.
+  It does so with a randomly generated UUID. The subscribe is kept
+  going by a SubscribeSupervisor, which, if the subscribe fails,
+  backs off before trying again.
 
   Circuit:
   * Ethernet shield attached to pins 10, 11, 12, 13
@@ -27,6 +29,8 @@ char subkey[]  = "demo";
 char channel[] = "hello_world";
 char uuid[]    = "xxxxxxxx-xxxx-4444-9999-xxxxxxxxxxxx";
 
+SubscribeSupervisor supervisor(PubNub, channel);
+
 void random_uuid()
 {
     randomSeed(analogRead(4) + millis() * 1024);
@@ -58,6 +62,9 @@ void setup()
     PubNub.begin(pubkey, subkey);
     random_uuid();
     PubNub.set_uuid(uuid);
+    /* Devices that lose the connection at the same time should not
+       retry at the same time */
+    supervisor.set_seed(random(0x7FFFFFFF));
     Serial.println("PubNub set up");
 }
 
@@ -75,11 +82,13 @@ void loop()
 {
     Ethernet.maintain();
 
-    Serial.println("waiting for a message (subscribe)");
-    PubSubClient* client = PubNub.subscribe(channel);
+    unsigned long failures = supervisor.failures();
+    PubSubClient* client   = supervisor.poll();
+    if (supervisor.failures() != failures) {
+        Serial.print("subscription error, retrying in (ms): ");
+        Serial.println(supervisor.backoff_ms());
+    }
     if (!client) {
-        Serial.println("subscription error");
-        delay(1000);
         return;
     }
 
@@ -95,6 +104,4 @@ void loop()
 
     client->stop();
     flash(subLedPin, 2);
-
-    delay(500);
 }
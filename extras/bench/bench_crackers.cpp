@@ -0,0 +1,178 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+/* Measures the throughput of the message crackers, comparing the
+   "byte at a time" reading (how the crackers used to read) with the
+   (current) block reading through the cracker staging buffer.
+
+   Usage: bench_crackers [-c call_cost_ns] [-m total_MB]
+ */
+#include "memory_client.h"
+#include "messages.h"
+
+#define PubNub_BASE_CLIENT MemoryClient
+#include "../../PubNubDefs.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+/** Result of cracking a (number of) response(s) */
+struct result {
+    unsigned long bytes;
+    unsigned long messages;
+    unsigned long reads;
+    double        seconds;
+};
+
+
+/** The way `SubscribeCracker::get()` used to read: a character at
+    a time, straight from the client. */
+static int bytewise_get(SubscribeCracker& cracker, PubSubClient& client, String& msg)
+{
+    msg.remove(0);
+    while (!cracker.finished() && !cracker.message_complete(msg)) {
+        if (!client.wait_for_data()) {
+            break;
+        }
+        int c = client.read();
+        if (c != -1) {
+            cracker.handle(c, msg);
+        }
+    }
+    return 0;
+}
+
+
+static result bench_subscribe(std::string const& body, unsigned long repeat, bool bytewise)
+{
+    PubSubClient client;
+    String       msg;
+    result       rslt = { 0, 0, 0, 0 };
+    double       t0   = now();
+    for (unsigned long i = 0; i < repeat; ++i) {
+        client.load(body.data(), body.size());
+        client.start_request();
+        client.start_body();
+        SubscribeCracker cracker(&client);
+        while (!cracker.finished()) {
+            if (bytewise) {
+                bytewise_get(cracker, client, msg);
+            }
+            else {
+                cracker.get(msg);
+            }
+            if (msg.length() > 0) {
+                ++rslt.messages;
+            }
+        }
+        rslt.bytes += body.size();
+    }
+    rslt.seconds = now() - t0;
+    rslt.reads   = client.reads();
+    return rslt;
+}
+
+
+static result bench_history(std::string const& body, unsigned long repeat, bool bytewise)
+{
+    PubNonSubClient client;
+    String          msg;
+    result          rslt = { 0, 0, 0, 0 };
+    double          t0   = now();
+    for (unsigned long i = 0; i < repeat; ++i) {
+        client.load(body.data(), body.size());
+        client.start_body(body.size(), false, false);
+        if (bytewise) {
+            /* The way `HistoryCracker::get()` used to read */
+            MessageCracker crack;
+            while (crack.state() != crack.done) {
+                msg.remove(0);
+                while ((crack.state() != crack.done) && !crack.msg_complete(msg)) {
+                    if (!client.available()) {
+                        break;
+                    }
+                    crack.handle(client.read(), msg);
+                }
+                if (msg.length() > 0) {
+                    ++rslt.messages;
+                }
+            }
+        }
+        else {
+            HistoryCracker cracker(&client);
+            while (!cracker.finished()) {
+                cracker.get(msg);
+                if (msg.length() > 0) {
+                    ++rslt.messages;
+                }
+            }
+        }
+        rslt.bytes += body.size();
+    }
+    rslt.seconds = now() - t0;
+    rslt.reads   = client.reads();
+    return rslt;
+}
+
+
+static void report(char const* name, result const& bytewise, result const& staged)
+{
+    result const* r[] = { &bytewise, &staged };
+    char const*   how[] = { "byte-at-a-time", "staged" };
+    for (int i = 0; i < 2; ++i) {
+        printf("%-26s %-15s %10.2f MB/s %12.0f msg/s %8.1f B/read\n",
+               name,
+               how[i],
+               r[i]->bytes / r[i]->seconds / 1e6,
+               r[i]->messages / r[i]->seconds,
+               (double)r[i]->bytes / r[i]->reads);
+    }
+    printf("%-26s speedup %.2fx\n\n", name, bytewise.seconds / staged.seconds);
+}
+
+
+int main(int argc, char* argv[])
+{
+    double total_mb = 20;
+    int    opt;
+    while ((opt = getopt(argc, argv, "c:m:")) != -1) {
+        switch (opt) {
+        case 'c':
+            MemoryClient::call_cost_ns = strtoul(optarg, 0, 10);
+            break;
+        case 'm':
+            total_mb = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c call_cost_ns] [-m total_MB]\n", argv[0]);
+            return 1;
+        }
+    }
+    printf("cracker buffer %d octets, simulated read call cost %lu ns\n\n",
+           PUBNUB_CRACKER_BUFFER_SIZE,
+           MemoryClient::call_cost_ns);
+
+    static const struct {
+        char const* name;
+        unsigned    count;
+        unsigned    size;
+    } scenarios[] = {
+        { "tiny messages", 100, 32 },
+        { "1 KB messages", 20, 1024 },
+        { "32 KB message", 1, 32 * 1024 },
+    };
+    for (size_t i = 0; i < sizeof scenarios / sizeof scenarios[0]; ++i) {
+        std::string   messages = make_messages(scenarios[i].count, scenarios[i].size);
+        /* Subscribe body, after the opening '[' */
+        std::string   sub = messages + ",\"15541420302549923\"]";
+        unsigned long repeat = (unsigned long)(total_mb * 1e6 / sub.size()) + 1;
+        std::string   name = std::string("subscribe, ") + scenarios[i].name;
+        report(name.c_str(),
+               bench_subscribe(sub, repeat, true),
+               bench_subscribe(sub, repeat, false));
+        name = std::string("history, ") + scenarios[i].name;
+        report(name.c_str(),
+               bench_history(messages, repeat, true),
+               bench_history(messages, repeat, false));
+    }
+    return 0;
+}
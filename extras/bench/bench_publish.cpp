@@ -0,0 +1,202 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+/* Measures the CPU cost of writing publish requests, to a
+   `MemoryClient`, which discards them, so there's no I/O: printing
+   the whole request on every publish (`start_publish(channel, ...)`)
+   versus writing out the text kept by a `PubNubChannel` handle.
+
+   Also measures the %-encoding of messages on its own, comparing the
+   way the library used to do it (`strspn()` against the list of the
+   characters that are left as they are, then a `write()` of each
+   encoded octet) with looking octets up in the `PubNubUrlEncoder`
+   bitmap one at a time, and with `PubNubUrlEncoder::encode()`
+   (which, with PUBNUB_SWAR_ENCODE, checks a word at a time).
+
+   Usage: bench_publish [-m total_MB]
+ */
+#include "memory_client.h"
+#include "messages.h"
+
+#define PubNub_BASE_CLIENT MemoryClient
+#include "../../PubNubDefs.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+
+/** Result of writing a (number of) request(s) */
+struct result {
+    unsigned long requests;
+    unsigned long bytes;
+    double        seconds;
+};
+
+
+static result bench(PubNub& pn, PubNubChannel* handle, std::string const& msg, unsigned long repeat)
+{
+    result rslt = { 0, 0, 0 };
+    MemoryClient::written = 0;
+    double t0 = now();
+    for (unsigned long i = 0; i < repeat; ++i) {
+        bool started = handle ? pn.start_publish(*handle, msg.c_str())
+                              : pn.start_publish("bench-channel", msg.c_str());
+        if (started) {
+            ++rslt.requests;
+        }
+    }
+    rslt.seconds = now() - t0;
+    rslt.bytes   = MemoryClient::written;
+    return rslt;
+}
+
+
+/** The way `PubNub` used to %-encode messages */
+static size_t strspn_encode(char const* s, char* out)
+{
+    static const char unreserved[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.~"
+        ",=:;@[]";
+    char* o = out;
+    while (s[0]) {
+        size_t okspan = strspn(s, unreserved);
+        if (okspan > 0) {
+            memcpy(o, s, okspan);
+            o += okspan;
+            s += okspan;
+        }
+        if (s[0]) {
+            char enc[3] = { '%' };
+            enc[1]      = "0123456789ABCDEF"[(uint8_t)s[0] / 16];
+            enc[2]      = "0123456789ABCDEF"[(uint8_t)s[0] % 16];
+            memcpy(o, enc, 3);
+            o += 3;
+            s++;
+        }
+    }
+    return o - out;
+}
+
+
+/** Looks up each octet in the encoder bitmap */
+static size_t bitmap_encode(char const* s, char* out)
+{
+    char* o = out;
+    for (; *s; ++s) {
+        uint8_t const c = *s;
+        if (PubNubUrlEncoder::unreserved(c)) {
+            *o++ = c;
+        }
+        else {
+            *o++ = '%';
+            *o++ = "0123456789ABCDEF"[c >> 4];
+            *o++ = "0123456789ABCDEF"[c & 0x0F];
+        }
+    }
+    return o - out;
+}
+
+
+static size_t library_encode(char const* s, char* out)
+{
+    size_t written;
+    size_t len = strlen(s);
+    PubNubUrlEncoder::encode(s, len, out, 3 * len, written);
+    return written;
+}
+
+
+static void bench_encode(char const* name, std::string const& msg, double total_mb)
+{
+    static const struct {
+        char const* name;
+        size_t (*encode)(char const*, char*);
+    } encoders[] = {
+        { "strspn", strspn_encode },
+        { "bitmap", bitmap_encode },
+        { "encoder", library_encode },
+    };
+    std::string   out(3 * msg.size(), '\0');
+    unsigned long repeat = (unsigned long)(total_mb * 1e6 / msg.size()) + 1;
+    size_t        expected = strspn_encode(msg.c_str(), &out[0]);
+    for (size_t i = 0; i < sizeof encoders / sizeof encoders[0]; ++i) {
+        size_t written = 0;
+        double t0      = now();
+        for (unsigned long j = 0; j < repeat; ++j) {
+            written = encoders[i].encode(msg.c_str(), &out[0]);
+        }
+        double seconds = now() - t0;
+        printf("%-22s %-8s %10.2f MB/s%s\n",
+               name,
+               encoders[i].name,
+               repeat * msg.size() / seconds / 1e6,
+               (written == expected) ? "" : " (WRONG LENGTH)");
+    }
+    printf("\n");
+}
+
+
+static void report(char const* name, result const& printed, result const& cached)
+{
+    result const* r[] = { &printed, &cached };
+    char const*   how[] = { "printed", "handle" };
+    for (int i = 0; i < 2; ++i) {
+        printf("%-22s %-8s %12.0f req/s %8.1f ns/req %10.2f MB/s\n",
+               name,
+               how[i],
+               r[i]->requests / r[i]->seconds,
+               r[i]->seconds * 1e9 / r[i]->requests,
+               r[i]->bytes / r[i]->seconds / 1e6);
+    }
+    printf("%-22s speedup %.2fx\n\n", name, printed.seconds / cached.seconds);
+}
+
+
+int main(int argc, char* argv[])
+{
+    double total_mb = 20;
+    int    opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        switch (opt) {
+        case 'm':
+            total_mb = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m total_MB]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* Keys and auth of the length of the real ones */
+    PubNub pn;
+    pn.begin("pub-c-8a7d2b3c-1e4f-4a6b-9c8d-7e6f5a4b3c2d",
+             "sub-c-1b2c3d4e-5f6a-7b8c-9d0e-1f2a3b4c5d6e");
+    pn.set_uuid("bench-device-0123456789");
+    pn.set_auth("bench-auth-key-0123456789abcdef");
+    static PubNubChannel handle("bench-channel");
+
+    static const struct {
+        char const* name;
+        unsigned    size;
+    } scenarios[] = {
+        { "tiny message", 32 },
+        { "1 KB message", 1024 },
+    };
+    for (size_t i = 0; i < sizeof scenarios / sizeof scenarios[0]; ++i) {
+        std::string   msg = make_message(i, scenarios[i].size);
+        unsigned long repeat = (unsigned long)(total_mb * 1e6 / (msg.size() + 300)) + 1;
+        result        printed = bench(pn, 0, msg, repeat);
+        report(scenarios[i].name, printed, bench(pn, &handle, msg, repeat));
+    }
+
+    printf("%%-encoding (PUBNUB_SWAR_ENCODE %d), of the message octets:\n\n",
+           PUBNUB_SWAR_ENCODE);
+    std::string json;
+    std::string utf8;
+    while (json.size() < 1024) {
+        json += "{\"id\":42,\"on\":true,\"name\":\"a b\"},";
+        utf8 += "\"h\xc3\xa9llo w\xc3\xb6rld \xe2\x82\xac\",";
+    }
+    bench_encode("1 KB text", make_message(0, 1024), total_mb);
+    bench_encode("1 KB JSON", json, total_mb);
+    bench_encode("1 KB UTF-8", utf8, total_mb);
+    return 0;
+}
@@ -0,0 +1,332 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+/* Measures whole requests - sending, parsing the response head,
+   cracking the body - of the publish, subscribe and history paths,
+   over TCP/IP sockets, against a stand-in server on the loopback
+   interface, which replies with canned responses.
+
+   For each path and scenario, reports the throughput (octets on the
+   wire and messages per second), the percentiles of the latency of
+   a request and the heap allocations per request.
+
+   Usage: bench_requests [-n requests] [-K]
+ */
+#include "socket_client.h"
+#include "standin_server.h"
+#include "messages.h"
+
+#define PubNub_BASE_CLIENT SocketClient
+#include "../../PubNubDefs.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+
+/* Heap allocations (of the benchmark thread, not the server's) */
+static unsigned long         allocations;
+static thread_local bool     count_allocations;
+
+void* operator new(size_t size)
+{
+    if (count_allocations) {
+        ++allocations;
+    }
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+
+/** A canned scenario: the messages published or received */
+struct scenario {
+    char const* name;
+    unsigned    count;
+    unsigned    size;
+    /** Dribble the responses this many octets at a time... */
+    size_t dribble_octets;
+    /** ...every this many microseconds */
+    unsigned long dribble_us;
+};
+
+/** What the requests of a scenario send and receive */
+struct scenario_data {
+    unsigned    count;
+    std::string message;
+};
+
+
+/** A request path: does one request and processes the response,
+    returning the number of messages sent or received */
+typedef unsigned (*request_path)(PubNub& pn, scenario_data const& d);
+
+static unsigned publish_get(PubNub& pn, scenario_data const& d)
+{
+    PubNonSubClient* client = pn.publish("bench", d.message.c_str());
+    if (!client) {
+        return 0;
+    }
+    PublishCracker cheez;
+    bool           sent = (cheez.sent == cheez.read_and_parse(client));
+    client->stop();
+    return sent ? d.count : 0;
+}
+
+static unsigned publish_handle(PubNub& pn, scenario_data const& d)
+{
+    static PubNubChannel bench("bench");
+    PubNonSubClient*     client = pn.publish(bench, d.message.c_str());
+    if (!client) {
+        return 0;
+    }
+    PublishCracker cheez;
+    bool           sent = (cheez.sent == cheez.read_and_parse(client));
+    client->stop();
+    return sent ? d.count : 0;
+}
+
+static unsigned publish_post(PubNub& pn, scenario_data const& d)
+{
+    PubNonSubClient* client = pn.publish_post("bench", d.message.c_str());
+    if (!client) {
+        return 0;
+    }
+    PublishCracker cheez;
+    bool           sent = (cheez.sent == cheez.read_and_parse(client));
+    client->stop();
+    return sent ? d.count : 0;
+}
+
+static unsigned subscribe(PubNub& pn, scenario_data const&)
+{
+    PubSubClient* client = pn.subscribe("bench");
+    if (!client) {
+        return 0;
+    }
+    SubscribeCracker ritz(client);
+    String           msg;
+    unsigned         count = 0;
+    while (!ritz.finished()) {
+        if ((ritz.get(msg) != 0) && (msg.length() == 0)) {
+            break;
+        }
+        if (msg.length() > 0) {
+            ++count;
+        }
+    }
+    client->stop();
+    return count;
+}
+
+static unsigned subscribe_v2(PubNub& pn, scenario_data const&)
+{
+    PubSubClient* client = pn.subscribe_v2("bench");
+    if (!client) {
+        return 0;
+    }
+    SubscribeV2Cracker ritz(client);
+    String             msg;
+    unsigned           count = 0;
+    while (!ritz.finished()) {
+        if (ritz.get(msg) != 0) {
+            break;
+        }
+        if (msg.length() > 0) {
+            ++count;
+        }
+    }
+    client->stop();
+    return count;
+}
+
+static unsigned history(PubNub& pn, scenario_data const& d)
+{
+    PubNonSubClient* client = pn.history("bench", d.count);
+    if (!client) {
+        return 0;
+    }
+    HistoryCracker smoki(client);
+    String         msg;
+    unsigned       count = 0;
+    while (!smoki.finished()) {
+        if ((smoki.get(msg) != 0) && (msg.length() == 0)) {
+            break;
+        }
+        if (msg.length() > 0) {
+            ++count;
+        }
+    }
+    client->stop();
+    return count;
+}
+
+
+/** The replies of the stand-in server for the `s`cenario */
+static StandinServer::replies make_replies(scenario const& s)
+{
+    StandinServer::replies r;
+    std::string const      messages = make_messages(s.count, s.size);
+
+    r.publish   = "[1,\"Sent\",\"15541724007473323\"]";
+    r.subscribe = "[" + messages + ",\"15541420302549923\"]";
+    r.history   = messages;
+
+    r.subscribe_v2 = "{\"t\":{\"t\":\"15541420302549923\",\"r\":12},\"m\":[";
+    for (unsigned i = 0; i < s.count; ++i) {
+        r.subscribe_v2 += i ? "," : "";
+        r.subscribe_v2 += "{\"a\":\"1\",\"f\":0,\"i\":\"bench-publisher\","
+                          "\"p\":{\"t\":\"15541420302549923\",\"r\":12},"
+                          "\"k\":\"sub-c-bench\",\"c\":\"bench\",\"d\":"
+                          + make_message(i, s.size) + "}";
+    }
+    r.subscribe_v2 += "]}";
+
+    r.dribble_octets = s.dribble_octets;
+    r.dribble_us     = s.dribble_us;
+    return r;
+}
+
+
+static double percentile(std::vector<double> const& sorted, double p)
+{
+    size_t i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+
+static void bench(PubNub&              pn,
+                  char const*          scenario_name,
+                  char const*          path_name,
+                  request_path         path,
+                  scenario_data const& d,
+                  unsigned             requests)
+{
+    /* Warm up: connect (for keep-alive), allocate what's kept */
+    path(pn, d);
+
+    std::vector<double> latency;
+    latency.reserve(requests);
+    unsigned long const bytes0  = SocketClient::bytes_in + SocketClient::bytes_out;
+    unsigned long const allocs0 = allocations;
+    unsigned long       messages = 0;
+    unsigned            failed   = 0;
+
+    double const t0 = now();
+    for (unsigned i = 0; i < requests; ++i) {
+        double const   start = now();
+        count_allocations    = true;
+        unsigned const n     = path(pn, d);
+        count_allocations    = false;
+        latency.push_back((now() - start) * 1e6);
+        if (0 == n) {
+            ++failed;
+        }
+        messages += n;
+    }
+    double const seconds = now() - t0;
+
+    std::sort(latency.begin(), latency.end());
+    unsigned long const bytes = SocketClient::bytes_in + SocketClient::bytes_out - bytes0;
+    printf("%-10s %-14s %8.2f MB/s %9.0f msg/s   us: p50 %7.0f p90 %7.0f p99 %7.0f max %7.0f"
+           "   %6.1f allocs/req",
+           scenario_name,
+           path_name,
+           bytes / seconds / 1e6,
+           messages / seconds,
+           percentile(latency, 50),
+           percentile(latency, 90),
+           percentile(latency, 99),
+           latency.back(),
+           (double)(allocations - allocs0) / requests);
+    if (failed > 0) {
+        printf("   %u FAILED", failed);
+    }
+    printf("\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    unsigned requests   = 200;
+    bool     keep_alive = true;
+    int      opt;
+    while ((opt = getopt(argc, argv, "n:K")) != -1) {
+        switch (opt) {
+        case 'n':
+            requests = strtoul(optarg, 0, 10);
+            break;
+        case 'K':
+            keep_alive = false;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-K]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (0 == requests) {
+        requests = 1;
+    }
+
+    StandinServer server;
+    if (0 == server.port()) {
+        perror("stand-in server");
+        return 1;
+    }
+    SocketClient::port_override = server.port();
+
+    static PubNub pn;
+    pn.begin("pub-c-bench", "sub-c-bench", "127.0.0.1");
+    pn.set_keep_alive(keep_alive);
+
+    printf("%u requests per measurement, keep-alive %s, cracker buffer %d, "
+           "request buffer %d octets\n\n",
+           requests,
+           keep_alive ? "on" : "off",
+           PUBNUB_CRACKER_BUFFER_SIZE,
+           PUBNUB_REQUEST_BUFFER_SIZE);
+
+    static const scenario scenarios[] = {
+        { "tiny", 1, 32, 0, 0 },
+        { "32 KB", 1, 32 * 1024, 0, 0 },
+        { "100-batch", 100, 64, 0, 0 },
+        { "dribble", 1, 32, 7, 200 },
+    };
+    static const struct {
+        char const*  name;
+        request_path path;
+    } paths[] = {
+        { "publish GET", publish_get },
+        { "publish handle", publish_handle },
+        { "publish POST", publish_post },
+        { "subscribe", subscribe },
+        { "subscribe v2", subscribe_v2 },
+        { "history", history },
+    };
+    for (size_t i = 0; i < sizeof scenarios / sizeof scenarios[0]; ++i) {
+        scenario const& s = scenarios[i];
+        server.set_replies(make_replies(s));
+        /* Publish the messages, the batch as one array */
+        scenario_data d;
+        d.count   = s.count;
+        d.message = (1 == s.count) ? make_message(0, s.size)
+                                   : make_messages(s.count, s.size);
+        for (size_t j = 0; j < sizeof paths / sizeof paths[0]; ++j) {
+            bench(pn, s.name, paths[j].name, paths[j].path, d, requests);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_MEMORY_CLIENT)
+#define INC_BENCH_MEMORY_CLIENT
+
+#include "Arduino.h"
+
+
+/** A #Client that "receives" data from memory, to measure the cost
+    of processing the data without any I/O. As reading from a
+    network stack has a per-call cost (locking, SPI transaction,
+    etc.), which is (much) bigger than that of a virtual function
+    call, it can be simulated by a busy-wait of `call_cost_ns`
+    on every read.
+ */
+class MemoryClient : public Client {
+public:
+    MemoryClient()
+        : d_data(0)
+        , d_len(0)
+        , d_pos(0)
+        , d_reads(0)
+    {
+    }
+
+    /** Makes the `data` of `len` octets the (whole) input */
+    void load(char const* data, size_t len)
+    {
+        d_data = data;
+        d_len  = len;
+        d_pos  = 0;
+    }
+
+    /** Number of read calls so far */
+    unsigned long reads() const { return d_reads; }
+
+    static unsigned long call_cost_ns;
+
+    /** Number of octets written (and discarded) by all the clients */
+    static unsigned long written;
+
+    int connect(const char*, uint16_t) { return 1; }
+    size_t write(uint8_t)
+    {
+        ++written;
+        return 1;
+    }
+    size_t write(const uint8_t*, size_t size)
+    {
+        written += size;
+        return size;
+    }
+    int  available() { return (int)(d_len - d_pos); }
+    int  read()
+    {
+        _call_cost();
+        return (d_pos < d_len) ? (uint8_t)d_data[d_pos++] : -1;
+    }
+    int read(uint8_t* buf, size_t size)
+    {
+        _call_cost();
+        if (size > d_len - d_pos) {
+            size = d_len - d_pos;
+        }
+        memcpy(buf, d_data + d_pos, size);
+        d_pos += size;
+        return (int)size;
+    }
+    int     peek() { return (d_pos < d_len) ? (uint8_t)d_data[d_pos] : -1; }
+    void    flush() {}
+    void    stop() { d_pos = d_len; }
+    uint8_t connected() { return d_pos < d_len; }
+    operator bool() { return true; }
+
+private:
+    void _call_cost()
+    {
+        ++d_reads;
+        if (call_cost_ns > 0) {
+            struct timespec t0, t;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            do {
+                clock_gettime(CLOCK_MONOTONIC, &t);
+            } while ((unsigned long)((t.tv_sec - t0.tv_sec) * 1000000000L
+                                     + t.tv_nsec - t0.tv_nsec)
+                     < call_cost_ns);
+        }
+    }
+
+    char const* d_data;
+    size_t      d_len;
+    size_t      d_pos;
+    unsigned long d_reads;
+};
+
+unsigned long MemoryClient::call_cost_ns;
+unsigned long MemoryClient::written;
+
+#endif /* !defined(INC_BENCH_MEMORY_CLIENT) */
@@ -0,0 +1,46 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_MESSAGES)
+#define INC_BENCH_MESSAGES
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+
+/** Monotonic time, in seconds */
+static inline double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Makes a JSON message number `seq` of (about) `size` octets, with
+    some spaces, to have some octets to %-encode */
+static inline std::string make_message(unsigned seq, unsigned size)
+{
+    char head[40];
+    snprintf(head, sizeof head, "{\"seq\":%u,\"text\":\"", seq);
+    std::string text(size > 24 ? size - 24 : 1, 'x');
+    for (size_t j = 7; j < text.size(); j += 11) {
+        text[j] = ' ';
+    }
+    return head + text + "\"}";
+}
+
+
+/** Makes a JSON array of `count` messages of (about) `size` octets */
+static inline std::string make_messages(unsigned count, unsigned size)
+{
+    std::string rslt("[");
+    for (unsigned i = 0; i < count; ++i) {
+        if (i > 0) {
+            rslt += ",";
+        }
+        rslt += make_message(i, size);
+    }
+    return rslt + "]";
+}
+
+#endif /* !defined(INC_BENCH_MESSAGES) */
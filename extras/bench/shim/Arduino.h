@@ -0,0 +1,40 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+/* Minimal Arduino core stand-in, just enough to build PubNubDefs.h
+   on a (POSIX) host, for benchmarking.
+ */
+#if !defined(INC_BENCH_ARDUINO)
+#define INC_BENCH_ARDUINO
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+
+inline unsigned long micros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+inline unsigned long millis() { return micros() / 1000; }
+
+inline void delayMicroseconds(unsigned long us)
+{
+    struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+    nanosleep(&ts, 0);
+}
+
+inline void delay(unsigned long ms) { delayMicroseconds(ms * 1000); }
+
+
+/* The time functions are used by Stream */
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "Client.h"
+
+#endif /* !defined(INC_BENCH_ARDUINO) */
@@ -0,0 +1,70 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_PRINT)
+#define INC_BENCH_PRINT
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size)
+    {
+        size_t n = 0;
+        while (size--) {
+            n += write(*buf++);
+        }
+        return n;
+    }
+    size_t write(const char* str)
+    {
+        return str ? write((const uint8_t*)str, strlen(str)) : 0;
+    }
+    size_t write(const char* buf, size_t size)
+    {
+        return write((const uint8_t*)buf, size);
+    }
+    virtual void flush() {}
+
+    size_t print(const __FlashStringHelper* s)
+    {
+        return print(reinterpret_cast<const char*>(s));
+    }
+    size_t print(const String& s) { return write(s.c_str(), s.length()); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned n, int base = DEC)
+    {
+        return print((unsigned long)n, base);
+    }
+    size_t print(long n, int base = DEC)
+    {
+        if ((DEC == base) && (n < 0)) {
+            return print('-') + print((unsigned long)-n, base);
+        }
+        return print((unsigned long)n, base);
+    }
+    size_t print(unsigned long n, int base = DEC)
+    {
+        char  buf[33];
+        char* p = buf + sizeof buf - 1;
+        *p      = '\0';
+        do {
+            int d = n % base;
+            *--p  = (d < 10) ? '0' + d : 'A' + d - 10;
+            n /= base;
+        } while (n);
+        return write(p);
+    }
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(T v) { return print(v) + println(); }
+};
+
+#endif /* !defined(INC_BENCH_PRINT) */
@@ -0,0 +1,53 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_STREAM)
+#define INC_BENCH_STREAM
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    Stream()
+        : d_timeout(1000)
+    {
+    }
+
+    virtual int available() = 0;
+    virtual int read()      = 0;
+    virtual int peek()      = 0;
+
+    void setTimeout(unsigned long timeout) { d_timeout = timeout; }
+
+    size_t readBytes(char* buf, size_t length)
+    {
+        size_t n = 0;
+        while (n < length) {
+            int c = _timed_read();
+            if (c < 0) {
+                break;
+            }
+            buf[n++] = (char)c;
+        }
+        return n;
+    }
+    size_t readBytes(uint8_t* buf, size_t length)
+    {
+        return readBytes((char*)buf, length);
+    }
+
+private:
+    int _timed_read()
+    {
+        unsigned long start = millis();
+        do {
+            int c = read();
+            if (c >= 0) {
+                return c;
+            }
+        } while (millis() - start < d_timeout);
+        return -1;
+    }
+
+    unsigned long d_timeout;
+};
+
+#endif /* !defined(INC_BENCH_STREAM) */
@@ -0,0 +1,48 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_WSTRING)
+#define INC_BENCH_WSTRING
+
+#include <string>
+
+class __FlashStringHelper;
+#define PSTR(s) (s)
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(PSTR(s)))
+
+/* Arduino `String`, on top of the standard one */
+class String : public std::string {
+public:
+    String() {}
+    String(const char* s)
+        : std::string(s ? s : "")
+    {
+    }
+    String(const std::string& s)
+        : std::string(s)
+    {
+    }
+    unsigned char concat(const String& s)
+    {
+        append(s);
+        return 1;
+    }
+    unsigned char concat(const char* s)
+    {
+        append(s);
+        return 1;
+    }
+    unsigned char concat(char c)
+    {
+        push_back(c);
+        return 1;
+    }
+    void         remove(unsigned idx) { erase(idx); }
+    void         remove(unsigned idx, unsigned n) { erase(idx, n); }
+    unsigned int length() const { return (unsigned)std::string::length(); }
+    bool         reserve(unsigned n)
+    {
+        std::string::reserve(n);
+        return true;
+    }
+};
+
+#endif /* !defined(INC_BENCH_WSTRING) */
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Reports the size (`.text`, `.data`, `.bss`) of a minimal program using
+# the library (size_sketch.cpp), for each of the compile-time feature
+# configurations, and the size of the `PubNub` object itself.
+#
+# This is built for the host, so the numbers are bigger than on a
+# board (especially on 8-bit AVR), but the differences between the
+# configurations show what each of the features costs.
+#
+# usage: size_report.sh [compiler flags...]
+
+CXX=${CXX:-c++}
+SIZE=${SIZE:-size}
+OUT=${TMPDIR:-/tmp}/pubnub_size_sketch.$$
+trap 'rm -f "$OUT"' EXIT
+
+printf "%-40s %8s %8s %8s %8s\n" configuration .text .data .bss sizeof
+for config in "" \
+              "-DPUBNUB_NO_TO_STR" \
+              "-DPUBNUB_STATS=1" \
+              "-DPUBNUB_NO_HISTORY" \
+              "-DPUBNUB_NO_SUBSCRIBE" \
+              "-DPUBNUB_PUBLISH_ONLY" \
+              "-DPUBNUB_PUBLISH_ONLY -DPUBNUB_NO_TO_STR"; do
+    $CXX -std=c++11 -Os -Ishim "$@" $config -o "$OUT" size_sketch.cpp || exit 1
+    sizes=$($SIZE "$OUT" | tail -1)
+    printf "%-40s %8s %8s %8s %8s\n" "${config:-(everything)}" \
+           $(echo $sizes | cut -d' ' -f1-3) \
+           $("$OUT" </dev/null | sed -n 's/^sizeof(PubNub) //p')
+done
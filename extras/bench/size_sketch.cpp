@@ -0,0 +1,53 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+/* A minimal "sketch" that uses (all of) what the configured
+   features provide, to see how big a program using the library is.
+   Built by `size_report.sh` once for each configuration.
+ */
+#include "memory_client.h"
+
+#define PubNub_BASE_CLIENT MemoryClient
+#include "../../PubNub.h"
+
+
+int main()
+{
+    PubNub.begin("demo", "demo");
+
+    PubNonSubClient* pclient = PubNub.publish("sensors", "{\"t\":21}");
+    if (pclient) {
+        PublishCracker cheez;
+        cheez.read_and_parse(pclient);
+#if !defined(PUBNUB_NO_TO_STR)
+        /* On the host, a "flash string" is a plain one */
+        puts(reinterpret_cast<char const*>(cheez.to_str(cheez.outcome())));
+#endif
+        pclient->stop();
+    }
+
+#if !defined(PUBNUB_NO_SUBSCRIBE)
+    PubSubClient* sclient = PubNub.subscribe("sensors");
+    if (sclient) {
+        SubscribeCracker ritz(sclient);
+        String           msg;
+        while (!ritz.finished() && (0 == ritz.get(msg))) {
+            puts(msg.c_str());
+        }
+        sclient->stop();
+    }
+#endif
+
+#if !defined(PUBNUB_NO_HISTORY)
+    PubNonSubClient* hclient = PubNub.history("sensors");
+    if (hclient) {
+        HistoryCracker smoki(hclient);
+        String         msg;
+        while (!smoki.finished() && (0 == smoki.get(msg))) {
+            puts(msg.c_str());
+        }
+        hclient->stop();
+    }
+#endif
+
+    printf("sizeof(PubNub) %lu\n", (unsigned long)sizeof PubNub);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_SOCKET_CLIENT)
+#define INC_BENCH_SOCKET_CLIENT
+
+#include "Arduino.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+
+/** A #Client on top of a (POSIX) TCP socket, which never blocks on
+    reading, like the clients of the Arduino network libraries. As
+    the library only knows of the HTTP (80) and TLS (443) ports, the
+    port to actually connect to can be set in `port_override`.
+ */
+class SocketClient : public Client {
+public:
+    SocketClient()
+        : d_fd(-1)
+    {
+    }
+
+    ~SocketClient() { stop(); }
+
+    static uint16_t port_override;
+
+    /** Counters of all the clients: read calls, octets read and
+        written and connections made */
+    static unsigned long reads;
+    static unsigned long bytes_in;
+    static unsigned long bytes_out;
+    static unsigned long connects;
+
+    int connect(const char* host, uint16_t port)
+    {
+        char service[8];
+        snprintf(service, sizeof service, "%u", port_override ? port_override : port);
+        struct addrinfo  hints = {};
+        struct addrinfo* ai;
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, service, &hints, &ai) != 0) {
+            return -2;
+        }
+        stop();
+        d_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if ((d_fd < 0) || (::connect(d_fd, ai->ai_addr, ai->ai_addrlen) != 0)) {
+            freeaddrinfo(ai);
+            stop();
+            return -1;
+        }
+        freeaddrinfo(ai);
+        int one = 1;
+        setsockopt(d_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        ++connects;
+        return 1;
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+
+    size_t write(const uint8_t* buf, size_t size)
+    {
+        size_t sent = 0;
+        while ((d_fd >= 0) && (sent < size)) {
+            ssize_t n = send(d_fd, buf + sent, size - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        bytes_out += sent;
+        return sent;
+    }
+
+    int available()
+    {
+        int n = 0;
+        if ((d_fd < 0) || (ioctl(d_fd, FIONREAD, &n) != 0)) {
+            return 0;
+        }
+        return n;
+    }
+
+    int read()
+    {
+        uint8_t c;
+        return (read(&c, 1) == 1) ? c : -1;
+    }
+
+    int read(uint8_t* buf, size_t size)
+    {
+        ++reads;
+        if (d_fd < 0) {
+            return -1;
+        }
+        ssize_t n = recv(d_fd, buf, size, MSG_DONTWAIT);
+        if (n <= 0) {
+            return -1;
+        }
+        bytes_in += n;
+        return (int)n;
+    }
+
+    int peek()
+    {
+        uint8_t c;
+        if ((d_fd < 0) || (recv(d_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 1)) {
+            return -1;
+        }
+        return c;
+    }
+
+    void flush() {}
+
+    void stop()
+    {
+        if (d_fd >= 0) {
+            close(d_fd);
+            d_fd = -1;
+        }
+    }
+
+    /** Like the Arduino clients, connected while there is data to
+        read, even if the peer has closed the connection */
+    uint8_t connected()
+    {
+        if (d_fd < 0) {
+            return 0;
+        }
+        uint8_t c;
+        ssize_t n = recv(d_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0) {
+            return 1;
+        }
+        return (n < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno));
+    }
+
+    operator bool() { return d_fd >= 0; }
+
+private:
+    int d_fd;
+};
+
+uint16_t      SocketClient::port_override;
+unsigned long SocketClient::reads;
+unsigned long SocketClient::bytes_in;
+unsigned long SocketClient::bytes_out;
+unsigned long SocketClient::connects;
+
+#endif /* !defined(INC_BENCH_SOCKET_CLIENT) */
@@ -0,0 +1,187 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#if !defined(INC_BENCH_STANDIN_SERVER)
+#define INC_BENCH_STANDIN_SERVER
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+/** A stand-in for the PubNub network, listening on the loopback
+    interface, which replies to publish, subscribe (v1 and v2) and
+    history requests with the (recorded) bodies it's been given.
+    Keep-alive is honored, each connection is served by a thread of
+    its own. To see how the library copes with a slow network, the
+    response can be "dribbled": sent a few octets at a time, with a
+    pause between them.
+ */
+class StandinServer {
+public:
+    /** The bodies to reply with and how to send them */
+    struct replies {
+        std::string publish;
+        std::string subscribe;
+        std::string subscribe_v2;
+        std::string history;
+        /** If not 0, send this many octets at a time... */
+        size_t dribble_octets;
+        /** ...with this many microseconds between them */
+        unsigned long dribble_us;
+    };
+
+    StandinServer()
+        : d_fd(socket(AF_INET, SOCK_STREAM, 0))
+        , d_port(0)
+    {
+        struct sockaddr_in addr = {};
+        socklen_t          len  = sizeof addr;
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        if ((bind(d_fd, (struct sockaddr*)&addr, sizeof addr) == 0)
+            && (listen(d_fd, 16) == 0)
+            && (getsockname(d_fd, (struct sockaddr*)&addr, &len) == 0)) {
+            d_port = ntohs(addr.sin_port);
+            std::thread(&StandinServer::_accept_loop, this).detach();
+        }
+    }
+
+    /** The port it listens on, 0 if it failed to start */
+    uint16_t port() const { return d_port; }
+
+    void set_replies(replies const& r)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_replies = r;
+    }
+
+private:
+    void _accept_loop()
+    {
+        for (;;) {
+            int fd = accept(d_fd, 0, 0);
+            if (fd < 0) {
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            std::thread(&StandinServer::_serve, this, fd).detach();
+        }
+    }
+
+    /** Serves the requests on the connection `fd`, until it's closed
+        (by either side) */
+    void _serve(int fd)
+    {
+        std::string in;
+        for (;;) {
+            size_t head_end;
+            while ((head_end = in.find("\r\n\r\n")) == std::string::npos) {
+                if (!_receive(fd, in)) {
+                    close(fd);
+                    return;
+                }
+            }
+            head_end += 4;
+            size_t body_len = 0;
+            size_t cl       = in.find("Content-Length: ");
+            if ((cl != std::string::npos) && (cl < head_end)) {
+                body_len = strtoul(in.c_str() + cl + 16, 0, 10);
+            }
+            while (in.size() < head_end + body_len) {
+                if (!_receive(fd, in)) {
+                    close(fd);
+                    return;
+                }
+            }
+            std::string head(in, 0, head_end);
+            in.erase(0, head_end + body_len);
+
+            bool const close_after = head.find("Connection: close") != std::string::npos;
+            if (!_reply(fd, head, close_after) || close_after) {
+                close(fd);
+                return;
+            }
+        }
+    }
+
+    static bool _receive(int fd, std::string& in)
+    {
+        char    buf[4096];
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0) {
+            return false;
+        }
+        in.append(buf, n);
+        return true;
+    }
+
+    bool _reply(int fd, std::string const& head, bool close_after)
+    {
+        replies r;
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            r = d_replies;
+        }
+        std::string const* body;
+        /* The path is after the method (GET or POST) */
+        std::string const path(head, head.find(' ') + 1, 16);
+        if (path.compare(0, 9, "/publish/") == 0) {
+            body = &r.publish;
+        }
+        else if (path.compare(0, 14, "/v2/subscribe/") == 0) {
+            body = &r.subscribe_v2;
+        }
+        else if (path.compare(0, 11, "/subscribe/") == 0) {
+            body = &r.subscribe;
+        }
+        else if (path.compare(0, 9, "/history/") == 0) {
+            body = &r.history;
+        }
+        else {
+            return _send(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n", r);
+        }
+        char length[24];
+        snprintf(length, sizeof length, "%lu", (unsigned long)body->size());
+        std::string out("HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/javascript; charset=\"UTF-8\"\r\n"
+                        "Content-Length: ");
+        out += length;
+        out += close_after ? "\r\nConnection: close\r\n\r\n"
+                           : "\r\nConnection: keep-alive\r\n\r\n";
+        out += *body;
+        return _send(fd, out, r);
+    }
+
+    static bool _send(int fd, std::string const& out, replies const& r)
+    {
+        size_t const piece = r.dribble_octets ? r.dribble_octets : out.size();
+        for (size_t pos = 0; pos < out.size(); pos += piece) {
+            size_t const end = std::min(pos + piece, out.size());
+            for (size_t sent = pos; sent < end;) {
+                ssize_t n = send(fd, out.data() + sent, end - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return false;
+                }
+                sent += n;
+            }
+            if (r.dribble_octets && (r.dribble_us > 0)) {
+                usleep(r.dribble_us);
+            }
+        }
+        return true;
+    }
+
+    int        d_fd;
+    uint16_t   d_port;
+    std::mutex d_mutex;
+    replies    d_replies;
+};
+
+#endif /* !defined(INC_BENCH_STANDIN_SERVER) */
@@ -2,6 +2,10 @@
 #include <ArduinoUnitTests.h>
 #include "../test_stubs/Ethernet.h"
 #define PUBNUB_UNIT_TEST
+/* The statistics are off by default, test them, unless told not to */
+#if !defined(PUBNUB_STATS)
+#define PUBNUB_STATS 1
+#endif
 #if defined(__CYGWIN__)
 #define PUBNUB_DEFINE_STRSPN_AND_STRNCASECMP
 #endif
@@ -230,5 +234,1951 @@ unittest(PubNub_history)
     client->stop();
 }
 
+unittest(PubNub_publish_keep_alive)
+{
+    PubNub PubNubObject;
+    String request("GET /publish/jet/airliner/0/flight/0/%22gear%20down%22"
+                   "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: keep-alive\r\n"
+                   "\r\n");
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Date: Tue, 02 Apr 2019 02:30:30 GMT\r\n"
+                    "Content-Type: text/javascript; charset=\"UTF-8\"\r\n"
+                    "Content-Length: 30\r\n"
+                    "\r\n"
+                    "[1,\"Sent\",\"15541724007473323\"]");
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+
+    auto client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(1, client->mGodmodeConnects);
+
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    assertEqual("15541724007473323", cheez.timestamp());
+    /* Body is read to its end, the user sees "end of response" */
+    assertEqual(0, client->available());
+    assertFalse(client->connected());
+    client->stop();
+
+    /* Same connection is reused for the next publish */
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473324\"]");
+    client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(1, client->mGodmodeConnects);
+    /* Unread body is read away on stop() */
+    client->stop();
+    assertEqual(0, response.length());
+    assertTrue(client->mGodmodeConnected);
+
+    /* Server tells it will close the connection after this response */
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473325\"]");
+    client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(1, client->mGodmodeConnects);
+    client->stop();
+    assertFalse(client->mGodmodeConnected);
+
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473326\"]");
+    client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(2, client->mGodmodeConnects);
+    cheez = PublishCracker();
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    assertEqual("15541724007473326", cheez.timestamp());
+    client->stop();
+
+    /* Server closes the idle connection */
+    client->mGodmodeConnected = false;
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473327\"]");
+    client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(3, client->mGodmodeConnects);
+    cheez = PublishCracker();
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    assertEqual("15541724007473327", cheez.timestamp());
+    client->stop();
+}
+
+unittest(PubNub_stop_does_not_wait_for_the_rest_of_the_body)
+{
+    String msg;
+    PubNub PubNubObject;
+    String pub_response("HTTP/1.1 200 OK\r\n"
+                        "Content-Length: 30\r\n"
+                        "\r\n"
+                        "[1,\"Sent\"");
+    String sub_response("HTTP/1.1 200 OK\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "[[\"climb\"]");
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &pub_response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &sub_response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+
+    /* The rest of a kept-alive body is read away by poll() */
+    auto client = PubNubObject.publish("flight", "\"gear down\"");
+    assertTrue(client != 0);
+    unsigned long t_stop = millis();
+    client->stop();
+    assertTrue(millis() - t_stop < 10);
+    assertTrue(client->mGodmodeConnected);
+    pub_response += ",\"155417240";
+    PubNubObject.poll();
+    assertEqual(0, pub_response.length());
+    pub_response += "07473323\"]";
+    PubNubObject.poll();
+    assertEqual(0, pub_response.length());
+
+    pub_response = String("HTTP/1.1 200 OK\r\n"
+                          "Content-Length: 30\r\n"
+                          "\r\n"
+                          "[1,\"Sent\"");
+    client = PubNubObject.publish("flight", "\"gear down\"");
+    assertEqual(1, client->mGodmodeConnects);
+
+    /* If it hasn't arrived by the next request, it is not waited
+     * for, the connection is closed and a new one made */
+    client->stop();
+    t_stop = millis();
+    assertTrue(PubNubObject.start_publish("flight", "\"gear up\""));
+    assertTrue(millis() - t_stop < 10);
+    assertEqual(2, client->mGodmodeConnects);
+    pub_response = String("HTTP/1.1 200 OK\r\n"
+                          "Content-Length: 30\r\n"
+                          "\r\n"
+                          "[1,\"Sent\",\"15541724007473324\"]");
+    PubNubObject.poll();
+    assertEqual(PubNub::async_done, PubNubObject.publish_state());
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(PubNubObject.publish_response()));
+    assertEqual("15541724007473324", cheez.timestamp());
+    client->stop();
+
+    /* The timetoken that arrives after stop() is caught by poll() */
+    auto subclient = PubNubObject.subscribe("flight");
+    assertTrue(subclient != 0);
+    SubscribeCracker ritz(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"climb\"", msg.c_str());
+    t_stop = millis();
+    subclient->stop();
+    assertTrue(millis() - t_stop < 10);
+    assertTrue(subclient->mGodmodeConnected);
+    sub_response += ",\"15541420302549923\",\"flight\"]";
+    PubNubObject.poll();
+    assertEqual("15541420302549923", subclient->server_timetoken());
+    assertFalse(subclient->mGodmodeConnected);
+
+    /* If it hasn't arrived by the next subscribe, it is lost and
+     * the previous timetoken is used */
+    sub_response = String("HTTP/1.1 200 OK\r\n"
+                          "Connection: close\r\n"
+                          "\r\n"
+                          "[[\"taxi\"]");
+    subclient = PubNubObject.subscribe("flight");
+    ritz      = SubscribeCracker(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"taxi\"", msg.c_str());
+    subclient->stop();
+    t_stop = millis();
+    assertTrue(PubNubObject.start_subscribe("flight"));
+    assertTrue(millis() - t_stop < 10);
+    assertEqual(3, subclient->mGodmodeConnects);
+    assertEqual(String("GET /subscribe/airliner/flight/0/15541420302549923"
+                       "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: close\r\n"
+                       "\r\n"),
+                subclient->getOuttaHere());
+}
+
+unittest(PubNub_history_keep_alive)
+{
+    String msg;
+    PubNub PubNubObject;
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Content-Length: 18\r\n"
+                    "\r\n"
+                    "[\"radio\",\"vacuum\"]");
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+    PubNubObject.set_keep_alive(true);
+
+    for (int i = 0; i < 3; ++i) {
+        auto client = PubNubObject.history("retro", 2);
+        assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+        assertEqual(1, client->mGodmodeConnects);
+
+        HistoryCracker smoki(client);
+        assertEqual(0, smoki.get(msg));
+        assertEqual("\"radio\"", msg.c_str());
+        assertEqual(0, smoki.get(msg));
+        assertEqual("\"vacuum\"", msg.c_str());
+        assertEqual(0, smoki.get(msg));
+        assertTrue(smoki.finished());
+        client->stop();
+
+        response = String("HTTP/1.1 200 OK\r\n"
+                          "Content-Length: 18\r\n"
+                          "\r\n"
+                          "[\"radio\",\"vacuum\"]");
+    }
+}
+
+
+static int                    async_calls;
+static PubNub::async_operation async_last_op;
+
+static void on_async_done(PubNub::async_operation op, PubNub::async_state state)
+{
+    ++async_calls;
+    async_last_op = op;
+}
+
+unittest(PubNub_async_publish_and_subscribe)
+{
+    String msg;
+    PubNub PubNubObject;
+    String pub_response;
+    String sub_response;
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &pub_response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &sub_response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_async_callback(on_async_done);
+    async_calls = 0;
+
+    assertEqual(PubNub::async_idle, PubNubObject.subscribe_state());
+    assertTrue(PubNubObject.start_subscribe("flight"));
+    assertTrue(PubNubObject.start_publish("flight", "wheels"));
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+    assertEqual(PubNub::async_in_progress, PubNubObject.publish_state());
+
+    /* Nothing has arrived yet */
+    PubNubObject.poll();
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+    assertEqual(PubNub::async_in_progress, PubNubObject.publish_state());
+    assertEqual(0, async_calls);
+    assertTrue(0 == PubNubObject.publish_response());
+
+    /* Response heads arrive in pieces */
+    sub_response += "HTTP/1.1 200 OK\r\nContent-Le";
+    pub_response += "HTTP/1.1 200 OK\r\nContent-Length: 30\r";
+    PubNubObject.poll();
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+    assertEqual(PubNub::async_in_progress, PubNubObject.publish_state());
+
+    pub_response += "\n\r\n[1,\"Sent\",\"15541724007473323\"]";
+    PubNubObject.poll();
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+    assertEqual(PubNub::async_done, PubNubObject.publish_state());
+    assertEqual(1, async_calls);
+    assertEqual(PubNub::async_publish, async_last_op);
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(PubNubObject.publish_response()));
+    assertEqual("15541724007473323", cheez.timestamp());
+    PubNubObject.publish_response()->stop();
+
+    sub_response += "ngth: 30\r\nConnection: close\r\n\r\n";
+    PubNubObject.poll();
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+    sub_response += "[[\"wheels\"],\"15541420302549923\"]";
+    PubNubObject.poll();
+    assertEqual(PubNub::async_done, PubNubObject.subscribe_state());
+    assertEqual(2, async_calls);
+    assertEqual(PubNub::async_subscribe, async_last_op);
+
+    SubscribeCracker ritz(PubNubObject.subscribe_response());
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"wheels\"", msg.c_str());
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual("15541420302549923", PubNubObject.subscribe_response()->server_timetoken());
+    PubNubObject.subscribe_response()->stop();
+}
+
+unittest(PubNub_async_timeout)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+
+    assertTrue(PubNubObject.start_history("retro", 10, 1));
+    PubNubObject.poll();
+    assertEqual(PubNub::async_in_progress, PubNubObject.history_state());
+    response += "HTTP/1.1 200 OK\r\n";
+    ::delay(1100);
+    PubNubObject.poll();
+    assertEqual(PubNub::async_timeout, PubNubObject.history_state());
+    assertTrue(0 == PubNubObject.history_response());
+    assertFalse(PubNubObject.historyClient().mGodmodeConnected);
+}
+
+
+/* Deterministic pseudo-random numbers for the "fuzz" tests */
+static unsigned long fuzz_state = 1;
+
+static unsigned fuzz_rand(unsigned n)
+{
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 17;
+    fuzz_state ^= fuzz_state << 5;
+    return (unsigned)((fuzz_state & 0xFFFFFFFFUL) % n);
+}
+
+/* Encodes the `body` as "chunked", with random chunk sizes, hex
+   digit case, chunk extensions and trailer. */
+static String chunked_body(String const& body)
+{
+    String rslt;
+    unsigned pos = 0;
+    while (pos < body.length()) {
+        unsigned size = 1 + fuzz_rand(body.length() - pos);
+        if (fuzz_rand(2)) {
+            size = 1 + fuzz_rand(size);
+        }
+        char size_line[32];
+        snprintf(size_line, sizeof size_line, fuzz_rand(2) ? "%x" : "%X", size);
+        rslt += size_line;
+        if (0 == fuzz_rand(5)) {
+            rslt += ";ext=\"x\"";
+        }
+        rslt += "\r\n";
+        rslt += body.substring(pos, pos + size);
+        rslt += "\r\n";
+        pos += size;
+    }
+    rslt += "0\r\n";
+    if (0 == fuzz_rand(4)) {
+        rslt += "Expires: never\r\n";
+    }
+    rslt += "\r\n";
+    return rslt;
+}
+
+static String history_page(String const& body)
+{
+    return String("HTTP/1.1 200 OK\r\n"
+                  "Content-Length: ")
+           + String((unsigned)body.length())
+           + String("\r\n"
+                    "\r\n")
+           + body;
+}
+
+static String history_v2_request(String const& query)
+{
+    return String("GET /v2/history/sub-key/date/channel/retro?count=2")
+           + query
+           + String("&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                    "Host: pubsub.pubnub.com\r\n"
+                    "User-Agent: PubNub-Arduino/1.0\r\n"
+                    "Connection: keep-alive\r\n"
+                    "\r\n");
+}
+
+unittest(PubNub_history_v2_pages_through_messages)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+    PubNubObject.set_keep_alive(true);
+
+    /* Forward, from the oldest, up to the end of the range */
+    response = history_page("[[{\"message\":\"one\",\"timetoken\":101},"
+                            "{\"message\":{\"n\":2},\"timetoken\":102}],101,102]")
+               + history_page("[[{\"message\":3,\"timetoken\":103},"
+                              "{\"message\":4,\"timetoken\":104}],103,104]");
+    PubNubHistoryPager pager(PubNubObject, "retro", 2);
+    pager.set_range(100, 103);
+    pager.set_reverse(true);
+    char msg[16];
+    assertEqual(1, pager.next(msg, sizeof msg));
+    assertEqual("\"one\"", msg);
+    assertEqual(101ULL, pager.timetoken());
+    assertEqual(1, pager.next(msg, sizeof msg));
+    assertEqual("{\"n\":2}", msg);
+    assertEqual(102ULL, pager.timetoken());
+    assertEqual(1, pager.next(msg, sizeof msg));
+    assertEqual("3", msg);
+    assertEqual(103ULL, pager.timetoken());
+    assertEqual(0, pager.next(msg, sizeof msg));
+    assertEqual(0, strlen(msg));
+    assertEqual(0, pager.next(msg, sizeof msg));
+    assertEqual(2, pager.pages());
+    assertEqual(3, pager.messages());
+    /* Only the (last) request of the next page is left to see */
+    assertEqual(history_v2_request("&start=102&reverse=true&include_token=true"),
+                PubNubObject.historyClient().getOuttaHere());
+    assertEqual(1, PubNubObject.historyClient().mGodmodeConnects);
+
+    /* Back, from the newest, until a page is not full. The range
+       means the same as forward: newer than 203, not newer than 206 */
+    response = history_page("[[{\"message\":5,\"timetoken\":205},"
+                            "{\"message\":6,\"timetoken\":206}],205,206]")
+               + history_page("[[{\"message\":4,\"timetoken\":204}],204,204]");
+    PubNubHistoryPager back(PubNubObject, "retro", 2);
+    back.set_range(203, 206);
+    assertEqual(1, back.next(msg, sizeof msg));
+    assertEqual("5", msg);
+    assertEqual(history_v2_request("&start=207&end=204&include_token=true"),
+                PubNubObject.historyClient().getOuttaHere());
+    assertEqual(1, back.next(msg, sizeof msg));
+    assertEqual("6", msg);
+    assertEqual(1, back.next(msg, sizeof msg));
+    assertEqual("4", msg);
+    assertEqual(0, back.next(msg, sizeof msg));
+    assertEqual(history_v2_request("&start=205&end=204&include_token=true"),
+                PubNubObject.historyClient().getOuttaHere());
+
+    /* Only the end of the range (the newest message) */
+    response = history_page("[[{\"message\":1,\"timetoken\":150}],150,150]");
+    PubNubHistoryPager upto(PubNubObject, "retro", 2);
+    upto.set_range(0, 150);
+    assertEqual(1, upto.next(msg, sizeof msg));
+    assertEqual(history_v2_request("&start=151&include_token=true"),
+                PubNubObject.historyClient().getOuttaHere());
+    assertEqual(0, upto.next(msg, sizeof msg));
+
+    /* A failed page is requested again, after the last message got */
+    response = history_page("[[{\"message\":1,\"timetoken\":301},"
+                            "{\"message\":2,\"time");
+    PubNubHistoryPager retry(PubNubObject, "retro", 2);
+    retry.set_range(300, 0);
+    retry.set_reverse(true);
+    assertEqual(1, retry.next(msg, sizeof msg));
+    assertEqual("1", msg);
+    assertEqual(-1, retry.next(msg, sizeof msg));
+    response = history_page("[[{\"message\":2,\"timetoken\":302}],302,302]");
+    assertEqual(1, retry.next(msg, sizeof msg));
+    assertEqual("2", msg);
+    assertEqual(0, retry.next(msg, sizeof msg));
+    assertEqual(history_v2_request("&start=301&reverse=true&include_token=true"),
+                PubNubObject.historyClient().getOuttaHere());
+
+    /* A count above the 100 PubNub gives is taken as 100, so a full
+       page of 100 is not the last */
+    String full("[[");
+    for (int i = 0; i < 100; ++i) {
+        full += String("{\"message\":") + String(i) + String(",\"timetoken\":")
+                + String(400 + i) + String("},");
+    }
+    full.remove(full.length() - 1);
+    response = history_page(full + String("],400,499]"))
+               + history_page("[[{\"message\":100,\"timetoken\":500}],500,500]");
+    PubNubHistoryPager many(PubNubObject, "retro", 200);
+    many.set_range(399, 0);
+    many.set_reverse(true);
+    int got = 0;
+    while (many.next(msg, sizeof msg) > 0) {
+        ++got;
+    }
+    assertEqual(101, got);
+    assertEqual(500ULL, many.timetoken());
+    assertEqual(2, many.pages());
+    assertEqual(String("GET /v2/history/sub-key/date/channel/retro?count=100"
+                       "&start=499&reverse=true&include_token=true"
+                       "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n"),
+                PubNubObject.historyClient().getOuttaHere());
+}
+
+unittest(PubNub_message_counts_and_fetch_messages)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+    PubNubObject.set_keep_alive(true);
+    PubNubObject.set_auth("palm-trees");
+
+    response = history_page("{\"status\":200,\"error\":false,\"error_message\":\"\","
+                            "\"channels\":{\"door\":1,\"lamp\":0}}");
+    auto client = PubNubObject.message_counts("door,lamp", 15541191365593405ULL);
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+    assertEqual(String("GET /v3/history/sub-key/date/message-counts/door,lamp"
+                       "?timetoken=15541191365593405&auth=palm-trees"
+                       "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n"),
+                client->getOuttaHere());
+    MessageCountsCracker counts(client);
+    String changed;
+    while ((0 == counts.get()) && !counts.finished()) {
+        if (counts.count() > 0) {
+            changed = String(counts.channel());
+        }
+    }
+    assertEqual("door", changed.c_str());
+    client->stop();
+
+    /* Only the channels with new messages are fetched */
+    response = history_page("{\"status\":200,\"error\":false,\"error_message\":\"\","
+                            "\"channels\":{\"door\":[{\"message\":\"open\","
+                            "\"timetoken\":\"15541191365593406\"}]}}");
+    PubNubHistoryOptions options;
+    options.end = 15541191365593405ULL;
+    client = PubNubObject.fetch_messages(changed.c_str(), 25, options);
+    assertEqual(String("GET /v3/history/sub-key/date/channel/door"
+                       "?max=25&end=15541191365593405&auth=palm-trees"
+                       "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n"),
+                client->getOuttaHere());
+    FetchMessagesCracker fritz(client);
+    String msg;
+    assertEqual(0, fritz.get(msg));
+    assertEqual("\"open\"", msg.c_str());
+    assertEqual("door", fritz.channel());
+    assertEqual(15541191365593406ULL, fritz.timetoken());
+    assertEqual(0, fritz.get(msg));
+    assertTrue(fritz.finished());
+    client->stop();
+    assertEqual(1, client->mGodmodeConnects);
+}
+
+unittest(PubNub_history_chunked_fuzz)
+{
+    String msg;
+    PubNub PubNubObject;
+    String body("[{\"rocket\":\"Saturn V\",\"mission\":\"Apolo 11\"},\"The Eagle has landed\",\"1969\"]");
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+    PubNubObject.set_keep_alive(true);
+
+    for (int i = 0; i < 200; ++i) {
+        /* Whatever is left of the previous response is drained
+           before the next request */
+        response += String("HTTP/1.1 200 OK\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "\r\n")
+                    + chunked_body(body);
+        auto client = PubNubObject.history("retro");
+        assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+        /* Chunked responses can be kept alive, too */
+        assertEqual(1, client->mGodmodeConnects);
+
+        HistoryCracker smoki(client);
+        assertEqual(0, smoki.get(msg));
+        assertEqual("{\"rocket\":\"Saturn V\",\"mission\":\"Apolo 11\"}", msg.c_str());
+        assertEqual(0, smoki.get(msg));
+        assertEqual("\"The Eagle has landed\"", msg.c_str());
+        assertEqual(0, smoki.get(msg));
+        assertEqual("\"1969\"", msg.c_str());
+        assertEqual(0, smoki.get(msg));
+        assertEqual(0, msg.length());
+        assertTrue(smoki.finished());
+        if (i % 2) {
+            /* Only the chunk framing may be left, stop() reads it */
+            client->stop();
+            assertEqual(0, response.length());
+        }
+    }
+}
+
+unittest(PubNub_subscribe_chunked_fuzz)
+{
+    String msg;
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    for (int i = 0; i < 200; ++i) {
+        char timetoken[20];
+        snprintf(timetoken, sizeof timetoken, "155414203025%05d", i);
+        response = String("HTTP/1.1 200 OK\r\n"
+                          "Transfer-Encoding: chunked\r\n"
+                          "Connection: close\r\n"
+                          "\r\n")
+                   + chunked_body(String("[[{\"text\":\"hello, world\"},[1,2]],\"")
+                                  + timetoken + "\"]");
+        auto subclient = PubNubObject.subscribe("flight");
+        assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+
+        SubscribeCracker ritz(subclient);
+        assertEqual(0, ritz.get(msg));
+        assertEqual("{\"text\":\"hello, world\"}", msg.c_str());
+        assertEqual(0, ritz.get(msg));
+        assertEqual("[1,2]", msg.c_str());
+        assertEqual(0, ritz.get(msg));
+        assertEqual(0, msg.length());
+        assertTrue(ritz.finished());
+        subclient->stop();
+        assertEqual(timetoken, subclient->server_timetoken());
+    }
+}
+
+unittest(PubNub_publish_chunked_arrives_in_pieces)
+{
+    PubNub PubNubObject;
+    String body("[1,\"Sent\",\"15541724007473323\"]");
+    String input;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &input;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    for (int i = 0; i < 200; ++i) {
+        response = String("HTTP/1.1 200 OK\r\n"
+                          "Transfer-Encoding: chunked\r\n"
+                          "\r\n")
+                   + chunked_body(body);
+        assertTrue(PubNubObject.start_publish("flight", "wheels"));
+
+        /* Array read directly into the user buffer, whatever has
+           arrived, with the framing split at random places. */
+        String read_body;
+        PubNonSubClient* client = 0;
+        while (response.length() > 0) {
+            unsigned piece = 1 + fuzz_rand(response.length() < 8 ? response.length() : 8);
+            input += response.substring(0, piece);
+            response.remove(0, piece);
+            PubNubObject.poll();
+            client = PubNubObject.publish_response();
+            if (client != 0) {
+                uint8_t buf[5];
+                int len;
+                while ((len = client->read(buf, sizeof buf)) > 0) {
+                    read_body += String(std::string((char*)buf, len));
+                }
+            }
+        }
+        assertTrue(client != 0);
+        assertEqual(body, read_body);
+        assertEqual(0, client->available());
+        assertFalse(client->connected());
+        client->stop();
+    }
+}
+
+
+unittest(PubNub_chunk_size_too_big_is_a_framing_error)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.historyClient().mGodmodeDataIn = &response;
+    PubNubObject.historyClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("book", "date"));
+    PubNubObject.set_keep_alive(true);
+
+    /* Would wrap around to a small size */
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "\r\n"
+                      "100000000000000000000000000000002\r\n"
+                      "[]\r\n"
+                      "0\r\n"
+                      "\r\n");
+    auto client = PubNubObject.history("retro");
+    assertTrue(client != 0);
+    uint8_t buf[8];
+    assertEqual(-1, client->read(buf, sizeof buf));
+    assertFalse(client->connected());
+    client->stop();
+    assertFalse(client->mGodmodeConnected);
+
+    /* Octets that are not ASCII are not hex digits */
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "\r\n"
+                      "2\xe9\r\n"
+                      "[]\r\n"
+                      "0\r\n"
+                      "\r\n");
+    client = PubNubObject.history("retro");
+    assertEqual(2, client->read(buf, sizeof buf));
+    assertEqual('[', buf[0]);
+    client->stop();
+}
+
+unittest(PubNub_subscribe_many_messages)
+{
+    String msg;
+    PubNub PubNubObject;
+    String body("[[");
+    for (int i = 0; i < 50; ++i) {
+        char message[64];
+        snprintf(message, sizeof message, "%s{\"seq\":%d,\"text\":\"reading, \\\"%d\\\"\"}", i ? "," : "", i, i);
+        body += message;
+    }
+    body += "],\"15541420302549923\"]";
+    String response(String("HTTP/1.1 200 OK\r\n"
+                           "Connection: close\r\n"
+                           "\r\n")
+                    + body);
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    /* The response is much bigger than the cracker buffer, so
+       messages and the timetoken are split across array reads */
+    auto subclient = PubNubObject.subscribe("flight");
+    SubscribeCracker ritz(subclient);
+    for (int i = 0; i < 50; ++i) {
+        char message[64];
+        snprintf(message, sizeof message, "{\"seq\":%d,\"text\":\"reading, \\\"%d\\\"\"}", i, i);
+        assertEqual(0, ritz.get(msg));
+        assertEqual(message, msg.c_str());
+    }
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual("15541420302549923", subclient->server_timetoken());
+    subclient->stop();
+}
+
+
+unittest(PubNub_request_written_in_few_segments)
+{
+    PubNub PubNubObject;
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Content-Length: 30\r\n"
+                    "\r\n"
+                    "[1,\"Sent\",\"15541724007473323\"]");
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    /* Lots of characters to %-escape */
+    auto client = PubNubObject.publish("flight", "{\"a b\": \"c d\"}");
+    String request(client->getOuttaHere());
+    if (request.length() <= PUBNUB_REQUEST_BUFFER_SIZE) {
+        assertEqual(1, client->mGodmodeWrites.size());
+        assertEqual(request.length(), client->mGodmodeWrites[0]);
+    }
+    client->stop();
+
+    /* Request bigger than the buffer is written in full buffers */
+    String message;
+    for (int i = 0; i < PUBNUB_REQUEST_BUFFER_SIZE; ++i) {
+        message.concat("%");
+    }
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473323\"]");
+    client = PubNubObject.publish("flight", message.c_str());
+    request = client->getOuttaHere();
+    size_t segments = (request.length() + PUBNUB_REQUEST_BUFFER_SIZE - 1) / PUBNUB_REQUEST_BUFFER_SIZE;
+    assertEqual(segments, client->mGodmodeWrites.size());
+    for (size_t i = 0; i + 1 < segments; ++i) {
+        assertEqual(PUBNUB_REQUEST_BUFFER_SIZE, client->mGodmodeWrites[i]);
+    }
+    client->stop();
+}
+
+
+unittest(PubNubUrlEncoder_encodes_all_octets)
+{
+    static char const left_as_is[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.~"
+        ",=:;@[]";
+    char   out[4];
+    char   expected[4];
+    size_t written;
+    for (int c = 0; c < 256; ++c) {
+        char const s[] = { (char)c, '\0' };
+        bool const as_is = (c != 0) && (strchr(left_as_is, c) != 0);
+        if (as_is) {
+            expected[0] = c;
+            expected[1] = '\0';
+        }
+        else {
+            snprintf(expected, sizeof expected, "%%%02X", c);
+        }
+        assertEqual(as_is, PubNubUrlEncoder::unreserved(c));
+        assertEqual(1, PubNubUrlEncoder::encode(s, 1, out, sizeof out - 1, written));
+        out[written] = '\0';
+        assertEqual(String(expected), String(out));
+    }
+
+    /* Runs of letters and digits (which may be encoded a word at a
+       time) mixed with other octets, at every offset and encoded
+       into every (small) size of output */
+    String message("abcdWXYZ0123{\"k\":\"v w\"}\xc3\xa9t\xc3\xa9@[Az09]");
+    String whole;
+    for (unsigned i = 0; i < message.length(); ++i) {
+        char const s[] = { message[i], '\0' };
+        PubNubUrlEncoder::encode(s, 1, out, sizeof out - 1, written);
+        out[written] = '\0';
+        whole.concat(out);
+    }
+    for (unsigned offset = 0; offset < 8; ++offset) {
+        for (size_t size = 3; size < 12; ++size) {
+            char const* s   = message.c_str() + offset;
+            size_t      len = message.length() - offset;
+            String      encoded;
+            while (len > 0) {
+                char   buf[13];
+                size_t n = PubNubUrlEncoder::encode(s, len, buf, size, written);
+                assertTrue(n > 0);
+                assertTrue(written <= size);
+                buf[written] = '\0';
+                encoded.concat(buf);
+                s += n;
+                len -= n;
+            }
+            String const tail = whole.substring(whole.length() - encoded.length());
+            assertEqual(tail, encoded);
+        }
+    }
+    assertEqual(String("abcdWXYZ0123%7B%22k%22:%22v%20w%22%7D%C3%A9t%C3%A9@[Az09]"), whole);
+}
+
+
+unittest(PubNub_publish_post)
+{
+    PubNub PubNubObject;
+    String request("POST /publish/jet/airliner/0/flight/0"
+                   "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: 22\r\n"
+                   "Connection: close\r\n"
+                   "\r\n"
+                   "{\"cargo\": \"100% mail\"}");
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Content-Length: 30\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "[1,\"Sent\",\"15541724007473323\"]");
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    /* The message is not %-encoded */
+    auto client = PubNubObject.publish_post("flight", "{\"cargo\": \"100% mail\"}");
+    assertTrue(0 != client);
+    assertEqual(request, client->getOuttaHere());
+    if (request.length() <= PUBNUB_REQUEST_BUFFER_SIZE) {
+        assertEqual(1, client->mGodmodeWrites.size());
+    }
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    client->stop();
+
+    /* A message from a stream, bigger than the request buffer */
+    String message("[");
+    while (message.length() < PUBNUB_REQUEST_BUFFER_SIZE * 5 / 2) {
+        message.concat("1024,");
+    }
+    message.concat("0]");
+    /* Any Stream will do, the stub Client is a simple one */
+    Client sensors;
+    sensors.mGodmodeDataIn = &message;
+    size_t length          = message.length();
+    request = String("POST /publish/jet/airliner/0/flight/0"
+                     "?auth=atlantic"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: ")
+              + String(length) + "\r\nConnection: close\r\n\r\n" + message;
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473324\"]");
+    PubNubObject.set_auth("atlantic");
+    client = PubNubObject.publish_post("flight", sensors, length);
+    assertTrue(0 != client);
+    assertEqual(request, client->getOuttaHere());
+    assertEqual(0, sensors.available());
+    cheez = PublishCracker();
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    assertEqual("15541724007473324", cheez.timestamp());
+    client->stop();
+
+    /* The stream runs dry before the promised length */
+    message = String("[1,2,3]");
+    assertTrue(0 == PubNubObject.publish_post("flight", sensors, 100));
+    assertEqual(PubNub::async_error, PubNubObject.publish_state());
+}
+
+
+/* The body of the (last) request written to the `client` */
+static String request_body(PubNonSubClient* client)
+{
+    String request(client->getOuttaHere());
+    int    head_end = request.indexOf(String("\r\n\r\n"));
+    return (head_end < 0) ? String() : request.substring(head_end + 4);
+}
+
+static String const publish_sent("HTTP/1.1 200 OK\r\n"
+                                 "Content-Length: 30\r\n"
+                                 "\r\n"
+                                 "[1,\"Sent\",\"15541724007473323\"]");
+
+unittest(PubNub_publish_batcher)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+    PubNonSubClient* client = &PubNubObject.publishClient();
+
+    PublishBatcher batch(PubNubObject, "sensors");
+
+    /* Flush on count, messages in the order they were added */
+    batch.set_flush_count(3);
+    response = publish_sent;
+    assertTrue(batch.add("1"));
+    assertTrue(batch.add("{\"t\":2}"));
+    assertEqual(2, batch.count());
+    assertEqual(0, batch.requests());
+    assertTrue(batch.add("\"three\""));
+    assertEqual(0, batch.count());
+    assertEqual(String("[1,{\"t\":2},\"three\"]"), request_body(client));
+    assertEqual(1, batch.requests());
+    assertEqual(3, batch.messages());
+    assertEqual(3, batch.last_batch());
+
+    /* Flush on size */
+    batch.set_flush_count(0);
+    batch.set_flush_size(10);
+    response = publish_sent;
+    assertTrue(batch.add("1234"));
+    assertEqual(6, batch.size());
+    assertTrue(batch.add("5678"));
+    assertEqual(String("[1234,5678]"), request_body(client));
+    assertEqual(2, batch.requests());
+    assertEqual(2, batch.last_batch());
+    assertEqual(3, batch.max_batch());
+
+    /* Flush on age, in poll() */
+    batch.set_flush_size(PUBNUB_BATCH_BUFFER_SIZE);
+    batch.set_flush_age(1000);
+    response = publish_sent;
+    assertTrue(batch.add("\"old\""));
+    ::delay(500);
+    batch.poll();
+    assertEqual(1, batch.count());
+    ::delay(600);
+    batch.poll();
+    assertEqual(0, batch.count());
+    assertEqual(String("[\"old\"]"), request_body(client));
+    batch.set_flush_age(0);
+
+    /* A failed publish keeps the messages, in order, for the next */
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 32\r\n"
+                      "\r\n"
+                      "[0,\"Account quota exceeded\",\"0\"]");
+    assertTrue(batch.add("1"));
+    assertTrue(batch.add("2"));
+    assertFalse(batch.flush());
+    assertEqual(1, batch.failures());
+    assertEqual(2, batch.count());
+    response = publish_sent;
+    assertTrue(batch.add("3"));
+    assertTrue(batch.flush());
+    assertEqual(String("[1,2,3]"), request_body(client));
+    assertTrue(batch.flush());
+    assertEqual(4, batch.requests());
+
+    /* A failed flush on age is not retried on the next poll(), only
+       after the flush age again */
+    batch.set_flush_age(1000);
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 32\r\n"
+                      "\r\n"
+                      "[0,\"Account quota exceeded\",\"0\"]");
+    assertTrue(batch.add("4"));
+    ::delay(1100);
+    batch.poll();
+    assertEqual(2, batch.failures());
+    assertEqual(1, batch.count());
+    response = publish_sent;
+    batch.poll();
+    ::delay(500);
+    batch.poll();
+    assertEqual(1, batch.count());
+    assertEqual(4, batch.requests());
+    ::delay(600);
+    batch.poll();
+    assertEqual(0, batch.count());
+    assertEqual(String("[4]"), request_body(client));
+    assertEqual(5, batch.requests());
+    assertEqual(2, batch.failures());
+    batch.set_flush_age(0);
+
+    /* Flush when the next message doesn't fit, drop what never can */
+    String big;
+    while (big.length() < PUBNUB_BATCH_BUFFER_SIZE / 2) {
+        big.concat('7');
+    }
+    response = publish_sent;
+    assertTrue(batch.add(big.c_str()));
+    assertTrue(batch.add(big.c_str()));
+    assertEqual(1, batch.count());
+    assertEqual(String("[") + big + "]", request_body(client));
+    big.concat(big);
+    assertFalse(batch.add(big.c_str()));
+    assertEqual(1, batch.dropped());
+    assertEqual(1, batch.count());
+}
+
+
+unittest(PubNub_subscribe_channels_and_groups)
+{
+    String msg;
+    char   channel[16];
+    PubNub PubNubObject;
+    String request("GET /subscribe/airliner/flight,tower/0/0"
+                   "?channel-group=airport"
+                   "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "[[\"climb\",{\"runway\":\"27L\"},\"taxi\"],\"15541420302549923\","
+                    "\"flight,tower,airport\",\"flight,tower,gate\"]");
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    auto subclient = PubNubObject.subscribe("flight,tower", "airport");
+    assertEqual(request, subclient->getOuttaHere());
+
+    SubscribeCracker ritz(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"climb\"", msg.c_str());
+    assertEqual(0, ritz.get(msg));
+    assertEqual("{\"runway\":\"27L\"}", msg.c_str());
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"taxi\"", msg.c_str());
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual(SubscribeCracker::done, ritz.state());
+    assertEqual("15541420302549923", subclient->server_timetoken());
+
+    assertEqual("flight,tower,gate", subclient->channel_list());
+    assertTrue(subclient->message_channel(0, channel, sizeof channel));
+    assertEqual("flight", channel);
+    assertTrue(subclient->message_channel(1, channel, sizeof channel));
+    assertEqual("tower", channel);
+    assertTrue(subclient->message_channel(2, channel, sizeof channel));
+    assertEqual("gate", channel);
+    assertFalse(subclient->message_channel(3, channel, sizeof channel));
+    assertFalse(subclient->message_channel(0, channel, 3));
+    subclient->stop();
+
+    /* Only channel groups */
+    request = String("GET /subscribe/airliner/,/0/15541420302549923"
+                     "?channel-group=airport,hangar"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "[[],\"15541420302549924\",\"\"]");
+    subclient = PubNubObject.subscribe(0, "airport,hangar");
+    assertEqual(request, subclient->getOuttaHere());
+    ritz = SubscribeCracker(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertEqual(SubscribeCracker::done, ritz.state());
+    assertEqual("15541420302549924", subclient->server_timetoken());
+    assertEqual("", subclient->channel_list());
+    subclient->stop();
+}
+
+
+unittest(PubNub_subscribe_keeps_timetoken_on_malformed_one)
+{
+    String msg;
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    char const* const bad[] = { "15541420302x49924", "155414203025499241234567890", "" };
+    for (size_t i = 0; i < sizeof bad / sizeof bad[0]; ++i) {
+        response = String("HTTP/1.1 200 OK\r\n"
+                          "Connection: close\r\n"
+                          "\r\n"
+                          "[[\"climb\"],\"15541420302549923\",\"flight\"]");
+        auto subclient = PubNubObject.subscribe("flight");
+        SubscribeCracker ritz(subclient);
+        while ((0 == ritz.get(msg)) && !ritz.finished()) {
+        }
+        assertFalse(subclient->malformed());
+        subclient->stop();
+
+        response = String("HTTP/1.1 200 OK\r\n"
+                          "Connection: close\r\n"
+                          "\r\n"
+                          "[[\"taxi\"],\"")
+                   + bad[i] + "\",\"flight\"]";
+        subclient = PubNubObject.subscribe("flight");
+        ritz      = SubscribeCracker(subclient);
+        assertEqual(0, ritz.get(msg));
+        assertEqual("\"taxi\"", msg.c_str());
+        assertEqual(0, ritz.get(msg));
+        assertTrue(ritz.finished());
+        assertTrue(subclient->malformed());
+        assertEqual("15541420302549923", subclient->server_timetoken());
+        assertEqual(15541420302549923ULL, subclient->server_timetoken_value());
+        assertEqual("flight", subclient->channel_list());
+        subclient->stop();
+
+        PubNubObject.subscribeClient().set_timetoken("0");
+    }
+}
+
+unittest(PubNub_subscribe_v2)
+{
+    String msg;
+    PubNub PubNubObject;
+    String request("GET /v2/subscribe/airliner/flight,tower/0?tt=0"
+                   "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "{\"t\":{\"t\":\"15541420302549923\",\"r\":7},\"m\":[]}");
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    auto subclient = PubNubObject.subscribe_v2("flight,tower");
+    assertEqual(request, subclient->getOuttaHere());
+    SubscribeV2Cracker ritz(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual("15541420302549923", subclient->server_timetoken());
+    assertEqual(7, subclient->server_region());
+    subclient->stop();
+
+    /* The next one continues from the timetoken, in its region,
+       and the response is chunked */
+    request = String("GET /v2/subscribe/airliner/,/0?tt=15541420302549923&tr=7"
+                     "&channel-group=airport"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = String("HTTP/1.1 200 OK\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "25\r\n{\"t\":{\"t\":\"15541420302549924\",\"r\":9},\r\n"
+                      "30\r\n\"m\":[{\"c\":\"gate\",\"b\":\"airport\",\"d\":\"boarding\"}]}\r\n"
+                      "0\r\n\r\n");
+    subclient = PubNubObject.subscribe_v2(0, "airport");
+    assertEqual(request, subclient->getOuttaHere());
+    ritz = SubscribeV2Cracker(subclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"boarding\"", msg.c_str());
+    assertEqual("gate", ritz.channel());
+    assertEqual("airport", ritz.subscription());
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual("15541420302549924", subclient->server_timetoken());
+    assertEqual(9, subclient->server_region());
+    subclient->stop();
+}
+
+
+unittest(PubNub_subscribe_with_filter_expr)
+{
+    String msg;
+    PubNub PubNubObject;
+    String request("GET /subscribe/airliner/flight/0/0"
+                   "?filter-expr=region%20==%20%27east%27%20%26%26%20temp%20%3E%2030"
+                   "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    /* As if the keys had no stream filtering, so filter locally */
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "[[{\"region\":\"west\",\"temp\":35},{\"region\":\"east\",\"temp\":31},"
+                    "{\"region\":\"east\",\"temp\":20},{\"region\":\"east\",\"temp\":40}],"
+                    "\"15541420302549923\"]");
+    unsigned long delay = 1;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    char const expr[] = "region == 'east' && temp > 30";
+    PubNubObject.set_filter_expr(expr);
+    auto subclient = PubNubObject.subscribe("flight");
+    assertEqual(request, subclient->getOuttaHere());
+
+    PubNubFilter     filter(expr);
+    SubscribeCracker ritz(subclient);
+    ritz.set_filter(&filter);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("{\"region\":\"east\",\"temp\":31}", msg.c_str());
+    char buf[40];
+    assertEqual(0, ritz.get(buf, sizeof buf));
+    assertEqual("{\"region\":\"east\",\"temp\":40}", buf);
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    assertEqual(2, ritz.filtered());
+    subclient->stop();
+}
+
+unittest(PubNub_publish_to_channel_handle)
+{
+    PubNub PubNubObject;
+    String request("GET /publish/jet/airliner/0/flight/0/package%21"
+                   "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    String const sent("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473323\"]");
+    String        response(sent);
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    PubNubChannel flight("flight");
+    assertEqual("flight", flight.name());
+    auto client = PubNubObject.publish(flight, "package!");
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+    assertEqual(request, client->getOuttaHere());
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    client->stop();
+
+    /* The same request, but for the message */
+    request = String("GET /publish/jet/airliner/0/flight/0/%22round%20trip%22"
+                     "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = sent;
+    client   = PubNubObject.publish(flight, "\"round trip\"");
+    assertEqual(request, client->getOuttaHere());
+    client->stop();
+
+    /* Printed again, with the auth key and keep-alive */
+    request = String("GET /publish/jet/airliner/0/flight/0/1"
+                     "?auth=atlantic"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: keep-alive\r\n"
+                     "\r\n");
+    PubNubObject.set_auth("atlantic");
+    PubNubObject.set_keep_alive(true);
+    response = sent;
+    client   = PubNubObject.publish(flight, "1");
+    assertEqual(request, client->getOuttaHere());
+    cheez = PublishCracker();
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    client->stop();
+}
+
+unittest(PubNub_fire_signal_and_publish_options)
+{
+    PubNub PubNubObject;
+    String const sent("HTTP/1.1 200 OK\r\n"
+                      "Content-Length: 30\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "[1,\"Sent\",\"15541724007473323\"]");
+    String        response(sent);
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    String request("GET /publish/jet/airliner/0/flight/0/%7B%22alt%22:9%7D"
+                   "?store=0&norep=true"
+                   "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    auto client = PubNubObject.fire("flight", "{\"alt\":9}");
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+    assertEqual(request, client->getOuttaHere());
+    SentCracker cheez;
+    assertEqual(PublishCracker::sent, cheez.read_and_parse(client));
+    assertEqual(15541724007473323ULL, cheez.timetoken());
+    client->stop();
+
+    request = String("GET /signal/jet/airliner/0/flight/0/%22ding%22"
+                     "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = sent;
+    client   = PubNubObject.signal("flight", "\"ding\"");
+    assertEqual(request, client->getOuttaHere());
+    cheez = SentCracker();
+    assertEqual(PublishCracker::sent, cheez.read_and_parse(client));
+    client->stop();
+
+    /* All the options, before the auth key */
+    PubNubPublishOptions options;
+    options.store = 1;
+    options.ttl   = 24;
+    options.meta  = "{\"gate\":\"A 1\"}";
+    PubNubObject.set_auth("atlantic");
+    request = String("GET /publish/jet/airliner/0/flight/0/1"
+                     "?store=1&ttl=24"
+                     "&meta=%7B%22gate%22:%22A%201%22%7D"
+                     "&auth=atlantic"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = sent;
+    client   = PubNubObject.publish("flight", "1", options);
+    assertEqual(request, client->getOuttaHere());
+    client->stop();
+
+    /* The same with POST, the message being in the body */
+    request = String("POST /publish/jet/airliner/0/flight/0"
+                     "?store=1&ttl=24"
+                     "&meta=%7B%22gate%22:%22A%201%22%7D"
+                     "&auth=atlantic"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: 1\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "1");
+    response = sent;
+    client   = PubNubObject.publish_post("flight", "1", options);
+    assertEqual(request, client->getOuttaHere());
+    client->stop();
+
+    /* Default options send no parameters */
+    request = String("GET /publish/jet/airliner/0/flight/0/2"
+                     "?auth=atlantic"
+                     "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                     "Host: pubsub.pubnub.com\r\n"
+                     "User-Agent: PubNub-Arduino/1.0\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+    response = sent;
+    client   = PubNubObject.publish("flight", "2", PubNubPublishOptions());
+    assertEqual(request, client->getOuttaHere());
+    client->stop();
+}
+
+static String presence_request(String const& path, String const& query)
+{
+    return String("GET /v2/presence/sub-key/airliner/channel/")
+           + path
+           + query
+           + String("&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                    "Host: pubsub.pubnub.com\r\n"
+                    "User-Agent: PubNub-Arduino/1.0\r\n"
+                    "Connection: keep-alive\r\n"
+                    "\r\n");
+}
+
+unittest(PubNub_presence_requests)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+
+    /* No UUID, no state */
+    assertTrue(0 == PubNubObject.get_state("flight"));
+    assertEqual(PubNub::async_error, PubNubObject.publish_state());
+
+    PubNubObject.set_uuid("pilot");
+    PubNubObject.set_auth("wings");
+    PubNubObject.set_presence_timeout(60);
+    assertEqual(60, PubNubObject.presence_timeout());
+
+    String const ok("{\"status\":200,\"message\":\"OK\",\"service\":\"Presence\"}");
+    response = history_page(ok);
+    ::delay(10);
+    auto client = PubNubObject.heartbeat("flight,tower", "airport", "{\"seat\":\"1A\"}");
+    assertEqual(PubNub::http_scc_success, PubNubObject.get_last_http_status_code_class());
+    assertEqual(presence_request("flight,tower/heartbeat",
+                                 "?heartbeat=60&channel-group=airport"
+                                 "&state=%7B%22seat%22:%221A%22%7D"
+                                 "&uuid=pilot&auth=wings"),
+                client->getOuttaHere());
+    assertEqual(millis(), PubNubObject.heartbeat_sent_at());
+    client->stop();
+
+    response = history_page(ok);
+    client = PubNubObject.leave(0, "airport");
+    assertEqual(presence_request(",/leave", "?channel-group=airport&uuid=pilot&auth=wings"),
+                client->getOuttaHere());
+    client->stop();
+
+    response = history_page("{\"status\":200,\"message\":\"OK\",\"occupancy\":2,"
+                            "\"uuids\":[\"pilot\",\"steward\"],\"service\":\"Presence\"}");
+    client = PubNubObject.here_now("flight");
+    assertEqual(presence_request("flight", "?uuid=pilot&auth=wings"),
+                client->getOuttaHere());
+    HereNowCracker here(client);
+    assertEqual(0, here.get());
+    assertEqual("pilot", here.uuid());
+    assertEqual(0, here.get());
+    assertEqual("steward", here.uuid());
+    assertEqual(0, here.get());
+    assertEqual("", here.uuid());
+    assertTrue(here.finished());
+    assertEqual(2, here.occupancy());
+    client->stop();
+
+    response = history_page(ok);
+    client = PubNubObject.set_state("flight", "{\"seat\":\"2B\"}");
+    assertEqual(presence_request("flight/uuid/pilot/data",
+                                 "?state=%7B%22seat%22:%222B%22%7D&uuid=pilot&auth=wings"),
+                client->getOuttaHere());
+    client->stop();
+
+    response = history_page("{\"status\":200,\"message\":\"OK\","
+                            "\"payload\":{\"seat\":\"2B\"},\"service\":\"Presence\"}");
+    client = PubNubObject.get_state("flight");
+    assertEqual(presence_request("flight/uuid/pilot", "?uuid=pilot&auth=wings"),
+                client->getOuttaHere());
+    client->stop();
+    assertEqual(1, client->mGodmodeConnects);
+
+    /* Not over a publish in progress */
+    assertTrue(PubNubObject.start_publish("flight", "\"boarding\""));
+    assertFalse(PubNubObject.start_heartbeat("flight"));
+    assertFalse(PubNubObject.start_leave("flight"));
+    assertTrue(0 == PubNubObject.set_state("flight", "{}"));
+    assertEqual(PubNub::async_in_progress, PubNubObject.publish_state());
+    response = history_page("[1,\"Sent\",\"15541724007473323\"]");
+    PubNubObject.poll();
+    SentCracker cheez;
+    assertEqual(PublishCracker::sent, cheez.read_and_parse(PubNubObject.publish_response()));
+    PubNubObject.publish_response()->stop();
+
+    /* Subscribe carries the presence timeout */
+    String sub_response;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &sub_response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    ::delay(10);
+    assertTrue(PubNubObject.start_subscribe("flight"));
+    assertEqual(String("GET /subscribe/airliner/flight/0/0"
+                       "?uuid=pilot&heartbeat=60&auth=wings"
+                       "&pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: close\r\n"
+                       "\r\n"),
+                PubNubObject.subscribeClient().getOuttaHere());
+    assertEqual(millis(), PubNubObject.heartbeat_sent_at());
+}
+
+unittest(PubNubHeartbeat_sends_heartbeats_while_subscribed)
+{
+    PubNub PubNubObject;
+    String pub_response;
+    String sub_response;
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &pub_response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &sub_response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+    PubNubObject.set_uuid("pilot");
+    PubNubObject.set_presence_timeout(20);
+
+    PubNubHeartbeat presence(PubNubObject, "flight");
+    assertEqual(9, presence.interval());
+
+    /* The subscribe is a heartbeat, so none is due yet */
+    assertTrue(PubNubObject.start_subscribe("flight"));
+    assertFalse(presence.poll());
+    ::delay(8000);
+    assertFalse(presence.poll());
+    assertEqual(0, presence.sent());
+
+    /* Subscribe is still waiting, so a heartbeat goes */
+    ::delay(1000);
+    assertTrue(presence.poll());
+    assertEqual(1, presence.sent());
+    assertEqual(presence_request("flight/heartbeat", "?heartbeat=20&uuid=pilot"),
+                PubNubObject.publishClient().getOuttaHere());
+    assertTrue(presence.poll());
+    pub_response = history_page("{\"status\":200,\"message\":\"OK\",\"service\":\"Presence\"}");
+    assertFalse(presence.poll());
+    assertEqual(0, presence.failures());
+    assertEqual(PubNub::async_in_progress, PubNubObject.subscribe_state());
+
+    /* A failed heartbeat is retried sooner */
+    ::delay(9000);
+    assertTrue(presence.poll());
+    pub_response = String("HTTP/1.1 503 Service Unavailable\r\n"
+                          "Content-Length: 0\r\n"
+                          "\r\n");
+    assertFalse(presence.poll());
+    assertEqual(1, presence.failures());
+    ::delay(1000);
+    assertFalse(presence.poll());
+    ::delay(1500);
+    assertTrue(presence.poll());
+    assertEqual(3, presence.sent());
+    pub_response = history_page("{\"status\":200,\"message\":\"OK\",\"service\":\"Presence\"}");
+    assertFalse(presence.poll());
+    assertEqual(1, presence.failures());
+
+    /* Not while a publish is in progress */
+    ::delay(9000);
+    assertTrue(PubNubObject.start_publish("flight", "\"landing\""));
+    assertFalse(presence.poll());
+    assertEqual(3, presence.sent());
+    pub_response = history_page("[1,\"Sent\",\"15541724007473323\"]");
+    PubNubObject.poll();
+    PubNubObject.publish_response()->stop();
+    assertTrue(presence.poll());
+    assertEqual(4, presence.sent());
+    pub_response = history_page("{\"status\":200,\"message\":\"OK\",\"service\":\"Presence\"}");
+    assertFalse(presence.poll());
+
+    pub_response = history_page("{\"status\":200,\"message\":\"OK\",\"action\":\"leave\","
+                                "\"service\":\"Presence\"}");
+    assertTrue(presence.leave());
+    assertEqual(1, PubNubObject.publishClient().mGodmodeConnects);
+}
+
+unittest(PubNub_time_and_clock)
+{
+    PubNub PubNubObject;
+    String response;
+    unsigned long delay = 1000;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+
+    response = history_page("[15541724007473323]");
+    auto client = PubNubObject.time();
+    assertEqual(String("GET /time/0"
+                       "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                       "Host: pubsub.pubnub.com\r\n"
+                       "User-Agent: PubNub-Arduino/1.0\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n"),
+                client->getOuttaHere());
+    TimeCracker cracker;
+    assertEqual(15541724007473323ULL, cracker.read_and_parse(client));
+    client->stop();
+
+    /* Not over a publish in progress */
+    assertTrue(PubNubObject.start_publish("flight", "\"boarding\""));
+    assertFalse(PubNubObject.start_time());
+    assertTrue(0 == PubNubObject.time());
+    assertEqual(PubNub::async_in_progress, PubNubObject.publish_state());
+    response = history_page("[1,\"Sent\",\"15541724007473323\"]");
+    PubNubObject.poll();
+    PubNubObject.publish_response()->stop();
+
+    /* Reading the response head takes (a millisecond an octet) */
+    PubNubClock clock(PubNubObject);
+    assertFalse(clock.synced());
+    assertEqual(0, clock.now());
+    response = history_page("[15541724007473323]");
+    assertTrue(clock.sync());
+    assertEqual(1, clock.samples());
+    assertMore(clock.rtt_ms(), 10);
+    uint64_t const synced = 15541724007473323ULL + clock.rtt_ms() / 2 * PubNubClock::tt_per_ms;
+    assertMoreOrEqual(clock.now(), synced);
+    assertLess(clock.now(), synced + 100 * PubNubClock::tt_per_ms);
+    ::delay(2000);
+    assertMoreOrEqual(clock.now(), synced + 2000 * PubNubClock::tt_per_ms);
+
+    /* Failures add no samples */
+    response = String("HTTP/1.1 500 Internal Server Error\r\n"
+                      "Content-Length: 0\r\n"
+                      "\r\n");
+    assertFalse(clock.sync());
+    response = history_page("[\"nope\"]");
+    assertFalse(clock.sync());
+    assertEqual(1, clock.samples());
+    assertEqual(1, PubNubObject.publishClient().mGodmodeConnects);
+
+    /* The sample with the shortest round trip wins */
+    clock.clear();
+    clock.add_sample(1000, 1100, 15000000000000000ULL);
+    clock.add_sample(2000, 2020, 15000000010000000ULL);
+    clock.add_sample(3000, 3300, 15000000020000000ULL);
+    assertEqual(3, clock.samples());
+    assertEqual(20, clock.rtt_ms());
+    assertEqual(15000000010000000ULL, clock.at(2010));
+    assertEqual(15000000020000000ULL, clock.at(3010));
+    assertEqual(15000000000000000ULL, clock.at(1010));
+    assertEqual(7010, clock.to_millis(15000000060000000ULL));
+    assertEqual(1010, clock.to_millis(15000000000000000ULL));
+
+    /* Until it is no longer kept */
+    for (int i = 0; i < PUBNUB_CLOCK_SAMPLES; ++i) {
+        clock.add_sample(4000 + i * 1000, 4050 + i * 1000, 15000000030000000ULL);
+    }
+    assertEqual(PUBNUB_CLOCK_SAMPLES, clock.samples());
+    assertEqual(50, clock.rtt_ms());
+
+    /* Across the wrap of millis() */
+    clock.clear();
+    clock.add_sample(~0UL - 0xFF, ~0UL - 0xEF, 15000000000000000ULL);
+    assertEqual(15000000000000000ULL + 0x1F8UL * PubNubClock::tt_per_ms, clock.at(0x100));
+}
+
+unittest(SubscribeSupervisor_backs_off_and_recovers)
+{
+    String        msg;
+    PubNub        PubNubObject;
+    String        response;
+    unsigned long delay = 1;
+    PubSubClient& client = PubNubObject.subscribeClient();
+    client.mGodmodeDataIn = &response;
+    client.mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    SubscribeSupervisor super(PubNubObject, "flight");
+    super.set_backoff(1000, 8000);
+    super.set_timeout(5);
+    super.set_seed(7);
+
+    /* Subscribe, get the response */
+    assertTrue(0 == super.poll());
+    assertEqual(1, client.mGodmodeConnects);
+    String request(client.getOuttaHere());
+    assertEqual(0, request.indexOf(String("GET /subscribe/airliner/flight/0/0?")));
+    response = "HTTP/1.1 200 OK\r\n"
+               "Content-Length: 32\r\n"
+               "\r\n"
+               "[[\"wheels\"],\"15541420302549923\"]";
+    PubSubClient* sclient = super.poll();
+    assertTrue(&client == sclient);
+    SubscribeCracker ritz(sclient);
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"wheels\"", msg.c_str());
+    assertEqual(0, ritz.get(msg));
+    sclient->stop();
+
+    /* Resubscribes right away, from the timetoken */
+    assertTrue(0 == super.poll());
+    assertEqual(2, client.mGodmodeConnects);
+    assertTrue(15541420302549923ULL == super.timetoken());
+    request = client.getOuttaHere();
+    assertEqual(0, request.indexOf(String("GET /subscribe/airliner/flight/0/15541420302549923?")));
+    assertEqual(0, super.failures());
+
+    /* Connection lost, over and over: the wait doubles, up to
+       the cap, with up to half of it random */
+    unsigned long const t_down = millis();
+    unsigned long       wait   = 1000;
+    for (unsigned i = 1; i <= 5; ++i) {
+        client.mGodmodeConnected = false;
+        assertTrue(0 == super.poll());
+        assertEqual(SubscribeSupervisor::failure_network, super.last_failure());
+        assertEqual(i, super.consecutive_failures());
+        assertTrue(super.backoff_ms() >= wait / 2);
+        assertTrue(super.backoff_ms() <= wait);
+        int const connects = client.mGodmodeConnects;
+        ::delay(super.backoff_ms() - 1);
+        assertTrue(0 == super.poll());
+        assertEqual(connects, client.mGodmodeConnects);
+        ::delay(1);
+        assertTrue(0 == super.poll());
+        assertEqual(connects + 1, client.mGodmodeConnects);
+        assertEqual(i, super.reconnects());
+        if (wait < 8000) {
+            wait *= 2;
+        }
+    }
+
+    /* Refused (403): wait the cap right away */
+    response = "HTTP/1.1 403 Forbidden\r\n"
+               "Content-Length: 22\r\n"
+               "\r\n"
+               "{\"message\":\"Forbidden\"}";
+    assertTrue(0 == super.poll());
+    assertEqual(SubscribeSupervisor::failure_client, super.last_failure());
+    assertTrue(super.backoff_ms() >= 4000);
+    ::delay(super.backoff_ms());
+
+    /* Can't connect */
+    client.mGodmodeRefuse = true;
+    assertTrue(0 == super.poll());
+    assertEqual(SubscribeSupervisor::failure_connect, super.last_failure());
+    client.mGodmodeRefuse = false;
+    ::delay(super.backoff_ms());
+
+    /* Server error */
+    response = "HTTP/1.1 503 Service Unavailable\r\n"
+               "Content-Length: 14\r\n"
+               "\r\n"
+               "{\"error\":true}";
+    assertTrue(0 == super.poll());
+    assertTrue(0 == super.poll());
+    assertEqual(SubscribeSupervisor::failure_server, super.last_failure());
+    ::delay(super.backoff_ms());
+
+    /* No response in time */
+    response = "";
+    assertTrue(0 == super.poll());
+    ::delay(5001);
+    assertTrue(0 == super.poll());
+    assertEqual(SubscribeSupervisor::failure_timeout, super.last_failure());
+    assertEqual(9, super.failures());
+    assertEqual(0, super.recoveries());
+    ::delay(super.backoff_ms());
+
+    /* Recovers, from the same timetoken */
+    client.getOuttaHere();
+    assertTrue(0 == super.poll());
+    request = client.getOuttaHere();
+    assertEqual(0, request.indexOf(String("GET /subscribe/airliner/flight/0/15541420302549923?")));
+    response = "HTTP/1.1 200 OK\r\n"
+               "Content-Length: 30\r\n"
+               "\r\n"
+               "[[\"gear\"],\"15541420302549924\"]";
+    sclient = super.poll();
+    unsigned long const t_up = millis();
+    assertTrue(0 != sclient);
+    sclient->stop();
+    assertEqual(1, super.recoveries());
+    assertEqual(t_up - t_down, super.last_recovery_ms());
+    assertEqual(t_up - t_down, super.max_recovery_ms());
+    assertEqual(0, super.consecutive_failures());
+    assertEqual(0, super.backoff_ms());
+    assertTrue(0 == super.poll());
+    assertTrue(15541420302549924ULL == super.timetoken());
+}
+
+
+#if PUBNUB_STATS
+/* Collects what is printed to it in a String */
+class StringPrint : public Print {
+public:
+    size_t write(uint8_t c)
+    {
+        str.concat((char)c);
+        return 1;
+    }
+    using Print::write;
+    String str;
+};
+
+unittest(PubNubHistogram_buckets_by_powers_of_4)
+{
+    PubNubHistogram h;
+    assertEqual(256, PubNubHistogram::bound_us(0));
+    assertEqual(1024, PubNubHistogram::bound_us(1));
+    assertEqual(0, PubNubHistogram::bound_us(PubNubHistogram::buckets - 1));
+    h.add(0);
+    h.add(255);
+    h.add(256);
+    h.add(5000);
+    h.add(~0UL);
+    assertEqual(2, h.count(0));
+    assertEqual(1, h.count(1));
+    assertEqual(1, h.count(3));
+    assertEqual(1, h.count(PubNubHistogram::buckets - 1));
+    assertEqual(5, h.total());
+    assertEqual(~0UL, h.last_us());
+    assertEqual(~0UL, h.max_us());
+    h.clear();
+    assertEqual(0, h.total());
+}
+
+unittest(PubNub_stats_of_requests)
+{
+    PubNub PubNubObject;
+    String response;
+    String sub_response;
+    unsigned long delay = 10;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    PubNubObject.subscribeClient().mGodmodeDataIn = &sub_response;
+    PubNubObject.subscribeClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+    PubNubObject.set_keep_alive(true);
+    PubNubOpStats const& pub = PubNubObject.stats().publish;
+    assertEqual(0, pub.requests());
+
+    /* Each phase is timed */
+    assertTrue(PubNubObject.start_publish("flight", "\"gear down\""));
+    String request(PubNubObject.publishClient().getOuttaHere());
+    ::delay(5);
+    response = "HTTP/1.1 200 OK\r\n"
+               "Content-Length: 30\r\n"
+               "\r\n"
+               "[1,\"Sent\",\"15541724007473323\"]";
+    size_t const response_length = response.length();
+    PubNubObject.poll();
+    assertEqual(PubNub::async_done, PubNubObject.publish_state());
+    assertEqual(1, pub.requests());
+    assertEqual(1, pub.connects());
+    assertEqual(1, pub.histogram(PubNubOpStats::phase_connect).total());
+    assertEqual(1, pub.histogram(PubNubOpStats::phase_write).total());
+    /* 5 ms after the request, in the bucket below 16 ms */
+    PubNubHistogram const& ttfb = pub.histogram(PubNubOpStats::phase_first_byte);
+    assertEqual(1, ttfb.count(3));
+    assertTrue(ttfb.last_us() >= 5000);
+    assertTrue(ttfb.last_us() <= 5010);
+    /* The rest of the head, read 10 us per octet */
+    assertEqual(10 * (response_length - 30 - 1),
+                pub.histogram(PubNubOpStats::phase_head).last_us());
+    assertEqual(0, pub.histogram(PubNubOpStats::phase_body).total());
+
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(PubNubObject.publish_response()));
+    assertEqual(10 * 30, pub.histogram(PubNubOpStats::phase_body).last_us());
+    PubNubObject.publish_response()->stop();
+    assertEqual(1, pub.histogram(PubNubOpStats::phase_body).total());
+    assertEqual(request.length(), pub.bytes_out());
+    assertEqual(response_length, pub.bytes_in());
+
+    /* The kept-alive connection is reused, no connect to time */
+    response = "HTTP/1.1 200 OK\r\n"
+               "Content-Length: 30\r\n"
+               "\r\n"
+               "[1,\"Sent\",\"15541724007473324\"]";
+    auto client = PubNubObject.publish("flight", "\"gear down\"");
+    client->stop();
+    assertEqual(2, pub.requests());
+    assertEqual(1, pub.connects());
+    assertEqual(1, pub.histogram(PubNubOpStats::phase_connect).total());
+    assertEqual(2, pub.histogram(PubNubOpStats::phase_body).total());
+    assertEqual(2 * request.length(), pub.bytes_out());
+    assertEqual(2 * response_length, pub.bytes_in());
+
+    /* Failures */
+    PubNubObject.publishClient().mGodmodeConnected = false;
+    PubNubObject.publishClient().mGodmodeRefuse = true;
+    assertFalse(PubNubObject.start_publish("flight", "1"));
+    assertEqual(1, pub.connect_failures());
+    PubNubObject.publishClient().mGodmodeRefuse = false;
+
+    response = "";
+    assertTrue(PubNubObject.start_publish("flight", "1", 1));
+    ::delay(1100);
+    PubNubObject.poll();
+    assertEqual(PubNub::async_timeout, PubNubObject.publish_state());
+    assertEqual(1, pub.timeouts());
+
+    PubNubOpStats const& sub = PubNubObject.stats().subscribe;
+    assertTrue(PubNubObject.start_subscribe("flight"));
+    PubNubObject.subscribeClient().mGodmodeConnected = false;
+    PubNubObject.poll();
+    assertEqual(PubNub::async_error, PubNubObject.subscribe_state());
+    assertEqual(1, sub.requests());
+    assertEqual(1, sub.resets());
+    assertEqual(0, sub.histogram(PubNubOpStats::phase_first_byte).total());
+
+    StringPrint json;
+    PubNubObject.stats().print_json(json);
+    assertEqual(0, json.str.indexOf(String("{\"publish\":{\"requests\":4,\"connects\":2,"
+                                           "\"connect_failures\":1,\"timeouts\":1,\"resets\":0,")));
+    assertTrue(json.str.indexOf(String("\"subscribe\":{\"requests\":1,")) > 0);
+    assertTrue(json.str.indexOf(String(",\"first_byte\":[1,0,0,1,")) > 0);
+
+    PubNubObject.clear_stats();
+    assertEqual(0, pub.requests());
+    assertEqual(0, pub.histogram(PubNubOpStats::phase_write).total());
+}
+#endif /* PUBNUB_STATS */
+
 
 unittest_main()
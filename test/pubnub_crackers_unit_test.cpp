@@ -5,6 +5,32 @@
 #define PUBNUB_DEFINE_STRSPN_AND_STRNCASECMP
 #endif
 #include "../PubNubDefs.h"
+#include <new>
+
+
+/* Counts the heap allocations, to check that cracking into
+   caller-supplied buffers doesn't allocate */
+static unsigned long allocations;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
 
 
 unittest_setup()
@@ -36,6 +62,7 @@ unittest(SubscribeCracker_cracks_valid_initial_response)
     assertTrue(ritz.finished());
 
     assertEqual("15540679465349520", subclient.server_timetoken()); 
+    assertEqual(15540679465349520ULL, subclient.server_timetoken_value());
     subclient.stop();
 }
 
@@ -89,9 +116,40 @@ unittest(PublishCracker_cracks_valid_response)
     assertEqual("Sent", cheez.description());
 
     assertEqual("15541191365593405", cheez.timestamp()); 
+    assertEqual(15541191365593405ULL, cheez.timetoken());
     client.stop();
 }
 
+unittest(PubNubTimetoken_converts_strings_and_integers)
+{
+    char     str[PubNubTimetoken::str_size];
+    uint64_t tt = 42;
+
+    assertTrue(PubNubTimetoken::parse("15541191365593405", tt));
+    assertEqual(15541191365593405ULL, tt);
+    assertEqual("15541191365593405", PubNubTimetoken::to_str(tt, str));
+    assertEqual("0", PubNubTimetoken::to_str(0, str));
+
+    assertTrue(PubNubTimetoken::parse("18446744073709551615", tt));
+    assertEqual("18446744073709551615", PubNubTimetoken::to_str(tt, str));
+    /* Overflow, not a number and empty leave it as it was */
+    assertFalse(PubNubTimetoken::parse("18446744073709551616", tt));
+    assertFalse(PubNubTimetoken::parse("1554119136559340x", tt));
+    assertFalse(PubNubTimetoken::parse("", tt));
+    assertEqual(18446744073709551615ULL, tt);
+
+    PubSubClient subclient;
+    assertEqual("0", subclient.server_timetoken());
+    subclient.set_timetoken((uint64_t)15541191365593405ULL, 4);
+    assertEqual("15541191365593405", subclient.server_timetoken());
+    assertEqual(4, subclient.server_region());
+    subclient.set_timetoken("not a timetoken");
+    assertEqual("15541191365593405", subclient.server_timetoken());
+    subclient.set_timetoken("15541191365593406");
+    assertEqual(15541191365593406ULL, subclient.server_timetoken_value());
+    assertEqual(-1, subclient.server_region());
+}
+
 unittest(PublishCracker_cracks_valid_response_with_error_from_server)
 {
     /* when our API cracks publish response body we do start with its initial bracket */
@@ -114,4 +172,624 @@ unittest(PublishCracker_cracks_valid_response_with_error_from_server)
 }
 
 
+unittest(SentCracker_cracks_response_of_fire_and_signal)
+{
+    String body("[1,\"Sent\",\"15541191365593405\"]");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 1;
+    client.mGodmodeMicrosDelay = &delay;
+
+    SentCracker cheez;
+    assertEqual(PublishCracker::sent, cheez.read_and_parse(&client));
+    assertEqual(cheez.done, cheez.state());
+    assertEqual(15541191365593405ULL, cheez.timetoken());
+    assertLess(sizeof cheez, sizeof(PublishCracker) / 4);
+
+    /* Quotes, brackets and commas in the description are skipped,
+       and so is whatever comes after the timetoken */
+    SentCracker crackers;
+    char const  failed[] = "[0, \"Invalid \\\"key\\\", [1,2]\" , \"15541219160927237\",1]";
+    crackers.handle((uint8_t const*)failed, sizeof failed - 1);
+    assertEqual(crackers.done, crackers.state());
+    assertEqual(PublishCracker::failed, crackers.outcome());
+    assertEqual(15541219160927237ULL, crackers.timetoken());
+
+    /* Fed an octet at a time, not done before the closing bracket */
+    SentCracker octets;
+    char const  sent[] = "[1,\"Sent\",\"42\"]";
+    for (size_t i = 0; i + 1 < sizeof sent - 1; ++i) {
+        octets.handle(sent[i]);
+    }
+    assertNotEqual(octets.done, octets.state());
+    assertEqual(PublishCracker::sent, octets.outcome());
+    octets.handle(']');
+    assertEqual(octets.done, octets.state());
+    assertEqual(42ULL, octets.timetoken());
+}
+
+unittest(TimeCracker_cracks_timetoken)
+{
+    String body("[15541724007473323]");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 1;
+    client.mGodmodeMicrosDelay = &delay;
+
+    TimeCracker cracker;
+    assertEqual(15541724007473323ULL, cracker.read_and_parse(&client));
+    assertTrue(cracker.finished());
+
+    /* Not known before the closing bracket */
+    TimeCracker octets;
+    char const  time[] = "[42]";
+    for (size_t i = 0; i + 1 < sizeof time - 1; ++i) {
+        octets.handle(time[i]);
+    }
+    assertFalse(octets.finished());
+    assertEqual(0, octets.timetoken());
+    octets.handle(']');
+    assertEqual(42, octets.timetoken());
+
+    TimeCracker bad;
+    char const  error[] = "[\"error\"]";
+    for (size_t i = 0; i < sizeof error - 1; ++i) {
+        bad.handle(error[i]);
+    }
+    assertTrue(bad.finished());
+    assertEqual(0, bad.timetoken());
+}
+
+unittest(SubscribeCracker_cracks_into_buffer_without_allocating)
+{
+    char msg[40];
+    bool truncated;
+    String body("[\"Hello_world\",{\"sender\":{\"name\":\"Arduino\",\"mac_last_byte\":237}},[4095,0,255]],\"15540677660037393\"]");
+    PubSubClient subclient;
+    subclient.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    subclient.mGodmodeMicrosDelay = &delay;
+
+    subclient.start_body();
+    SubscribeCracker ritz(&subclient);
+
+    unsigned long allocated = allocations;
+    int           first     = ritz.get(msg, sizeof msg, &truncated);
+    bool          first_truncated = truncated;
+    String        first_msg(msg);
+    allocations = allocated;
+    int  second           = ritz.get(msg, sizeof msg, &truncated);
+    bool second_truncated = truncated;
+    assertEqual(allocated, allocations);
+
+    assertEqual(0, first);
+    assertFalse(first_truncated);
+    assertEqual("\"Hello_world\"", first_msg.c_str());
+    /* Doesn't fit, the rest is dropped */
+    assertEqual(0, second);
+    assertTrue(second_truncated);
+    assertEqual("{\"sender\":{\"name\":\"Arduino\",\"mac_last_b", msg);
+    assertEqual(0, ritz.get(msg, sizeof msg, &truncated));
+    assertFalse(truncated);
+    assertEqual("[4095,0,255]", msg);
+    assertFalse(ritz.finished());
+    assertEqual(0, ritz.get(msg, sizeof msg));
+    assertEqual(0, strlen(msg));
+    assertTrue(ritz.finished());
+
+    assertEqual("15540677660037393", subclient.server_timetoken()); 
+    subclient.stop();
+}
+
+unittest(HistoryCracker_cracks_into_buffer_without_allocating)
+{
+    char msg[16];
+    bool truncated;
+    String body("[{\"rocket\":\"Saturn V\"},\"Eagle\",\"1969\"]");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    HistoryCracker smoki(&client);
+
+    unsigned long allocated = allocations;
+    int  first = smoki.get(msg, sizeof msg, &truncated);
+    bool first_truncated = truncated;
+    assertEqual(allocated, allocations);
+    assertEqual(0, first);
+    assertTrue(first_truncated);
+    assertEqual("{\"rocket\":\"Satu", msg);
+    assertEqual(0, smoki.get(msg, sizeof msg, &truncated));
+    assertFalse(truncated);
+    assertEqual("\"Eagle\"", msg);
+    assertEqual(0, smoki.get(msg, sizeof msg, &truncated));
+    assertEqual("\"1969\"", msg);
+    assertEqual(0, smoki.get(msg, sizeof msg, &truncated));
+    assertEqual(0, strlen(msg));
+    assertTrue(smoki.finished());
+    client.stop();
+}
+
+/* Keeps the messages it is handed out in a fixed-size array, or
+   just their lengths, if they don't fit. */
+class CollectingVisitor : public MessageVisitor {
+public:
+    CollectingVisitor()
+        : count(0)
+        , parts(0)
+        , len(0)
+    {
+    }
+    void message_data(char const* data, size_t size)
+    {
+        if (len + size < sizeof text) {
+            memcpy(text + len, data, size);
+            text[len + size] = '\0';
+        }
+        len += size;
+        ++parts;
+    }
+    void message_end()
+    {
+        lengths[count++] = len;
+        len = 0;
+    }
+
+    char   text[64];
+    size_t lengths[64];
+    int    count;
+    int    parts;
+    size_t len;
+};
+
+unittest(HistoryV2Cracker_cracks_messages_and_timetokens)
+{
+    String msg;
+    String body("[[\"Eagle\",{\"rocket\":\"Saturn V\",\"stages\":[1,2,3]},1969,"
+                "[\"a\\\"]\"]],15541191365593405,15541191365593409]");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    HistoryV2Cracker smoki(&client);
+    assertEqual(0, smoki.get(msg));
+    assertEqual("\"Eagle\"", msg.c_str());
+    assertEqual(0, smoki.get(msg));
+    assertEqual("{\"rocket\":\"Saturn V\",\"stages\":[1,2,3]}", msg.c_str());
+    assertEqual(0, smoki.get(msg));
+    assertEqual("1969", msg.c_str());
+    assertEqual(0, smoki.get(msg));
+    assertEqual("[\"a\\\"]\"]", msg.c_str());
+    assertFalse(smoki.finished());
+    assertEqual(0, smoki.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(smoki.finished());
+    assertEqual(4, smoki.count());
+    assertEqual(0ULL, smoki.timetoken());
+    assertEqual(15541191365593405ULL, smoki.start());
+    assertEqual(15541191365593409ULL, smoki.end());
+
+    /* With the timetokens, in either order of the fields, telling
+       them from the other fields by their whole names */
+    char buf[16];
+    bool truncated;
+    body = String("[[{\"message\":{\"cmd\":\"open\"},\"timetoken\":15541191365593405},"
+                  "{\"timetoken\":\"15541191365593406\",\"message\":\"a long message\"},"
+                  "{\"mistake\":8,\"message\":7,\"tokentime\":1,\"meta\":{\"k\":1},"
+                  "\"timetoken\":15541191365593407}],"
+                  "\"15541191365593405\",\"15541191365593407\"]");
+    smoki.reset(&client, true);
+    assertEqual(0, smoki.get(buf, sizeof buf, &truncated));
+    assertEqual("{\"cmd\":\"open\"}", buf);
+    assertFalse(truncated);
+    assertEqual(15541191365593405ULL, smoki.timetoken());
+    assertEqual(0, smoki.get(buf, sizeof buf, &truncated));
+    assertEqual("\"a long message", buf);
+    assertTrue(truncated);
+    assertEqual(15541191365593406ULL, smoki.timetoken());
+    assertEqual(0, smoki.get(buf, sizeof buf, &truncated));
+    assertEqual("7", buf);
+    assertEqual(15541191365593407ULL, smoki.timetoken());
+    assertEqual(0, smoki.get(buf, sizeof buf));
+    assertEqual(0, strlen(buf));
+    assertTrue(smoki.finished());
+    assertEqual(3, smoki.count());
+    assertEqual(15541191365593405ULL, smoki.start());
+    assertEqual(15541191365593407ULL, smoki.end());
+
+    /* An empty page */
+    body = String("[[],0,0]");
+    smoki.reset(&client, true);
+    assertEqual(0, smoki.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(smoki.finished());
+    assertEqual(0, smoki.count());
+    assertEqual(0ULL, smoki.start());
+
+    /* The response ends before the message does */
+    body = String("[[{\"message\":{\"cmd\":");
+    smoki.reset(&client, true);
+    assertEqual(-1, smoki.get(msg));
+    client.stop();
+
+    /* The rest of the response doesn't arrive, waited for only as
+       long as the timeout set */
+    body = String("[[{\"message\":{\"cmd\":");
+    client.connect("pubsub.pubnub.com", 80);
+    smoki.reset(&client, true);
+    smoki.set_timeout(2);
+    unsigned long const t_start = millis();
+    assertEqual(-1, smoki.get(msg));
+    assertTrue(millis() - t_start >= 2000);
+    assertTrue(millis() - t_start < 3000);
+    client.stop();
+}
+
+unittest(FetchMessagesCracker_tags_messages_with_channels)
+{
+    char   msg[16];
+    bool   truncated;
+    String body("{\"status\": 200, \"error\": false, \"error_message\": \"\", "
+                "\"channels\": {\"door\": [{\"message\": {\"open\": true}, "
+                "\"timetoken\": \"15541191365593405\"}, "
+                "{\"timetoken\": \"15541191365593406\", \"uuid\": \"x\", "
+                "\"message\": \"shut,\\\"now\\\"please\"}], "
+                "\"lamp\": [{\"message\": 42, \"meta\": {\"message\": 1}, "
+                "\"timetoken\": \"15541191365593407\", \"massage\": 5, "
+                "\"timetaken\": \"8\"}]}, "
+                "\"chandler\": {\"x\": [{\"message\": 1}]}, "
+                "\"more\": {\"url\": \"/v3/history\", \"start\": \"1\", \"max\": 25}}");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    FetchMessagesCracker fritz(&client);
+    assertEqual(0, fritz.get(msg, sizeof msg, &truncated));
+    assertEqual("{\"open\": true}", msg);
+    assertFalse(truncated);
+    assertEqual("door", fritz.channel());
+    assertEqual(15541191365593405ULL, fritz.timetoken());
+    assertEqual(0, fritz.get(msg, sizeof msg, &truncated));
+    assertEqual("\"shut,\\\"now\\\"pl", msg);
+    assertTrue(truncated);
+    assertEqual("door", fritz.channel());
+    assertEqual(15541191365593406ULL, fritz.timetoken());
+    assertEqual(0, fritz.get(msg, sizeof msg, &truncated));
+    assertEqual("42", msg);
+    assertEqual("lamp", fritz.channel());
+    assertEqual(15541191365593407ULL, fritz.timetoken());
+    assertFalse(fritz.finished());
+    assertEqual(0, fritz.get(msg, sizeof msg));
+    assertEqual(0, strlen(msg));
+    assertTrue(fritz.finished());
+    assertEqual(3, fritz.count());
+}
+
+unittest(MessageCountsCracker_cracks_counts_of_channels)
+{
+    String body("{\"status\":200,\"error\":false,\"error_message\":\"\","
+                "\"channels\":{\"door\":2,\"la\\\"mp\":0,\"fan\":123456},"
+                "\"cheddars\":{\"x\":7}}");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    MessageCountsCracker counts(&client);
+    assertEqual(0, counts.get());
+    assertEqual("door", counts.channel());
+    assertEqual(2, counts.count());
+    assertEqual(0, counts.get());
+    assertEqual("la\\\"mp", counts.channel());
+    assertEqual(0, counts.count());
+    assertEqual(0, counts.get());
+    assertEqual("fan", counts.channel());
+    assertEqual(123456, counts.count());
+    assertFalse(counts.finished());
+    assertEqual(0, counts.get());
+    assertEqual("", counts.channel());
+    assertTrue(counts.finished());
+
+    body = String("{\"status\":200,\"channels\":{\"door\":");
+    MessageCountsCracker cut(&client);
+    assertEqual(-1, cut.get());
+}
+
+unittest(HereNowCracker_cracks_occupancy_and_uuids)
+{
+    String body("{\"status\":200,\"message\":\"OK\",\"occupancy\":12,"
+                "\"uuids\":[\"pi\\\"lot\",\"steward\"],\"users\":[\"x\"],"
+                "\"ownership\":3,\"service\":\"Presence\"}");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    HereNowCracker here(&client);
+    assertEqual(0, here.get());
+    assertEqual("pi\\\"lot", here.uuid());
+    assertEqual(12, here.occupancy());
+    assertEqual(0, here.get());
+    assertEqual("steward", here.uuid());
+    assertFalse(here.finished());
+    assertEqual(0, here.get());
+    assertEqual("", here.uuid());
+    assertTrue(here.finished());
+
+    /* No UUIDs, the occupancy last */
+    body = String("{\"status\":200,\"uuids\":[],\"occupancy\":0}");
+    HereNowCracker empty(&client);
+    assertEqual(0, empty.get());
+    assertEqual("", empty.uuid());
+    assertTrue(empty.finished());
+    assertEqual(0, empty.occupancy());
+
+    body = String("{\"status\":200,\"occupancy\":1,\"uuids\":[\"pil");
+    HereNowCracker cut(&client);
+    assertEqual(-1, cut.get());
+}
+
+unittest(SubscribeCracker_visits_messages_without_copying)
+{
+    /* Messages are longer than the cracker buffer, so they are
+       handed out in more than one part. */
+    String big;
+    while (big.length() < PUBNUB_CRACKER_BUFFER_SIZE * 3 / 2) {
+        big.concat('x');
+    }
+    String body(String("[\"") + big + "\",12,{\"a\":[\"]\"]},\"" + big + "\"],\"15540677660037393\"]");
+    PubSubClient subclient;
+    subclient.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    subclient.mGodmodeMicrosDelay = &delay;
+
+    subclient.start_body();
+    SubscribeCracker  ritz(&subclient);
+    CollectingVisitor visitor;
+
+    unsigned long allocated = allocations;
+    int           result    = ritz.visit(visitor);
+    assertEqual(allocated, allocations);
+    assertEqual(0, result);
+    assertTrue(ritz.finished());
+    assertEqual(4, visitor.count);
+    assertEqual(big.length() + 2, visitor.lengths[0]);
+    assertEqual(2, visitor.lengths[1]);
+    assertEqual(11, visitor.lengths[2]);
+    assertEqual(big.length() + 2, visitor.lengths[3]);
+    assertTrue(visitor.parts > 4);
+    assertEqual("15540677660037393", subclient.server_timetoken()); 
+    subclient.stop();
+}
+
+unittest(HistoryCracker_visits_messages_without_copying)
+{
+    String body("[{\"rocket\":\"Saturn V\"},\"Eagle\",1969]");
+    PubNonSubClient client;
+    client.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    client.mGodmodeMicrosDelay = &delay;
+
+    HistoryCracker    smoki(&client);
+    CollectingVisitor visitor;
+
+    assertEqual(0, smoki.visit(visitor));
+    assertTrue(smoki.finished());
+    assertEqual(3, visitor.count);
+    assertEqual(21, visitor.lengths[0]);
+    assertEqual(7, visitor.lengths[1]);
+    assertEqual(4, visitor.lengths[2]);
+    assertTrue(visitor.parts >= 3);
+    client.stop();
+}
+
+
+/* Logs the extracted fields, as "path=value;", to a fixed buffer */
+class LoggingFieldVisitor : public JsonFieldVisitor {
+public:
+    LoggingFieldVisitor() : messages(0) { log[0] = '\0'; }
+
+    void field_string(int path, char const* s, size_t len, bool truncated)
+    {
+        _log("%d=\"%s\"%s%u;", path, s, truncated ? "..." : "", (unsigned)len);
+    }
+    void field_number(int path, double value, char const* text)
+    {
+        _log("%d=%g(%s);", path, value, text);
+    }
+    void field_bool(int path, bool value) { _log("%d=%s;", path, value ? "T" : "F"); }
+    void field_null(int path) { _log("%d=null;", path); }
+    void fields_done()
+    {
+        ++messages;
+        _log("|");
+    }
+
+    char log[512];
+    int  messages;
+
+private:
+    template <typename... Args> void _log(char const* fmt, Args... args)
+    {
+        size_t len = strlen(log);
+        snprintf(log + len, sizeof log - len, fmt, args...);
+    }
+};
+
+unittest(PubNubJsonExtractor_extracts_paths_while_streaming)
+{
+    /* Unrelated data, longer than the cracker buffer, is skipped */
+    String big;
+    while (big.length() < PUBNUB_CRACKER_BUFFER_SIZE * 3 / 2) {
+        big.concat("{\"x\":[1,\"]}\"]},");
+    }
+    String body(String("[{\"noise\":[") + big + "0],\"sensor\":{\"id\":\"a\\\"b\\n\","
+                "\"temp\":21.5,\"ok\":true},\"cmd\":[\"on\",{\"temp\":1},null]},"
+                "{\"sensor\":{\"temp\":-3e2,\"id\":\"0123456789012345678901234567890123456789"
+                "0123456789012345678901234567890123456789012345678901234567890123456789"
+                "01234567890123456789\"},\"cmd\":[false]},"
+                "42,[],{}],\"15540677660037393\"]");
+    PubSubClient subclient;
+    subclient.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    subclient.mGodmodeMicrosDelay = &delay;
+
+    LoggingFieldVisitor fields;
+    PubNubJsonExtractor jx(fields);
+    assertEqual(0, jx.add_path("sensor.temp"));
+    assertEqual(1, jx.add_path("cmd[0]"));
+    assertEqual(2, jx.add_path("sensor.id"));
+    assertEqual(3, jx.add_path("cmd[2]"));
+    assertEqual(4, jx.add_path("sensor.ok"));
+    assertEqual(-1, jx.add_path("cmd["));
+    assertEqual(-1, jx.add_path("sensor..temp"));
+    assertEqual(-1, jx.add_path(""));
+
+    subclient.start_body();
+    SubscribeCracker ritz(&subclient);
+
+    unsigned long allocated = allocations;
+    assertEqual(0, ritz.visit(jx));
+    assertEqual(allocated, allocations);
+    assertTrue(ritz.finished());
+    assertEqual(5, fields.messages);
+    char expected[512];
+    snprintf(expected,
+             sizeof expected,
+             "2=\"a\"b\n\"4;0=21.5(21.5);4=T;1=\"on\"2;3=null;|"
+             "0=-300(-3e2);2=\"%.*s\"...%u;1=F;||||",
+             PUBNUB_JSON_VALUE_SIZE - 1,
+             "0123456789012345678901234567890123456789"
+             "0123456789012345678901234567890123456789012345678901234567890123456789"
+             "01234567890123456789",
+             PUBNUB_JSON_VALUE_SIZE - 1);
+    assertEqual(expected, fields.log);
+    subclient.stop();
+}
+
+unittest(SubscribeV2Cracker_cracks_envelope_with_metadata)
+{
+    String msg;
+    char   buf[8];
+    bool   truncated;
+    /* Fields in unusual order, unknown ones (also those that begin
+       like the known ones) and nesting that looks like the envelope,
+       inside of the messages */
+    String body("{\"t\":{\"tt\":\"1\",\"t\":\"15540677660037393\",\"r\":12},\"m\":["
+                "{\"a\":\"4\",\"cc\":\"venus\",\"dd\":7,\"f\":0,\"i\":\"rover\",\"p\":{\"t\":\"15540677660000001\",\"r\":12},"
+                "\"k\":\"sub-c\",\"c\":\"mars\",\"d\":{\"t\":{\"r\":1},\"m\":[\"}\\\"\"]}},"
+                "{\"d\":\"Hello \\\"world\\\"\",\"c\":\"earth.moon\",\"b\":\"earth.*\","
+                "\"p\":{\"r\":4,\"t\":\"15540677660000002\"},\"i\":\"eagle\"},"
+                "{\"c\":\"mars\",\"d\":-1.5e3},"
+                "{\"c\":\"mars\",\"d\":[1,2,3,4,5,6,7,8]}"
+                "]}");
+    PubSubClient subclient;
+    subclient.mGodmodeDataIn = &body;
+    unsigned long delay = 0;
+    subclient.mGodmodeMicrosDelay = &delay;
+
+    SubscribeV2Cracker ritz(&subclient);
+
+    assertFalse(ritz.finished());
+    assertEqual(0, ritz.get(msg));
+    /* The timetoken (and region) is taken as soon as it's cracked */
+    assertEqual("15540677660037393", subclient.server_timetoken());
+    assertEqual(12, subclient.server_region());
+    assertEqual("{\"t\":{\"r\":1},\"m\":[\"}\\\"\"]}", msg.c_str());
+    assertEqual("mars", ritz.channel());
+    assertEqual("", ritz.subscription());
+    assertEqual("rover", ritz.publisher());
+    assertEqual("15540677660000001", ritz.timetoken());
+    assertEqual(12, ritz.region());
+
+    assertEqual(0, ritz.get(msg));
+    assertEqual("\"Hello \\\"world\\\"\"", msg.c_str());
+    assertEqual("earth.moon", ritz.channel());
+    assertEqual("earth.*", ritz.subscription());
+    assertEqual("eagle", ritz.publisher());
+    assertEqual("15540677660000002", ritz.timetoken());
+    assertEqual(4, ritz.region());
+
+    assertEqual(0, ritz.get(buf, sizeof buf, &truncated));
+    assertEqual("-1.5e3", buf);
+    assertFalse(truncated);
+    assertEqual("mars", ritz.channel());
+    assertEqual("", ritz.publisher());
+    assertEqual("", ritz.timetoken());
+    assertEqual(-1, ritz.region());
+
+    assertEqual(0, ritz.get(buf, sizeof buf, &truncated));
+    assertEqual("[1,2,3,", buf);
+    assertTrue(truncated);
+
+    assertFalse(ritz.finished());
+    assertEqual(0, ritz.get(msg));
+    assertEqual(0, msg.length());
+    assertTrue(ritz.finished());
+    subclient.stop();
+}
+
+
+unittest(PubNubFilter_evaluates_expressions)
+{
+    char const json[] = "{\"region\":\"east\",\"temp\":31.5,\"on\":true,"
+                        "\"tags\":[\"a\",{\"b\":\"}\"}],\"where\":{\"room\":\"Lab-2\",\"floor\":-1},"
+                        "\"note\":\"it's \\\"hot\\\"\",\"n\":null}";
+    static const struct {
+        char const* expr;
+        bool        expected;
+    } cases[] = {
+        { "region == 'east'", true },
+        { "region == \"east\"", true },
+        { "region != 'east'", false },
+        { "temp > 30", true },
+        { "temp >= 31.5 && temp <= 31.5", true },
+        { "temp < 4e1", true },
+        { "temp > 100 || region == 'east'", true },
+        { "!(region == 'east')", false },
+        { "! region == 'west'", true },
+        { "where.floor < 0 && where.room LIKE 'lab*'", true },
+        { "where.room like '*-3'", false },
+        { "where.room CONTAINS 'b-'", true },
+        { "on == true && n == null", true },
+        { "region", true },
+        { "missing", false },
+        { "missing != 'x'", false },
+        { "!missing", true },
+        { "tags.b == '}'", false },
+        { "region > 'abc' && region < 'f'", true },
+        { "(temp > 30 && (region == 'west' || where.floor == -1))", true },
+    };
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+        PubNubFilter filter(cases[i].expr);
+        assertTrue(filter.valid());
+        assertEqual(cases[i].expected, filter.matches(json));
+    }
+    /* Many stars don't take exponential time */
+    char const long_json[] = "{\"s\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab\"}";
+    PubNubFilter stars("s like '*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*c'");
+    assertTrue(stars.valid());
+    assertFalse(stars.matches(long_json));
+    assertTrue(PubNubFilter("s like '*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*B'").matches(long_json));
+    assertTrue(PubNubFilter("s like 'a*'").matches(long_json));
+    assertTrue(PubNubFilter("s like '**'").matches(long_json));
+    assertFalse(PubNubFilter("s like '*a'").matches(long_json));
+
+    /* Messages that are not objects have no fields */
+    assertFalse(PubNubFilter("region == 'east'").matches("\"east\""));
+    assertFalse(PubNubFilter("region == 'east'").matches("{\"region\":\"ea"));
+
+    static char const* const invalid[] = {
+        "", "region ==", "region == 'east", "(temp > 30", "temp > 30)", "a && || b", "#",
+    };
+    for (size_t i = 0; i < sizeof invalid / sizeof invalid[0]; ++i) {
+        PubNubFilter filter(invalid[i]);
+        assertFalse(filter.valid());
+        assertFalse(filter.matches(json));
+    }
+}
+
 unittest_main()
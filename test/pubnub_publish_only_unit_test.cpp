@@ -0,0 +1,51 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#include <ArduinoUnitTests.h>
+#include "../test_stubs/Ethernet.h"
+#define PUBNUB_UNIT_TEST
+#define PUBNUB_PUBLISH_ONLY
+#define PUBNUB_NO_TO_STR
+#if defined(__CYGWIN__)
+#define PUBNUB_DEFINE_STRSPN_AND_STRNCASECMP
+#endif
+#include "../PubNubDefs.h"
+
+
+unittest_setup()
+{
+}
+
+unittest_teardown()
+{
+}
+
+unittest(PubNub_publish_only_builds_and_publishes)
+{
+    PubNub PubNubObject;
+    String request("GET /publish/jet/airliner/0/flight/0/%22wheels%20up%22"
+                   "?pnsdk=PubNub-Arduino/1.0 HTTP/1.1\r\n"
+                   "Host: pubsub.pubnub.com\r\n"
+                   "User-Agent: PubNub-Arduino/1.0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n");
+    String response("HTTP/1.1 200 OK\r\n"
+                    "Content-Length: 30\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "[1,\"Sent\",\"15541724007473323\"]");
+    unsigned long delay = 1;
+    PubNubObject.publishClient().mGodmodeDataIn = &response;
+    PubNubObject.publishClient().mGodmodeMicrosDelay = &delay;
+    assertEqual(true, PubNubObject.begin("jet", "airliner"));
+
+    auto client = PubNubObject.publish("flight", "\"wheels up\"");
+    assertEqual(request, client->getOuttaHere());
+    PublishCracker cheez;
+    assertEqual(cheez.sent, cheez.read_and_parse(client));
+    client->stop();
+
+    /* Only the publish client is left in */
+    assertTrue(sizeof PubNubObject < 2 * sizeof(PubNonSubClient) + sizeof(PubSubClient));
+}
+
+
+unittest_main()
@@ -2,6 +2,7 @@
 #define stub_client_h
 
 #include "Stream.h"
+#include <vector>
 
 class Client : public Stream {
 
@@ -13,9 +14,19 @@ public:
     virtual size_t write(uint8_t aChar)
     {
         mGodmodeDataOut.append(String((char)aChar));
+        mGodmodeWrites.push_back(1);
         return 1;
     }
 
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            mGodmodeDataOut.append(String((char)buf[i]));
+        }
+        mGodmodeWrites.push_back(size);
+        return size;
+    }
+
     String getOuttaHere() {
         String ret(mGodmodeDataOut);
         mGodmodeDataOut.clear();
@@ -25,7 +36,12 @@ public:
     virtual void flush()
     {
         mGodmodeDataOut.clear();
+        mGodmodeWrites.clear();
     }
+
+    /* The sizes of the segments written (one for each write() call)
+       since the last flush() */
+    std::vector<size_t> mGodmodeWrites;
 private:
     String mGodmodeDataOut;
 };
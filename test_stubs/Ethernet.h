@@ -7,7 +7,12 @@
 
 class EthernetClient : public Client {
 public:
-	EthernetClient() { }
+	EthernetClient()
+        : mGodmodeConnects(0)
+        , mGodmodeConnected(false)
+        , mGodmodeRefuse(false)
+    {
+    }
 /* Functions and class fields commented out are not currently used by 'pubnub' arduino
    unit tests but, they are the original EthernetClient class members and there is a
    possibility that some of them might become stubs in the future.
@@ -21,6 +26,11 @@ public:
 //	virtual int connect(IPAddress ip, uint16_t port);
 	virtual int connect(const char *host, uint16_t port)
     {
+        if (mGodmodeRefuse) {
+            return 0;
+        }
+        ++mGodmodeConnects;
+        mGodmodeConnected = true;
         return +1;
     }
 //	virtual int availableForWrite(void);
@@ -35,10 +45,11 @@ public:
     }
 	virtual void stop()
     {
+        mGodmodeConnected = false;
     }
 	virtual uint8_t connected()
     {
-        return +1;
+        return mGodmodeConnected;
     }
 //	virtual operator bool() { return sockindex < MAX_SOCK_NUM; }
 //	virtual bool operator==(const bool value) { return bool() == value; }
@@ -52,6 +63,14 @@ public:
 //	virtual void setConnectionTimeout(uint16_t timeout) { _timeout = timeout; }
 
 //	friend class EthernetServer;
+
+    /* Stand-in server godmode: the number of connections accepted
+       (connect() calls) and whether the connection is up. Set
+       `mGodmodeConnected` to false to have the server close it, and
+       `mGodmodeRefuse` to true to have it refuse connections. */
+    int  mGodmodeConnects;
+    bool mGodmodeConnected;
+    bool mGodmodeRefuse;
 private:
 //	uint8_t sockindex; // MAX_SOCK_NUM means client not in use
 //	uint16_t _timeout;